@@ -213,6 +213,26 @@ LOCAL_MULTILIB := first
 
 include $(BUILD_HOST_NATIVE_TEST)
 
+# adb_benchmark (see ../liblog/tests)
+# =========================================================
+
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+LOCAL_MODULE := adb_benchmark
+LOCAL_CFLAGS := -DADB_HOST=1 $(LIBADB_CFLAGS) $(LIBADB_linux_CFLAGS) \
+    -I$(LOCAL_PATH)/../liblog/tests
+LOCAL_SRC_FILES := \
+    ../liblog/tests/benchmark_main.cpp \
+    fdevent_benchmark.cpp \
+
+LOCAL_SANITIZE := $(adb_host_sanitize)
+LOCAL_SHARED_LIBRARIES := libbase
+LOCAL_STATIC_LIBRARIES := libadb libcrypto_static libcutils libdiagnose_usb
+LOCAL_LDLIBS += -lrt -ldl -lpthread
+LOCAL_MULTILIB := first
+include $(BUILD_HOST_NATIVE_TEST)
+endif
+
 # adb device tracker (used by ddms) test tool
 # =========================================================
 
@@ -252,6 +272,7 @@ LOCAL_SRC_FILES := \
     console.cpp \
     commandline.cpp \
     file_sync_client.cpp \
+    file_sync_deflate.cpp \
     line_printer.cpp \
     services.cpp \
     shell_service_protocol.cpp \
@@ -282,6 +303,7 @@ LOCAL_STATIC_LIBRARIES := \
     libcrypto_static \
     libdiagnose_usb \
     liblog \
+    libz \
 
 # Don't use libcutils on Windows.
 LOCAL_STATIC_LIBRARIES_darwin := libcutils
@@ -313,6 +335,7 @@ LOCAL_CLANG := true
 LOCAL_SRC_FILES := \
     daemon/main.cpp \
     services.cpp \
+    file_sync_deflate.cpp \
     file_sync_service.cpp \
     framebuffer_service.cpp \
     remount_service.cpp \
@@ -356,6 +379,7 @@ LOCAL_STATIC_LIBRARIES := \
     libcutils \
     libbase \
     libcrypto_static \
-    libminijail
+    libminijail \
+    libz
 
 include $(BUILD_EXECUTABLE)
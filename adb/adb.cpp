@@ -30,6 +30,7 @@
 #include <sys/time.h>
 #include <time.h>
 
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -82,19 +83,68 @@ void fatal_errno(const char* fmt, ...) {
     exit(-1);
 }
 
-apacket* get_apacket(void)
+// Packets come in two sizes: MAX_PAYLOAD_V1 for control messages and
+// small writes, and MAX_PAYLOAD for everything else. Each size keeps a
+// short free list, so the steady state of a transfer allocates nothing.
+struct apacket_class {
+    size_t capacity;
+    size_t max_free;
+    size_t nfree;
+    apacket* free;
+};
+
+static apacket_class apacket_classes[] = {
+    { MAX_PAYLOAD_V1, 64, 0, nullptr },
+    { MAX_PAYLOAD, 4, 0, nullptr },
+};
+
+static std::mutex& apacket_lock = *new std::mutex();
+
+static apacket_class* find_apacket_class(size_t payload) {
+    for (auto& c : apacket_classes) {
+        if (payload <= c.capacity) {
+            return &c;
+        }
+    }
+    fatal("apacket payload too large (%zu)", payload);
+}
+
+apacket* get_apacket(size_t payload)
 {
-    apacket* p = reinterpret_cast<apacket*>(malloc(sizeof(apacket)));
+    apacket_class* c = find_apacket_class(payload);
+    apacket* p = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(apacket_lock);
+        if (c->free != nullptr) {
+            p = c->free;
+            c->free = p->next;
+            --c->nfree;
+        }
+    }
     if (p == nullptr) {
-      fatal("failed to allocate an apacket");
+        p = reinterpret_cast<apacket*>(malloc(offsetof(apacket, data) + c->capacity));
+        if (p == nullptr) {
+          fatal("failed to allocate an apacket");
+        }
     }
 
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    memset(p, 0, offsetof(apacket, data));
+    p->capacity = c->capacity;
     return p;
 }
 
 void put_apacket(apacket *p)
 {
+    apacket_class* c = find_apacket_class(p->capacity);
+    {
+        std::lock_guard<std::mutex> lock(apacket_lock);
+        if (c->nfree < c->max_free) {
+            p->next = c->free;
+            c->free = p;
+            ++c->nfree;
+            return;
+        }
+    }
     free(p);
 }
 
@@ -161,7 +211,7 @@ void print_packet(const char *label, apacket *p)
 static void send_ready(unsigned local, unsigned remote, atransport *t)
 {
     D("Calling send_ready");
-    apacket *p = get_apacket();
+    apacket *p = get_apacket(0);
     p->msg.command = A_OKAY;
     p->msg.arg0 = local;
     p->msg.arg1 = remote;
@@ -171,7 +221,7 @@ static void send_ready(unsigned local, unsigned remote, atransport *t)
 static void send_close(unsigned local, unsigned remote, atransport *t)
 {
     D("Calling send_close");
-    apacket *p = get_apacket();
+    apacket *p = get_apacket(0);
     p->msg.command = A_CLSE;
     p->msg.arg0 = local;
     p->msg.arg1 = remote;
@@ -206,7 +256,7 @@ std::string get_connection_string() {
 
 void send_connect(atransport* t) {
     D("Calling send_connect");
-    apacket* cp = get_apacket();
+    apacket* cp = get_apacket(MAX_PAYLOAD_V1);
     cp->msg.command = A_CNXN;
     cp->msg.arg0 = t->get_protocol_version();
     cp->msg.arg1 = t->get_max_payload();
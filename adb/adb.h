@@ -50,7 +50,7 @@ constexpr size_t MAX_PAYLOAD = MAX_PAYLOAD_V2;
 std::string adb_version();
 
 // Increment this when we want to force users to start a new adb server.
-#define ADB_SERVER_VERSION 36
+#define ADB_SERVER_VERSION 38
 
 class atransport;
 struct usb_handle;
@@ -64,12 +64,16 @@ struct amessage {
     unsigned magic;         /* command ^ 0xffffffff             */
 };
 
+// Packets are allocated with only as much of data as was asked of
+// get_apacket(), so data must stay the last member. Transports rely on
+// it following msg directly.
 struct apacket
 {
     apacket *next;
 
     unsigned len;
     unsigned char *ptr;
+    size_t capacity;
 
     amessage msg;
     unsigned char data[MAX_PAYLOAD];
@@ -186,7 +190,9 @@ void set_verity_enabled_state_service(int fd, void* cookie);
 #endif
 
 /* packet allocator */
-apacket *get_apacket(void);
+// Returns a packet with room for at least payload bytes of data. Freed
+// packets are kept for reuse, so this is cheap for the usual sizes.
+apacket *get_apacket(size_t payload = MAX_PAYLOAD);
 void put_apacket(apacket *p);
 
 // Define it if you want to dump packets.
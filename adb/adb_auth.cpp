@@ -42,7 +42,7 @@ void send_auth_request(atransport *t)
         return;
     }
 
-    p = get_apacket();
+    p = get_apacket(MAX_PAYLOAD_V1);
     memcpy(p->data, t->token, ret);
     p->msg.command = A_AUTH;
     p->msg.arg0 = ADB_AUTH_TOKEN;
@@ -53,7 +53,7 @@ void send_auth_request(atransport *t)
 void send_auth_response(uint8_t *token, size_t token_size, atransport *t)
 {
     D("Calling send_auth_response");
-    apacket *p = get_apacket();
+    apacket *p = get_apacket(MAX_PAYLOAD_V1);
     int ret;
 
     ret = adb_auth_sign(t->key, token, token_size, p->data);
@@ -72,7 +72,7 @@ void send_auth_response(uint8_t *token, size_t token_size, atransport *t)
 void send_auth_publickey(atransport *t)
 {
     D("Calling send_auth_publickey");
-    apacket *p = get_apacket();
+    apacket *p = get_apacket(MAX_PAYLOAD_V1);
     int ret;
 
     ret = adb_auth_get_userkey(p->data, MAX_PAYLOAD_V1);
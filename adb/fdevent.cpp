@@ -25,6 +25,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define FDEVENT_EPOLL 1
+#endif
+
 #include <atomic>
 #include <list>
 #include <unordered_map>
@@ -51,9 +56,15 @@ int SHELL_EXIT_NOTIFY_FD = -1;
 #define FDE_PENDING    0x0200
 #define FDE_CREATED    0x0400
 
+// On Linux the nodes are also registered with epoll, which is kept in step
+// with pollfd.events. Fds that epoll refuses (regular files, bad fds) are
+// still handed to poll(), which reports them ready at once.
 struct PollNode {
   fdevent* fde;
   adb_pollfd pollfd;
+#if defined(FDEVENT_EPOLL)
+  bool epolled = false;
+#endif
 
   PollNode(fdevent* fde) : fde(fde) {
       memset(&pollfd, 0, sizeof(pollfd));
@@ -72,6 +83,10 @@ struct PollNode {
 static auto& g_poll_node_map = *new std::unordered_map<int, PollNode>();
 static auto& g_pending_list = *new std::list<fdevent*>();
 static std::atomic<bool> terminate_loop(false);
+#if defined(FDEVENT_EPOLL)
+static int g_epoll_fd = -1;
+static size_t g_unepolled_count;
+#endif
 static bool main_thread_valid;
 static unsigned long main_thread_id;
 
@@ -112,6 +127,44 @@ static std::string dump_fde(const fdevent* fde) {
     return android::base::StringPrintf("(fdevent %d %s)", fde->fd, state.c_str());
 }
 
+#if defined(FDEVENT_EPOLL)
+// The epoll bits are the poll bits on Linux, so revents can be handled alike.
+static_assert(EPOLLIN == POLLIN && EPOLLOUT == POLLOUT && EPOLLERR == POLLERR &&
+              EPOLLHUP == POLLHUP && EPOLLRDHUP == POLLRDHUP, "epoll and poll bits differ");
+
+// Registration is level triggered, like poll(): handlers often take one
+// packet per call and expect to be called again while there is more.
+static void fdevent_epoll_ctl(PollNode& node, int op) {
+    if (g_epoll_fd == -1) {
+        g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (g_epoll_fd == -1) {
+            PLOG(FATAL) << "failed to create epoll fd";
+        }
+    }
+    if (op != EPOLL_CTL_ADD && !node.epolled) {
+        if (op == EPOLL_CTL_DEL) {
+            --g_unepolled_count;
+        }
+        return;
+    }
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = node.pollfd.events;
+    ev.data.fd = node.pollfd.fd;
+    if (epoll_ctl(g_epoll_fd, op, node.pollfd.fd, &ev) == 0) {
+        node.epolled = (op != EPOLL_CTL_DEL);
+        return;
+    }
+    if (op == EPOLL_CTL_ADD) {
+        D("epoll refused fd %d (%s), polling it instead", node.pollfd.fd, strerror(errno));
+        ++g_unepolled_count;
+    } else if (op == EPOLL_CTL_MOD) {
+        PLOG(ERROR) << "failed to update epoll events for fd " << node.pollfd.fd;
+    }
+}
+#endif
+
 fdevent *fdevent_create(int fd, fd_func func, void *arg)
 {
     check_main_thread();
@@ -149,6 +202,9 @@ void fdevent_install(fdevent* fde, int fd, fd_func func, void* arg) {
     }
     auto pair = g_poll_node_map.emplace(fde->fd, PollNode(fde));
     CHECK(pair.second) << "install existing fd " << fd;
+#if defined(FDEVENT_EPOLL)
+    fdevent_epoll_ctl(pair.first->second, EPOLL_CTL_ADD);
+#endif
     D("fdevent_install %s", dump_fde(fde).c_str());
 }
 
@@ -156,6 +212,11 @@ void fdevent_remove(fdevent* fde) {
     check_main_thread();
     D("fdevent_remove %s", dump_fde(fde).c_str());
     if (fde->state & FDE_ACTIVE) {
+#if defined(FDEVENT_EPOLL)
+        auto it = g_poll_node_map.find(fde->fd);
+        CHECK(it != g_poll_node_map.end());
+        fdevent_epoll_ctl(it->second, EPOLL_CTL_DEL);
+#endif
         g_poll_node_map.erase(fde->fd);
         if (fde->state & FDE_PENDING) {
             g_pending_list.remove(fde);
@@ -184,6 +245,9 @@ static void fdevent_update(fdevent* fde, unsigned events) {
     } else {
         node.pollfd.events &= ~POLLOUT;
     }
+#if defined(FDEVENT_EPOLL)
+    fdevent_epoll_ctl(node, EPOLL_CTL_MOD);
+#endif
     fde->state = (fde->state & FDE_STATEMASK) | events;
 }
 
@@ -232,6 +296,76 @@ static std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
     return result;
 }
 
+static void fdevent_handle_revents(int fd, unsigned revents) {
+    if (revents != 0) {
+        D("for fd %d, revents = %x", fd, revents);
+    }
+    unsigned events = 0;
+    if (revents & POLLIN) {
+        events |= FDE_READ;
+    }
+    if (revents & POLLOUT) {
+        events |= FDE_WRITE;
+    }
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        // We fake a read, as the rest of the code assumes that errors will
+        // be detected at that point.
+        events |= FDE_READ | FDE_ERROR;
+    }
+#if defined(__linux__)
+    if (revents & POLLRDHUP) {
+        events |= FDE_READ | FDE_ERROR;
+    }
+#endif
+    if (events != 0) {
+        auto it = g_poll_node_map.find(fd);
+        CHECK(it != g_poll_node_map.end());
+        fdevent* fde = it->second.fde;
+        CHECK_EQ(fde->fd, fd);
+        fde->events |= events;
+        D("%s got events %x", dump_fde(fde).c_str(), events);
+        fde->state |= FDE_PENDING;
+        g_pending_list.push_back(fde);
+    }
+}
+
+#if defined(FDEVENT_EPOLL)
+
+static void fdevent_process() {
+    CHECK_GT(g_poll_node_map.size(), 0u);
+
+    // Only the fds that epoll refused are polled, and those never block.
+    int timeout = -1;
+    std::vector<adb_pollfd> pollfds;
+    if (g_unepolled_count != 0) {
+        for (const auto& pair : g_poll_node_map) {
+            if (!pair.second.epolled) {
+                pollfds.push_back(pair.second.pollfd);
+            }
+        }
+        D("poll(), pollfds = %s", dump_pollfds(pollfds).c_str());
+        if (adb_poll(&pollfds[0], pollfds.size(), 0) > 0) {
+            timeout = 0;
+        }
+    }
+
+    epoll_event events[256];
+    D("epoll_wait(), %zu fds", g_poll_node_map.size() - pollfds.size());
+    int ret = TEMP_FAILURE_RETRY(epoll_wait(g_epoll_fd, events, arraysize(events), timeout));
+    if (ret == -1) {
+        PLOG(ERROR) << "epoll_wait(), ret = " << ret;
+        return;
+    }
+    for (int i = 0; i < ret; ++i) {
+        fdevent_handle_revents(events[i].data.fd, events[i].events);
+    }
+    for (const auto& pollfd : pollfds) {
+        fdevent_handle_revents(pollfd.fd, pollfd.revents);
+    }
+}
+
+#else
+
 static void fdevent_process() {
     std::vector<adb_pollfd> pollfds;
     for (const auto& pair : g_poll_node_map) {
@@ -245,39 +379,12 @@ static void fdevent_process() {
         return;
     }
     for (const auto& pollfd : pollfds) {
-        if (pollfd.revents != 0) {
-            D("for fd %d, revents = %x", pollfd.fd, pollfd.revents);
-        }
-        unsigned events = 0;
-        if (pollfd.revents & POLLIN) {
-            events |= FDE_READ;
-        }
-        if (pollfd.revents & POLLOUT) {
-            events |= FDE_WRITE;
-        }
-        if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-            // We fake a read, as the rest of the code assumes that errors will
-            // be detected at that point.
-            events |= FDE_READ | FDE_ERROR;
-        }
-#if defined(__linux__)
-        if (pollfd.revents & POLLRDHUP) {
-            events |= FDE_READ | FDE_ERROR;
-        }
-#endif
-        if (events != 0) {
-            auto it = g_poll_node_map.find(pollfd.fd);
-            CHECK(it != g_poll_node_map.end());
-            fdevent* fde = it->second.fde;
-            CHECK_EQ(fde->fd, pollfd.fd);
-            fde->events |= events;
-            D("%s got events %x", dump_fde(fde).c_str(), events);
-            fde->state |= FDE_PENDING;
-            g_pending_list.push_back(fde);
-        }
+        fdevent_handle_revents(pollfd.fd, pollfd.revents);
     }
 }
 
+#endif
+
 static void fdevent_call_fdfunc(fdevent* fde)
 {
     unsigned events = fde->events;
@@ -391,6 +498,13 @@ size_t fdevent_installed_count() {
 }
 
 void fdevent_reset() {
+#if defined(FDEVENT_EPOLL)
+    if (g_epoll_fd != -1) {
+        adb_close(g_epoll_fd);
+        g_epoll_fd = -1;
+    }
+    g_unepolled_count = 0;
+#endif
     g_poll_node_map.clear();
     g_pending_list.clear();
     main_thread_valid = false;
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "adb_io.h"
+#include "fdevent.h"
+#include "sysdeps.h"
+
+#include "benchmark.h"
+
+struct LoopArg {
+    int echo_fd;    // bytes read here are written straight back
+    int stop_fd;    // any byte here ends the loop
+    int idle_fd;    // dup'd idle_count times, never written to
+    size_t idle_count;
+};
+
+static void EchoCallback(int fd, unsigned, void*) {
+    char c;
+    if (adb_read(fd, &c, 1) == 1) {
+        WriteFdExactly(fd, &c, 1);
+    }
+}
+
+static void StopCallback(int fd, unsigned, void*) {
+    char c;
+    adb_read(fd, &c, 1);
+    fdevent_terminate_loop();
+}
+
+static void LoopThreadFunc(LoopArg* arg) {
+    std::vector<std::unique_ptr<fdevent>> idle_fdes;
+    for (size_t i = 0; i < arg->idle_count; ++i) {
+        idle_fdes.push_back(std::unique_ptr<fdevent>(new fdevent));
+        fdevent_install(idle_fdes.back().get(), dup(arg->idle_fd), [](int, unsigned, void*) {},
+                        nullptr);
+        fdevent_add(idle_fdes.back().get(), FDE_READ);
+    }
+    fdevent echo_fde;
+    fdevent_install(&echo_fde, arg->echo_fd, EchoCallback, nullptr);
+    fdevent_add(&echo_fde, FDE_READ);
+    fdevent stop_fde;
+    fdevent_install(&stop_fde, arg->stop_fd, StopCallback, nullptr);
+    fdevent_add(&stop_fde, FDE_READ);
+
+    fdevent_loop();
+
+    fdevent_remove(&stop_fde);
+    fdevent_remove(&echo_fde);
+    for (auto& fde : idle_fdes) {
+        fdevent_remove(fde.get());
+    }
+}
+
+// Time one wakeup of the loop (a byte echoed back) while idle_count other
+// fds are watched but never ready. Should stay flat as idle_count grows.
+static void fdevent_wakeup(int iters, size_t idle_count) {
+    signal(SIGPIPE, SIG_IGN);
+    fdevent_reset();
+
+    int echo_pair[2];
+    int stop_pair[2];
+    int idle_pair[2];
+    if (adb_socketpair(echo_pair) || adb_socketpair(stop_pair) || adb_socketpair(idle_pair)) {
+        fprintf(stderr, "adb_socketpair failed: %s\n", strerror(errno));
+        return;
+    }
+    LoopArg arg = { echo_pair[1], stop_pair[1], idle_pair[1], idle_count };
+    adb_thread_t thread;
+    if (!adb_thread_create(reinterpret_cast<void (*)(void*)>(LoopThreadFunc), &arg, &thread)) {
+        fprintf(stderr, "adb_thread_create failed\n");
+        return;
+    }
+
+    // First round trip waits for the loop thread to get going.
+    char c = 'x';
+    WriteFdExactly(echo_pair[0], &c, 1);
+    ReadFdExactly(echo_pair[0], &c, 1);
+
+    StartBenchmarkTiming();
+    for (int i = 0; i < iters; ++i) {
+        WriteFdExactly(echo_pair[0], &c, 1);
+        ReadFdExactly(echo_pair[0], &c, 1);
+    }
+    StopBenchmarkTiming();
+
+    WriteFdExactly(stop_pair[0], &c, 1);
+    adb_thread_join(thread);
+    adb_close(echo_pair[0]);
+    adb_close(stop_pair[0]);
+    adb_close(idle_pair[0]);
+    adb_close(idle_pair[1]);
+}
+
+static void BM_fdevent_wakeup_10_idle(int iters) {
+    fdevent_wakeup(iters, 10);
+}
+BENCHMARK(BM_fdevent_wakeup_10_idle);
+
+static void BM_fdevent_wakeup_100_idle(int iters) {
+    fdevent_wakeup(iters, 100);
+}
+BENCHMARK(BM_fdevent_wakeup_100_idle);
+
+static void BM_fdevent_wakeup_1000_idle(int iters) {
+    fdevent_wakeup(iters, 1000);
+}
+BENCHMARK(BM_fdevent_wakeup_1000_idle);
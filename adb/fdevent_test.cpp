@@ -18,11 +18,15 @@
 
 #include <gtest/gtest.h>
 
+#include <fcntl.h>
+
 #include <limits>
 #include <queue>
 #include <string>
 #include <vector>
 
+#include <android-base/test_utils.h>
+
 #include "adb_io.h"
 #include "fdevent_test.h"
 
@@ -175,3 +179,185 @@ TEST_F(FdeventTest, invalid_fd) {
     ASSERT_TRUE(adb_thread_create(InvalidFdThreadFunc, nullptr, &thread));
     ASSERT_TRUE(adb_thread_join(thread));
 }
+
+
+struct ToggleWriteArg {
+    fdevent fde;
+    int fd;
+    int peer_fd;
+    size_t step;
+};
+
+// A socket is always writable, so FDE_WRITE must show up exactly while it is
+// asked for: each change of events has to reach the kernel.
+static void ToggleWriteCallback(int fd, unsigned events, void* userdata) {
+    ToggleWriteArg* arg = reinterpret_cast<ToggleWriteArg*>(userdata);
+    switch (arg->step++) {
+        case 0:
+            ASSERT_EQ(static_cast<unsigned>(FDE_WRITE), events);
+            fdevent_del(&arg->fde, FDE_WRITE);
+            fdevent_add(&arg->fde, FDE_READ);
+            ASSERT_TRUE(WriteFdExactly(arg->peer_fd, "x", 1));
+            break;
+        case 1: {
+            ASSERT_EQ(static_cast<unsigned>(FDE_READ), events);
+            char c;
+            ASSERT_EQ(1, adb_read(fd, &c, 1));
+            fdevent_set(&arg->fde, FDE_WRITE);
+            break;
+        }
+        default:
+            ASSERT_EQ(static_cast<unsigned>(FDE_WRITE), events);
+            fdevent_remove(&arg->fde);
+            fdevent_terminate_loop();
+            break;
+    }
+}
+
+static void ToggleWriteThreadFunc(ToggleWriteArg* arg) {
+    fdevent_install(&arg->fde, arg->fd, ToggleWriteCallback, arg);
+    fdevent_add(&arg->fde, FDE_WRITE);
+    fdevent_loop();
+}
+
+TEST_F(FdeventTest, toggle_write) {
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    ToggleWriteArg arg;
+    arg.fd = fds[0];
+    arg.peer_fd = fds[1];
+    arg.step = 0;
+    adb_thread_t thread;
+    ASSERT_TRUE(adb_thread_create(reinterpret_cast<void (*)(void*)>(ToggleWriteThreadFunc), &arg,
+                                  &thread));
+    ASSERT_TRUE(adb_thread_join(thread));
+    ASSERT_EQ(3u, arg.step);
+    ASSERT_EQ(0, adb_close(fds[1]));
+}
+
+struct ReinstallArg {
+    fdevent fde;
+    int fd;
+    int peer_fd;
+    size_t reinstalls;
+};
+
+// Each time a byte arrives the fd is removed (which closes it) and a new
+// socket is installed under the same fd number.
+static void ReinstallCallback(int fd, unsigned events, void* userdata) {
+    ReinstallArg* arg = reinterpret_cast<ReinstallArg*>(userdata);
+    ASSERT_EQ(static_cast<unsigned>(FDE_READ), events);
+    char c;
+    ASSERT_EQ(1, adb_read(fd, &c, 1));
+    fdevent_remove(&arg->fde);
+    ASSERT_EQ(0, adb_close(arg->peer_fd));
+    if (++arg->reinstalls == 3) {
+        fdevent_terminate_loop();
+        return;
+    }
+
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    if (fds[0] != fd) {
+        ASSERT_EQ(fd, dup2(fds[0], fd));
+        ASSERT_EQ(0, adb_close(fds[0]));
+    }
+    arg->peer_fd = fds[1];
+    fdevent_install(&arg->fde, fd, ReinstallCallback, arg);
+    fdevent_add(&arg->fde, FDE_READ);
+    ASSERT_TRUE(WriteFdExactly(arg->peer_fd, "x", 1));
+}
+
+static void ReinstallThreadFunc(ReinstallArg* arg) {
+    fdevent_install(&arg->fde, arg->fd, ReinstallCallback, arg);
+    fdevent_add(&arg->fde, FDE_READ);
+    ASSERT_TRUE(WriteFdExactly(arg->peer_fd, "x", 1));
+    fdevent_loop();
+}
+
+TEST_F(FdeventTest, reinstall_fd) {
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    ReinstallArg arg;
+    arg.fd = fds[0];
+    arg.peer_fd = fds[1];
+    arg.reinstalls = 0;
+    adb_thread_t thread;
+    ASSERT_TRUE(adb_thread_create(reinterpret_cast<void (*)(void*)>(ReinstallThreadFunc), &arg,
+                                  &thread));
+    ASSERT_TRUE(adb_thread_join(thread));
+    ASSERT_EQ(3u, arg.reinstalls);
+    ASSERT_EQ(0u, fdevent_installed_count());
+}
+
+#if !defined(_WIN32)
+// Windows can't hand a C Runtime file descriptor to fdevent.
+struct RegularFileArg {
+    fdevent file_fde;
+    fdevent socket_fde;
+    int file_fd;
+    int socket_fd;
+    int peer_fd;
+    size_t file_events;
+    bool socket_event;
+};
+
+// epoll refuses regular files, so they are polled, and poll() reports them
+// ready every time round. Events on the other fds must still come through,
+// both while the file is installed and after it is gone.
+static void RegularFileCallback(int, unsigned events, void* userdata) {
+    RegularFileArg* arg = reinterpret_cast<RegularFileArg*>(userdata);
+    ASSERT_EQ(static_cast<unsigned>(FDE_READ), events);
+    if (++arg->file_events == 3) {
+        fdevent_remove(&arg->file_fde);
+        ASSERT_TRUE(WriteFdExactly(arg->peer_fd, "x", 1));
+    }
+}
+
+static void RegularFileSocketCallback(int fd, unsigned events, void* userdata) {
+    RegularFileArg* arg = reinterpret_cast<RegularFileArg*>(userdata);
+    ASSERT_EQ(static_cast<unsigned>(FDE_READ), events);
+    char c;
+    ASSERT_EQ(1, adb_read(fd, &c, 1));
+    if (!arg->socket_event) {
+        // The first byte is there before the loop starts, with the file.
+        ASSERT_LT(arg->file_events, 3u);
+        arg->socket_event = true;
+        return;
+    }
+    ASSERT_EQ(3u, arg->file_events);
+    fdevent_remove(&arg->socket_fde);
+    fdevent_terminate_loop();
+}
+
+static void RegularFileThreadFunc(RegularFileArg* arg) {
+    fdevent_install(&arg->socket_fde, arg->socket_fd, RegularFileSocketCallback, arg);
+    fdevent_add(&arg->socket_fde, FDE_READ);
+    fdevent_install(&arg->file_fde, arg->file_fd, RegularFileCallback, arg);
+    fdevent_add(&arg->file_fde, FDE_READ);
+    fdevent_loop();
+}
+
+TEST_F(FdeventTest, regular_file) {
+    TemporaryFile tf;
+    ASSERT_NE(-1, tf.fd);
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    RegularFileArg arg;
+    arg.file_fd = adb_open(tf.path, O_RDONLY);
+    ASSERT_NE(-1, arg.file_fd);
+    arg.socket_fd = fds[0];
+    arg.peer_fd = fds[1];
+    arg.file_events = 0;
+    arg.socket_event = false;
+    ASSERT_TRUE(WriteFdExactly(arg.peer_fd, "x", 1));
+    adb_thread_t thread;
+    ASSERT_TRUE(adb_thread_create(reinterpret_cast<void (*)(void*)>(RegularFileThreadFunc), &arg,
+                                  &thread));
+    ASSERT_TRUE(adb_thread_join(thread));
+    ASSERT_EQ(3u, arg.file_events);
+    ASSERT_TRUE(arg.socket_event);
+    ASSERT_EQ(0u, fdevent_installed_count());
+    ASSERT_EQ(0, adb_close(fds[1]));
+}
+#endif  // !defined(_WIN32)
@@ -28,8 +28,11 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "sysdeps.h"
@@ -38,13 +41,19 @@
 #include "adb_client.h"
 #include "adb_io.h"
 #include "adb_utils.h"
+#include "file_sync_deflate.h"
 #include "file_sync_service.h"
 #include "line_printer.h"
+#include "transport.h"
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
 #include <android-base/stringprintf.h>
 
+// With kFeatureSyncPipeline, how many files may be on their way before we
+// wait for the device to acknowledge the oldest of them.
+static constexpr size_t kPipelineDepth = 128;
+
 struct syncsendbuf {
     unsigned id;
     unsigned size;
@@ -101,13 +110,21 @@ class SyncConnection {
               start_time_ms_(CurrentTimeMs()),
               expected_total_bytes_(0),
               expect_multiple_files_(false),
-              expect_done_(false) {
+              pipelined_(false),
+              deflating_(false) {
         max = SYNC_DATA_MAX; // TODO: decide at runtime.
 
         std::string error;
         fd = adb_connect("sync:", &error);
         if (fd < 0) {
             Error("connect failed: %s", error.c_str());
+            return;
+        }
+
+        FeatureSet features;
+        if (adb_get_feature_set(&features, &error)) {
+            pipelined_ = CanUseFeature(features, kFeatureSyncPipeline);
+            deflating_ = CanUseFeature(features, kFeatureSyncDeflate);
         }
     }
 
@@ -130,6 +147,20 @@ class SyncConnection {
 
     bool IsValid() { return fd >= 0; }
 
+    // Whether the device keeps the connection after a failed SEND or RECV,
+    // so that many of them may be in flight.
+    bool IsPipelined() { return pipelined_; }
+
+    // ID_RECV, or ID_RCVZ if the device may send ID_ZDAT chunks.
+    int RecvId() { return deflating_ ? ID_RCVZ : ID_RECV; }
+
+    // Reads the length bytes of an ID_ZDAT chunk and inflates them into out,
+    // which has room for SYNC_DATA_MAX bytes.
+    bool ReadDeflated(size_t length, char* out, size_t* out_length) {
+        return ReadFdExactly(fd, deflate_.buffer(), length) &&
+               deflate_.Inflate(length, out, SYNC_DATA_MAX, out_length);
+    }
+
     bool ReceivedError(const char* from, const char* to) {
         adb_pollfd pfd = {.fd = fd, .events = POLLIN};
         int rc = adb_poll(&pfd, 1, 0);
@@ -161,11 +192,13 @@ class SyncConnection {
     }
 
     // Sending header, payload, and footer in a single write makes a huge
-    // difference to "adb sync" performance.
+    // difference to "adb sync" performance. The payload of a symlink must
+    // not be deflated.
     bool SendSmallFile(const char* path_and_mode,
                        const char* lpath, const char* rpath,
                        unsigned mtime,
-                       const char* data, size_t data_length) {
+                       const char* data, size_t data_length,
+                       bool may_deflate = true) {
         size_t path_length = strlen(path_and_mode);
         if (path_length > 1024) {
             Error("SendSmallFile failed: path too long: %zu", path_length);
@@ -173,6 +206,15 @@ class SyncConnection {
             return false;
         }
 
+        unsigned data_id = ID_DATA;
+        size_t file_length = data_length;
+        size_t deflated = (deflating_ && may_deflate) ? deflate_.Deflate(data, data_length) : 0;
+        if (deflated) {
+            data_id = ID_ZDAT;
+            data = deflate_.buffer();
+            data_length = deflated;
+        }
+
         std::vector<char> buf(sizeof(SyncRequest) + path_length +
                               sizeof(SyncRequest) + data_length +
                               sizeof(SyncRequest));
@@ -186,7 +228,7 @@ class SyncConnection {
         p += path_length;
 
         SyncRequest* req_data = reinterpret_cast<SyncRequest*>(p);
-        req_data->id = ID_DATA;
+        req_data->id = data_id;
         req_data->path_length = data_length;
         p += sizeof(SyncRequest);
         memcpy(p, data, data_length);
@@ -198,15 +240,21 @@ class SyncConnection {
         p += sizeof(SyncRequest);
 
         WriteOrDie(lpath, rpath, &buf[0], (p - &buf[0]));
-        expect_done_ = true;
-        total_bytes_ += data_length;
-        ReportProgress(rpath, data_length, data_length);
+        pending_acks_.emplace_back(lpath, rpath);
+        total_bytes_ += file_length;
+        ReportProgress(rpath, file_length, file_length);
         return true;
     }
 
     bool SendLargeFile(const char* path_and_mode,
                        const char* lpath, const char* rpath,
                        unsigned mtime) {
+        // Anything the device sends while this file is on its way is to be
+        // about this file, see ReceivedError.
+        if (!ReadAcknowledgements()) {
+            return false;
+        }
+
         if (!SendRequest(ID_SEND, path_and_mode)) {
             Error("failed to send ID_SEND message '%s': %s", path_and_mode, strerror(errno));
             return false;
@@ -228,7 +276,6 @@ class SyncConnection {
         }
 
         syncsendbuf sbuf;
-        sbuf.id = ID_DATA;
         while (true) {
             int bytes_read = adb_read(lfd, sbuf.data, max);
             if (bytes_read == -1) {
@@ -239,8 +286,16 @@ class SyncConnection {
                 break;
             }
 
+            // A deflated chunk is smaller, and so fits in place of the raw one.
+            sbuf.id = ID_DATA;
             sbuf.size = bytes_read;
-            WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + bytes_read);
+            size_t deflated = deflating_ ? deflate_.Deflate(sbuf.data, bytes_read) : 0;
+            if (deflated) {
+                sbuf.id = ID_ZDAT;
+                sbuf.size = deflated;
+                memcpy(sbuf.data, deflate_.buffer(), deflated);
+            }
+            WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + sbuf.size);
 
             total_bytes_ += bytes_read;
             bytes_copied += bytes_read;
@@ -258,10 +313,30 @@ class SyncConnection {
         syncmsg msg;
         msg.data.id = ID_DONE;
         msg.data.size = mtime;
-        expect_done_ = true;
+        pending_acks_.emplace_back(lpath, rpath);
         return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
     }
 
+    // Reads the device's responses to the files sent, oldest first, until no
+    // more than max_pending are outstanding and none that have already
+    // arrived are left unread.
+    bool ReadAcknowledgements(size_t max_pending = 0) {
+        while (!pending_acks_.empty()) {
+            if (pending_acks_.size() <= max_pending) {
+                adb_pollfd pfd = {.fd = fd, .events = POLLIN};
+                if (adb_poll(&pfd, 1, 0) <= 0) {
+                    return true;
+                }
+            }
+            std::pair<std::string, std::string> ack = std::move(pending_acks_.front());
+            pending_acks_.pop_front();
+            if (!CopyDone(ack.first.c_str(), ack.second.c_str())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     bool CopyDone(const char* from, const char* to) {
         syncmsg msg;
         if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
@@ -269,13 +344,7 @@ class SyncConnection {
             return false;
         }
         if (msg.status.id == ID_OKAY) {
-            if (expect_done_) {
-                expect_done_ = false;
-                return true;
-            } else {
-                Error("failed to copy '%s' to '%s': received premature success", from, to);
-                return true;
-            }
+            return true;
         }
         if (msg.status.id != ID_FAIL) {
             Error("failed to copy '%s' to '%s': unknown reason %d", from, to, msg.status.id);
@@ -394,7 +463,12 @@ class SyncConnection {
 
     uint64_t expected_total_bytes_;
     bool expect_multiple_files_;
-    bool expect_done_;
+    bool pipelined_;
+    bool deflating_;
+    SyncDeflate deflate_;
+
+    // Files sent that the device has yet to acknowledge, from and to
+    std::deque<std::pair<std::string, std::string>> pending_acks_;
 
     LinePrinter line_printer_;
 
@@ -488,10 +562,11 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
         }
         buf[data_length++] = '\0';
 
-        if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime, buf, data_length)) {
+        if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime, buf, data_length,
+                              false)) {
             return false;
         }
-        return sc.CopyDone(lpath, rpath);
+        return sc.ReadAcknowledgements(sc.IsPipelined() ? kPipelineDepth : 0);
 #endif
     }
 
@@ -515,20 +590,35 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
             return false;
         }
     }
-    return sc.CopyDone(lpath, rpath);
+    return sc.ReadAcknowledgements(sc.IsPipelined() ? kPipelineDepth : 0);
 }
 
-static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
-                      const char* name=nullptr) {
-    unsigned size = 0;
-    if (!sync_stat(sc, rpath, nullptr, nullptr, &size)) return false;
+// Reads and throws away the response to an ID_RECV request.
+static bool sync_skip_recv(SyncConnection& sc) {
+    while (true) {
+        syncmsg msg;
+        if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) return false;
+
+        if (msg.data.id == ID_DONE) return true;
+        if ((msg.data.id != ID_DATA && msg.data.id != ID_ZDAT && msg.data.id != ID_FAIL) ||
+                msg.data.size > sc.max) {
+            return false;
+        }
 
-    if (!sc.SendRequest(ID_RECV, rpath)) return false;
+        char buffer[SYNC_DATA_MAX];
+        if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) return false;
+        if (msg.data.id == ID_FAIL) return true;
+    }
+}
 
+// Reads the response to an ID_RECV request already sent for rpath.
+static bool sync_finish_recv(SyncConnection& sc, const char* rpath, const char* lpath,
+                             const char* name, uint64_t size) {
     adb_unlink(lpath);
     int lfd = adb_creat(lpath, 0644);
     if (lfd < 0) {
         sc.Error("cannot create '%s': %s", lpath, strerror(errno));
+        sync_skip_recv(sc);
         return false;
     }
 
@@ -543,7 +633,7 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
 
         if (msg.data.id == ID_DONE) break;
 
-        if (msg.data.id != ID_DATA) {
+        if (msg.data.id != ID_DATA && msg.data.id != ID_ZDAT) {
             adb_close(lfd);
             adb_unlink(lpath);
             sc.ReportCopyFailure(rpath, lpath, msg);
@@ -558,22 +648,31 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
         }
 
         char buffer[SYNC_DATA_MAX];
-        if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) {
+        size_t length = msg.data.size;
+        if (msg.data.id == ID_ZDAT) {
+            if (!sc.ReadDeflated(msg.data.size, buffer, &length)) {
+                sc.Error("failed to copy '%s' to '%s': corrupt compressed data", rpath, lpath);
+                adb_close(lfd);
+                adb_unlink(lpath);
+                return false;
+            }
+        } else if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) {
             adb_close(lfd);
             adb_unlink(lpath);
             return false;
         }
 
-        if (!WriteFdExactly(lfd, buffer, msg.data.size)) {
+        if (!WriteFdExactly(lfd, buffer, length)) {
             sc.Error("cannot write '%s': %s", lpath, strerror(errno));
             adb_close(lfd);
             adb_unlink(lpath);
+            sync_skip_recv(sc);
             return false;
         }
 
-        sc.total_bytes_ += msg.data.size;
+        sc.total_bytes_ += length;
 
-        bytes_copied += msg.data.size;
+        bytes_copied += length;
 
         sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, size);
     }
@@ -582,6 +681,16 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
     return true;
 }
 
+static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
+                      const char* name=nullptr) {
+    unsigned size = 0;
+    if (!sync_stat(sc, rpath, nullptr, nullptr, &size)) return false;
+
+    if (!sc.SendRequest(sc.RecvId(), rpath)) return false;
+
+    return sync_finish_recv(sc, rpath, lpath, name, size);
+}
+
 bool do_sync_ls(const char* path) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
@@ -675,6 +784,10 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
     }
 
     if (check_timestamps) {
+        // The responses to these must not be mixed up with acknowledgements.
+        if (!sc.ReadAcknowledgements()) {
+            return false;
+        }
         for (const copyinfo& ci : file_list) {
             if (!sc.SendRequest(ID_STAT, ci.rpath.c_str())) {
                 return false;
@@ -712,6 +825,10 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
         }
     }
 
+    if (!sc.ReadAcknowledgements()) {
+        return false;
+    }
+
     sc.Printf("%s: %d file%s pushed. %d file%s skipped.%s", rpath.c_str(),
               pushed, (pushed == 1) ? "" : "s", skipped,
               (skipped == 1) ? "" : "s", sc.TransferRate().c_str());
@@ -794,6 +911,7 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst) {
         success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode);
     }
 
+    success &= sc.ReadAcknowledgements();
     return success;
 }
 
@@ -892,9 +1010,23 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
 
     sc.ComputeExpectedTotalBytes(file_list);
 
+    // With a pipelined connection, ask for the files ahead of the one being
+    // written, the sizes from the listing are good enough for progress.
+    size_t depth = sc.IsPipelined() ? kPipelineDepth : 0;
+    size_t requested = 0;
+    size_t in_flight = 0;
+    auto is_recv = [](const copyinfo& ci) { return !ci.skip && !S_ISDIR(ci.mode); };
+    auto fail = [&]() {
+        while (in_flight--) {
+            if (!sync_skip_recv(sc)) break;
+        }
+        return false;
+    };
+
     int pulled = 0;
     int skipped = 0;
-    for (const copyinfo &ci : file_list) {
+    for (size_t i = 0; i < file_list.size(); ++i) {
+        const copyinfo& ci = file_list[i];
         if (!ci.skip) {
             if (S_ISDIR(ci.mode)) {
                 // Entry is for an empty directory, create it and continue.
@@ -902,18 +1034,33 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
                 if (!mkdirs(ci.lpath))  {
                     sc.Error("failed to create directory '%s': %s",
                              ci.lpath.c_str(), strerror(errno));
-                    return false;
+                    return fail();
                 }
                 pulled++;
                 continue;
             }
 
-            if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str())) {
-                return false;
+            if (!depth) {
+                if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str())) {
+                    return false;
+                }
+            } else {
+                for (requested = std::max(requested, i);
+                        requested < file_list.size() && in_flight < depth; ++requested) {
+                    const copyinfo& next = file_list[requested];
+                    if (!is_recv(next)) continue;
+                    if (!sc.SendRequest(sc.RecvId(), next.rpath.c_str())) return false;
+                    ++in_flight;
+                }
+                --in_flight;
+                if (!sync_finish_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(),
+                                      nullptr, ci.size)) {
+                    return fail();
+                }
             }
 
             if (copy_attrs && set_time_and_mode(ci.lpath, ci.time, ci.mode)) {
-                return false;
+                return fail();
             }
             pulled++;
         } else {
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_deflate.h"
+
+#include <string.h>
+
+#include "file_sync_service.h"
+
+static constexpr unsigned kMaxBackoff = 16;
+
+SyncDeflate::SyncDeflate() : buffer_(SYNC_DATA_MAX), backoff_(1), skip_(0) {
+    memset(&deflate_, 0, sizeof(deflate_));
+    memset(&inflate_, 0, sizeof(inflate_));
+    // Speed over ratio, the link is slow but not that slow.
+    deflate_ok_ = deflateInit(&deflate_, Z_BEST_SPEED) == Z_OK;
+    inflate_ok_ = inflateInit(&inflate_) == Z_OK;
+}
+
+SyncDeflate::~SyncDeflate() {
+    if (deflate_ok_) deflateEnd(&deflate_);
+    if (inflate_ok_) inflateEnd(&inflate_);
+}
+
+size_t SyncDeflate::Deflate(const void* data, size_t length) {
+    if (!deflate_ok_ || length > buffer_.size()) {
+        return 0;
+    }
+    if (skip_) {
+        --skip_;
+        return 0;
+    }
+
+    deflateReset(&deflate_);
+    deflate_.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+    deflate_.avail_in = length;
+    deflate_.next_out = reinterpret_cast<Bytef*>(buffer());
+    deflate_.avail_out = length - length / 16;
+    if (deflate(&deflate_, Z_FINISH) != Z_STREAM_END) {
+        skip_ = backoff_;
+        if (backoff_ < kMaxBackoff) backoff_ *= 2;
+        return 0;
+    }
+    backoff_ = 1;
+    return deflate_.total_out;
+}
+
+bool SyncDeflate::Inflate(size_t length, void* out, size_t out_size, size_t* out_length) {
+    if (!inflate_ok_ || length > buffer_.size()) {
+        return false;
+    }
+
+    inflateReset(&inflate_);
+    inflate_.next_in = reinterpret_cast<Bytef*>(buffer());
+    inflate_.avail_in = length;
+    inflate_.next_out = reinterpret_cast<Bytef*>(out);
+    inflate_.avail_out = out_size;
+    if (inflate(&inflate_, Z_FINISH) != Z_STREAM_END || inflate_.avail_in) {
+        return false;
+    }
+    *out_length = inflate_.total_out;
+    return true;
+}
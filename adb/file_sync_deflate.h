@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FILE_SYNC_DEFLATE_H_
+#define _FILE_SYNC_DEFLATE_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+#include <android-base/macros.h>
+#include <zlib.h>
+
+// Compression of sync ID_DATA chunks, sent as ID_ZDAT when both ends have
+// kFeatureSyncDeflate. Each chunk is a zlib stream of its own, so that any
+// chunk may go as it is instead. Chunks that do not shrink by at least a
+// sixteenth go as they are, and after such a chunk the next 1, 2, 4 ... 16
+// are not tried, so that incompressible files cost little more to send.
+class SyncDeflate {
+  public:
+    SyncDeflate();
+    ~SyncDeflate();
+
+    // SYNC_DATA_MAX bytes, Deflate() leaves the deflated chunk here, and
+    // an ID_ZDAT chunk is read into here for Inflate().
+    char* buffer() { return &buffer_[0]; }
+
+    // Returns the length of the deflated chunk in buffer(), or 0 if the
+    // chunk is to be sent as it is.
+    size_t Deflate(const void* data, size_t length);
+
+    // Inflates the length bytes in buffer() into out, returns false if they
+    // are not a whole zlib stream or inflate to more than out_size bytes.
+    bool Inflate(size_t length, void* out, size_t out_size, size_t* out_length);
+
+  private:
+    std::vector<char> buffer_;
+    z_stream deflate_;
+    z_stream inflate_;
+    bool deflate_ok_;
+    bool inflate_ok_;
+    unsigned backoff_;  // chunks to skip after the next incompressible one
+    unsigned skip_;     // chunks still to skip
+
+    DISALLOW_COPY_AND_ASSIGN(SyncDeflate);
+};
+
+#endif
@@ -34,6 +34,7 @@
 #include "adb.h"
 #include "adb_io.h"
 #include "adb_utils.h"
+#include "file_sync_deflate.h"
 #include "private/android_filesystem_config.h"
 #include "security_log_tags.h"
 
@@ -147,7 +148,8 @@ static bool SendSyncFailErrno(int fd, const std::string& reason) {
 }
 
 static bool handle_send_file(int s, const char* path, uid_t uid,
-                             gid_t gid, mode_t mode, std::vector<char>& buffer, bool do_unlink) {
+                             gid_t gid, mode_t mode, std::vector<char>& buffer,
+                             SyncDeflate& deflate, bool do_unlink) {
     syncmsg msg;
     unsigned int timestamp = 0;
 
@@ -183,9 +185,9 @@ static bool handle_send_file(int s, const char* path, uid_t uid,
     }
 
     while (true) {
-        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto fail;
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto abort;
 
-        if (msg.data.id != ID_DATA) {
+        if (msg.data.id != ID_DATA && msg.data.id != ID_ZDAT) {
             if (msg.data.id == ID_DONE) {
                 timestamp = msg.data.size;
                 break;
@@ -199,9 +201,18 @@ static bool handle_send_file(int s, const char* path, uid_t uid,
             goto abort;
         }
 
-        if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto abort;
+        size_t length = msg.data.size;
+        if (msg.data.id == ID_ZDAT) {
+            if (!ReadFdExactly(s, deflate.buffer(), msg.data.size)) goto abort;
+            if (!deflate.Inflate(msg.data.size, &buffer[0], buffer.size(), &length)) {
+                SendSyncFail(s, "corrupt compressed data message");
+                goto fail;
+            }
+        } else {
+            if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto abort;
+        }
 
-        if (!WriteFdExactly(fd, &buffer[0], msg.data.size)) {
+        if (!WriteFdExactly(fd, &buffer[0], length)) {
             SendSyncFailErrno(s, "write failed");
             goto fail;
         }
@@ -219,18 +230,21 @@ static bool handle_send_file(int s, const char* path, uid_t uid,
     return WriteFdExactly(s, &msg.status, sizeof(msg.status));
 
 fail:
-    // If there's a problem on the device, we'll send an ID_FAIL message and
-    // close the socket. Unfortunately the kernel will sometimes throw that
-    // data away if the other end keeps writing without reading (which is
-    // the case with old versions of adb). To maintain compatibility, keep
-    // reading and throwing away ID_DATA packets until the other side notices
-    // that we've reported an error.
+    // If there's a problem on the device, we'll send an ID_FAIL message.
+    // Unfortunately the kernel will sometimes throw that data away if the
+    // other end keeps writing without reading (which is the case with old
+    // versions of adb), and a client with requests in flight has more to
+    // come after this file. Keep reading and throwing away ID_DATA packets
+    // up to the ID_DONE, which leaves the connection ready for the next
+    // request.
     while (true) {
-        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto fail;
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto abort;
 
         if (msg.data.id == ID_DONE) {
-            goto abort;
-        } else if (msg.data.id != ID_DATA) {
+            if (fd >= 0) adb_close(fd);
+            if (do_unlink) adb_unlink(path);
+            return true;
+        } else if (msg.data.id != ID_DATA && msg.data.id != ID_ZDAT) {
             char id[5];
             memcpy(id, &msg.data.id, sizeof(msg.data.id));
             id[4] = '\0';
@@ -269,41 +283,40 @@ static bool handle_send_link(int s, const std::string& path, std::vector<char>&
     }
 
     len = msg.data.size;
-    if (len > buffer.size()) { // TODO: resize buffer?
+    if (len >= buffer.size()) { // TODO: resize buffer?
         SendSyncFail(s, "oversize data message");
         return false;
     }
     if (!ReadFdExactly(s, &buffer[0], len)) return false;
+    buffer[len] = '\0';
+
+    // Take the ID_DONE first, so that a failure leaves the connection ready
+    // for the next request.
+    if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+    if (msg.data.id != ID_DONE) {
+        SendSyncFail(s, "invalid data message: expected ID_DONE");
+        return false;
+    }
 
     ret = symlink(&buffer[0], path.c_str());
     if (ret && errno == ENOENT) {
         if (!secure_mkdirs(adb_dirname(path))) {
-            SendSyncFailErrno(s, "secure_mkdirs failed");
-            return false;
+            return SendSyncFailErrno(s, "secure_mkdirs failed");
         }
         ret = symlink(&buffer[0], path.c_str());
     }
     if (ret) {
-        SendSyncFailErrno(s, "symlink failed");
-        return false;
-    }
-
-    if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
-
-    if (msg.data.id == ID_DONE) {
-        msg.status.id = ID_OKAY;
-        msg.status.msglen = 0;
-        if (!WriteFdExactly(s, &msg.status, sizeof(msg.status))) return false;
-    } else {
-        SendSyncFail(s, "invalid data message: expected ID_DONE");
-        return false;
+        return SendSyncFailErrno(s, "symlink failed");
     }
 
-    return true;
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return WriteFdExactly(s, &msg.status, sizeof(msg.status));
 }
 #endif
 
-static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
+static bool do_send(int s, const std::string& spec, std::vector<char>& buffer,
+                    SyncDeflate& deflate) {
     // 'spec' is of the form "/some/path,0755". Break it up.
     size_t comma = spec.find_last_of(',');
     if (comma == std::string::npos) {
@@ -344,30 +357,40 @@ static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
         fs_config(path.c_str(), 0, nullptr, &uid, &gid, &broken_api_hack, &cap);
         mode = broken_api_hack;
     }
-    return handle_send_file(s, path.c_str(), uid, gid, mode, buffer, do_unlink);
+    return handle_send_file(s, path.c_str(), uid, gid, mode, buffer, deflate, do_unlink);
 }
 
-static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
+// With deflate, for ID_RCVZ, chunks that compress are sent as ID_ZDAT.
+static bool do_recv(int s, const char* path, std::vector<char>& buffer, SyncDeflate* deflate) {
     __android_log_security_bswrite(SEC_TAG_ADB_RECV_FILE, path);
 
+    // The ID_FAIL takes the place of the file's ID_DATA and ID_DONE, so the
+    // connection is ready for the next request after either.
     int fd = adb_open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
-        SendSyncFailErrno(s, "open failed");
-        return false;
+        return SendSyncFailErrno(s, "open failed");
     }
 
     syncmsg msg;
-    msg.data.id = ID_DATA;
     while (true) {
         int r = adb_read(fd, &buffer[0], buffer.size());
         if (r <= 0) {
             if (r == 0) break;
-            SendSyncFailErrno(s, "read failed");
+            bool sent = SendSyncFailErrno(s, "read failed");
             adb_close(fd);
-            return false;
+            return sent;
         }
+        const char* data = &buffer[0];
+        msg.data.id = ID_DATA;
         msg.data.size = r;
-        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) || !WriteFdExactly(s, &buffer[0], r)) {
+        size_t deflated = deflate ? deflate->Deflate(data, r) : 0;
+        if (deflated) {
+            data = deflate->buffer();
+            msg.data.id = ID_ZDAT;
+            msg.data.size = deflated;
+        }
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) ||
+                !WriteFdExactly(s, data, msg.data.size)) {
             adb_close(fd);
             return false;
         }
@@ -380,7 +403,7 @@ static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
     return WriteFdExactly(s, &msg.data, sizeof(msg.data));
 }
 
-static bool handle_sync_command(int fd, std::vector<char>& buffer) {
+static bool handle_sync_command(int fd, std::vector<char>& buffer, SyncDeflate& deflate) {
     D("sync: waiting for request");
 
     SyncRequest request;
@@ -411,10 +434,13 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
         if (!do_list(fd, name)) return false;
         break;
       case ID_SEND:
-        if (!do_send(fd, name, buffer)) return false;
+        if (!do_send(fd, name, buffer, deflate)) return false;
         break;
       case ID_RECV:
-        if (!do_recv(fd, name, buffer)) return false;
+        if (!do_recv(fd, name, buffer, nullptr)) return false;
+        break;
+      case ID_RCVZ:
+        if (!do_recv(fd, name, buffer, &deflate)) return false;
         break;
       case ID_QUIT:
         return false;
@@ -429,8 +455,9 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
 
 void file_sync_service(int fd, void* cookie) {
     std::vector<char> buffer(SYNC_DATA_MAX);
+    SyncDeflate deflate;
 
-    while (handle_sync_command(fd, buffer)) {
+    while (handle_sync_command(fd, buffer, deflate)) {
     }
 
     D("sync: done");
@@ -32,6 +32,10 @@
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+// With kFeatureSyncDeflate, an ID_DATA chunk as a zlib stream, and an
+// ID_RECV whose chunks may be sent as ID_ZDAT.
+#define ID_ZDAT MKID('Z','D','A','T')
+#define ID_RCVZ MKID('R','C','V','Z')
 
 struct SyncRequest {
     uint32_t id;  // ID_STAT, et cetera.
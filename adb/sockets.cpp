@@ -461,7 +461,7 @@ static int remote_socket_enqueue(asocket* s, apacket* p) {
 
 static void remote_socket_ready(asocket* s) {
     D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d", s->id, s->fd, s->peer->fd);
-    apacket* p = get_apacket();
+    apacket* p = get_apacket(0);
     p->msg.command = A_OKAY;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
@@ -471,7 +471,7 @@ static void remote_socket_ready(asocket* s) {
 static void remote_socket_shutdown(asocket* s) {
     D("entered remote_socket_shutdown RS(%d) CLOSE fd=%d peer->fd=%d", s->id, s->fd,
       s->peer ? s->peer->fd : -1);
-    apacket* p = get_apacket();
+    apacket* p = get_apacket(0);
     p->msg.command = A_CLSE;
     if (s->peer) {
         p->msg.arg0 = s->peer->id;
@@ -518,12 +518,12 @@ asocket* create_remote_socket(unsigned id, atransport* t) {
 
 void connect_to_remote(asocket* s, const char* destination) {
     D("Connect_to_remote call RS(%d) fd=%d", s->id, s->fd);
-    apacket* p = get_apacket();
     size_t len = strlen(destination) + 1;
 
     if (len > (s->get_max_payload() - 1)) {
         fatal("destination oversized");
     }
+    apacket* p = get_apacket(len);
 
     D("LS(%d): connect('%s')", s->id, destination);
     p->msg.command = A_OPEN;
@@ -661,7 +661,8 @@ static int smart_socket_enqueue(asocket* s, apacket* p) {
         s->pkt_first = p;
         s->pkt_last = p;
     } else {
-        if ((s->pkt_first->len + p->len) > s->get_max_payload()) {
+        if ((s->pkt_first->len + p->len) > s->get_max_payload() ||
+            (s->pkt_first->len + p->len) > s->pkt_first->capacity) {
             D("SS(%d): overflow", s->id);
             put_apacket(p);
             goto fail;
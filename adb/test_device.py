@@ -845,6 +845,41 @@ class FileOperationsTest(DeviceTest):
             if host_dir is not None:
                 shutil.rmtree(host_dir)
 
+    def test_push_pull_dir_many_files(self):
+        """Push then pull a directory of many small files.
+
+        With the sync_pipeline feature many files are in flight at once, check
+        that each ends up where it belongs.
+        """
+        self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        self.device.shell(['mkdir', self.DEVICE_TEMP_DIR])
+
+        host_dir = None
+        pull_dir = None
+        try:
+            host_dir = tempfile.mkdtemp()
+            pull_dir = tempfile.mkdtemp()
+
+            # Make sure the temp directory isn't setuid, or else adb will complain.
+            os.chmod(host_dir, 0o700)
+
+            temp_files = make_random_host_files(in_dir=host_dir, num_files=512)
+            self.device.push(host_dir, self.DEVICE_TEMP_DIR)
+            self.device.pull(remote=self.DEVICE_TEMP_DIR, local=pull_dir)
+
+            for temp_file in temp_files:
+                host_path = os.path.join(
+                    pull_dir, posixpath.basename(self.DEVICE_TEMP_DIR),
+                    os.path.basename(host_dir), temp_file.base_name)
+                self._verify_local(temp_file.checksum, host_path)
+
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        finally:
+            if host_dir is not None:
+                shutil.rmtree(host_dir)
+            if pull_dir is not None:
+                shutil.rmtree(pull_dir)
+
     def test_pull_dir_symlink(self):
         """Pull a directory into a symlink to a directory.
 
@@ -47,6 +47,8 @@ ADB_MUTEX_DEFINE( transport_lock );
 
 const char* const kFeatureShell2 = "shell_v2";
 const char* const kFeatureCmd = "cmd";
+const char* const kFeatureSyncPipeline = "sync_pipeline";
+const char* const kFeatureSyncDeflate = "sync_deflate";
 
 static std::string dump_packet(const char* name, const char* func, apacket* p) {
     unsigned  command = p->msg.command;
@@ -199,7 +201,7 @@ static void read_transport_thread(void* _t) {
                                                    (t->serial != nullptr ? t->serial : "transport")));
     D("%s: starting read_transport thread on fd %d, SYNC online (%d)",
        t->serial, t->fd, t->sync_token + 1);
-    p = get_apacket();
+    p = get_apacket(0);
     p->msg.command = A_SYNC;
     p->msg.arg0 = 1;
     p->msg.arg1 = ++(t->sync_token);
@@ -211,14 +213,30 @@ static void read_transport_thread(void* _t) {
     }
 
     D("%s: data pump started", t->serial);
+    // Packets are read into a full sized one, since the payload length is
+    // not known until the header has been read. Short payloads are copied
+    // out so that the big packet can be reused, and the rest is passed on.
+    p = nullptr;
     for(;;) {
-        p = get_apacket();
+        if (p == nullptr) {
+            p = get_apacket();
+        }
 
         if(t->read_from_remote(p, t) == 0){
             D("%s: received remote packet, sending to transport",
               t->serial);
-            if(write_packet(t->fd, t->serial, &p)){
-                put_apacket(p);
+            apacket* q;
+            if (p->msg.data_length <= MAX_PAYLOAD_V1) {
+                q = get_apacket(p->msg.data_length);
+                q->msg = p->msg;
+                memcpy(q->data, p->data, p->msg.data_length);
+            } else {
+                q = p;
+                p = nullptr;
+            }
+            if(write_packet(t->fd, t->serial, &q)){
+                put_apacket(q);
+                if (p) put_apacket(p);
                 D("%s: failed to write apacket to transport", t->serial);
                 goto oops;
             }
@@ -230,7 +248,7 @@ static void read_transport_thread(void* _t) {
     }
 
     D("%s: SYNC offline for transport", t->serial);
-    p = get_apacket();
+    p = get_apacket(0);
     p->msg.command = A_SYNC;
     p->msg.arg0 = 0;
     p->msg.arg1 = 0;
@@ -784,7 +802,9 @@ const FeatureSet& supported_features() {
     // Local static allocation to avoid global non-POD variables.
     static const FeatureSet* features = new FeatureSet{
         kFeatureShell2,
-        kFeatureCmd
+        kFeatureCmd,
+        kFeatureSyncPipeline,
+        kFeatureSyncDeflate
         // Increment ADB_SERVER_VERSION whenever the feature list changes to
         // make sure that the adb client and server features stay in sync
         // (http://b/24370690).
@@ -41,6 +41,11 @@ bool CanUseFeature(const FeatureSet& feature_set, const std::string& feature);
 extern const char* const kFeatureShell2;
 // The 'cmd' command is available
 extern const char* const kFeatureCmd;
+// The sync service survives per-file failures, so that a client may have
+// many requests in flight and read their responses later.
+extern const char* const kFeatureSyncPipeline;
+// The sync service takes ID_ZDAT chunks, and answers ID_RCVZ.
+extern const char* const kFeatureSyncDeflate;
 
 class atransport {
 public:
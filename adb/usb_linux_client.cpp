@@ -21,12 +21,14 @@
 #include <cutils/properties.h>
 #include <dirent.h>
 #include <errno.h>
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -49,11 +51,30 @@
 // fragmentation. 16k chosen arbitrarily to match the write limit.
 #define USB_FFS_MAX_READ 16384
 
+// Bulk transfers that may be queued at once in each direction, so the link
+// does not sit idle while adbd turns one transfer around into the next.
+#define USB_FFS_AIO_DEPTH 8
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
 static int dummy_fd = -1;
 
+// Asynchronous I/O on one FunctionFS endpoint. Writes are copied into the
+// slot buffers and may still be in flight when usb_write() returns; reads
+// go straight into the caller's buffer and are all reaped before returning.
+struct usb_ffs_aio {
+    bool enabled;
+    bool submitted;             // any, since the endpoint was opened
+    bool failed;                // a write in flight failed
+    aio_context_t ctx;
+    size_t pending;
+    struct iocb iocbs[USB_FFS_AIO_DEPTH];
+    bool busy[USB_FFS_AIO_DEPTH];
+    int64_t res[USB_FFS_AIO_DEPTH];  // of each finished transfer
+    char* bufs[USB_FFS_AIO_DEPTH];   // for writes only
+};
+
 struct usb_handle
 {
     adb_cond_t notify;
@@ -73,6 +94,8 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+    usb_ffs_aio read_aio;
+    usb_ffs_aio write_aio;
 };
 
 struct func_desc {
@@ -380,6 +403,44 @@ static void usb_adb_init()
 }
 
 
+// Neither bionic nor glibc wrap the kernel's native AIO calls.
+static int io_setup(unsigned nr, aio_context_t* ctx) {
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx) {
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb** iocbpp) {
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event* events,
+                        struct timespec* timeout) {
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static void usb_ffs_aio_open(usb_ffs_aio* aio) {
+    aio->ctx = 0;
+    aio->enabled = (io_setup(USB_FFS_AIO_DEPTH, &aio->ctx) == 0);
+    if (!aio->enabled) {
+        D("[ io_setup failed, errno=%d: using synchronous I/O ]", errno);
+    }
+    aio->submitted = false;
+    aio->failed = false;
+    aio->pending = 0;
+    memset(aio->busy, 0, sizeof(aio->busy));
+}
+
+// Cancels, and waits for, anything still in flight on the endpoint.
+static void usb_ffs_aio_close(usb_ffs_aio* aio) {
+    if (aio->enabled) {
+        io_destroy(aio->ctx);
+        aio->enabled = false;
+    }
+}
+
 static bool init_functionfs(struct usb_handle *h)
 {
     ssize_t ret;
@@ -441,6 +502,8 @@ static bool init_functionfs(struct usb_handle *h)
         goto err;
     }
 
+    usb_ffs_aio_open(&h->read_aio);
+    usb_ffs_aio_open(&h->write_aio);
     return true;
 
 err:
@@ -489,7 +552,7 @@ static void usb_ffs_open_thread(void* x) {
     abort();
 }
 
-static int usb_ffs_write(usb_handle* h, const void* data, int len) {
+static int usb_ffs_write_sync(usb_handle* h, const void* data, int len) {
     D("about to write (fd=%d, len=%d)", h->bulk_in, len);
 
     const char* buf = static_cast<const char*>(data);
@@ -508,7 +571,7 @@ static int usb_ffs_write(usb_handle* h, const void* data, int len) {
     return 0;
 }
 
-static int usb_ffs_read(usb_handle* h, void* data, int len) {
+static int usb_ffs_read_sync(usb_handle* h, void* data, int len) {
     D("about to read (fd=%d, len=%d)", h->bulk_out, len);
 
     char* buf = static_cast<char*>(data);
@@ -527,6 +590,212 @@ static int usb_ffs_read(usb_handle* h, void* data, int len) {
     return 0;
 }
 
+// Waits for at least min_nr transfers to complete, and returns -1 if any
+// of them failed, or came up short unless allow_short. Gives up if the
+// handle is kicked meanwhile.
+static int usb_ffs_aio_reap(usb_handle* h, usb_ffs_aio* aio, size_t min_nr,
+                            bool allow_short = false) {
+    int result = 0;
+    while (true) {
+        struct io_event events[USB_FFS_AIO_DEPTH];
+        struct timespec timeout = { 0, 100 * 1000 * 1000 };
+        int n = io_getevents(aio->ctx, min_nr ? 1 : 0, aio->pending, events,
+                             min_nr ? &timeout : nullptr);
+        if (n < 0 && errno != EINTR) {
+            D("[ io_getevents failed, errno=%d ]", errno);
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            size_t slot = events[i].data;
+            aio->busy[slot] = false;
+            aio->res[slot] = events[i].res;
+            --aio->pending;
+            if (events[i].res < 0 ||
+                (!allow_short &&
+                 events[i].res != static_cast<int64_t>(aio->iocbs[slot].aio_nbytes))) {
+                D("[ transfer on fd %d: res=%lld, expected %llu ]", aio->iocbs[slot].aio_fildes,
+                  static_cast<long long>(events[i].res),
+                  static_cast<unsigned long long>(aio->iocbs[slot].aio_nbytes));
+                result = -1;
+            }
+            if (min_nr) --min_nr;
+        }
+        if (min_nr == 0 || result < 0) {
+            return result;
+        }
+        if (h->kicked) {
+            D("[ aio on usb handle finished due to kicked ]");
+            return -1;
+        }
+    }
+}
+
+// Waits for the transfer in slot, which may come up short, to complete.
+// Returns -1 if it or any other failed meanwhile.
+static int usb_ffs_aio_wait(usb_handle* h, usb_ffs_aio* aio, size_t slot) {
+    while (aio->busy[slot]) {
+        if (usb_ffs_aio_reap(h, aio, 1, true) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if the transfer was queued, 0 if the endpoint turned out not to
+// support AIO (so nothing was), or -1 on error.
+static int usb_ffs_aio_submit(usb_ffs_aio* aio, size_t slot, uint16_t opcode, int fd, void* buf,
+                              size_t len) {
+    struct iocb* iocb = &aio->iocbs[slot];
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = slot;
+    iocb->aio_lio_opcode = opcode;
+    iocb->aio_fildes = fd;
+    iocb->aio_buf = reinterpret_cast<uintptr_t>(buf);
+    iocb->aio_nbytes = len;
+    if (io_submit(aio->ctx, 1, &iocb) != 1) {
+        if (errno == EINVAL && !aio->submitted) {
+            D("[ fd %d does not support aio: using synchronous I/O ]", fd);
+            usb_ffs_aio_close(aio);
+            return 0;
+        }
+        D("[ io_submit on fd %d failed, errno=%d ]", fd, errno);
+        return -1;
+    }
+    aio->submitted = true;
+    aio->busy[slot] = true;
+    ++aio->pending;
+    return 1;
+}
+
+static size_t usb_ffs_aio_free_slot(const usb_ffs_aio* aio) {
+    for (size_t slot = 0; slot < USB_FFS_AIO_DEPTH; ++slot) {
+        if (!aio->busy[slot]) {
+            return slot;
+        }
+    }
+    LOG(FATAL) << "no free aio slot with " << aio->pending << " pending";
+    return 0;
+}
+
+static int usb_ffs_write(usb_handle* h, const void* data, int len) {
+    usb_ffs_aio* aio = &h->write_aio;
+    if (!aio->enabled) {
+        return usb_ffs_write_sync(h, data, len);
+    }
+    D("about to queue write (fd=%d, len=%d)", h->bulk_in, len);
+
+    // Pick up any completions, so that a failed transfer is reported on the
+    // next write rather than after the queue fills.
+    if (h->kicked || aio->failed || (aio->pending && usb_ffs_aio_reap(h, aio, 0) < 0)) {
+        aio->failed = true;
+        return -1;
+    }
+
+    const char* buf = static_cast<const char*>(data);
+    while (len > 0) {
+        if (aio->pending == USB_FFS_AIO_DEPTH && usb_ffs_aio_reap(h, aio, 1) < 0) {
+            aio->failed = true;
+            return -1;
+        }
+        size_t slot = usb_ffs_aio_free_slot(aio);
+        int write_len = std::min(USB_FFS_MAX_WRITE, len);
+        memcpy(aio->bufs[slot], buf, write_len);
+        int rc = usb_ffs_aio_submit(aio, slot, IOCB_CMD_PWRITE, h->bulk_in, aio->bufs[slot],
+                                    write_len);
+        if (rc == 0) {
+            return usb_ffs_write_sync(h, buf, len);
+        } else if (rc < 0) {
+            aio->failed = true;
+            return -1;
+        }
+        buf += write_len;
+        len -= write_len;
+    }
+
+    D("[ queued fd=%d, %zu pending ]", h->bulk_in, aio->pending);
+    return 0;
+}
+
+// The reads are kept to the lengths asked for, as the host does not end
+// every transfer with a short packet; a read running on into the next
+// transfer could wait for data that the host will only send once adbd
+// has answered this one.
+//
+// A read can still come up short, or empty on a zero length packet, as
+// usb_ffs_read_sync() allows for. What came next is then in the reads
+// queued behind it, so those are waited for and moved down against it,
+// and the rest is read again.
+static int usb_ffs_read(usb_handle* h, void* data, int len) {
+    usb_ffs_aio* aio = &h->read_aio;
+    if (!aio->enabled) {
+        return usb_ffs_read_sync(h, data, len);
+    }
+    D("about to read (fd=%d, len=%d)", h->bulk_out, len);
+
+    char* buf = static_cast<char*>(data);  // end of what has been read
+    char* next = buf;                      // where the next read goes
+    char* end = buf + len;
+    // Slots are used in turn, so that those from head on hold the reads
+    // not yet taken, in the order they were queued. A read can finish
+    // before those ahead of it are taken, freeing its slot in the aio's
+    // eyes only.
+    size_t head = 0;
+    size_t count = 0;
+    while (buf < end) {
+        while (next < end && count < USB_FFS_AIO_DEPTH) {
+            size_t slot = (head + count) % USB_FFS_AIO_DEPTH;
+            int read_len = std::min<ptrdiff_t>(USB_FFS_MAX_READ, end - next);
+            int rc = usb_ffs_aio_submit(aio, slot, IOCB_CMD_PREAD, h->bulk_out, next, read_len);
+            if (rc == 0) {
+                return usb_ffs_read_sync(h, buf, end - buf);
+            } else if (rc < 0) {
+                break;
+            }
+            ++count;
+            next += read_len;
+        }
+        if (count == 0 || h->kicked) {
+            goto fail;
+        }
+
+        size_t slot = head;
+        if (usb_ffs_aio_wait(h, aio, slot) < 0) {
+            goto fail;
+        }
+        head = (head + 1) % USB_FFS_AIO_DEPTH;
+        --count;
+        buf += aio->res[slot];
+        if (aio->res[slot] == static_cast<int64_t>(aio->iocbs[slot].aio_nbytes)) {
+            continue;
+        }
+
+        D("[ short read on fd %d: res=%lld, expected %llu ]", h->bulk_out,
+          static_cast<long long>(aio->res[slot]),
+          static_cast<unsigned long long>(aio->iocbs[slot].aio_nbytes));
+        while (count > 0) {
+            slot = head;
+            if (usb_ffs_aio_wait(h, aio, slot) < 0) {
+                goto fail;
+            }
+            head = (head + 1) % USB_FFS_AIO_DEPTH;
+            --count;
+            memmove(buf, reinterpret_cast<char*>(aio->iocbs[slot].aio_buf), aio->res[slot]);
+            buf += aio->res[slot];
+        }
+        next = buf;
+    }
+
+    D("[ done fd=%d ]", h->bulk_out);
+    return 0;
+
+fail:
+    // Reads still in flight would land in a buffer the caller is about
+    // to free: cancel and wait for them, and read without aio from here
+    // on.
+    usb_ffs_aio_close(aio);
+    return -1;
+}
+
 static void usb_ffs_kick(usb_handle *h)
 {
     int err;
@@ -552,6 +821,8 @@ static void usb_ffs_kick(usb_handle *h)
 
 static void usb_ffs_close(usb_handle *h) {
     h->kicked = false;
+    usb_ffs_aio_close(&h->read_aio);
+    usb_ffs_aio_close(&h->write_aio);
     adb_close(h->bulk_out);
     adb_close(h->bulk_in);
     adb_close(h->control);
@@ -577,6 +848,10 @@ static void usb_ffs_init()
     h->control = -1;
     h->bulk_out = -1;
     h->bulk_out = -1;
+    for (size_t i = 0; i < USB_FFS_AIO_DEPTH; ++i) {
+        h->write_aio.bufs[i] = reinterpret_cast<char*>(malloc(USB_FFS_MAX_WRITE));
+        if (h->write_aio.bufs[i] == nullptr) fatal("couldn't allocate usb aio buffers");
+    }
 
     h->open_new_connection = true;
     adb_cond_init(&h->notify, 0);
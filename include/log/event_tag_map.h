@@ -43,6 +43,15 @@ void android_closeEventTagMap(EventTagMap* map);
  */
 const char* android_lookupEventTag(const EventTagMap* map, int tag);
 
+/*
+ * Write a precompiled index of the map, opened from fileName, to indexName.
+ * android_openEventTagMap() maps "<fileName>.idx" in place of parsing
+ * fileName when it is there and current. Returns 0 on success.
+ */
+int android_writeEventTagMapIndex(const EventTagMap* map,
+                                  const char* fileName,
+                                  const char* indexName);
+
 #ifdef __cplusplus
 }
 #endif
@@ -679,6 +679,24 @@ int __android_log_is_loggable(int prio, const char *tag, int default_prio);
 
 int __android_log_security(); /* Device Owner is present */
 
+/*
+ * Opt in to batched writes to logd for high rate producers. Entries are
+ * accumulated per thread and sent together once the batch is full,
+ * deadline_ms after the first was queued, or at once for ANDROID_LOG_FATAL.
+ * A deadline_ms of 0 returns to a write per entry. Pending entries are sent
+ * by __android_log_close(), when their thread exits and on exit(). Up to
+ * deadline_ms of entries are lost should the process crash, be killed or
+ * call _exit(); only fatal entries are sure to have been sent.
+ */
+int __android_log_set_batch(unsigned deadline_ms);
+
+/*
+ * Opt in to writing to logd through a shared memory ring, entries are
+ * copied in without a syscall. Falls back to the socket should logd not
+ * hand out a ring or the ring be full. Takes precedence over batching.
+ */
+int __android_log_set_shm(int enable);
+
 int __android_log_error_write(int tag, const char *subTag, int32_t uid, const char *data,
                               uint32_t dataLen);
 
@@ -202,6 +202,17 @@ struct logger_list *android_logger_list_open(log_id_t id,
                                              pid_t pid);
 #define android_logger_list_close android_logger_list_free
 
+/*
+ * Have logd filter entries before they are sent, space separated:
+ *   tags=<tag>[:<priority>][,...]  priority one of VDIWEFS, * the default
+ *   pids=<pid>[,...]
+ *   uids=<uid>[,...]
+ *   regex=<expr>                   POSIX extended, must come last
+ * Must be called before the first read. Other transports ignore filters.
+ */
+int android_logger_list_set_filter(struct logger_list *logger_list,
+                                   const char *filter);
+
 #ifdef __linux__
 clockid_t android_log_clockid();
 #endif
@@ -146,6 +146,21 @@ char *android_log_formatLogLine (
     const AndroidLogEntry *p_line,
     size_t *p_outLength);
 
+/**
+ * Formats a log message into the caller's buffer, without allocating
+ *
+ * Returns the length of the formatted line. Like snprintf, the line is only
+ * complete, and nul terminated, if that is less than bufferSize.
+ *
+ * The last time stamp formatted is kept in p_format, a p_format should
+ * not be used by more than one thread at a time.
+ */
+size_t android_log_formatLogLineInto(
+    AndroidLogFormat *p_format,
+    char *buffer,
+    size_t bufferSize,
+    const AndroidLogEntry *p_line);
+
 
 /**
  * Either print or do not print log line, based on filter
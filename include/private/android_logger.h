@@ -44,6 +44,79 @@ typedef struct __attribute__((__packed__)) {
     log_time realtime;
 } android_log_header_t;
 
+/*
+ * Several entries in one datagram to logd, distinguished from a single
+ * entry by the id. Followed by count records, each an
+ * android_log_batch_record_t then len bytes of payload.
+ */
+#define LOGGER_ID_BATCH 0xFF
+
+typedef struct __attribute__((__packed__)) {
+    typeof_log_id_t id; // LOGGER_ID_BATCH
+    uint16_t count;
+} android_log_batch_header_t;
+
+typedef struct __attribute__((__packed__)) {
+    android_log_header_t header;
+    uint16_t len;
+} android_log_batch_record_t;
+
+/*
+ * Shared memory ring handed out by logd in reply to the "shm" command,
+ * along with an eventfd to kick logd with. The single producer is the
+ * process that asked for it, the single consumer logd. head and tail are
+ * free running byte counts, the data follows the header and holds
+ * android_log_batch_record_t records then payload, each padded to
+ * LOGGER_SHM_ALIGN. A record does not wrap: when fewer than
+ * sizeof(android_log_batch_record_t) bytes remain before the end they are
+ * skipped, otherwise a record with an id of LOGGER_ID_BATCH pads to the end.
+ */
+#define LOGGER_SHM_MAGIC 0x6d68534c /* "LShm" */
+#define LOGGER_SHM_ALIGN 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;     /* of the data, a power of two */
+    uint32_t sleeping; /* set by logd before it waits on the eventfd */
+    uint32_t reserved;
+    uint64_t head __attribute__((__aligned__(64))); /* producer only */
+    uint64_t tail __attribute__((__aligned__(64))); /* consumer only */
+} __attribute__((__aligned__(64))) android_log_shm_header_t;
+
+/*
+ * Compact reader stream, asked for with " format=2" on the logdr socket.
+ * logd agrees by sending an android_log_compact_hello_t first, an older
+ * logd ignores the option and sends logger_entry_v4 as before. Each
+ * datagram that follows is one entry: a flags byte, then in order
+ *   uint8_t lid                              if LOGGER_COMPACT_LID
+ *   zigzag varint pid - previous pid         if LOGGER_COMPACT_PID
+ *   zigzag varint tid - previous tid         if LOGGER_COMPACT_TID
+ *   varint uid                               if LOGGER_COMPACT_UID
+ *   zigzag varint nanoseconds - previous     always
+ *   varint tag index, uint8_t priority       if LOGGER_COMPACT_TAG
+ * and the payload takes the rest of the datagram. Fields not flagged are
+ * those of the previous entry, all start at zero. LOGGER_COMPACT_TAG
+ * entries have the priority and tag taken off the front of the payload,
+ * to be put back from the per connection dictionary. LOGGER_COMPACT_NEWTAG
+ * entries carry their tag in full, and it is added to the dictionary at
+ * the next index. Varints are little endian base 128.
+ */
+#define LOGGER_COMPACT_MAGIC   0x3276434c /* "LCv2" */
+#define LOGGER_COMPACT_LID     0x01
+#define LOGGER_COMPACT_PID     0x02
+#define LOGGER_COMPACT_TID     0x04
+#define LOGGER_COMPACT_UID     0x08
+#define LOGGER_COMPACT_NOUID   0x10 /* reader gets a logger_entry_v3 */
+#define LOGGER_COMPACT_TAG     0x20
+#define LOGGER_COMPACT_NEWTAG  0x40
+#define LOGGER_COMPACT_MAX_TAGS    256
+#define LOGGER_COMPACT_MAX_TAG_LEN 63 /* longer tags are always sent */
+#define LOGGER_COMPACT_MAX_HEADER  32
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t magic;
+} android_log_compact_hello_t;
+
 /* Event Header Structure to logd */
 typedef struct __attribute__((__packed__)) {
     int32_t tag;  // Little Endian Order
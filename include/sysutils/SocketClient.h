@@ -5,6 +5,7 @@
 
 #include <pthread.h>
 #include <cutils/atomic.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 
@@ -62,6 +63,10 @@ public:
     int sendData(const void *data, int len);
     // iovec contents not preserved through call
     int sendDatav(struct iovec *iov, int iovcnt);
+    // Each mmsghdr is sent as a separate packet, with a single syscall
+    // where possible. Returns the number sent, or -1. With MSG_DONTWAIT in
+    // flags that stops short of vlen, errno EAGAIN, once the socket is full.
+    int sendDatamv(struct mmsghdr *msgs, unsigned int vlen, int flags = 0);
 
     // Optional reference counting.  Reference count starts at 1.  If
     // it's decremented to 0, it deletes itself.
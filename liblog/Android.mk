@@ -32,7 +32,8 @@ liblog_host_sources += fake_writer.c
 liblog_target_sources := $(liblog_sources) event_tag_map.c
 liblog_target_sources += config_read.c log_time.cpp log_is_loggable.c logprint.c
 liblog_target_sources += pmsg_reader.c pmsg_writer.c
-liblog_target_sources += logd_reader.c logd_writer.c logger_read.c
+liblog_target_sources += logd_reader.c logd_writer.c logd_batch_writer.c
+liblog_target_sources += logd_shm_writer.c logger_read.c
 
 # Shared and static library for host
 # ========================================================
@@ -73,6 +74,8 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := liblog
 LOCAL_WHOLE_STATIC_LIBRARIES := liblog
 LOCAL_CFLAGS := -Werror -fvisibility=hidden $(liblog_cflags)
+# android_openEventTagMap() maps this in place of parsing event-log-tags
+LOCAL_REQUIRED_MODULES := event-log-tags.idx
 
 # TODO: This is to work around b/24465209. Remove after root cause is fixed
 LOCAL_LDFLAGS_arm := -Wl,--hash-style=both
@@ -82,4 +85,33 @@ LOCAL_CXX_STL := none
 
 include $(BUILD_SHARED_LIBRARY)
 
+# Precompiled event log tag map index
+# ========================================================
+include $(CLEAR_VARS)
+LOCAL_MODULE := event-tag-index
+LOCAL_SRC_FILES := event_tag_index.c
+LOCAL_CFLAGS := -Werror
+LOCAL_STATIC_LIBRARIES := liblog
+LOCAL_LDLIBS_linux := -lrt
+LOCAL_MODULE_HOST_OS := darwin linux
+include $(BUILD_HOST_EXECUTABLE)
+
+event_tag_index_tool := $(LOCAL_INSTALLED_MODULE)
+
+# Generated from the merged event-log-tags, see build/core/Makefile
+include $(CLEAR_VARS)
+LOCAL_MODULE := event-log-tags.idx
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)
+include $(BUILD_SYSTEM)/base_rules.mk
+
+$(LOCAL_BUILT_MODULE): PRIVATE_TOOL := $(event_tag_index_tool)
+$(LOCAL_BUILT_MODULE): PRIVATE_TAGS := $(TARGET_OUT_ETC)/event-log-tags
+$(LOCAL_BUILT_MODULE): $(TARGET_OUT_ETC)/event-log-tags $(event_tag_index_tool)
+	@echo "Event tag index: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PRIVATE_TOOL) $(PRIVATE_TAGS) $@
+
+event_tag_index_tool :=
+
 include $(call first-makefiles-under,$(LOCAL_PATH))
@@ -51,11 +51,30 @@ static void __android_log_add_transport(
     }
 }
 
+LIBLOG_HIDDEN void __android_log_remove_transport(
+        struct listnode *list, struct android_log_transport_write *transport) {
+    struct android_log_transport_write *transp;
+
+    write_transport_for_each(transp, list) {
+        if (transp == transport) {
+            list_remove(&transport->node);
+            list_init(&transport->node);
+            break;
+        }
+    }
+    transport->logMask = 0;
+}
+
 LIBLOG_HIDDEN void __android_log_config_write() {
 #if (FAKE_LOG_DEVICE == 0)
+    extern struct android_log_transport_write logdShmLoggerWrite;
+    extern struct android_log_transport_write logdBatchLoggerWrite;
     extern struct android_log_transport_write logdLoggerWrite;
     extern struct android_log_transport_write pmsgLoggerWrite;
 
+    /* Only available if opted in, in which case they stand in for logd */
+    __android_log_add_transport(&__android_log_transport_write, &logdShmLoggerWrite);
+    __android_log_add_transport(&__android_log_transport_write, &logdBatchLoggerWrite);
     __android_log_add_transport(&__android_log_transport_write, &logdLoggerWrite);
     __android_log_add_transport(&__android_log_persist_write, &pmsgLoggerWrite);
 #else
@@ -45,6 +45,11 @@ extern LIBLOG_HIDDEN struct listnode __android_log_persist_write;
 
 LIBLOG_HIDDEN void __android_log_config_write();
 
+struct android_log_transport_write;
+/* log_init_lock assumed, the next write after a close reconfigures */
+LIBLOG_HIDDEN void __android_log_remove_transport(
+        struct listnode *list, struct android_log_transport_write *transport);
+
 __END_DECLS
 
 #endif /* _LIBLOG_CONFIG_WRITE_H__ */
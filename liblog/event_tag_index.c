@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Build time generator of the precompiled index of an event log tag map,
+ * so that readers of the events buffer map it instead of parsing the map.
+ *
+ *   event-tag-index <event-log-tags> [<event-log-tags.idx>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <log/event_tag_map.h>
+
+int main(int argc, char** argv)
+{
+    EventTagMap* map;
+    char* indexName;
+    int ret;
+
+    if ((argc < 2) || (argc > 3)) {
+        fprintf(stderr, "Usage: %s <event-log-tags> [<index>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 3) {
+        indexName = strdup(argv[2]);
+    } else if (asprintf(&indexName, "%s.idx", argv[1]) < 0) {
+        indexName = NULL;
+    }
+    if (!indexName) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* never read back what we are about to replace */
+    unlink(indexName);
+    map = android_openEventTagMap(argv[1]);
+    if (!map) {
+        free(indexName);
+        return EXIT_FAILURE;
+    }
+
+    ret = android_writeEventTagMapIndex(map, argv[1], indexName);
+    if (ret) {
+        fprintf(stderr, "%s: unable to write %s\n", argv[0], indexName);
+        unlink(indexName);
+    }
+
+    android_closeEventTagMap(map);
+    free(indexName);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
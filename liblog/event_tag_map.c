@@ -17,9 +17,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <log/event_tag_map.h>
 #include <log/log.h>
@@ -29,31 +34,54 @@
 #define OUT_TAG "EventTagMap"
 
 /*
- * Single entry.
+ * Single entry. Also the layout of the entries in a precompiled index.
  */
 typedef struct EventTag {
-    unsigned int    tagIndex;
-    const char*     tagStr;
+    uint32_t        tagIndex;
+    uint32_t        tagStr;     /* offset of the nul terminated name */
 } EventTag;
 
+/*
+ * Precompiled index, "<map file>.idx", generated at build time by
+ * event-tag-index. The header is followed by the sorted EventTag array
+ * then the names they point into. It is used in place of the map file
+ * provided that it is not older, and was made from a file of the same size.
+ */
+#define EVENT_TAG_INDEX_MAGIC   0x78644945 /* "EIdx" */
+#define EVENT_TAG_INDEX_VERSION 1
+#define EVENT_TAG_INDEX_SUFFIX  ".idx"
+
+typedef struct EventTagIndexHeader {
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        sourceSize;
+    uint32_t        numTags;
+    uint32_t        stringsLen;
+} EventTagIndexHeader;
+
 /*
  * Map.
  */
 struct EventTagMap {
-    /* memory-mapped source file; we get strings from here */
+    /* memory-mapped source file or index; we get strings from here */
     void*           mapAddr;
     size_t          mapLen;
+    const char*     strings;
+    size_t          stringsLen;
 
     /* array of event tags, sorted numerically by tag index */
     EventTag*       tagArray;
     int             numTags;
+    bool            tagArrayMapped;     /* part of the index, not allocated */
 };
 
 /* fwd */
+static int openIndex(EventTagMap* map, const char* fileName);
 static int processFile(EventTagMap* map);
 static int countMapLines(const EventTagMap* map);
 static int parseMapLines(EventTagMap* map);
-static int scanTagLine(char** pData, EventTag* tag, int lineNum);
+static int scanTagLine(EventTagMap* map, char** pData, EventTag* tag,
+                       int lineNum);
 static int sortTags(EventTagMap* map);
 
 
@@ -73,6 +101,10 @@ LIBLOG_ABI_PUBLIC EventTagMap* android_openEventTagMap(const char* fileName)
     if (newTagMap == NULL)
         return NULL;
 
+    /* prefer the precompiled index, it need not be parsed */
+    if (openIndex(newTagMap, fileName) == 0)
+        return newTagMap;
+
     fd = open(fileName, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         fprintf(stderr, "%s: unable to open map '%s': %s\n",
@@ -95,6 +127,8 @@ LIBLOG_ABI_PUBLIC EventTagMap* android_openEventTagMap(const char* fileName)
         goto fail;
     }
     newTagMap->mapLen = end;
+    newTagMap->strings = newTagMap->mapAddr;
+    newTagMap->stringsLen = end;
 
     if (processFile(newTagMap) != 0)
         goto fail;
@@ -119,41 +153,166 @@ LIBLOG_ABI_PUBLIC void android_closeEventTagMap(EventTagMap* map)
     if (map == NULL)
         return;
 
-    munmap(map->mapAddr, map->mapLen);
+    if (map->mapAddr)
+        munmap(map->mapAddr, map->mapLen);
+    if (!map->tagArrayMapped)
+        free(map->tagArray);
     free(map);
 }
 
 /*
  * Look up an entry in the map.
  *
- * The entries are sorted by tag number, so we can do a binary search.
+ * The entries are sorted by tag number, so we can do a binary search. The
+ * halving is branch free, leaving the one comparison at the end.
  */
 LIBLOG_ABI_PUBLIC const char* android_lookupEventTag(const EventTagMap* map,
                                                      int tag)
 {
-    int hi, lo, mid;
-
-    lo = 0;
-    hi = map->numTags-1;
-
-    while (lo <= hi) {
-        int cmp;
-
-        mid = (lo+hi)/2;
-        cmp = map->tagArray[mid].tagIndex - tag;
-        if (cmp < 0) {
-            /* tag is bigger */
-            lo = mid + 1;
-        } else if (cmp > 0) {
-            /* tag is smaller */
-            hi = mid - 1;
-        } else {
-            /* found */
-            return map->tagArray[mid].tagStr;
+    const EventTag* base = map->tagArray;
+    size_t n = map->numTags;
+
+    if (n == 0)
+        return NULL;
+
+    while (n > 1) {
+        size_t half = n / 2;
+        base = (base[half].tagIndex <= (uint32_t)tag) ? base + half : base;
+        n -= half;
+    }
+
+    if ((base->tagIndex != (uint32_t)tag)
+            || (base->tagStr >= map->stringsLen))
+        return NULL;
+
+    return map->strings + base->tagStr;
+}
+
+/*
+ * Map "<fileName>.idx" if it is there and current.
+ *
+ * Returns 0 on success, nonzero if the map file is to be parsed instead.
+ */
+static int openIndex(EventTagMap* map, const char* fileName)
+{
+    const EventTagIndexHeader* header;
+    struct stat st, sourceSt;
+    size_t len = strlen(fileName);
+    char* indexName;
+    void* addr;
+    int fd;
+
+    indexName = malloc(len + sizeof(EVENT_TAG_INDEX_SUFFIX));
+    if (indexName == NULL)
+        return -1;
+    memcpy(indexName, fileName, len);
+    memcpy(indexName + len, EVENT_TAG_INDEX_SUFFIX,
+           sizeof(EVENT_TAG_INDEX_SUFFIX));
+    fd = open(indexName, O_RDONLY | O_CLOEXEC);
+    free(indexName);
+    if (fd < 0)
+        return -1;
+
+    if ((fstat(fd, &st) != 0)
+            || ((size_t)st.st_size < sizeof(EventTagIndexHeader))) {
+        close(fd);
+        return -1;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return -1;
+
+    header = addr;
+    if ((header->magic != EVENT_TAG_INDEX_MAGIC)
+            || (header->version != EVENT_TAG_INDEX_VERSION)
+            || ((sizeof(*header)
+                    + (uint64_t)header->numTags * sizeof(EventTag)
+                    + header->stringsLen) != (uint64_t)st.st_size)
+            || (header->numTags > INT32_MAX)
+            || !header->stringsLen
+            || (((const char*)addr)[st.st_size - 1] != '\0')) {
+        munmap(addr, st.st_size);
+        return -1;
+    }
+
+    /* stale if the map file has since changed */
+    if ((stat(fileName, &sourceSt) == 0)
+            && (((uint64_t)sourceSt.st_size != header->sourceSize)
+                || (sourceSt.st_mtime > st.st_mtime))) {
+        munmap(addr, st.st_size);
+        return -1;
+    }
+
+    map->mapAddr = addr;
+    map->mapLen = st.st_size;
+    map->tagArray = (EventTag*)(header + 1);
+    map->numTags = header->numTags;
+    map->tagArrayMapped = true;
+    map->strings = (const char*)(map->tagArray + map->numTags);
+    map->stringsLen = header->stringsLen;
+    return 0;
+}
+
+/*
+ * Write the map out as a precompiled index for the map file, which must
+ * be fileName.
+ */
+LIBLOG_ABI_PRIVATE int android_writeEventTagMapIndex(const EventTagMap* map,
+                                                     const char* fileName,
+                                                     const char* indexName)
+{
+    EventTagIndexHeader header;
+    EventTag* tags;
+    struct stat st;
+    FILE* fp;
+    int i, ret = -1;
+
+    if (stat(fileName, &st) != 0)
+        return -1;
+
+    tags = malloc(sizeof(EventTag) * (map->numTags ? map->numTags : 1));
+    if (tags == NULL)
+        return -1;
+
+    /* names are packed in tag order, after a leading empty one */
+    memset(&header, 0, sizeof(header));
+    header.magic = EVENT_TAG_INDEX_MAGIC;
+    header.version = EVENT_TAG_INDEX_VERSION;
+    header.sourceSize = st.st_size;
+    header.numTags = map->numTags;
+    header.stringsLen = 1;
+    for (i = 0; i < map->numTags; i++) {
+        tags[i].tagIndex = map->tagArray[i].tagIndex;
+        tags[i].tagStr = header.stringsLen;
+        header.stringsLen +=
+            strlen(map->strings + map->tagArray[i].tagStr) + 1;
+    }
+
+    fp = fopen(indexName, "we");
+    if (fp == NULL)
+        goto done;
+    if ((fwrite(&header, sizeof(header), 1, fp) != 1)
+            || (map->numTags && (fwrite(tags, sizeof(EventTag),
+                                        map->numTags, fp)
+                                     != (size_t)map->numTags))
+            || (fputc('\0', fp) == EOF)) {
+        fclose(fp);
+        goto done;
+    }
+    for (i = 0; i < map->numTags; i++) {
+        const char* name = map->strings + map->tagArray[i].tagStr;
+        if (fwrite(name, strlen(name) + 1, 1, fp) != 1) {
+            fclose(fp);
+            goto done;
         }
     }
+    if (fclose(fp) == 0)
+        ret = 0;
 
-    return NULL;
+done:
+    free(tags);
+    return ret;
 }
 
 
@@ -297,7 +456,7 @@ static int parseMapLines(EventTagMap* map)
                         "%s: more tags than expected (%d)\n", OUT_TAG, tagNum);
                     return -1;
                 }
-                if (scanTagLine(&cp, &map->tagArray[tagNum], lineNum) != 0)
+                if (scanTagLine(map, &cp, &map->tagArray[tagNum], lineNum) != 0)
                     return -1;
                 tagNum++;
                 lineNum++;      // we eat the '\n'
@@ -334,7 +493,8 @@ static int parseMapLines(EventTagMap* map)
  *
  * Returns 0 on success, nonzero on failure.
  */
-static int scanTagLine(char** pData, EventTag* tag, int lineNum)
+static int scanTagLine(EventTagMap* map, char** pData, EventTag* tag,
+                       int lineNum)
 {
     char* cp = *pData;
     char* startp;
@@ -362,7 +522,7 @@ static int scanTagLine(char** pData, EventTag* tag, int lineNum)
         return -1;
     }
 
-    tag->tagStr = cp;
+    tag->tagStr = cp - (char*)map->mapAddr;
 
     while (isCharValidTag(*++cp))
         ;
@@ -387,7 +547,8 @@ static int scanTagLine(char** pData, EventTag* tag, int lineNum)
 
     *pData = cp;
 
-    //printf("+++ Line %d: got %d '%s'\n", lineNum, tag->tagIndex, tag->tagStr);
+    //printf("+++ Line %d: got %d '%s'\n", lineNum, tag->tagIndex,
+    //       map->strings + tag->tagStr);
     return 0;
 }
 
@@ -399,7 +560,7 @@ static int compareEventTags(const void* v1, const void* v2)
     const EventTag* tag1 = (const EventTag*) v1;
     const EventTag* tag2 = (const EventTag*) v2;
 
-    return tag1->tagIndex - tag2->tagIndex;
+    return (tag1->tagIndex > tag2->tagIndex) - (tag1->tagIndex < tag2->tagIndex);
 }
 
 /*
@@ -418,8 +579,10 @@ static int sortTags(EventTagMap* map)
         if (map->tagArray[i].tagIndex == map->tagArray[i-1].tagIndex) {
             fprintf(stderr, "%s: duplicate tag entries (%d:%s and %d:%s)\n",
                 OUT_TAG,
-                map->tagArray[i].tagIndex, map->tagArray[i].tagStr,
-                map->tagArray[i-1].tagIndex, map->tagArray[i-1].tagStr);
+                map->tagArray[i].tagIndex,
+                map->strings + map->tagArray[i].tagStr,
+                map->tagArray[i-1].tagIndex,
+                map->strings + map->tagArray[i-1].tagStr);
             return -1;
         }
     }
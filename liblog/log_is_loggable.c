@@ -16,6 +16,7 @@
 
 #include <ctype.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
@@ -85,6 +86,127 @@ static void refresh_cache(struct cache *cache, const char *key)
     }
 }
 
+static int level_of(unsigned char c, int default_prio)
+{
+    switch (toupper(c)) {
+    case 'V': return ANDROID_LOG_VERBOSE;
+    case 'D': return ANDROID_LOG_DEBUG;
+    case 'I': return ANDROID_LOG_INFO;
+    case 'W': return ANDROID_LOG_WARN;
+    case 'E': return ANDROID_LOG_ERROR;
+    case 'F': /* FALLTHRU */ /* Not officially supported */
+    case 'A': return ANDROID_LOG_FATAL;
+    case BOOLEAN_FALSE: /* FALLTHRU */ /* Not Officially supported */
+    case 'S': return -1; /* ANDROID_LOG_SUPPRESS */
+    }
+    return default_prio;
+}
+
+/*
+ * Lock-free cache of the tag specific priority, persist.log.tag.<tag> then
+ * log.tag.<tag>, for up to TAG_CACHE_SIZE distinct tags. An entry is
+ * valid for the property area serial number it was resolved against, so any
+ * property change invalidates them all. Entries are claimed once and never
+ * released; if the table is full, or the tag too long, the properties are
+ * looked up uncached. No allocation or locking, we may be in a signal handler.
+ */
+#define TAG_CACHE_SIZE 512 /* power of two */
+#define TAG_CACHE_PROBE 16
+#define TAG_CACHE_EMPTY 0
+#define TAG_CACHE_CLAIMED 1
+#define TAG_CACHE_READY 2
+#define TAG_CACHE_RESOLVED 0x100
+
+struct tag_entry {
+    atomic_uint_fast32_t state; /* TAG_CACHE_* */
+    uint32_t hash;
+    char tag[PROP_NAME_MAX];
+    atomic_uint_fast64_t level; /* serial << 9 | TAG_CACHE_RESOLVED | c */
+};
+
+static struct tag_entry tag_table[TAG_CACHE_SIZE];
+
+static uint32_t tag_hash(const char *tag, size_t taglen)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < taglen; ++i) {
+        hash = (hash ^ (unsigned char)tag[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/* key is the persist.log.tag.<tag> property name */
+static unsigned char resolve_tag(const char *key, size_t base_offset)
+{
+    struct cache cache = { NULL, -1, '\0' };
+
+    refresh_cache(&cache, key);
+    if (!cache.c) {
+        cache.pinfo = NULL;
+        refresh_cache(&cache, key + base_offset);
+    }
+    return cache.c;
+}
+
+static struct tag_entry *find_tag(const char *tag, size_t taglen)
+{
+    uint32_t hash;
+    size_t i;
+
+    if (taglen >= PROP_NAME_MAX) {
+        return NULL;
+    }
+    hash = tag_hash(tag, taglen);
+    for (i = 0; i < TAG_CACHE_PROBE; ++i) {
+        struct tag_entry *entry = &tag_table[(hash + i) & (TAG_CACHE_SIZE - 1)];
+        uint_fast32_t state = atomic_load(&entry->state);
+
+        if ((state == TAG_CACHE_EMPTY)
+                && atomic_compare_exchange_strong(&entry->state, &state,
+                                                  TAG_CACHE_CLAIMED)) {
+            entry->hash = hash;
+            memcpy(entry->tag, tag, taglen + 1);
+            atomic_store(&entry->state, TAG_CACHE_READY);
+            return entry;
+        }
+        /* state is current, should we have lost the race to claim it */
+        if (state != TAG_CACHE_READY) {
+            /* being filled in, we will not wait */
+            return NULL;
+        }
+        if ((entry->hash == hash) && !strcmp(entry->tag, tag)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static unsigned char tag_level(const char *tag, size_t taglen,
+                               const char *key, size_t base_offset)
+{
+    /* sampled first, a change while we resolve will be caught next time */
+    uint32_t serial = __system_property_area_serial();
+    struct tag_entry *entry = find_tag(tag, taglen);
+    uint_fast64_t level;
+    unsigned char c;
+
+    if (entry) {
+        level = atomic_load(&entry->level);
+        if ((level & TAG_CACHE_RESOLVED) && ((uint32_t)(level >> 9) == serial)) {
+            return level & 0xFF;
+        }
+    }
+
+    c = resolve_tag(key, base_offset);
+    if (entry) {
+        atomic_store(&entry->level,
+                     ((uint_fast64_t)serial << 9) | TAG_CACHE_RESOLVED | c);
+    }
+    return c;
+}
+
 static int __android_log_level(const char *tag, int default_prio)
 {
     /* sizeof() is used on this array below */
@@ -98,37 +220,51 @@ static int __android_log_level(const char *tag, int default_prio)
     size_t i;
     char c = 0;
     /*
-     * Single layer cache of four properties. Priorities are:
+     * Four properties. Priorities are:
      *    log.tag.<tag>
      *    persist.log.tag.<tag>
      *    log.tag
      *    persist.log.tag
      * Where the missing tag matches all tags and becomes the
      * system global default. We do not support ro.log.tag* .
+     * The tag specific pair are held in tag_table, the global pair
+     * in a single layer cache.
      */
-    static char last_tag[PROP_NAME_MAX];
     static uint32_t global_serial;
     /* some compilers erroneously see uninitialized use. !not_locked */
     uint32_t current_global_serial = 0;
-    static struct cache tag_cache[2];
     static struct cache global_cache[2];
-    int change_detected;
     int global_change_detected;
     int not_locked;
 
     strcpy(key, log_namespace);
 
-    global_change_detected = change_detected = not_locked = lock();
+    if (taglen) {
+        strcpy(key + sizeof(log_namespace) - 1, tag);
+        c = tag_level(tag, taglen, key, base_offset);
+    }
+
+    switch (toupper(c)) { /* if invalid, resort to global */
+    case 'V':
+    case 'D':
+    case 'I':
+    case 'W':
+    case 'E':
+    case 'F': /* Not officially supported */
+    case 'A':
+    case 'S':
+    case BOOLEAN_FALSE: /* Not officially supported */
+        return level_of(c, default_prio);
+    default:
+        break;
+    }
+
+    global_change_detected = not_locked = lock();
 
     if (!not_locked) {
         /*
          *  check all known serial numbers to changes.
          */
-        for (i = 0; i < (sizeof(tag_cache) / sizeof(tag_cache[0])); ++i) {
-            if (check_cache(&tag_cache[i])) {
-                change_detected = 1;
-            }
-        }
         for (i = 0; i < (sizeof(global_cache) / sizeof(global_cache[0])); ++i) {
             if (check_cache(&global_cache[i])) {
                 global_change_detected = 1;
@@ -137,94 +273,36 @@ static int __android_log_level(const char *tag, int default_prio)
 
         current_global_serial = __system_property_area_serial();
         if (current_global_serial != global_serial) {
-            change_detected = 1;
             global_change_detected = 1;
         }
     }
 
-    if (taglen) {
-        int local_change_detected = change_detected;
-        if (!not_locked) {
-            if (!last_tag[0]
-                    || (last_tag[0] != tag[0])
-                    || strncmp(last_tag + 1, tag + 1, sizeof(last_tag) - 1)) {
-                /* invalidate log.tag.<tag> cache */
-                for (i = 0; i < (sizeof(tag_cache) / sizeof(tag_cache[0])); ++i) {
-                    tag_cache[i].pinfo = NULL;
-                    tag_cache[i].c = '\0';
-                }
-                last_tag[0] = '\0';
-                local_change_detected = 1;
-            }
-            if (!last_tag[0]) {
-                strncpy(last_tag, tag, sizeof(last_tag));
-            }
-        }
-        strcpy(key + sizeof(log_namespace) - 1, tag);
+    /* clear '.' after log.tag */
+    key[sizeof(log_namespace) - 2] = '\0';
 
-        kp = key;
-        for (i = 0; i < (sizeof(tag_cache) / sizeof(tag_cache[0])); ++i) {
-            struct cache *cache = &tag_cache[i];
-            struct cache temp_cache;
+    kp = key;
+    for (i = 0; i < (sizeof(global_cache) / sizeof(global_cache[0])); ++i) {
+        struct cache *cache = &global_cache[i];
+        struct cache temp_cache;
 
-            if (not_locked) {
+        if (not_locked) {
+            temp_cache = *cache;
+            if (temp_cache.pinfo != cache->pinfo) { /* check atomic */
                 temp_cache.pinfo = NULL;
                 temp_cache.c = '\0';
-                cache = &temp_cache;
-            }
-            if (local_change_detected) {
-                refresh_cache(cache, kp);
-            }
-
-            if (cache->c) {
-                c = cache->c;
-                break;
             }
-
-            kp = key + base_offset;
+            cache = &temp_cache;
+        }
+        if (global_change_detected) {
+            refresh_cache(cache, kp);
         }
-    }
-
-    switch (toupper(c)) { /* if invalid, resort to global */
-    case 'V':
-    case 'D':
-    case 'I':
-    case 'W':
-    case 'E':
-    case 'F': /* Not officially supported */
-    case 'A':
-    case 'S':
-    case BOOLEAN_FALSE: /* Not officially supported */
-        break;
-    default:
-        /* clear '.' after log.tag */
-        key[sizeof(log_namespace) - 2] = '\0';
-
-        kp = key;
-        for (i = 0; i < (sizeof(global_cache) / sizeof(global_cache[0])); ++i) {
-            struct cache *cache = &global_cache[i];
-            struct cache temp_cache;
-
-            if (not_locked) {
-                temp_cache = *cache;
-                if (temp_cache.pinfo != cache->pinfo) { /* check atomic */
-                    temp_cache.pinfo = NULL;
-                    temp_cache.c = '\0';
-                }
-                cache = &temp_cache;
-            }
-            if (global_change_detected) {
-                refresh_cache(cache, kp);
-            }
-
-            if (cache->c) {
-                c = cache->c;
-                break;
-            }
 
-            kp = key + base_offset;
+        if (cache->c) {
+            c = cache->c;
+            break;
         }
-        break;
+
+        kp = key + base_offset;
     }
 
     if (!not_locked) {
@@ -232,18 +310,7 @@ static int __android_log_level(const char *tag, int default_prio)
         unlock();
     }
 
-    switch (toupper(c)) {
-    case 'V': return ANDROID_LOG_VERBOSE;
-    case 'D': return ANDROID_LOG_DEBUG;
-    case 'I': return ANDROID_LOG_INFO;
-    case 'W': return ANDROID_LOG_WARN;
-    case 'E': return ANDROID_LOG_ERROR;
-    case 'F': /* FALLTHRU */ /* Not officially supported */
-    case 'A': return ANDROID_LOG_FATAL;
-    case BOOLEAN_FALSE: /* FALLTHRU */ /* Not Officially supported */
-    case 'S': return -1; /* ANDROID_LOG_SUPPRESS */
-    }
-    return default_prio;
+    return level_of(c, default_prio);
 }
 
 LIBLOG_ABI_PUBLIC int __android_log_is_loggable(int prio, const char *tag,
@@ -0,0 +1,500 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Batching transport to logd, opted in to by __android_log_set_batch().
+ *
+ * Entries are accumulated in a small per thread batch and sent to logd as a
+ * single LOGGER_ID_BATCH datagram once the batch is full, once the deadline
+ * since the first entry was queued passes, or at once for a fatal entry. A
+ * flusher thread sends the batches of threads that have gone quiet. The
+ * logd transport's socket is shared, its open and close manage it.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/list.h>
+#include <log/logd.h>
+#include <log/logger.h>
+#include <private/android_filesystem_config.h>
+#include <private/android_logger.h>
+
+#include "config_write.h"
+#include "log_portability.h"
+#include "logger.h"
+
+/* branchless on many architectures. */
+#define min(x,y) ((y) ^ (((x) ^ (y)) & -((x) < (y))))
+
+extern struct android_log_transport_write logdLoggerWrite;
+
+static int logdBatchAvailable(log_id_t LogId);
+static int logdBatchOpen();
+static void logdBatchClose();
+static int logdBatchWrite(log_id_t logId, struct timespec *ts,
+                          struct iovec *vec, size_t nr);
+
+LIBLOG_HIDDEN struct android_log_transport_write logdBatchLoggerWrite = {
+    .node = { &logdBatchLoggerWrite.node, &logdBatchLoggerWrite.node },
+    .context.sock = -1,
+    .name = "logd-batch",
+    .available = logdBatchAvailable,
+    .open = logdBatchOpen,
+    .close = logdBatchClose,
+    .write = logdBatchWrite,
+};
+
+/* Largest datagram logd will accept */
+#define BATCH_MAX (sizeof(android_log_header_t) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+struct batch {
+    struct listnode node; /* on batches */
+    pthread_mutex_t lock;
+    struct timespec first; /* CLOCK_MONOTONIC, when the first was queued */
+    size_t count;
+    size_t len;
+    char buffer[BATCH_MAX];
+};
+
+static atomic_uint deadline; /* ms, 0 if not opted in */
+
+static pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct listnode batches = { &batches, &batches };
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t batch_key;
+static atomic_int flusher_running;
+static atomic_int_fast32_t dropped; /* entries lost, yet to be reported */
+
+static int logdBatchAvailable(log_id_t logId)
+{
+    if (!atomic_load(&deadline)) {
+        return -EINVAL;
+    }
+    return (*logdLoggerWrite.available)(logId);
+}
+
+/* log_init_lock assumed */
+static int logdBatchOpen()
+{
+    return (*logdLoggerWrite.open)();
+}
+
+/*
+ * Should logd have restarted, reopen the shared socket. Only tried if the
+ * lock is free: __android_log_close() holds it while it flushes our
+ * batches, and a writer must never block on it with a batch locked.
+ */
+static int reconnect()
+{
+    int ret;
+
+    if (__android_log_trylock()) {
+        return -EBUSY;
+    }
+    (*logdLoggerWrite.close)();
+    ret = (*logdLoggerWrite.open)();
+    __android_log_unlock();
+    return ret;
+}
+
+static ssize_t send_datagram(const struct iovec *vec, int nr)
+{
+    int sock = logdLoggerWrite.context.sock;
+    ssize_t ret;
+
+    if (sock < 0) {
+        return -EBADF;
+    }
+    ret = TEMP_FAILURE_RETRY(writev(sock, vec, nr));
+    return (ret < 0) ? -errno : ret;
+}
+
+/* Report the entries lost so far, as logdWrite does, ahead of the next */
+static void send_dropped()
+{
+    int32_t snapshot = atomic_exchange_explicit(&dropped, 0,
+                                                memory_order_relaxed);
+    android_log_header_t header;
+    android_log_event_int_t buffer;
+    struct timespec ts;
+    struct iovec vec[2];
+
+    if (!snapshot) {
+        return;
+    }
+    if (!__android_log_is_loggable(ANDROID_LOG_INFO, "liblog",
+                                   ANDROID_LOG_VERBOSE)) {
+        return;
+    }
+
+    header.id = LOG_ID_EVENTS;
+    header.tid = gettid();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.realtime.tv_sec = ts.tv_sec;
+    header.realtime.tv_nsec = ts.tv_nsec;
+    buffer.header.tag = htole32(LIBLOG_LOG_TAG);
+    buffer.payload.type = EVENT_TYPE_INT;
+    buffer.payload.data = htole32(snapshot);
+    vec[0].iov_base = &header;
+    vec[0].iov_len = sizeof(header);
+    vec[1].iov_base = &buffer;
+    vec[1].iov_len = sizeof(buffer);
+    if (send_datagram(vec, 2) != (ssize_t)(sizeof(header) + sizeof(buffer))) {
+        atomic_fetch_add_explicit(&dropped, snapshot, memory_order_relaxed);
+    }
+}
+
+/* batch->lock assumed */
+static void send_locked(struct batch *batch)
+{
+    android_log_batch_header_t *header =
+        (android_log_batch_header_t *)batch->buffer;
+    struct iovec vec[2];
+    int nr;
+    ssize_t ret;
+
+    if (!batch->count) {
+        return;
+    }
+
+    if (batch->count == 1) {
+        /* a single entry goes as is, any logd understands it */
+        android_log_batch_record_t *record =
+            (android_log_batch_record_t *)(header + 1);
+
+        vec[0].iov_base = &record->header;
+        vec[0].iov_len = sizeof(record->header);
+        vec[1].iov_base = record + 1;
+        vec[1].iov_len = record->len;
+        nr = 2;
+    } else {
+        header->id = LOGGER_ID_BATCH;
+        header->count = batch->count;
+        vec[0].iov_base = batch->buffer;
+        vec[0].iov_len = batch->len;
+        nr = 1;
+    }
+
+    /*
+     * Will never block. ENOTCONN, ECONNREFUSED or EBADF if logd died, in
+     * which case reconnect and try once more. EAGAIN if logd is overloaded.
+     */
+    send_dropped();
+    ret = send_datagram(vec, nr);
+    if (((ret == -ENOTCONN) || (ret == -ECONNREFUSED) || (ret == -EBADF))
+            && (reconnect() >= 0)) {
+        send_dropped();
+        ret = send_datagram(vec, nr);
+    }
+    if (ret < 0) {
+        atomic_fetch_add_explicit(&dropped, batch->count,
+                                  memory_order_relaxed);
+    }
+
+    batch->count = 0;
+    batch->len = sizeof(android_log_batch_header_t);
+}
+
+static int expired(const struct batch *batch, unsigned ms)
+{
+    struct timespec now;
+    long long elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - batch->first.tv_sec) * 1000LL
+            + (now.tv_nsec - batch->first.tv_nsec) / 1000000;
+    return elapsed >= (long long)ms;
+}
+
+/* Send what any quiet thread has left behind */
+static void *flusher(void *obj __unused)
+{
+    for (;;) {
+        unsigned ms = atomic_load(&deadline);
+        struct timespec ts;
+        struct listnode *node;
+
+        if (!ms) {
+            ms = 1000;
+        }
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+
+        pthread_mutex_lock(&batches_lock);
+        list_for_each(node, &batches) {
+            struct batch *batch = node_to_item(node, struct batch, node);
+            /* busy, the owner will see to it */
+            if (pthread_mutex_trylock(&batch->lock)) {
+                continue;
+            }
+            if (batch->count && expired(batch, ms)) {
+                send_locked(batch);
+            }
+            pthread_mutex_unlock(&batch->lock);
+        }
+        pthread_mutex_unlock(&batches_lock);
+    }
+    return NULL;
+}
+
+static void batch_destroy(void *obj)
+{
+    struct batch *batch = obj;
+
+    pthread_mutex_lock(&batches_lock);
+    list_remove(&batch->node);
+    pthread_mutex_unlock(&batches_lock);
+
+    pthread_mutex_lock(&batch->lock);
+    send_locked(batch);
+    pthread_mutex_unlock(&batch->lock);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+}
+
+/*
+ * A forked child must not send its parent's entries a second time, and has
+ * no flusher thread; keep only the forking thread's batch, emptied.
+ */
+static void batch_atfork_child()
+{
+    struct batch *own = pthread_getspecific(batch_key);
+    struct listnode *node, *n;
+
+    pthread_mutex_init(&batches_lock, NULL);
+    list_for_each_safe(node, n, &batches) {
+        struct batch *batch = node_to_item(node, struct batch, node);
+        list_remove(node);
+        if (batch != own) {
+            free(batch);
+        }
+    }
+    atomic_store(&flusher_running, 0);
+    atomic_store(&dropped, 0);
+    if (own) {
+        pthread_mutex_init(&own->lock, NULL);
+        own->count = 0;
+        own->len = sizeof(android_log_batch_header_t);
+        list_add_tail(&batches, &own->node);
+    }
+}
+
+/*
+ * Send what is left on exit(), the key destructor only runs for threads
+ * that exit on their own. Never waits on a batch, the exiting thread may
+ * hold its own should it have been interrupted mid write.
+ */
+static void batch_atexit()
+{
+    struct listnode *node;
+
+    pthread_mutex_lock(&batches_lock);
+    list_for_each(node, &batches) {
+        struct batch *batch = node_to_item(node, struct batch, node);
+        if (pthread_mutex_trylock(&batch->lock)) {
+            continue;
+        }
+        send_locked(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    pthread_mutex_unlock(&batches_lock);
+}
+
+static void batch_init()
+{
+    pthread_key_create(&batch_key, batch_destroy);
+    pthread_atfork(NULL, NULL, batch_atfork_child);
+    atexit(batch_atexit);
+}
+
+/* batches_lock assumed */
+static void start_flusher_locked()
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (atomic_load(&flusher_running)) {
+        return;
+    }
+    if (!pthread_attr_init(&attr)) {
+        if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)
+                && !pthread_create(&thread, &attr, flusher, NULL)) {
+            atomic_store(&flusher_running, 1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+static struct batch *batch_get()
+{
+    struct batch *batch;
+
+    pthread_once(&batch_once, batch_init);
+    batch = pthread_getspecific(batch_key);
+    if (batch) {
+        if (!atomic_load(&flusher_running)) {
+            pthread_mutex_lock(&batches_lock);
+            start_flusher_locked();
+            pthread_mutex_unlock(&batches_lock);
+        }
+        return batch;
+    }
+
+    batch = malloc(sizeof(*batch));
+    if (!batch) {
+        return NULL;
+    }
+    pthread_mutex_init(&batch->lock, NULL);
+    batch->count = 0;
+    batch->len = sizeof(android_log_batch_header_t);
+    if (pthread_setspecific(batch_key, batch)) {
+        pthread_mutex_destroy(&batch->lock);
+        free(batch);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&batches_lock);
+    list_add_tail(&batches, &batch->node);
+    start_flusher_locked();
+    pthread_mutex_unlock(&batches_lock);
+
+    return batch;
+}
+
+/* Send every thread's batch */
+static void flush_all()
+{
+    struct listnode *node;
+
+    pthread_mutex_lock(&batches_lock);
+    list_for_each(node, &batches) {
+        struct batch *batch = node_to_item(node, struct batch, node);
+        pthread_mutex_lock(&batch->lock);
+        send_locked(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    pthread_mutex_unlock(&batches_lock);
+}
+
+static void logdBatchClose()
+{
+    flush_all();
+    (*logdLoggerWrite.close)();
+}
+
+static int logdBatchWrite(log_id_t logId, struct timespec *ts,
+                          struct iovec *vec, size_t nr)
+{
+    android_log_batch_record_t *record;
+    struct batch *batch;
+    size_t i, len;
+    char *cp;
+    int fatal;
+
+    if ((logdLoggerWrite.context.sock < 0) && (reconnect() < 0)) {
+        return -EBADF;
+    }
+
+    /* logd, after initialization and priv drop */
+    if (__android_log_uid() == AID_LOGD) {
+        return 0;
+    }
+
+    for (len = i = 0; i < nr; ++i) {
+        len += vec[i].iov_len;
+    }
+    if (len > LOGGER_ENTRY_MAX_PAYLOAD) {
+        len = LOGGER_ENTRY_MAX_PAYLOAD;
+    }
+
+    fatal = (logId != LOG_ID_EVENTS) && (logId != LOG_ID_SECURITY)
+         && nr && vec[0].iov_len
+         && (*(const char *)vec[0].iov_base >= ANDROID_LOG_FATAL);
+
+    batch = NULL;
+    if ((logId != LOG_ID_SECURITY)
+            && ((sizeof(android_log_batch_header_t) + sizeof(*record) + len)
+                    <= BATCH_MAX)) {
+        batch = batch_get();
+    }
+    if (!batch) {
+        /* Too large to ever batch, or not worth the risk */
+        return (*logdLoggerWrite.write)(logId, ts, vec, nr);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+
+    if ((batch->len + sizeof(*record) + len) > BATCH_MAX) {
+        send_locked(batch);
+    }
+    if (!batch->count) {
+        clock_gettime(CLOCK_MONOTONIC, &batch->first);
+    }
+
+    record = (android_log_batch_record_t *)(batch->buffer + batch->len);
+    record->header.id = logId;
+    record->header.tid = gettid();
+    record->header.realtime.tv_sec = ts->tv_sec;
+    record->header.realtime.tv_nsec = ts->tv_nsec;
+    record->len = len;
+
+    cp = (char *)(record + 1);
+    for (i = 0; (i < nr) && (cp < ((char *)(record + 1) + len)); ++i) {
+        size_t n = min(vec[i].iov_len,
+                       (size_t)(((char *)(record + 1) + len) - cp));
+        memcpy(cp, vec[i].iov_base, n);
+        cp += n;
+    }
+    batch->len += sizeof(*record) + len;
+    ++batch->count;
+
+    if (fatal || expired(batch, atomic_load(&deadline))) {
+        send_locked(batch);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    return len;
+}
+
+LIBLOG_ABI_PUBLIC int __android_log_set_batch(unsigned deadline_ms)
+{
+    if (atomic_exchange(&deadline, deadline_ms) == deadline_ms) {
+        return 0;
+    }
+
+    __android_log_close();
+
+    /* Drop the logd transports so that the next write reconfigures */
+    __android_log_lock();
+    __android_log_remove_transport(&__android_log_transport_write,
+                                   &logdBatchLoggerWrite);
+    __android_log_remove_transport(&__android_log_transport_write,
+                                   &logdLoggerWrite);
+    __android_log_unlock();
+
+    return 0;
+}
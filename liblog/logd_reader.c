@@ -475,25 +475,182 @@ static void caught_signal(int signum __unused)
 {
 }
 
+/*
+ * Per connection state, the socket and what is needed to decode the
+ * compact stream, see LOGGER_COMPACT_MAGIC.
+ */
+struct logd_reader_context {
+    int sock;
+    int hello;   /* logd has yet to answer format=2 */
+    int compact; /* logd agreed to format=2 */
+    struct logger_entry_v4 last; /* previous entry */
+    int64_t time;
+    size_t count;
+    char tags[LOGGER_COMPACT_MAX_TAGS][LOGGER_COMPACT_MAX_TAG_LEN + 1];
+};
+
+static int get_varint(const char **cp, const char *end, uint64_t *value)
+{
+    unsigned shift = 0;
+
+    *value = 0;
+    while (*cp < end) {
+        uint8_t c = *(*cp)++;
+        *value |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+        if (shift >= 64) {
+            break;
+        }
+    }
+    return -EIO;
+}
+
+static int get_zigzag(const char **cp, const char *end, int64_t *value)
+{
+    uint64_t v;
+
+    if (get_varint(cp, end, &v)) {
+        return -EIO;
+    }
+    *value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    return 0;
+}
+
+/* Expand a compact entry of len bytes in buf into log_msg */
+static int compact_decode(struct logd_reader_context *context,
+                          const char *buf, size_t len,
+                          struct log_msg *log_msg)
+{
+    const char *cp = buf + 1;
+    const char *end = buf + len;
+    struct logger_entry_v4 *entry = &log_msg->entry_v4;
+    uint64_t value;
+    int64_t delta;
+    uint32_t uid;
+    uint8_t flags;
+    char *msg;
+    size_t tagLen;
+
+    if (!len) {
+        return -EIO;
+    }
+    flags = buf[0];
+
+    *entry = context->last;
+    uid = context->last.uid;
+    if (flags & LOGGER_COMPACT_LID) {
+        if (cp >= end) {
+            return -EIO;
+        }
+        entry->lid = (uint8_t)*cp++;
+    }
+    if (flags & LOGGER_COMPACT_PID) {
+        if (get_zigzag(&cp, end, &delta)) {
+            return -EIO;
+        }
+        entry->pid += delta;
+    }
+    if (flags & LOGGER_COMPACT_TID) {
+        if (get_zigzag(&cp, end, &delta)) {
+            return -EIO;
+        }
+        entry->tid += delta;
+    }
+    if (flags & LOGGER_COMPACT_UID) {
+        if (get_varint(&cp, end, &value)) {
+            return -EIO;
+        }
+        uid = value;
+    }
+    if (get_zigzag(&cp, end, &delta)) {
+        return -EIO;
+    }
+    context->time += delta;
+    entry->sec = (uint64_t)context->time / NS_PER_SEC;
+    entry->nsec = (uint64_t)context->time % NS_PER_SEC;
+
+    entry->hdr_size = (flags & LOGGER_COMPACT_NOUID) ?
+                          sizeof(struct logger_entry_v3) :
+                          sizeof(struct logger_entry_v4);
+    if (!(flags & LOGGER_COMPACT_NOUID)) {
+        entry->uid = uid;
+    }
+    msg = (char *)entry + entry->hdr_size;
+
+    if (flags & LOGGER_COMPACT_TAG) {
+        const char *tag;
+
+        if (get_varint(&cp, end, &value) || (value >= context->count)
+                || (cp >= end)) {
+            return -EIO;
+        }
+        tag = context->tags[value];
+        tagLen = strlen(tag);
+        msg[0] = *cp++;
+        memcpy(msg + 1, tag, tagLen + 1);
+        msg += 1 + tagLen + 1;
+    }
+    if ((size_t)(end - cp) >
+            (size_t)(((char *)log_msg->buf + LOGGER_ENTRY_MAX_LEN) - msg)) {
+        return -EIO;
+    }
+    memcpy(msg, cp, end - cp);
+    msg += end - cp;
+    entry->len = msg - ((char *)entry + entry->hdr_size);
+
+    if (flags & LOGGER_COMPACT_NEWTAG) {
+        const char *tag = (char *)entry + entry->hdr_size + 1;
+        const char *nul;
+
+        if ((entry->len < 3) || (context->count >= LOGGER_COMPACT_MAX_TAGS)) {
+            return -EIO;
+        }
+        nul = memchr(tag, '\0', min(entry->len - 1,
+                                    LOGGER_COMPACT_MAX_TAG_LEN + 1));
+        if (!nul || (nul == tag)) {
+            return -EIO;
+        }
+        memcpy(context->tags[context->count], tag, nul - tag + 1);
+        ++context->count;
+    }
+
+    context->last = *entry;
+    /* a v3 entry has the payload where the uid would be */
+    context->last.uid = uid;
+    return entry->hdr_size + entry->len;
+}
+
 static int logdOpen(struct android_log_logger_list *logger_list,
                     struct android_log_transport_context *transp)
 {
+    struct logd_reader_context *context = transp->context.private;
     struct android_log_logger *logger;
     struct sigaction ignore;
     struct sigaction old_sigaction;
     unsigned int old_alarm = 0;
-    char buffer[256], *cp, c;
-    int e, ret, remaining;
+    char buffer[1024], *cp, c; /* logd reads at most 1023 */
+    int e, ret, remaining, sock;
 
-    int sock = transp->context.sock;
-    if (sock > 0) {
-        return sock;
+    if (context && (context->sock > 0)) {
+        return context->sock;
     }
 
     if (!logger_list) {
         return -EINVAL;
     }
 
+    if (!context) {
+        context = calloc(1, sizeof(*context));
+        if (!context) {
+            return -ENOMEM;
+        }
+        context->sock = -1;
+        transp->context.private = context;
+    }
+
     sock = socket_local_client("logdr",
                                ANDROID_SOCKET_NAMESPACE_RESERVED,
                                SOCK_SEQPACKET);
@@ -555,6 +712,22 @@ static int logdOpen(struct android_log_logger_list *logger_list,
     if (logger_list->pid) {
         ret = snprintf(cp, remaining, " pid=%u", logger_list->pid);
         ret = min(ret, remaining);
+        remaining -= ret;
+        cp += ret;
+    }
+
+    ret = snprintf(cp, remaining, " format=2");
+    ret = min(ret, remaining);
+    remaining -= ret;
+    cp += ret;
+
+    /* last, regex= takes the remainder of the request */
+    if (logger_list->filter) {
+        ret = snprintf(cp, remaining, " %s", logger_list->filter);
+        if (ret >= remaining) {
+            close(sock);
+            return -E2BIG;
+        }
         cp += ret;
     }
 
@@ -588,7 +761,9 @@ static int logdOpen(struct android_log_logger_list *logger_list,
         return ret;
     }
 
-    return transp->context.sock = sock;
+    memset(context, 0, sizeof(*context));
+    context->hello = 1;
+    return context->sock = sock;
 }
 
 /* Read from the selected logs */
@@ -596,15 +771,18 @@ static int logdRead(struct android_log_logger_list *logger_list,
                     struct android_log_transport_context *transp,
                     struct log_msg *log_msg)
 {
-    int ret, e;
+    struct logd_reader_context *context;
+    char buf[LOGGER_ENTRY_MAX_LEN];
+    int ret, e, sock;
     struct sigaction ignore;
     struct sigaction old_sigaction;
     unsigned int old_alarm = 0;
 
-    ret = logdOpen(logger_list, transp);
-    if (ret < 0) {
-        return ret;
+    sock = logdOpen(logger_list, transp);
+    if (sock < 0) {
+        return sock;
     }
+    context = transp->context.private;
 
     memset(log_msg, 0, sizeof(*log_msg));
 
@@ -618,8 +796,27 @@ static int logdRead(struct android_log_logger_list *logger_list,
     }
 
     /* NOTE: SOCK_SEQPACKET guarantees we read exactly one full entry */
-    ret = recv(ret, log_msg, LOGGER_ENTRY_MAX_LEN, 0);
+    ret = recv(sock, context->compact ? buf : (char *)log_msg,
+               LOGGER_ENTRY_MAX_LEN, 0);
     e = errno;
+    if (context->hello && (ret > 0)) {
+        android_log_compact_hello_t *hello = (android_log_compact_hello_t *)log_msg;
+
+        /* An older logd goes straight to the entries */
+        context->hello = 0;
+        if ((ret == sizeof(*hello)) && (hello->magic == LOGGER_COMPACT_MAGIC)) {
+            context->compact = 1;
+            ret = recv(sock, buf, LOGGER_ENTRY_MAX_LEN, 0);
+            e = errno;
+        }
+    }
+    if (context->compact && (ret > 0)) {
+        ret = compact_decode(context, buf, ret, log_msg);
+        if (ret < 0) {
+            e = -ret;
+            ret = -1;
+        }
+    }
 
     if (logger_list->mode & ANDROID_LOG_NONBLOCK) {
         if ((ret == 0) || (e == EINTR)) {
@@ -663,8 +860,13 @@ static int logdPoll(struct android_log_logger_list *logger_list,
 static void logdClose(struct android_log_logger_list *logger_list __unused,
                       struct android_log_transport_context *transp)
 {
-    if (transp->context.sock > 0) {
-        close (transp->context.sock);
-        transp->context.sock = -1;
+    struct logd_reader_context *context = transp->context.private;
+
+    if (context) {
+        if (context->sock > 0) {
+            close(context->sock);
+        }
+        free(context);
+        transp->context.private = NULL;
     }
 }
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Shared memory transport to logd, opted in to by __android_log_set_shm().
+ *
+ * logd hands out a ring and an eventfd over its control socket, which is
+ * held open for as long as the ring is in use so that logd can tell when
+ * we are gone. Entries are copied into the ring without a syscall; logd is
+ * only kicked through the eventfd if it went to sleep waiting for more.
+ * Should the ring be full, or not be had at all, the entry goes through the
+ * logd transport's socket instead.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/sockets.h>
+#include <log/logd.h>
+#include <log/logger.h>
+#include <private/android_filesystem_config.h>
+#include <private/android_logger.h>
+
+#include "config_write.h"
+#include "log_portability.h"
+#include "logger.h"
+
+/* branchless on many architectures. */
+#define min(x,y) ((y) ^ (((x) ^ (y)) & -((x) < (y))))
+
+extern struct android_log_transport_write logdLoggerWrite;
+
+static int logdShmAvailable(log_id_t LogId);
+static int logdShmOpen();
+static void logdShmClose();
+static int logdShmWrite(log_id_t logId, struct timespec *ts,
+                        struct iovec *vec, size_t nr);
+
+LIBLOG_HIDDEN struct android_log_transport_write logdShmLoggerWrite = {
+    .node = { &logdShmLoggerWrite.node, &logdShmLoggerWrite.node },
+    .context.sock = -1, /* logd control socket, holds on to the ring */
+    .name = "logd-shm",
+    .available = logdShmAvailable,
+    .open = logdShmOpen,
+    .close = logdShmClose,
+    .write = logdShmWrite,
+};
+
+static atomic_int enabled;
+
+/* Serializes the threads of this process, logd sees a single producer */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static android_log_shm_header_t *ring;
+static size_t ring_len;
+static int ring_eventfd = -1;
+static pid_t ring_pid; /* a forked child must not share our ring */
+
+static int logdShmAvailable(log_id_t logId)
+{
+    if (!atomic_load(&enabled)) {
+        return -EINVAL;
+    }
+    return (*logdLoggerWrite.available)(logId);
+}
+
+/* Ask logd for a ring, on failure we carry on through the socket */
+static int ring_connect()
+{
+    static const char cmd[] = "shm";
+    char buf[32];
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2] = { -1, -1 };
+    unsigned long size;
+    ssize_t ret;
+    void *map;
+    int sock;
+
+    sock = socket_local_client("logd", ANDROID_SOCKET_NAMESPACE_RESERVED,
+                               SOCK_STREAM);
+    if (sock < 0) {
+        return -errno;
+    }
+
+    if (TEMP_FAILURE_RETRY(write(sock, cmd, sizeof(cmd))) != sizeof(cmd)) {
+        goto error;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf) - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ret = TEMP_FAILURE_RETRY(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC));
+    if (ret <= 0) {
+        goto error;
+    }
+    buf[ret] = '\0';
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET)
+                && (cmsg->cmsg_type == SCM_RIGHTS)
+                && (cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+    }
+    if ((fds[0] < 0) || (fds[1] < 0)) {
+        goto error;
+    }
+
+    /* reply is the size of the data */
+    size = strtoul(buf, NULL, 10);
+    if (!size || (size & (size - 1)) || (size > (16 * 1024 * 1024))) {
+        goto error;
+    }
+    map = mmap(NULL, sizeof(android_log_shm_header_t) + size,
+               PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (map == MAP_FAILED) {
+        goto error;
+    }
+    if ((((android_log_shm_header_t *)map)->magic != LOGGER_SHM_MAGIC)
+            || (((android_log_shm_header_t *)map)->size != size)) {
+        munmap(map, sizeof(android_log_shm_header_t) + size);
+        goto error;
+    }
+    close(fds[0]);
+
+    ring = map;
+    ring_len = sizeof(android_log_shm_header_t) + size;
+    ring_eventfd = fds[1];
+    ring_pid = getpid();
+    logdShmLoggerWrite.context.sock = sock;
+    return 0;
+
+error:
+    ret = -EPROTO;
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    close(sock);
+    return ret;
+}
+
+/* log_init_lock assumed */
+static int logdShmOpen()
+{
+    int ret = (*logdLoggerWrite.open)();
+
+    if ((ret >= 0) && (logdShmLoggerWrite.context.sock < 0)) {
+        pthread_mutex_lock(&ring_lock);
+        ring_connect();
+        pthread_mutex_unlock(&ring_lock);
+    }
+    return ret;
+}
+
+static void logdShmClose()
+{
+    pthread_mutex_lock(&ring_lock);
+    if (ring) {
+        munmap(ring, ring_len);
+        ring = NULL;
+        ring_len = 0;
+    }
+    if (ring_eventfd >= 0) {
+        close(ring_eventfd);
+        ring_eventfd = -1;
+    }
+    if (logdShmLoggerWrite.context.sock >= 0) {
+        close(logdShmLoggerWrite.context.sock);
+        logdShmLoggerWrite.context.sock = -1;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    (*logdLoggerWrite.close)();
+}
+
+/* ring_lock assumed, returns -EAGAIN if there is no room */
+static int ring_write_locked(log_id_t logId, struct timespec *ts,
+                             struct iovec *vec, size_t nr, size_t len)
+{
+    static const size_t align = LOGGER_SHM_ALIGN;
+    android_log_batch_record_t *record;
+    char *data = (char *)(ring + 1);
+    size_t size = ring->size;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = head & (size - 1);
+    size_t need = (sizeof(*record) + len + align - 1) & ~(align - 1);
+    size_t skip = 0;
+    size_t i;
+    char *cp;
+
+    if ((size - offset) < need) {
+        skip = size - offset;
+    }
+    if ((head - tail) > size) {
+        return -EBADF; /* not ours to fix, logd will tidy up */
+    }
+    if ((size - (head - tail)) < (skip + need)) {
+        return -EAGAIN;
+    }
+    if (skip) {
+        if (skip >= sizeof(*record)) {
+            record = (android_log_batch_record_t *)(data + offset);
+            record->header.id = LOGGER_ID_BATCH;
+            record->len = 0;
+        }
+        head += skip;
+        offset = 0;
+    }
+
+    record = (android_log_batch_record_t *)(data + offset);
+    record->header.id = logId;
+    record->header.tid = gettid();
+    record->header.realtime.tv_sec = ts->tv_sec;
+    record->header.realtime.tv_nsec = ts->tv_nsec;
+    record->len = len;
+
+    cp = (char *)(record + 1);
+    for (i = 0; (i < nr) && (cp < ((char *)(record + 1) + len)); ++i) {
+        size_t n = min(vec[i].iov_len,
+                       (size_t)(((char *)(record + 1) + len) - cp));
+        memcpy(cp, vec[i].iov_base, n);
+        cp += n;
+    }
+
+    /*
+     * Publish, then check whether logd has gone to sleep. logd sets
+     * sleeping before it looks at head a last time, the sequentially
+     * consistent pair makes sure one of us sees the other.
+     */
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        static const uint64_t one = 1;
+        TEMP_FAILURE_RETRY(write(ring_eventfd, &one, sizeof(one)));
+    }
+    return len;
+}
+
+static int logdShmWrite(log_id_t logId, struct timespec *ts,
+                        struct iovec *vec, size_t nr)
+{
+    size_t i, len;
+    int ret;
+
+    /* logd, after initialization and priv drop */
+    if (__android_log_uid() == AID_LOGD) {
+        return 0;
+    }
+
+    /* Security entries keep to the socket, logd checks their credentials */
+    if (logId == LOG_ID_SECURITY) {
+        return (*logdLoggerWrite.write)(logId, ts, vec, nr);
+    }
+
+    for (len = i = 0; i < nr; ++i) {
+        len += vec[i].iov_len;
+    }
+    if (len > LOGGER_ENTRY_MAX_PAYLOAD) {
+        len = LOGGER_ENTRY_MAX_PAYLOAD;
+    }
+
+    ret = -EBADF;
+    pthread_mutex_lock(&ring_lock);
+    if (ring && (ring_pid == getpid())) {
+        ret = ring_write_locked(logId, ts, vec, nr, len);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (ret < 0) {
+        return (*logdLoggerWrite.write)(logId, ts, vec, nr);
+    }
+    return ret;
+}
+
+LIBLOG_ABI_PUBLIC int __android_log_set_shm(int enable)
+{
+    enable = !!enable;
+    if (atomic_exchange(&enabled, enable) == enable) {
+        return 0;
+    }
+
+    __android_log_close();
+
+    /* Drop the logd transports so that the next write reconfigures */
+    __android_log_lock();
+    __android_log_remove_transport(&__android_log_transport_write,
+                                   &logdShmLoggerWrite);
+    __android_log_remove_transport(&__android_log_transport_write,
+                                   &logdLoggerWrite);
+    __android_log_unlock();
+
+    return 0;
+}
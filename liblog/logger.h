@@ -102,6 +102,7 @@ struct android_log_logger_list {
   unsigned int tail;
   log_time start;
   pid_t pid;
+  char *filter; /* reader filters pushed down to logd, or NULL */
 };
 
 struct android_log_logger {
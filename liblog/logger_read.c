@@ -271,6 +271,29 @@ LIBLOG_ABI_PUBLIC struct logger_list *android_logger_list_alloc_time(
     return (struct logger_list *)logger_list;
 }
 
+LIBLOG_ABI_PUBLIC int android_logger_list_set_filter(
+        struct logger_list *logger_list,
+        const char *filter)
+{
+    struct android_log_logger_list *logger_list_internal =
+            (struct android_log_logger_list *)logger_list;
+    char *copy = NULL;
+
+    if (!logger_list_internal) {
+        return -EINVAL;
+    }
+    if (filter && *filter) {
+        copy = strdup(filter);
+        if (!copy) {
+            return -ENOMEM;
+        }
+    }
+    free(logger_list_internal->filter);
+    logger_list_internal->filter = copy;
+
+    return 0;
+}
+
 /* android_logger_list_register unimplemented, no use case */
 /* android_logger_list_unregister unimplemented, no use case */
 
@@ -475,5 +498,6 @@ LIBLOG_ABI_PUBLIC void android_logger_list_free(struct logger_list *logger_list)
         android_logger_free((struct logger *)logger);
     }
 
+    free(logger_list_internal->filter);
     free(logger_list_internal);
 }
@@ -45,6 +45,23 @@ typedef struct FilterInfo_t {
     struct FilterInfo_t *p_next;
 } FilterInfo;
 
+/*
+ * Kept from the last line formatted, see formatTime() and formatUid(). The
+ * time stamp changes far less often than the lines it is formatted for.
+ */
+struct formatCache {
+    bool time_cached;
+    time_t time_sec;
+    bool tz_unset;
+    char tz[64];            /* TZ the seconds were formatted in */
+    char seconds[32];
+    size_t seconds_len;
+    char zone[16];
+    bool uid_cached;
+    int32_t uid;
+    char uid_name[16];
+};
+
 struct AndroidLogFormat_t {
     android_LogPriority global_pri;
     FilterInfo *filters;
@@ -57,6 +74,8 @@ struct AndroidLogFormat_t {
     bool epoch_output;
     bool monotonic_output;
     bool uid_output;
+    /* for android_log_formatLogLineInto() only, callers do not share it */
+    struct formatCache cache;
 };
 
 /*
@@ -241,6 +260,9 @@ LIBLOG_ABI_PUBLIC int android_log_setPrintFormat(
         AndroidLogFormat *p_format,
         AndroidLogPrintFormat format)
 {
+    /* The cached seconds were formatted for the old modifiers */
+    p_format->cache.time_cached = false;
+
     switch (format) {
     case FORMAT_MODIFIER_COLOR:
         p_format->colored_output = true;
@@ -915,17 +937,124 @@ LIBLOG_WEAK ssize_t utf8_character_length(const char *src, size_t len)
 }
 
 /*
- * Convert to printable from message to p buffer, return string length. If p is
- * NULL, do not copy, but still return the expected string length.
+ * Length of the run at the start of message that needs no conversion to be
+ * printable, that is ASCII from ' ' up and not a backslash. Checked a word
+ * at a time, falling back to a byte at a time on the word that ends it.
+ */
+static size_t printableRun(const char *message, size_t messageLen)
+{
+    static const uint64_t ones = 0x0101010101010101ULL;
+    static const uint64_t highs = 0x8080808080808080ULL;
+    const char *begin = message;
+
+    while (messageLen >= sizeof(uint64_t)) {
+        uint64_t w, backslash;
+
+        memcpy(&w, message, sizeof(w));
+        backslash = w ^ (ones * '\\');
+        /* high bit, any byte below ' ', or any backslash */
+        if ((w | ((w - ones * ' ') & ~w) | ((backslash - ones) & ~backslash))
+                & highs) {
+            break;
+        }
+        message += sizeof(w);
+        messageLen -= sizeof(w);
+    }
+    while (messageLen && ((unsigned char)*message >= ' ')
+            && !(*message & 0x80) && (*message != '\\')) {
+        ++message;
+        --messageLen;
+    }
+    return message - begin;
+}
+
+/*
+ * Where a line is being formatted to. Once it no longer fits in the
+ * caller's buffer p is NULL and the length required is only counted.
  */
-static size_t convertPrintable(char *p, const char *message, size_t messageLen)
+struct formatCursor {
+    char *p;
+    char *end;  /* of the buffer, less room for the nul */
+    size_t len;
+};
+
+static void formatAppend(struct formatCursor *c, const char *s, size_t n)
 {
-    char *begin = p;
-    bool print = p != NULL;
+    if (c->p && (n <= (size_t)(c->end - c->p))) {
+        memcpy(c->p, s, n);
+        c->p += n;
+    } else {
+        c->p = NULL;
+    }
+    c->len += n;
+}
 
+static void formatAppendPadded(struct formatCursor *c, const char *s,
+                               size_t width)
+{
+    static const char spaces[] = "        ";
+    size_t n = strlen(s);
+
+    formatAppend(c, s, n);
+    while (n < width) {
+        size_t pad = MIN(width - n, sizeof(spaces) - 1);
+        formatAppend(c, spaces, pad);
+        n += pad;
+    }
+}
+
+/* value right justified in width with pad, returns the end */
+static char *formatDecimal(char *p, long long value, size_t width, char pad)
+{
+    char digits[24];
+    char *d = digits + sizeof(digits);
+    unsigned long long v = (value < 0) ? -(unsigned long long)value
+                                       : (unsigned long long)value;
+    size_t n;
+
+    do {
+        *--d = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) {
+        *--d = '-';
+    }
+    n = digits + sizeof(digits) - d;
+    while (n < width) {
+        *p++ = pad;
+        --width;
+    }
+    memcpy(p, d, n);
+    return p + n;
+}
+
+static void formatAppendDecimal(struct formatCursor *c, long long value,
+                                size_t width)
+{
+    char buf[32];
+
+    formatAppend(c, buf, formatDecimal(buf, value, width, ' ') - buf);
+}
+
+/*
+ * Convert to printable from message and append, plain ASCII is copied
+ * in runs as is.
+ */
+static void formatAppendPrintable(struct formatCursor *c,
+                                  const char *message, size_t messageLen)
+{
     while (messageLen) {
         char buf[6];
-        ssize_t len = sizeof(buf) - 1;
+        ssize_t len = printableRun(message, messageLen);
+
+        if (len) {
+            formatAppend(c, message, len);
+            message += len;
+            messageLen -= len;
+            continue;
+        }
+
+        len = sizeof(buf) - 1;
         if ((size_t)len > messageLen) {
             len = messageLen;
         }
@@ -964,14 +1093,10 @@ static size_t convertPrintable(char *p, const char *message, size_t messageLen)
                 buf[len] = '\0';
             }
         }
-        if (print) {
-            strcpy(p, buf);
-        }
-        p += strlen(buf);
+        formatAppend(c, buf, strlen(buf));
         message += len;
         messageLen -= len;
     }
-    return p - begin;
 }
 
 static char *readSeconds(char *e, struct timespec *t)
@@ -1253,40 +1378,52 @@ static void convertMonotonic(struct timespec *result,
     subTimespec(result, result, &convert);
 }
 
-/**
- * Formats a log message into a buffer
- *
- * Uses defaultBuffer if it can, otherwise malloc()'s a new buffer
- * If return value != defaultBuffer, caller must call free()
- * Returns NULL on malloc error
+/*
+ * Prefix and suffix templates for each AndroidLogPrintFormat, expanded a
+ * field at a time by formatTemplate() rather than parsed by snprintf for
+ * every line:
+ *   %t time, %c priority, %g tag padded to 8, %s tag,
+ *   %u uid with a ':', %U uid with a ' ', %p pid, %i tid
  */
+static const struct {
+    const char *prefix;
+    const char *suffix;
+    bool headerFooter; /* wraps the whole message, rather than each line */
+} formatTemplates[] = {
+    [FORMAT_BRIEF]      = { "%c/%g(%u%p): ",          "\n",        false },
+    [FORMAT_PROCESS]    = { "%c(%u%p) ",              "  (%s)\n",  false },
+    [FORMAT_TAG]        = { "%c/%g: ",                "\n",        false },
+    [FORMAT_THREAD]     = { "%c(%u%p:%i) ",           "\n",        false },
+    [FORMAT_RAW]        = { "",                       "\n",        false },
+    [FORMAT_TIME]       = { "%t %c/%g(%u%p): ",       "\n",        false },
+    [FORMAT_THREADTIME] = { "%t %U%p %i %c %g: ",     "\n",        false },
+    [FORMAT_LONG]       = { "[ %t %u%p:%i %c/%g ]\n", "\n\n",      true },
+};
 
-LIBLOG_ABI_PUBLIC char *android_log_formatLogLine (
-        AndroidLogFormat *p_format,
-        char *defaultBuffer,
-        size_t defaultBufferSize,
-        const AndroidLogEntry *entry,
-        size_t *p_outLength)
+/* Were the cached seconds formatted in the timezone tz */
+static bool sameZone(const struct formatCache *cache, const char *tz)
 {
-#if !defined(_WIN32)
-    struct tm tmBuf;
-#endif
-    struct tm* ptm;
-    char timeBuf[64]; /* good margin, 23+nul for msec, 26+nul for usec */
-    char prefixBuf[128], suffixBuf[128];
-    char priChar;
-    int prefixSuffixIsHeaderFooter = 0;
-    char *ret;
-    time_t now;
-    unsigned long nsec;
-
-    priChar = filterPriToChar(entry->priority);
-    size_t prefixLen = 0, suffixLen = 0;
-    size_t len;
+    if (!tz) {
+        return cache->tz_unset;
+    }
+    return !cache->tz_unset && !strcmp(cache->tz, tz);
+}
+
+/*
+ * Format the time stamp of entry into buf, returning its length. The
+ * seconds, and the zone, are kept in cache from the last call.
+ */
+static size_t formatTime(const AndroidLogFormat *p_format,
+                         struct formatCache *cache,
+                         const AndroidLogEntry *entry, char *buf)
+{
+    time_t now = entry->tv_sec;
+    unsigned long nsec = entry->tv_nsec;
+    bool local = !p_format->epoch_output && !p_format->monotonic_output;
+    const char *tz = local ? getenv("TZ") : NULL;
+    char *p;
 
     /*
-     * Get the current date/time in pretty form
-     *
      * It's often useful when examining a log with "less" to jump to
      * a specific point in the file by searching for the date/time stamp.
      * For this reason it's very annoying to have regexp meta characters
@@ -1296,8 +1433,6 @@ LIBLOG_ABI_PUBLIC char *android_log_formatLogLine (
      * The caller may have affected the timezone environment, this is
      * expected to be sensitive to that.
      */
-    now = entry->tv_sec;
-    nsec = entry->tv_nsec;
     if (p_format->monotonic_output) {
         // prevent convertMonotonic from being called if logd is monotonic
         if (android_log_clockid() != CLOCK_MONOTONIC) {
@@ -1310,237 +1445,282 @@ LIBLOG_ABI_PUBLIC char *android_log_formatLogLine (
     if (now < 0) {
         nsec = NS_PER_SEC - nsec;
     }
-    if (p_format->epoch_output || p_format->monotonic_output) {
-        ptm = NULL;
-        snprintf(timeBuf, sizeof(timeBuf),
-                 p_format->monotonic_output ? "%6lld" : "%19lld",
-                 (long long)now);
-    } else {
+
+    if (!cache->time_cached || (cache->time_sec != now)
+            || (local && !sameZone(cache, tz))) {
+        cache->zone[0] = '\0';
+        if (!local) {
+            snprintf(cache->seconds, sizeof(cache->seconds),
+                     p_format->monotonic_output ? "%6lld" : "%19lld",
+                     (long long)now);
+        } else {
 #if !defined(_WIN32)
-        ptm = localtime_r(&now, &tmBuf);
+            struct tm tmBuf;
+            struct tm* ptm = localtime_r(&now, &tmBuf);
 #else
-        ptm = localtime(&now);
+            struct tm* ptm = localtime(&now);
 #endif
-        strftime(timeBuf, sizeof(timeBuf),
-                 &"%Y-%m-%d %H:%M:%S"[p_format->year_output ? 0 : 3],
-                 ptm);
+            strftime(cache->seconds, sizeof(cache->seconds),
+                     &"%Y-%m-%d %H:%M:%S"[p_format->year_output ? 0 : 3],
+                     ptm);
+            if (p_format->zone_output) {
+                strftime(cache->zone, sizeof(cache->zone), " %z", ptm);
+            }
+        }
+        cache->seconds_len = strlen(cache->seconds);
+        cache->time_sec = now;
+        /* a zone too long to remember is looked up again each time */
+        cache->time_cached = !tz || (strlen(tz) < sizeof(cache->tz));
+        cache->tz_unset = !tz;
+        if (tz && cache->time_cached) {
+            strcpy(cache->tz, tz);
+        }
     }
-    len = strlen(timeBuf);
+
+    memcpy(buf, cache->seconds, cache->seconds_len);
+    p = buf + cache->seconds_len;
+    *p++ = '.';
     if (p_format->usec_time_output) {
-        len += snprintf(timeBuf + len, sizeof(timeBuf) - len,
-                        ".%06ld", nsec / US_PER_NSEC);
+        p = formatDecimal(p, nsec / US_PER_NSEC, 6, '0');
     } else {
-        len += snprintf(timeBuf + len, sizeof(timeBuf) - len,
-                        ".%03ld", nsec / MS_PER_NSEC);
-    }
-    if (p_format->zone_output && ptm) {
-        strftime(timeBuf + len, sizeof(timeBuf) - len, " %z", ptm);
-    }
-
-    /*
-     * Construct a buffer containing the log header and log message.
-     */
-    if (p_format->colored_output) {
-        prefixLen = snprintf(prefixBuf, sizeof(prefixBuf), "\x1B[38;5;%dm",
-                             colorFromPri(entry->priority));
-        prefixLen = MIN(prefixLen, sizeof(prefixBuf));
-        suffixLen = snprintf(suffixBuf, sizeof(suffixBuf), "\x1B[0m");
-        suffixLen = MIN(suffixLen, sizeof(suffixBuf));
+        p = formatDecimal(p, nsec / MS_PER_NSEC, 3, '0');
     }
+    strcpy(p, cache->zone);
+    return p - buf + strlen(p);
+}
 
-    char uid[16];
-    uid[0] = '\0';
-    if (p_format->uid_output) {
-        if (entry->uid >= 0) {
-            const struct android_id_info *info = android_ids;
-            size_t i;
+/* Format the uid as "%5s" or "%5d", the last looked up is kept */
+static const char *formatUid(struct formatCache *cache, int32_t uid)
+{
+    if (!cache->uid_cached || (cache->uid != uid)) {
+        const struct android_id_info *info = android_ids;
+        size_t i;
 
-            for (i = 0; i < android_id_count; ++i) {
-                if (info->aid == (unsigned int)entry->uid) {
-                    break;
-                }
-                ++info;
-            }
-            if ((i < android_id_count) && (strlen(info->name) <= 5)) {
-                 snprintf(uid, sizeof(uid), "%5s:", info->name);
-            } else {
-                 // Not worth parsing package list, names all longer than 5
-                 snprintf(uid, sizeof(uid), "%5d:", entry->uid);
+        for (i = 0; i < android_id_count; ++i) {
+            if (info->aid == (unsigned int)uid) {
+                break;
             }
+            ++info;
+        }
+        if ((i < android_id_count) && (strlen(info->name) <= 5)) {
+            snprintf(cache->uid_name, sizeof(cache->uid_name),
+                     "%5s", info->name);
         } else {
-            snprintf(uid, sizeof(uid), "      ");
+            // Not worth parsing package list, names all longer than 5
+            snprintf(cache->uid_name, sizeof(cache->uid_name),
+                     "%5d", uid);
         }
+        cache->uid = uid;
+        cache->uid_cached = true;
     }
+    return cache->uid_name;
+}
 
-    switch (p_format->format) {
-        case FORMAT_TAG:
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "%c/%-8s: ", priChar, entry->tag);
-            strcpy(suffixBuf + suffixLen, "\n");
-            ++suffixLen;
-            break;
-        case FORMAT_PROCESS:
-            len = snprintf(suffixBuf + suffixLen, sizeof(suffixBuf) - suffixLen,
-                "  (%s)\n", entry->tag);
-            suffixLen += MIN(len, sizeof(suffixBuf) - suffixLen);
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "%c(%s%5d) ", priChar, uid, entry->pid);
+static void formatTemplate(const AndroidLogFormat *p_format,
+                           struct formatCache *cache,
+                           const AndroidLogEntry *entry,
+                           const char *template, const char *timeBuf,
+                           size_t timeLen, struct formatCursor *c)
+{
+    const char *tag = entry->tag ? entry->tag : "(null)";
+
+    while (*template) {
+        const char *literal = strchr(template, '%');
+        char priChar;
+
+        if (!literal) {
+            formatAppend(c, template, strlen(template));
+            return;
+        }
+        formatAppend(c, template, literal - template);
+        template = literal + 2;
+        switch (literal[1]) {
+        case 't':
+            formatAppend(c, timeBuf, timeLen);
             break;
-        case FORMAT_THREAD:
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "%c(%s%5d:%5d) ", priChar, uid, entry->pid, entry->tid);
-            strcpy(suffixBuf + suffixLen, "\n");
-            ++suffixLen;
+        case 'c':
+            priChar = filterPriToChar(entry->priority);
+            formatAppend(c, &priChar, 1);
             break;
-        case FORMAT_RAW:
-            prefixBuf[prefixLen] = 0;
-            len = 0;
-            strcpy(suffixBuf + suffixLen, "\n");
-            ++suffixLen;
+        case 'g':
+            formatAppendPadded(c, tag, 8);
             break;
-        case FORMAT_TIME:
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "%s %c/%-8s(%s%5d): ", timeBuf, priChar, entry->tag,
-                uid, entry->pid);
-            strcpy(suffixBuf + suffixLen, "\n");
-            ++suffixLen;
+        case 's':
+            formatAppend(c, tag, strlen(tag));
             break;
-        case FORMAT_THREADTIME:
-            ret = strchr(uid, ':');
-            if (ret) {
-                *ret = ' ';
+        case 'u':
+        case 'U':
+            if (!p_format->uid_output) {
+                break;
+            }
+            if (entry->uid >= 0) {
+                const char *name = formatUid(cache, entry->uid);
+                formatAppend(c, name, strlen(name));
+                formatAppend(c, (literal[1] == 'u') ? ":" : " ", 1);
+            } else {
+                formatAppend(c, "      ", 6);
             }
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "%s %s%5d %5d %c %-8s: ", timeBuf,
-                uid, entry->pid, entry->tid, priChar, entry->tag);
-            strcpy(suffixBuf + suffixLen, "\n");
-            ++suffixLen;
             break;
-        case FORMAT_LONG:
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "[ %s %s%5d:%5d %c/%-8s ]\n",
-                timeBuf, uid, entry->pid, entry->tid, priChar, entry->tag);
-            strcpy(suffixBuf + suffixLen, "\n\n");
-            suffixLen += 2;
-            prefixSuffixIsHeaderFooter = 1;
+        case 'p':
+            formatAppendDecimal(c, entry->pid, 5);
             break;
-        case FORMAT_BRIEF:
-        default:
-            len = snprintf(prefixBuf + prefixLen, sizeof(prefixBuf) - prefixLen,
-                "%c/%-8s(%s%5d): ", priChar, entry->tag, uid, entry->pid);
-            strcpy(suffixBuf + suffixLen, "\n");
-            ++suffixLen;
+        case 'i':
+            formatAppendDecimal(c, entry->tid, 5);
             break;
+        }
     }
+}
 
-    /* snprintf has a weird return value.   It returns what would have been
-     * written given a large enough buffer.  In the case that the prefix is
-     * longer then our buffer(128), it messes up the calculations below
-     * possibly causing heap corruption.  To avoid this we double check and
-     * set the length at the maximum (size minus null byte)
-     */
-    prefixLen += len;
-    if (prefixLen >= sizeof(prefixBuf)) {
-        prefixLen = sizeof(prefixBuf) - 1;
-        prefixBuf[sizeof(prefixBuf) - 1] = '\0';
+/*
+ * Format entry into buffer, returning the length required, with the time
+ * stamp and uid name lookups kept in cache.
+ */
+static size_t formatLogLine(const AndroidLogFormat *p_format,
+                            struct formatCache *cache,
+                            char *buffer,
+                            size_t bufferSize,
+                            const AndroidLogEntry *entry)
+{
+    char timeBuf[64]; /* good margin, 23+nul for msec, 26+nul for usec */
+    char prefix[128], suffix[128];
+    size_t timeLen = 0;
+    AndroidLogPrintFormat format = p_format->format;
+    struct formatCursor c;
+    const char *pm, *end;
+
+    if (((size_t)format >= (sizeof(formatTemplates) / sizeof(formatTemplates[0])))
+            || !formatTemplates[format].prefix) {
+        format = FORMAT_BRIEF;
     }
-    if (suffixLen >= sizeof(suffixBuf)) {
-        suffixLen = sizeof(suffixBuf) - 1;
-        suffixBuf[sizeof(suffixBuf) - 2] = '\n';
-        suffixBuf[sizeof(suffixBuf) - 1] = '\0';
-    }
-
-    /* the following code is tragically unreadable */
-
-    size_t numLines;
-    char *p;
-    size_t bufferSize;
-    const char *pm;
-
-    if (prefixSuffixIsHeaderFooter) {
-        /* we're just wrapping message with a header/footer */
-        numLines = 1;
-    } else {
-        pm = entry->message;
-        numLines = 0;
-
-        /*
-         * The line-end finding here must match the line-end finding
-         * in for ( ... numLines...) loop below
-         */
-        while (pm < (entry->message + entry->messageLen)) {
-            if (*pm++ == '\n') numLines++;
-        }
-        /* plus one line for anything not newline-terminated at the end */
-        if (pm > entry->message && *(pm-1) != '\n') numLines++;
+    if (strstr(formatTemplates[format].prefix, "%t")) {
+        timeLen = formatTime(p_format, cache, entry, timeBuf);
     }
 
     /*
-     * this is an upper bound--newlines in message may be counted
-     * extraneously
+     * Prefix and suffix are expanded once per entry, if they do not fit
+     * their buffers they are expanded again for each line.
      */
-    bufferSize = (numLines * (prefixLen + suffixLen)) + 1;
-    if (p_format->printable_output) {
-        /* Calculate extra length to convert non-printable to printable */
-        bufferSize += convertPrintable(NULL, entry->message, entry->messageLen);
-    } else {
-        bufferSize += entry->messageLen;
+    struct formatCursor pc = { prefix, prefix + sizeof(prefix), 0 };
+    struct formatCursor sc = { suffix, suffix + sizeof(suffix), 0 };
+    if (p_format->colored_output) {
+        char color[16];
+        static const char reset[] = "\x1B[0m";
+
+        memcpy(color, "\x1B[38;5;", 7);
+        strcpy(formatDecimal(color + 7, colorFromPri(entry->priority), 0, ' '),
+               "m");
+        formatAppend(&pc, color, strlen(color));
+        formatAppend(&sc, reset, sizeof(reset) - 1);
     }
-
-    if (defaultBufferSize >= bufferSize) {
-        ret = defaultBuffer;
-    } else {
-        ret = (char *)malloc(bufferSize);
-
-        if (ret == NULL) {
-            return ret;
-        }
+    formatTemplate(p_format, cache, entry, formatTemplates[format].prefix,
+                   timeBuf, timeLen, &pc);
+    formatTemplate(p_format, cache, entry, formatTemplates[format].suffix,
+                   timeBuf, timeLen, &sc);
+
+    c.p = buffer;
+    c.end = bufferSize ? (buffer + bufferSize - 1) : buffer;
+    c.len = 0;
+    if (!buffer || !bufferSize) {
+        c.p = NULL;
     }
 
-    ret[0] = '\0';       /* to start strcat off */
-
-    p = ret;
     pm = entry->message;
+    end = entry->message + entry->messageLen;
+    do {
+        const char *lineStart = pm;
+        size_t lineLen;
 
-    if (prefixSuffixIsHeaderFooter) {
-        strcat(p, prefixBuf);
-        p += prefixLen;
+        if (formatTemplates[format].headerFooter) {
+            pm = end;
+        } else {
+            /* Find the next end-of-line in message */
+            pm = memchr(lineStart, '\n', end - lineStart);
+            if (!pm) {
+                pm = end;
+            }
+        }
+        lineLen = pm - lineStart;
+
+        if (pc.p) {
+            formatAppend(&c, prefix, pc.len);
+        } else {
+            formatTemplate(p_format, cache, entry,
+                           formatTemplates[format].prefix, timeBuf, timeLen,
+                           &c);
+        }
         if (p_format->printable_output) {
-            p += convertPrintable(p, entry->message, entry->messageLen);
+            formatAppendPrintable(&c, lineStart, lineLen);
         } else {
-            strncat(p, entry->message, entry->messageLen);
-            p += entry->messageLen;
+            formatAppend(&c, lineStart, lineLen);
+        }
+        if (sc.p) {
+            formatAppend(&c, suffix, sc.len);
+        } else {
+            formatTemplate(p_format, cache, entry,
+                           formatTemplates[format].suffix, timeBuf, timeLen,
+                           &c);
         }
-        strcat(p, suffixBuf);
-        p += suffixLen;
-    } else {
-        do {
-            const char *lineStart;
-            size_t lineLen;
-            lineStart = pm;
 
-            /* Find the next end-of-line in message */
-            while (pm < (entry->message + entry->messageLen)
-                    && *pm != '\n') pm++;
-            lineLen = pm - lineStart;
-
-            strcat(p, prefixBuf);
-            p += prefixLen;
-            if (p_format->printable_output) {
-                p += convertPrintable(p, lineStart, lineLen);
-            } else {
-                strncat(p, lineStart, lineLen);
-                p += lineLen;
-            }
-            strcat(p, suffixBuf);
-            p += suffixLen;
+        if ((pm < end) && (*pm == '\n')) pm++;
+    } while (pm < end);
+
+    if (c.p) {
+        *c.p = '\0';
+    }
+    return c.len;
+}
+
+/**
+ * Formats a log message into the caller's buffer, without allocating
+ *
+ * Returns the length of the formatted line. Like snprintf, the line is only
+ * complete, and nul terminated, if that is less than bufferSize.
+ */
+LIBLOG_ABI_PUBLIC size_t android_log_formatLogLineInto(
+        AndroidLogFormat *p_format,
+        char *buffer,
+        size_t bufferSize,
+        const AndroidLogEntry *entry)
+{
+    return formatLogLine(p_format, &p_format->cache, buffer, bufferSize,
+                         entry);
+}
 
-            if (*pm == '\n') pm++;
-        } while (pm < (entry->message + entry->messageLen));
+/**
+ * Formats a log message into a buffer
+ *
+ * Uses defaultBuffer if it can, otherwise malloc()'s a new buffer
+ * If return value != defaultBuffer, caller must call free()
+ * Returns NULL on malloc error
+ */
+
+LIBLOG_ABI_PUBLIC char *android_log_formatLogLine (
+        AndroidLogFormat *p_format,
+        char *defaultBuffer,
+        size_t defaultBufferSize,
+        const AndroidLogEntry *entry,
+        size_t *p_outLength)
+{
+    /* p_format may be shared between threads, keep nothing in it */
+    struct formatCache cache;
+    char *ret = defaultBuffer;
+    size_t len;
+
+    cache.time_cached = false;
+    cache.uid_cached = false;
+    len = formatLogLine(p_format, &cache, defaultBuffer, defaultBufferSize,
+                        entry);
+
+    if (len >= defaultBufferSize) {
+        ret = (char *)malloc(len + 1);
+        if (ret == NULL) {
+            return ret;
+        }
+        len = formatLogLine(p_format, &cache, ret, len + 1, entry);
     }
 
     if (p_outLength != NULL) {
-        *p_outLength = p - ret;
+        *p_outLength = len;
     }
 
     return ret;
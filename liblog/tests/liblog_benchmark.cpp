@@ -20,10 +20,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <string>
+#include <vector>
+
 #include <cutils/sockets.h>
+#include <log/event_tag_map.h>
 #include <log/log.h>
 #include <log/logger.h>
 #include <log/log_read.h>
+#include <log/logprint.h>
 #include <private/android_logger.h>
 
 #include "benchmark.h"
@@ -77,6 +82,38 @@ static void BM_log_maximum(int iters) {
 }
 BENCHMARK(BM_log_maximum);
 
+/*
+ *	Measure the fastest rate we can stuff print messages into the log
+ * at high pressure with the per thread batching writer opted in, a 5ms
+ * deadline.
+ */
+static void BM_log_maximum_batch(int iters) {
+    __android_log_set_batch(5);
+
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iters; ++i) {
+        __android_log_print(ANDROID_LOG_INFO, "BM_log_maximum_batch", "%d", i);
+    }
+
+    StopBenchmarkTiming();
+
+    __android_log_set_batch(0);
+}
+BENCHMARK(BM_log_maximum_batch);
+
+/*
+ *	Measure the fastest rate we can stuff print messages into the log
+ * at high pressure through the shared memory ring, to be compared with
+ * BM_log_maximum.
+ */
+static void BM_log_maximum_shm(int iters) {
+    __android_log_set_shm(1);
+    BM_log_maximum(iters);
+    __android_log_set_shm(0);
+}
+BENCHMARK(BM_log_maximum_shm);
+
 /*
  *	Measure the time it takes to submit the android logging call using
  * discrete acquisition under light load. Expect this to be a pair of
@@ -479,6 +516,17 @@ static void BM_log_overhead(int iters) {
 }
 BENCHMARK(BM_log_overhead);
 
+/*
+ *	BM_log_overhead through the shared memory ring, logd is asleep each
+ * time so this includes the kick.
+ */
+static void BM_log_overhead_shm(int iters) {
+    __android_log_set_shm(1);
+    BM_log_overhead(iters);
+    __android_log_set_shm(0);
+}
+BENCHMARK(BM_log_overhead_shm);
+
 static void caught_latency(int /*signum*/)
 {
     unsigned long long v = 0xDEADBEEFA55A5AA5ULL;
@@ -573,6 +621,16 @@ static void BM_log_latency(int iters) {
 }
 BENCHMARK(BM_log_latency);
 
+/*
+ *	BM_log_latency through the shared memory ring.
+ */
+static void BM_log_latency_shm(int iters) {
+    __android_log_set_shm(1);
+    BM_log_latency(iters);
+    __android_log_set_shm(0);
+}
+BENCHMARK(BM_log_latency_shm);
+
 static void caught_delay(int /*signum*/)
 {
     unsigned long long v = 0xDEADBEEFA55A5AA6ULL;
@@ -647,20 +705,47 @@ static void BM_log_delay(int iters) {
 }
 BENCHMARK(BM_log_delay);
 
-/*
- *	Measure the time it takes for __android_log_is_loggable.
- */
-static void BM_is_loggable(int iters) {
+// Rotate through count distinct tags
+static void is_loggable(int iters, size_t count) {
+    std::vector<std::string> tags;
+    for (size_t i = 0; i < count; ++i) {
+        char tag[32];
+        snprintf(tag, sizeof(tag), "logd%zu", i);
+        tags.push_back(tag);
+    }
+
     StartBenchmarkTiming();
 
     for (int i = 0; i < iters; ++i) {
-        __android_log_is_loggable(ANDROID_LOG_WARN, "logd", ANDROID_LOG_VERBOSE);
+        __android_log_is_loggable(ANDROID_LOG_WARN, tags[i % count].c_str(),
+                                  ANDROID_LOG_VERBOSE);
     }
 
     StopBenchmarkTiming();
 }
+
+/*
+ *	Measure the time it takes for __android_log_is_loggable.
+ */
+static void BM_is_loggable(int iters) {
+    is_loggable(iters, 1);
+}
 BENCHMARK(BM_is_loggable);
 
+/*
+ *	Measure the same with a process logging with many tags, which should
+ * cost no more.
+ */
+static void BM_is_loggable_16(int iters) {
+    is_loggable(iters, 16);
+}
+BENCHMARK(BM_is_loggable_16);
+
+static void BM_is_loggable_256(int iters) {
+    is_loggable(iters, 256);
+}
+BENCHMARK(BM_is_loggable_256);
+
 /*
  *	Measure the time it takes for android_log_clockid.
  */
@@ -688,3 +773,101 @@ static void BM_security(int iters) {
     StopBenchmarkTiming();
 }
 BENCHMARK(BM_security);
+
+/*
+ *	Measure formatting throughput of android_log_formatLogLineInto for a
+ * mix of the lines found in a typical dump: short ASCII, multi-line,
+ * escapes and UTF-8.
+ */
+static void format_throughput(int iters, AndroidLogPrintFormat format,
+                              bool printable) {
+    static const char *messages[] = {
+        "Start proc 1234:com.example.app/u0a55 for service com.example/.Svc",
+        "Displayed com.example.app/.MainActivity: +412ms",
+        "java.lang.RuntimeException: boom\n"
+            "\tat com.example.app.Main.onCreate(Main.java:42)\n"
+            "\tat android.app.Activity.performCreate(Activity.java:6679)\n",
+        "path=C:\\temp\\x \"quoted\" bell\a done",
+        "r\xc3\xa9sum\xc3\xa9 na\xc3\xafve \xe2\x82\xac 10",
+    };
+    AndroidLogFormat *p_format = android_log_format_new();
+    android_log_setPrintFormat(p_format, format);
+    if (printable) {
+        android_log_setPrintFormat(p_format, FORMAT_MODIFIER_PRINTABLE);
+    }
+
+    AndroidLogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.tv_sec = 1476600000;
+    entry.priority = ANDROID_LOG_INFO;
+    entry.uid = 10055;
+    entry.pid = 1234;
+    entry.tid = 1240;
+    entry.tag = "ActivityManager";
+
+    char buffer[4096];
+    uint64_t bytes = 0;
+
+    StartBenchmarkTiming();
+    for (int i = 0; i < iters; ++i) {
+        const char *message = messages[i % (sizeof(messages) / sizeof(messages[0]))];
+        entry.tv_nsec = (i * 997) % 1000000000;
+        entry.message = message;
+        entry.messageLen = strlen(message);
+        bytes += android_log_formatLogLineInto(p_format, buffer,
+                                               sizeof(buffer), &entry);
+    }
+    StopBenchmarkTiming();
+
+    SetBenchmarkBytesProcessed(bytes);
+    android_log_format_free(p_format);
+}
+
+static void BM_format_threadtime(int iters) {
+    format_throughput(iters, FORMAT_THREADTIME, false);
+}
+BENCHMARK(BM_format_threadtime);
+
+static void BM_format_threadtime_printable(int iters) {
+    format_throughput(iters, FORMAT_THREADTIME, true);
+}
+BENCHMARK(BM_format_threadtime_printable);
+
+static void BM_format_long(int iters) {
+    format_throughput(iters, FORMAT_LONG, false);
+}
+BENCHMARK(BM_format_long);
+
+/*
+ *	Measure the time it takes to open and close the event tag map, as every
+ * reader of the events buffer does at startup. Uses the precompiled index
+ * when there is a current one next to the map.
+ */
+static void BM_openEventTagMap(int iters) {
+    StartBenchmarkTiming();
+    for (int i = 0; i < iters; ++i) {
+        EventTagMap *map = android_openEventTagMap(EVENT_TAG_MAP_FILE);
+        android_closeEventTagMap(map);
+    }
+    StopBenchmarkTiming();
+}
+BENCHMARK(BM_openEventTagMap);
+
+/*
+ *	Measure the time it takes to look up the tag of each event.
+ */
+static void BM_lookupEventTag(int iters) {
+    EventTagMap *map = android_openEventTagMap(EVENT_TAG_MAP_FILE);
+    if (!map) {
+        return;
+    }
+
+    StartBenchmarkTiming();
+    for (int i = 0; i < iters; ++i) {
+        android_lookupEventTag(map, 2718 + (i % 64) * 1000);
+    }
+    StopBenchmarkTiming();
+
+    android_closeEventTagMap(map);
+}
+BENCHMARK(BM_lookupEventTag);
@@ -18,12 +18,19 @@
 #include <inttypes.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <string>
+
 #include <cutils/properties.h>
 #include <gtest/gtest.h>
+#include <log/event_tag_map.h>
 #include <log/log.h>
 #include <log/logger.h>
 #include <log/log_read.h>
@@ -124,6 +131,41 @@ TEST(liblog, concurrent_name(__android_log_buf_print, NUM_CONCURRENT)) {
     ASSERT_LT(0, ret);
 }
 
+TEST(liblog, __android_log_set_batch__exit) {
+    static const char tag[] = "TEST__android_log_set_batch__exit";
+
+    // Left in the batch, well short of the deadline, until exit()
+    pid_t pid = fork();
+    ASSERT_LE(0, pid);
+    if (!pid) {
+        __android_log_set_batch(60000);
+        __android_log_buf_print(LOG_ID_MAIN, ANDROID_LOG_INFO, tag, "exit");
+        exit(0);
+    }
+    int status;
+    ASSERT_EQ(pid, TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)));
+    usleep(1000000);
+
+    struct logger_list *logger_list;
+    ASSERT_TRUE(NULL != (logger_list = android_logger_list_open(
+        LOG_ID_MAIN, ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK, 1000, pid)));
+
+    int count = 0;
+    for (;;) {
+        log_msg log_msg;
+        if (android_logger_list_read(logger_list, &log_msg) <= 0) {
+            break;
+        }
+        if ((log_msg.entry.pid == pid) && !strcmp(log_msg.msg() + 1, tag)) {
+            ++count;
+        }
+    }
+
+    EXPECT_EQ(1, count);
+
+    android_logger_list_close(logger_list);
+}
+
 TEST(liblog, __android_log_btwrite__android_logger_list_read) {
     struct logger_list *logger_list;
 
@@ -1232,6 +1274,89 @@ TEST(liblog, filterRule) {
     android_log_format_free(p_format);
 }
 
+TEST(liblog, formatLogLineInto) {
+    AndroidLogFormat *p_format = android_log_format_new();
+    android_log_setPrintFormat(p_format, FORMAT_THREAD);
+    android_log_setPrintFormat(p_format, FORMAT_MODIFIER_PRINTABLE);
+
+    static const char message[] = "one\ttwo\\three\nfour\x01";
+    AndroidLogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.priority = ANDROID_LOG_WARN;
+    entry.pid = 123;
+    entry.tid = 4567;
+    entry.tag = "tag";
+    entry.message = message;
+    entry.messageLen = strlen(message);
+
+    static const char expected[] =
+        "W(  123: 4567) one\ttwo\\\\three\n"
+        "W(  123: 4567) four\\1\n";
+    char buffer[sizeof(expected)];
+
+    // Too small, nothing but the length needed
+    EXPECT_EQ(strlen(expected), android_log_formatLogLineInto(p_format,
+        buffer, sizeof(buffer) - 1, &entry));
+    EXPECT_EQ(strlen(expected), android_log_formatLogLineInto(p_format,
+        NULL, 0, &entry));
+
+    EXPECT_EQ(strlen(expected), android_log_formatLogLineInto(p_format,
+        buffer, sizeof(buffer), &entry));
+    EXPECT_STREQ(expected, buffer);
+
+    // Same as the allocating variant
+    char defaultBuffer[8];
+    size_t len = 0;
+    char *line = android_log_formatLogLine(p_format, defaultBuffer,
+        sizeof(defaultBuffer), &entry, &len);
+    ASSERT_TRUE(NULL != line);
+    EXPECT_NE(defaultBuffer, line);
+    EXPECT_EQ(strlen(expected), len);
+    EXPECT_STREQ(expected, line);
+    free(line);
+
+    android_log_format_free(p_format);
+}
+
+TEST(liblog, formatLogLineInto_timezone) {
+    const char *tz = getenv("TZ");
+    std::string hold(tz ? tz : "");
+
+    AndroidLogFormat *p_format = android_log_format_new();
+    android_log_setPrintFormat(p_format, FORMAT_TIME);
+
+    static const char message[] = "noon";
+    AndroidLogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.tv_sec = 12 * 60 * 60;
+    entry.priority = ANDROID_LOG_INFO;
+    entry.tag = "tag";
+    entry.message = message;
+    entry.messageLen = strlen(message);
+
+    // The cached time stamp must follow a change of timezone
+    char buffer[128];
+    setenv("TZ", "UTC0", true);
+    tzset();
+    EXPECT_LT(18U, android_log_formatLogLineInto(p_format,
+        buffer, sizeof(buffer), &entry));
+    EXPECT_EQ(0, strncmp("01-01 12:00:00.000", buffer, 18)) << buffer;
+    setenv("TZ", "JST-9", true);
+    tzset();
+    EXPECT_LT(18U, android_log_formatLogLineInto(p_format,
+        buffer, sizeof(buffer), &entry));
+    EXPECT_EQ(0, strncmp("01-01 21:00:00.000", buffer, 18)) << buffer;
+
+    if (tz) {
+        setenv("TZ", hold.c_str(), true);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+
+    android_log_format_free(p_format);
+}
+
 TEST(liblog, is_loggable) {
     static const char tag[] = "is_loggable";
     static const char log_namespace[] = "persist.log.tag.";
@@ -2517,3 +2642,154 @@ TEST(liblog, __android_log_pmsg_file_read) {
     EXPECT_LT(0, ret);
     EXPECT_EQ(1U, signaled);
 }
+
+static const char __event_tag_map[] = "/data/local/tmp/liblog-event-log-tags";
+static const char __event_tag_index[] =
+        "/data/local/tmp/liblog-event-log-tags.idx";
+
+static const char __event_tags[] =
+        "# comment\n"
+        "42 answer (to life the universe etc|3)\n"
+        "314 pi\n"
+        "1 one\n"
+        "\n"
+        "2718 e (value|2|5)\n";
+
+static bool write_file(const char *name, const char *buf, size_t len) {
+    FILE *fp = fopen(name, "we");
+    if (!fp) {
+        return false;
+    }
+    bool ret = fwrite(buf, 1, len, fp) == len;
+    return !fclose(fp) && ret;
+}
+
+// Compare every tag of interest, and some that are not there
+static void expect_lookups(EventTagMap *map) {
+    ASSERT_TRUE(NULL != map);
+    static const struct {
+        int tag;
+        const char *name;
+    } tags[] = {
+        { 0, NULL }, { 1, "one" }, { 2, NULL }, { 42, "answer" },
+        { 314, "pi" }, { 2718, "e" }, { 2719, NULL }, { -1, NULL },
+    };
+    for (size_t i = 0; i < (sizeof(tags) / sizeof(tags[0])); ++i) {
+        const char *name = android_lookupEventTag(map, tags[i].tag);
+        if (!tags[i].name) {
+            EXPECT_TRUE(NULL == name) << "tag " << tags[i].tag;
+        } else {
+            ASSERT_TRUE(NULL != name) << "tag " << tags[i].tag;
+            EXPECT_STREQ(tags[i].name, name);
+        }
+    }
+}
+
+static void write_event_tag_index() {
+    ASSERT_TRUE(write_file(__event_tag_map, __event_tags,
+                           sizeof(__event_tags) - 1));
+    unlink(__event_tag_index);
+    EventTagMap *map = android_openEventTagMap(__event_tag_map);
+    ASSERT_TRUE(NULL != map);
+    EXPECT_EQ(0, android_writeEventTagMapIndex(map, __event_tag_map,
+                                               __event_tag_index));
+    android_closeEventTagMap(map);
+}
+
+static void cleanup_event_tag_index() {
+    unlink(__event_tag_index);
+    unlink(__event_tag_map);
+}
+
+TEST(liblog, android_openEventTagMap_index) {
+    write_event_tag_index();
+
+    // The parsed map and its index must agree
+    unlink(__event_tag_index);
+    EventTagMap *map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    android_closeEventTagMap(map);
+    write_event_tag_index();
+    map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    android_closeEventTagMap(map);
+
+    // A current index is used in place of the map, rename one of the tags
+    // in the map, keep its size, and backdate it.
+    std::string tags(__event_tags);
+    tags.replace(tags.find("314 pi"), 6, "314 PI");
+    ASSERT_TRUE(write_file(__event_tag_map, tags.data(), tags.length()));
+    struct timeval times[2] = { { 1, 0 }, { 1, 0 } };
+    ASSERT_EQ(0, utimes(__event_tag_map, times));
+    map = android_openEventTagMap(__event_tag_map);
+    ASSERT_TRUE(NULL != map);
+    EXPECT_STREQ("pi", android_lookupEventTag(map, 314));
+    android_closeEventTagMap(map);
+
+    cleanup_event_tag_index();
+}
+
+TEST(liblog, android_openEventTagMap_index_fallback) {
+    write_event_tag_index();
+    struct stat st;
+    ASSERT_EQ(0, stat(__event_tag_index, &st));
+    std::string index(st.st_size, '\0');
+    FILE *fp = fopen(__event_tag_index, "re");
+    ASSERT_TRUE(NULL != fp);
+    ASSERT_EQ(index.length(), fread(&index[0], 1, index.length(), fp));
+    fclose(fp);
+
+    // truncated
+    ASSERT_TRUE(write_file(__event_tag_index, index.data(),
+                           index.length() - 1));
+    EventTagMap *map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    android_closeEventTagMap(map);
+
+    ASSERT_TRUE(write_file(__event_tag_index, index.data(), 4));
+    map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    android_closeEventTagMap(map);
+
+    // corrupt magic, and an entry count that does not fit the file
+    std::string corrupt(index);
+    corrupt[0] ^= 0xFF;
+    ASSERT_TRUE(write_file(__event_tag_index, corrupt.data(),
+                           corrupt.length()));
+    map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    android_closeEventTagMap(map);
+
+    corrupt = index;
+    corrupt[16] ^= 0x40; // numTags
+    ASSERT_TRUE(write_file(__event_tag_index, corrupt.data(),
+                           corrupt.length()));
+    map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    android_closeEventTagMap(map);
+
+    // stale, the map has since changed size
+    ASSERT_TRUE(write_file(__event_tag_index, index.data(), index.length()));
+    std::string tags(__event_tags);
+    tags += "3141 pie\n";
+    ASSERT_TRUE(write_file(__event_tag_map, tags.data(), tags.length()));
+    map = android_openEventTagMap(__event_tag_map);
+    expect_lookups(map);
+    ASSERT_TRUE(NULL != map);
+    EXPECT_STREQ("pie", android_lookupEventTag(map, 3141));
+    android_closeEventTagMap(map);
+
+    // stale, the map is newer than the index
+    write_event_tag_index();
+    tags = __event_tags;
+    tags.replace(tags.find("314 pi"), 6, "314 PI");
+    ASSERT_TRUE(write_file(__event_tag_map, tags.data(), tags.length()));
+    struct timeval times[2] = { { 1, 0 }, { 1, 0 } };
+    ASSERT_EQ(0, utimes(__event_tag_index, times));
+    map = android_openEventTagMap(__event_tag_map);
+    ASSERT_TRUE(NULL != map);
+    EXPECT_STREQ("PI", android_lookupEventTag(map, 314));
+    android_closeEventTagMap(map);
+
+    cleanup_event_tag_index();
+}
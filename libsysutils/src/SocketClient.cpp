@@ -227,6 +227,61 @@ int SocketClient::sendDataLockedv(struct iovec *iov, int iovcnt) {
     return ret;
 }
 
+int SocketClient::sendDatamv(struct mmsghdr *msgs, unsigned int vlen,
+                             int flags) {
+    pthread_mutex_lock(&mWriteMutex);
+
+    if (mSocket < 0) {
+        pthread_mutex_unlock(&mWriteMutex);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    int ret = 0;
+    int e = 0; // SLOGW and sigaction are not inert regarding errno
+    unsigned int current = 0;
+
+    struct sigaction new_action, old_action;
+    memset(&new_action, 0, sizeof(new_action));
+    new_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &new_action, &old_action);
+
+    while (current < vlen) {
+        int rc = TEMP_FAILURE_RETRY(
+            sendmmsg(mSocket, msgs + current, vlen - current, flags));
+
+        if (rc > 0) {
+            current += rc;
+            continue;
+        }
+
+        if (rc == 0) {
+            e = EIO;
+            SLOGW("0 length write :(");
+        } else if ((flags & MSG_DONTWAIT)
+                && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            e = EAGAIN;
+            break;
+        } else {
+            e = errno;
+            SLOGW("write error (%s)", strerror(e));
+        }
+        ret = -1;
+        break;
+    }
+    if (!ret) {
+        ret = current;
+    }
+
+    sigaction(SIGPIPE, &old_action, &new_action);
+    pthread_mutex_unlock(&mWriteMutex);
+
+    if (e != 0) {
+        errno = e;
+    }
+    return ret;
+}
+
 void SocketClient::incRef() {
     pthread_mutex_lock(&mRefCountMutex);
     mRefCount++;
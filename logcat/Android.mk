@@ -3,9 +3,9 @@
 LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES:= logcat.cpp event.logtags
+LOCAL_SRC_FILES:= logcat.cpp capture.cpp event.logtags
 
-LOCAL_SHARED_LIBRARIES := liblog libbase libcutils libpcrecpp
+LOCAL_SHARED_LIBRARIES := liblog libbase libcutils libpcrecpp libz
 
 LOCAL_MODULE := logcat
 
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "capture.h"
+
+static bool preadFully(int fd, void *buf, size_t len, uint64_t offset) {
+    char *cp = static_cast<char *>(buf);
+    while (len) {
+        ssize_t ret = TEMP_FAILURE_RETRY(pread(fd, cp, len, offset));
+        if (ret <= 0) {
+            return false;
+        }
+        cp += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, struct iovec *iov, int count) {
+    while (count) {
+        ssize_t ret = TEMP_FAILURE_RETRY(writev(fd, iov, count));
+        if (ret < 0) {
+            return false;
+        }
+        while (count && (static_cast<size_t>(ret) >= iov->iov_len)) {
+            ret -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+static size_t entryLength(const char *entry) {
+    const struct logger_entry *e =
+        reinterpret_cast<const struct logger_entry *>(entry);
+    return (e->__pad ? e->__pad : sizeof(struct logger_entry)) + e->len;
+}
+
+static bool before(uint32_t sec, uint32_t nsec,
+                   uint32_t thanSec, uint32_t thanNsec) {
+    return (sec < thanSec) || ((sec == thanSec) && (nsec < thanNsec));
+}
+
+// Load the index at the end of the file, if it was closed properly
+static bool readIndex(int fd, uint64_t size,
+                      std::vector<capture_index_entry> &index,
+                      uint64_t *indexOffset) {
+    capture_footer footer;
+    capture_index_header header;
+
+    if ((size < (sizeof(capture_file_header) + sizeof(header) + sizeof(footer)))
+            || !preadFully(fd, &footer, sizeof(footer), size - sizeof(footer))
+            || (footer.magic != CAPTURE_FOOTER_MAGIC)
+            || (footer.index_offset > (size - sizeof(header) - sizeof(footer)))
+            || !preadFully(fd, &header, sizeof(header), footer.index_offset)
+            || (header.magic != CAPTURE_INDEX_MAGIC)
+            || ((footer.index_offset + sizeof(header)
+                    + static_cast<uint64_t>(header.count) * sizeof(index[0])
+                    + sizeof(footer)) != size)) {
+        return false;
+    }
+    index.resize(header.count);
+    if (header.count && !preadFully(fd, &index[0],
+                                    header.count * sizeof(index[0]),
+                                    footer.index_offset + sizeof(header))) {
+        index.clear();
+        return false;
+    }
+    *indexOffset = footer.index_offset;
+    return true;
+}
+
+// Index the file by walking its block headers, up to the first that is
+// not whole. Returns where that is.
+static uint64_t scanBlocks(int fd, uint64_t size,
+                           std::vector<capture_index_entry> &index) {
+    uint64_t offset = sizeof(capture_file_header);
+    capture_block_header header;
+
+    index.clear();
+    while (((offset + sizeof(header)) <= size)
+            && preadFully(fd, &header, sizeof(header), offset)
+            && (header.magic == CAPTURE_BLOCK_MAGIC)
+            && ((offset + sizeof(header) + header.size) <= size)) {
+        capture_index_entry entry;
+        entry.offset = offset;
+        entry.count = header.count;
+        entry.first_sec = header.first_sec;
+        entry.first_nsec = header.first_nsec;
+        entry.last_sec = header.last_sec;
+        entry.last_nsec = header.last_nsec;
+        index.push_back(entry);
+        offset += sizeof(header) + header.size;
+    }
+    return offset;
+}
+
+int CaptureWriter::open(int fd) {
+    struct stat st;
+    capture_file_header header;
+
+    mIndex.clear();
+    if (fstat(fd, &st)) {
+        return -errno;
+    }
+
+    if (!st.st_size) {
+        header.magic = CAPTURE_FILE_MAGIC;
+        header.version = CAPTURE_VERSION;
+        struct iovec iov = { &header, sizeof(header) };
+        if (!writeFully(fd, &iov, 1)) {
+            return -errno;
+        }
+        mOffset = sizeof(header);
+        return 0;
+    }
+
+    if (!preadFully(fd, &header, sizeof(header), 0)
+            || (header.magic != CAPTURE_FILE_MAGIC)
+            || (header.version != CAPTURE_VERSION)) {
+        return -EINVAL;
+    }
+
+    // Carry on from the last whole block, the index is written anew
+    if (!readIndex(fd, st.st_size, mIndex, &mOffset)) {
+        mOffset = scanBlocks(fd, st.st_size, mIndex);
+    }
+    if ((mOffset != static_cast<uint64_t>(st.st_size))
+            && ftruncate(fd, mOffset)) {
+        return -errno;
+    }
+    return 0;
+}
+
+ssize_t CaptureWriter::write(int fd, const char *entries, size_t len) {
+    capture_block_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CAPTURE_BLOCK_MAGIC;
+    header.len = len;
+    for (size_t offset = 0; (offset + sizeof(struct logger_entry)) <= len;
+            offset += entryLength(entries + offset)) {
+        const struct logger_entry *e =
+            reinterpret_cast<const struct logger_entry *>(entries + offset);
+        if (!header.count++
+                || before(e->sec, e->nsec, header.first_sec, header.first_nsec)) {
+            header.first_sec = e->sec;
+            header.first_nsec = e->nsec;
+        }
+        if (!before(e->sec, e->nsec, header.last_sec, header.last_nsec)) {
+            header.last_sec = e->sec;
+            header.last_nsec = e->nsec;
+        }
+    }
+    if (!header.count) {
+        return 0;
+    }
+
+    uLongf size = compressBound(len);
+    mDeflated.resize(size);
+    if (compress2(reinterpret_cast<Bytef *>(&mDeflated[0]), &size,
+                  reinterpret_cast<const Bytef *>(entries), len,
+                  Z_BEST_SPEED) != Z_OK) {
+        return -ENOMEM;
+    }
+    header.size = size;
+
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { &mDeflated[0], size }
+    };
+    if (!writeFully(fd, iov, 2)) {
+        return -errno;
+    }
+
+    capture_index_entry entry;
+    entry.offset = mOffset;
+    entry.count = header.count;
+    entry.first_sec = header.first_sec;
+    entry.first_nsec = header.first_nsec;
+    entry.last_sec = header.last_sec;
+    entry.last_nsec = header.last_nsec;
+    mIndex.push_back(entry);
+    mOffset += sizeof(header) + size;
+
+    return sizeof(header) + size;
+}
+
+int CaptureWriter::close(int fd) {
+    capture_index_header header = { CAPTURE_INDEX_MAGIC,
+                                    static_cast<uint32_t>(mIndex.size()) };
+    capture_footer footer = { mOffset, CAPTURE_FOOTER_MAGIC };
+    struct iovec iov[3] = {
+        { &header, sizeof(header) },
+        { mIndex.empty() ? NULL : &mIndex[0],
+          mIndex.size() * sizeof(mIndex[0]) },
+        { &footer, sizeof(footer) }
+    };
+
+    int ret = writeFully(fd, iov, 3) ? 0 : -errno;
+    mIndex.clear();
+    return ret;
+}
+
+CaptureReader::~CaptureReader() {
+    if (mFd >= 0) {
+        ::close(mFd);
+    }
+}
+
+int CaptureReader::open(const char *pathname) {
+    struct stat st;
+    capture_file_header header;
+    uint64_t indexOffset;
+
+    mFd = ::open(pathname, O_RDONLY | O_CLOEXEC);
+    if (mFd < 0) {
+        return -errno;
+    }
+    if (fstat(mFd, &st)) {
+        return -errno;
+    }
+    if (!preadFully(mFd, &header, sizeof(header), 0)
+            || (header.magic != CAPTURE_FILE_MAGIC)
+            || (header.version != CAPTURE_VERSION)) {
+        return -EINVAL;
+    }
+    if (!readIndex(mFd, st.st_size, mIndex, &indexOffset)) {
+        scanBlocks(mFd, st.st_size, mIndex);
+    }
+    return 0;
+}
+
+void CaptureReader::seek(const log_time &start) {
+    // Blocks are in the order logd sent them, which is by time
+    for (mBlock = 0; mBlock < mIndex.size(); ++mBlock) {
+        const capture_index_entry &entry = mIndex[mBlock];
+        if (!before(entry.last_sec, entry.last_nsec,
+                    start.tv_sec, start.tv_nsec)) {
+            break;
+        }
+    }
+    mEntries.clear();
+    mEntry = 0;
+    mStart = start;
+}
+
+size_t CaptureReader::tail(size_t count) {
+    size_t sum = 0;
+
+    for (mBlock = mIndex.size(); mBlock && (sum < count);) {
+        sum += mIndex[--mBlock].count;
+    }
+    mSkip = (sum > count) ? (sum - count) : 0;
+    mEntries.clear();
+    mEntry = 0;
+    mStart = log_time::EPOCH;
+    return sum - mSkip;
+}
+
+bool CaptureReader::last(log_time &time) const {
+    if (mIndex.empty()) {
+        return false;
+    }
+    time = log_time(mIndex.back().last_sec, mIndex.back().last_nsec);
+    return true;
+}
+
+// Inflate the next block, false at the end
+bool CaptureReader::next() {
+    while (mBlock < mIndex.size()) {
+        const capture_index_entry &entry = mIndex[mBlock++];
+        capture_block_header header;
+
+        // Pass over any that do not add up, rather than give up on the rest
+        if (!preadFully(mFd, &header, sizeof(header), entry.offset)
+                || (header.magic != CAPTURE_BLOCK_MAGIC)
+                || (header.len > (64 * 1024 * 1024))) {
+            continue;
+        }
+        mDeflated.resize(header.size);
+        mEntries.resize(header.len);
+        uLongf len = header.len;
+        if (!preadFully(mFd, &mDeflated[0], header.size,
+                        entry.offset + sizeof(header))
+                || (uncompress(reinterpret_cast<Bytef *>(&mEntries[0]), &len,
+                               reinterpret_cast<const Bytef *>(&mDeflated[0]),
+                               header.size) != Z_OK)
+                || (len != header.len)) {
+            continue;
+        }
+        mEntry = 0;
+        return true;
+    }
+    mEntries.clear();
+    mEntry = 0;
+    return false;
+}
+
+int CaptureReader::read(struct log_msg *log_msg) {
+    for (;;) {
+        if (((mEntry + sizeof(struct logger_entry)) > mEntries.size())
+                && !next()) {
+            return 0;
+        }
+        if ((mEntry + sizeof(struct logger_entry)) > mEntries.size()) {
+            continue;
+        }
+
+        const char *cp = &mEntries[mEntry];
+        size_t len = entryLength(cp);
+        if ((len > LOGGER_ENTRY_MAX_LEN)
+                || ((mEntry + len) > mEntries.size())) {
+            mEntry = mEntries.size();
+            continue;
+        }
+        mEntry += len;
+
+        if (mSkip) {
+            --mSkip;
+            continue;
+        }
+        const struct logger_entry *e =
+            reinterpret_cast<const struct logger_entry *>(cp);
+        if (before(e->sec, e->nsec, mStart.tv_sec, mStart.tv_nsec)) {
+            continue;
+        }
+
+        memcpy(log_msg->buf, cp, len);
+        return len;
+    }
+}
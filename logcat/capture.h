@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGCAT_CAPTURE_H__
+#define _LOGCAT_CAPTURE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include <log/log_read.h>
+#include <log/logger.h>
+
+/*
+ * Capture file, logcat --capture -f <file>, read back with --replay=<file>.
+ *
+ * The entries are kept as logd sent them, so any -v format, filter or
+ * buffer selection can be applied after the fact. The file is a
+ * capture_file_header followed by blocks, each a capture_block_header then
+ * the deflated entries. Block headers are not compressed and carry the
+ * time range of their entries, so a reader can find a time by skipping
+ * from header to header without inflating anything. A file closed by
+ * logcat also ends in an index of the blocks, then a capture_footer, so
+ * that even the block headers need not be read. A file left without one,
+ * logcat having been killed, is indexed by walking the block headers.
+ * Appending to a file takes its index back off, to be written anew.
+ */
+#define CAPTURE_FILE_MAGIC   0x5041434c /* "LCAP" */
+#define CAPTURE_BLOCK_MAGIC  0x6b42434c /* "LCBk" */
+#define CAPTURE_INDEX_MAGIC  0x7849434c /* "LCIx" */
+#define CAPTURE_FOOTER_MAGIC 0x6e45434c /* "LCEn" */
+#define CAPTURE_VERSION      1
+
+struct capture_file_header {
+    uint32_t magic;
+    uint32_t version;
+} __attribute__((__packed__));
+
+struct capture_block_header {
+    uint32_t magic;
+    uint32_t size;          // of the deflated entries that follow
+    uint32_t len;           // of the entries once inflated
+    uint32_t count;         // of entries
+    uint32_t first_sec;     // earliest entry
+    uint32_t first_nsec;
+    uint32_t last_sec;      // latest entry
+    uint32_t last_nsec;
+} __attribute__((__packed__));
+
+struct capture_index_entry {
+    uint64_t offset;        // of the capture_block_header
+    uint32_t count;
+    uint32_t first_sec;
+    uint32_t first_nsec;
+    uint32_t last_sec;
+    uint32_t last_nsec;
+} __attribute__((__packed__));
+
+// The index is a magic and count, then count capture_index_entry
+struct capture_index_header {
+    uint32_t magic;
+    uint32_t count;
+} __attribute__((__packed__));
+
+struct capture_footer {
+    uint64_t index_offset;
+    uint32_t magic;
+} __attribute__((__packed__));
+
+class CaptureWriter {
+    std::vector<capture_index_entry> mIndex;
+    std::vector<char> mDeflated;
+    uint64_t mOffset;
+
+public:
+    CaptureWriter() : mOffset(0) { }
+
+    // Ready fd, opened for append, for more blocks. Returns 0 or -errno.
+    int open(int fd);
+    // Write entries, as read from logd, out as one block. Returns the
+    // bytes written or -errno.
+    ssize_t write(int fd, const char *entries, size_t len);
+    // Write the index, fd is not closed. Returns 0 or -errno.
+    int close(int fd);
+};
+
+class CaptureReader {
+    std::vector<capture_index_entry> mIndex;
+    std::vector<char> mDeflated;
+    std::vector<char> mEntries;
+    int mFd;
+    size_t mBlock;          // next in mIndex
+    size_t mEntry;          // offset of the next in mEntries
+    size_t mSkip;           // entries to pass over in the next block
+    log_time mStart;        // entries before are passed over
+
+    bool next();
+
+public:
+    CaptureReader() :
+            mFd(-1),
+            mBlock(0),
+            mEntry(0),
+            mSkip(0),
+            mStart(log_time::EPOCH) {
+    }
+    ~CaptureReader();
+
+    // Returns 0 or -errno
+    int open(const char *pathname);
+    // Start at the first entry at or after start, without reading the
+    // blocks that come before it.
+    void seek(const log_time &start);
+    // Start at the last count entries, returns how many there are of them
+    size_t tail(size_t count);
+    // Time of the latest entry, false if there are none
+    bool last(log_time &time) const;
+    // Returns the length of the entry, or 0 at the end
+    int read(struct log_msg *log_msg);
+};
+
+#endif // _LOGCAT_CAPTURE_H__
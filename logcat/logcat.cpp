@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -22,6 +23,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -39,6 +41,9 @@
 #include <utils/threads.h>
 
 #include <pcrecpp.h>
+#include <zlib.h>
+
+#include "capture.h"
 
 #define DEFAULT_MAX_ROTATED_LOGS 4
 
@@ -89,13 +94,224 @@ static size_t g_printCount;
 static bool g_printItAnyways;
 static bool g_logDumpEnabled;
 static size_t g_logDumpEndPosition = 0;
+static bool g_compressRotatedLogs;
+static pthread_t g_compressThread;
+static bool g_compressing;
+static bool g_capture;
+static CaptureWriter g_captureWriter;
+static const char *g_replayFileName;
+
+/*
+ * Bounded hand off between the stages of the pipeline. The producer copies
+ * into the open block, and hands it on once it is full or once the consumer
+ * has nothing else to do, so that a quiet log is not held back waiting for
+ * a block to fill. A write of up to a block lands whole in one block.
+ */
+class PipeQueue {
+public:
+    static const size_t blockSize = 64 * 1024;
+
+    struct Block {
+        Block *next;
+        size_t len;
+        char data[blockSize] __attribute__((aligned(8)));
+    };
+
+private:
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    Block *mFree;
+    Block *mReady;      // first of the blocks to consume
+    Block **mReadyTail;
+    Block *mOpen;       // being filled by the producer
+    bool mWaiting;      // consumer wants whatever there is
+    bool mClosed;
+
+public:
+    explicit PipeQueue(size_t blocks) :
+            mFree(NULL),
+            mReady(NULL),
+            mReadyTail(&mReady),
+            mOpen(NULL),
+            mWaiting(false),
+            mClosed(false) {
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mCond, NULL);
+        for (size_t i = 0; i < blocks; ++i) {
+            Block *block = new Block;
+            block->next = mFree;
+            mFree = block;
+        }
+    }
+
+    // Blocks while every block is in flight. Only a write of more than
+    // blockSize is split across blocks.
+    void write(const void *buf, size_t len) {
+        while (len > blockSize) {
+            write(buf, blockSize);
+            buf = static_cast<const char *>(buf) + blockSize;
+            len -= blockSize;
+        }
+        pthread_mutex_lock(&mLock);
+        if (mOpen && ((mOpen->len + len) > blockSize)) {
+            ready();
+        }
+        while (!mOpen) {
+            if (mFree) {
+                mOpen = mFree;
+                mFree = mFree->next;
+                mOpen->len = 0;
+                break;
+            }
+            pthread_cond_wait(&mCond, &mLock);
+        }
+        memcpy(mOpen->data + mOpen->len, buf, len);
+        mOpen->len += len;
+        if (mWaiting) {
+            pthread_cond_broadcast(&mCond);
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    // Returns NULL once closed and drained, or if given a timeout, once
+    // that passes with nothing to read. A block goes back by release().
+    Block *read(const struct timespec *timeout = NULL) {
+        struct timespec deadline;
+        if (timeout) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout->tv_sec;
+            deadline.tv_nsec += timeout->tv_nsec;
+            if (deadline.tv_nsec >= (long)NS_PER_SEC) {
+                deadline.tv_nsec -= NS_PER_SEC;
+                ++deadline.tv_sec;
+            }
+        }
+        pthread_mutex_lock(&mLock);
+        while (!mReady && !(mOpen && mOpen->len) && !mClosed) {
+            mWaiting = true;
+            if (!timeout) {
+                pthread_cond_wait(&mCond, &mLock);
+            } else if (pthread_cond_timedwait(&mCond, &mLock, &deadline)
+                           == ETIMEDOUT) {
+                break;
+            }
+        }
+        mWaiting = false;
+        if (!mReady && mOpen && mOpen->len) {
+            ready();
+        }
+        Block *block = mReady;
+        if (block) {
+            mReady = block->next;
+            if (!mReady) {
+                mReadyTail = &mReady;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+        return block;
+    }
+
+    void release(Block *block) {
+        pthread_mutex_lock(&mLock);
+        block->next = mFree;
+        mFree = block;
+        pthread_cond_broadcast(&mCond);
+        pthread_mutex_unlock(&mLock);
+    }
+
+    // No more writes, read() drains what is left then returns NULL
+    void close() {
+        pthread_mutex_lock(&mLock);
+        mClosed = true;
+        pthread_cond_broadcast(&mCond);
+        pthread_mutex_unlock(&mLock);
+    }
+
+    bool closed() {
+        pthread_mutex_lock(&mLock);
+        bool ret = mClosed;
+        pthread_mutex_unlock(&mLock);
+        return ret;
+    }
+
+private:
+    // mLock assumed
+    void ready() {
+        mOpen->next = NULL;
+        *mReadyTail = mOpen;
+        mReadyTail = &mOpen->next;
+        mOpen = NULL;
+    }
+};
+
+// Entries as read, and the output as formatted, with --pipeline
+static PipeQueue *g_readQueue;
+static PipeQueue *g_outputQueue;
+static std::atomic<bool> g_pipelineDone;
+// The thread in android_logger_list_read(), interrupted once we are done
+static pthread_t g_readThread;
 
 // if showHelp is set, newline required in fmt statement to transition to usage
 __noreturn static void logcat_panic(bool showHelp, const char *fmt, ...) __printflike(2,3);
 
 static int openLogFile (const char *pathname)
 {
-    return open(pathname, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+    // a capture file is read back to carry on where it left off
+    return open(pathname, (g_capture ? O_RDWR : O_WRONLY) | O_APPEND | O_CREAT,
+                S_IRUSR | S_IWUSR);
+}
+
+// Compress pathname to pathname.gz, then remove it
+static void *compressLog(void *obj)
+{
+    char *pathname = static_cast<char *>(obj);
+    char *gzname = NULL, *tmpname = NULL;
+    bool ok = false;
+
+    asprintf(&gzname, "%s.gz", pathname);
+    asprintf(&tmpname, "%s.gz.tmp", pathname);
+    int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    gzFile gz = (gzname && tmpname && (fd >= 0)) ? gzopen(tmpname, "wb1") : NULL;
+    if (gz) {
+        static char buf[PipeQueue::blockSize];
+        ssize_t len;
+
+        ok = true;
+        while ((len = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+            if (gzwrite(gz, buf, len) != len) {
+                ok = false;
+                break;
+            }
+        }
+        ok = (gzclose(gz) == Z_OK) && ok && !len;
+        if (ok && rename(tmpname, gzname)) {
+            ok = false;
+        }
+        if (ok) {
+            unlink(pathname);
+        } else {
+            unlink(tmpname);
+        }
+    }
+    if (!ok) {
+        // left uncompressed, to be overwritten by the next rotation
+        fprintf(stderr, "failed to compress %s\n", pathname);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(tmpname);
+    free(gzname);
+    free(pathname);
+    return NULL;
+}
+
+static void waitForCompression()
+{
+    if (g_compressing) {
+        pthread_join(g_compressThread, NULL);
+        g_compressing = false;
+    }
 }
 
 static void rotateLogs()
@@ -107,22 +323,32 @@ static void rotateLogs()
         return;
     }
 
+    if (g_capture) {
+        g_captureWriter.close(g_outFD);
+    }
     close(g_outFD);
 
+    // One at a time, the last has to be done before its file moves on
+    waitForCompression();
+
     // Compute the maximum number of digits needed to count up to g_maxRotatedLogs in decimal.
     // eg: g_maxRotatedLogs == 30 -> log10(30) == 1.477 -> maxRotationCountDigits == 2
     int maxRotationCountDigits =
             (g_maxRotatedLogs > 0) ? (int) (floor(log10(g_maxRotatedLogs) + 1)) : 0;
+    const char *suffix = g_compressRotatedLogs ? ".gz" : "";
 
     for (int i = g_maxRotatedLogs ; i > 0 ; i--) {
         char *file0, *file1;
 
-        asprintf(&file1, "%s.%.*d", g_outputFileName, maxRotationCountDigits, i);
+        // the newest is compressed once it has been moved out of the way
+        asprintf(&file1, "%s.%.*d%s", g_outputFileName, maxRotationCountDigits,
+                 i, (i - 1 == 0) ? "" : suffix);
 
         if (i - 1 == 0) {
             asprintf(&file0, "%s", g_outputFileName);
         } else {
-            asprintf(&file0, "%s.%.*d", g_outputFileName, maxRotationCountDigits, i - 1);
+            asprintf(&file0, "%s.%.*d%s", g_outputFileName,
+                     maxRotationCountDigits, i - 1, suffix);
         }
 
         if (!file0 || !file1) {
@@ -145,16 +371,38 @@ static void rotateLogs()
     if (g_outFD < 0) {
         logcat_panic(false, "couldn't open output file");
     }
+    if (g_capture && g_captureWriter.open(g_outFD)) {
+        logcat_panic(false, "couldn't start capture file");
+    }
 
     g_outByteCount = 0;
 
+    if (g_compressRotatedLogs && (g_maxRotatedLogs > 0)) {
+        char *file;
+        asprintf(&file, "%s.%.*d", g_outputFileName, maxRotationCountDigits, 1);
+        if (file && !pthread_create(&g_compressThread, NULL, compressLog, file)) {
+            g_compressing = true;
+        } else {
+            free(file);
+        }
+    }
+}
+
+// Output, through the writer thread with --pipeline
+static ssize_t writeOutput(const void *buf, size_t len)
+{
+    if (g_outputQueue) {
+        g_outputQueue->write(buf, len);
+        return len;
+    }
+    return TEMP_FAILURE_RETRY(write(g_outFD, buf, len));
 }
 
 void printBinary(struct log_msg *buf)
 {
     size_t size = buf->len();
 
-    TEMP_FAILURE_RETRY(write(g_outFD, buf, size));
+    writeOutput(buf, size);
 }
 
 static void checkAndRotateLogDump(size_t logLength)
@@ -240,6 +488,26 @@ static void processBuffer(log_device_t* dev, struct log_msg *buf)
         bool match = regexOk(entry);
 
         g_printCount += match;
+        if ((match || g_printItAnyways) && g_outputQueue) {
+            // Rotation is up to the writer thread
+            static char buffer[PipeQueue::blockSize];
+            size_t len = android_log_formatLogLineInto(g_logformat, buffer,
+                                                       sizeof(buffer), &entry);
+            if (len < sizeof(buffer)) {
+                g_outputQueue->write(buffer, len);
+            } else {
+                char *outBuffer = android_log_formatLogLine(g_logformat,
+                        buffer, sizeof(buffer), &entry, &len);
+                if (!outBuffer) {
+                    logcat_panic(false, "output error");
+                }
+                g_outputQueue->write(outBuffer, len);
+                if (outBuffer != buffer) {
+                    free(outBuffer);
+                }
+            }
+            return;
+        }
         if (match || g_printItAnyways) {
             bytesWritten = android_log_printLogLine(g_logformat, g_outFD, &entry);
 
@@ -277,7 +545,7 @@ static void maybePrintStart(log_device_t* dev, bool printDividers) {
                 }
                 g_outByteCountOfLogDump += bytesWrittenToLogDump;
             }
-            if (write(g_outFD, buf, strlen(buf)) < 0) {
+            if (writeOutput(buf, strlen(buf)) < 0) {
                 logcat_panic(false, "output error");
             }
         }
@@ -285,6 +553,189 @@ static void maybePrintStart(log_device_t* dev, bool printDividers) {
     }
 }
 
+// Find the buffer the entry came from, and output it
+static void outputEntry(log_device_t* devices, log_device_t*& dev,
+                        bool printDividers, struct log_msg *log_msg)
+{
+    static log_device_t unexpected("unexpected", false);
+    log_device_t* d;
+
+    for (d = devices; d; d = d->next) {
+        if (android_name_to_log_id(d->device) == log_msg->id()) {
+            break;
+        }
+    }
+    if (!d) {
+        g_devCount = 2; // set to Multiple
+        d = &unexpected;
+        d->binary = log_msg->id() == LOG_ID_EVENTS;
+    }
+
+    if (dev != d) {
+        dev = d;
+        maybePrintStart(dev, printDividers);
+    }
+    if (g_printBinary) {
+        printBinary(log_msg);
+    } else {
+        processBuffer(dev, log_msg);
+    }
+}
+
+// Entries are padded in the read queue to keep them aligned
+static size_t pipeEntryLength(struct log_msg *log_msg)
+{
+    return (log_msg->len() + 7) & ~7;
+}
+
+struct FormatterArgs {
+    log_device_t* devices;
+    bool printDividers;
+};
+
+// Only there to interrupt a blocking read, installed without SA_RESTART
+static void wakeReader(int)
+{
+}
+
+// Pipeline stage, entries from the read queue to the output queue
+static void *formatLogs(void *obj)
+{
+    FormatterArgs *args = static_cast<FormatterArgs *>(obj);
+    log_device_t* dev = NULL;
+    PipeQueue::Block *block;
+    // the wake up may land before the reader blocks, so repeat it
+    static const struct timespec wakeInterval = { 0, 100 * 1000 * 1000 };
+
+    for (;;) {
+        block = g_readQueue->read(g_pipelineDone ? &wakeInterval : NULL);
+        if (!block) {
+            if (g_readQueue->closed()) {
+                break;
+            }
+            pthread_kill(g_readThread, SIGURG);
+            continue;
+        }
+        for (size_t offset = 0; offset < block->len;) {
+            struct log_msg *log_msg =
+                reinterpret_cast<struct log_msg *>(block->data + offset);
+            offset += pipeEntryLength(log_msg);
+            // drain whatever was read past the end
+            if (g_pipelineDone) {
+                continue;
+            }
+            outputEntry(args->devices, dev, args->printDividers, log_msg);
+            if (g_maxCount && (g_printCount >= g_maxCount)) {
+                g_pipelineDone = true;
+                pthread_kill(g_readThread, SIGURG);
+            }
+        }
+        g_readQueue->release(block);
+    }
+    g_outputQueue->close();
+    return NULL;
+}
+
+// Pipeline stage, the output queue to the file, rotating as it goes
+static void *writeLogs(void *)
+{
+    PipeQueue::Block *block;
+
+    while ((block = g_outputQueue->read())) {
+        if (g_capture) {
+            ssize_t ret = g_captureWriter.write(g_outFD, block->data,
+                                                block->len);
+            if (ret < 0) {
+                logcat_panic(false, "output error");
+            }
+            g_outByteCount += ret;
+            g_outputQueue->release(block);
+        } else {
+            const char *cp = block->data;
+            size_t len = block->len;
+            while (len) {
+                ssize_t ret = TEMP_FAILURE_RETRY(write(g_outFD, cp, len));
+                if (ret < 0) {
+                    logcat_panic(false, "output error");
+                }
+                cp += ret;
+                len -= ret;
+            }
+            g_outByteCount += block->len;
+            g_outputQueue->release(block);
+        }
+
+        if (g_logRotateSizeKBytes > 0
+            && (g_outByteCount / 1024) >= g_logRotateSizeKBytes
+        ) {
+            rotateLogs();
+        }
+    }
+    return NULL;
+}
+
+// Whether an entry of a capture file is one of those asked for
+static bool captureWanted(log_device_t* devices, size_t pid,
+                          struct log_msg *log_msg)
+{
+    if (pid && (log_msg->entry.pid != static_cast<int32_t>(pid))) {
+        return false;
+    }
+    for (log_device_t* d = devices; d; d = d->next) {
+        if (android_name_to_log_id(d->device) == log_msg->id()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Output the entries of a capture file as if they had come from logd
+static int replayCapture(log_device_t* devices, bool printDividers,
+                         size_t tail_lines, const log_time &tail_time,
+                         size_t pid)
+{
+    CaptureReader reader;
+    struct log_msg log_msg;
+    size_t skip = 0;
+
+    int ret = reader.open(g_replayFileName);
+    if (ret) {
+        logcat_panic(false, "couldn't read capture file %s: %s\n",
+                     g_replayFileName, strerror(-ret));
+    }
+    if (tail_time != log_time::EPOCH) {
+        reader.seek(tail_time);
+    } else if (tail_lines) {
+        // Go back far enough to find tail_lines of the entries asked for
+        for (size_t count = tail_lines;; count *= 2) {
+            size_t available = reader.tail(count);
+            size_t wanted = 0;
+            while (reader.read(&log_msg) > 0) {
+                wanted += captureWanted(devices, pid, &log_msg);
+            }
+            if ((wanted >= tail_lines) || (available < count)) {
+                reader.tail(count);
+                skip = (wanted > tail_lines) ? (wanted - tail_lines) : 0;
+                break;
+            }
+        }
+    }
+
+    log_device_t* dev = NULL;
+    while ((!g_maxCount || (g_printCount < g_maxCount))
+            && (reader.read(&log_msg) > 0)) {
+        if (!captureWanted(devices, pid, &log_msg)) {
+            continue;
+        }
+        if (skip) {
+            --skip;
+            continue;
+        }
+        outputEntry(devices, dev, printDividers, &log_msg);
+    }
+    return EXIT_SUCCESS;
+}
+
 static void setupOutput()
 {
     if (g_logDumpEnabled) {
@@ -334,6 +785,10 @@ static void setupOutput()
         if (g_outFD < 0) {
             logcat_panic(false, "couldn't open output file");
         }
+        if (g_capture && g_captureWriter.open(g_outFD)) {
+            close(g_outFD);
+            logcat_panic(false, "output file is not a capture file\n");
+        }
 
         struct stat statbuf;
         if (fstat(g_outFD, &statbuf) == -1) {
@@ -361,6 +816,14 @@ static void show_help(const char *cmd)
                     "                  Rotate log every kbytes. Requires -f option\n"
                     "  -n <count>, --rotate-count=<count>\n"
                     "                  Sets max number of rotated logs to <count>, default 4\n"
+                    "  --gzip          Compress rotated logs in the background. Requires -r\n"
+                    "  --pipeline[=<kbytes>]\n"
+                    "                  Read, format and write the log on separate threads,\n"
+                    "                  holding at most <kbytes> between each, default 1024\n"
+                    "  --capture       Log to file in the capture format: entries as read,\n"
+                    "                  compressed and indexed by time. Requires -f\n"
+                    "  --replay=<file> Print a capture file instead of the log, with any\n"
+                    "                  format and filters, -t and -T seek by its index\n"
                     "  -v <format>, --format=<format>\n"
                     "                  Sets the log print format, where <format> is:\n"
                     "                    brief color epoch long monotonic printable process raw\n"
@@ -635,6 +1098,8 @@ int main(int argc, char **argv)
     log_time tail_time(log_time::EPOCH);
     size_t pid = 0;
     bool got_t = false;
+    size_t pipelineKBytes = 0;
+    bool resumeOutput = false;
 
     signal(SIGPIPE, exit);
 
@@ -653,15 +1118,21 @@ int main(int argc, char **argv)
         static const char pid_str[] = "pid";
         static const char wrap_str[] = "wrap";
         static const char print_str[] = "print";
+        static const char pipeline_str[] = "pipeline";
+        static const char gzip_str[] = "gzip";
+        static const char capture_str[] = "capture";
+        static const char replay_str[] = "replay";
         static const struct option long_options[] = {
           { "binary",        no_argument,       NULL,   'B' },
           { "buffer",        required_argument, NULL,   'b' },
           { "buffer-size",   optional_argument, NULL,   'g' },
+          { capture_str,     no_argument,       NULL,   0 },
           { "clear",         no_argument,       NULL,   'c' },
           { "color",         no_argument,       NULL,   'C' },
           { "dividers",      no_argument,       NULL,   'D' },
           { "file",          required_argument, NULL,   'f' },
           { "format",        required_argument, NULL,   'v' },
+          { gzip_str,        no_argument,       NULL,   0 },
           // hidden and undocumented reserved alias for --regex
           { "grep",          required_argument, NULL,   'e' },
           // hidden and undocumented reserved alias for --max-count
@@ -669,9 +1140,11 @@ int main(int argc, char **argv)
           { "last",          no_argument,       NULL,   'L' },
           { "max-count",     required_argument, NULL,   'm' },
           { pid_str,         required_argument, NULL,   0 },
+          { pipeline_str,    optional_argument, NULL,   0 },
           { print_str,       no_argument,       NULL,   0 },
           { "prune",         optional_argument, NULL,   'p' },
           { "regex",         required_argument, NULL,   'e' },
+          { replay_str,      required_argument, NULL,   0 },
           { "rotate-count",  required_argument, NULL,   'n' },
           { "rotate-kbytes", required_argument, NULL,   'r' },
           { "statistics",    no_argument,       NULL,   'S' },
@@ -722,6 +1195,26 @@ int main(int argc, char **argv)
                     g_printItAnyways = true;
                     break;
                 }
+                if (long_options[option_index].name == pipeline_str) {
+                    pipelineKBytes = 1024;
+                    if (optarg && !getSizeTArg(optarg, &pipelineKBytes, 1)) {
+                        logcat_panic(true, "%s %s out of range\n",
+                                     long_options[option_index].name, optarg);
+                    }
+                    break;
+                }
+                if (long_options[option_index].name == gzip_str) {
+                    g_compressRotatedLogs = true;
+                    break;
+                }
+                if (long_options[option_index].name == capture_str) {
+                    g_capture = true;
+                    break;
+                }
+                if (long_options[option_index].name == replay_str) {
+                    g_replayFileName = optarg;
+                    break;
+                }
             break;
 
             case 's':
@@ -913,6 +1406,7 @@ int main(int argc, char **argv)
             case 'f':
                 if ((tail_time == log_time::EPOCH) && (tail_lines == 0)) {
                     tail_time = lastLogTime(optarg);
+                    resumeOutput = true;
                 }
                 // redirect output to a file
                 g_outputFileName = optarg;
@@ -1054,6 +1548,35 @@ int main(int argc, char **argv)
     if (g_logRotateSizeKBytes != 0 && g_outputFileName == NULL) {
         logcat_panic(true, "-r requires -f as well\n");
     }
+    if (g_compressRotatedLogs && g_logRotateSizeKBytes == 0) {
+        logcat_panic(true, "--gzip requires -r as well\n");
+    }
+    if (g_capture) {
+        if (g_outputFileName == NULL) {
+            logcat_panic(true, "--capture requires -f as well\n");
+        }
+        if (g_compressRotatedLogs) {
+            logcat_panic(true, "--capture is compressed already, "
+                               "it does not take --gzip\n");
+        }
+        if (g_replayFileName) {
+            logcat_panic(true, "--capture can not be used with --replay\n");
+        }
+        // Carry on from where the capture file left off
+        if (resumeOutput) {
+            CaptureReader reader;
+            log_time last(log_time::EPOCH);
+            if (!reader.open(g_outputFileName) && reader.last(last)) {
+                tail_time = last;
+                tail_time += log_time(0, 1);
+            }
+        }
+        // Entries are written as read, a block at a time by the writer
+        g_printBinary = 1;
+        if (!pipelineKBytes) {
+            pipelineKBytes = 1024;
+        }
+    }
 
     setupOutput();
 
@@ -1099,6 +1622,11 @@ int main(int argc, char **argv)
         }
     }
 
+    if (g_replayFileName) {
+        return replayCapture(devices, printDividers, tail_lines, tail_time,
+                             pid);
+    }
+
     dev = devices;
     if (tail_time != log_time::EPOCH) {
         logger_list = android_logger_list_alloc_time(mode, tail_time, pid);
@@ -1149,6 +1677,20 @@ int main(int argc, char **argv)
                     }
 
                     free(file);
+
+                    // and any compressed with --gzip
+                    if (i == 0) {
+                        continue;
+                    }
+                    asprintf(&file, "%s.%.*d.gz", g_outputFileName, maxRotationCountDigits, i);
+                    if (file) {
+                        err = unlink(file);
+                        if (err < 0 && errno != ENOENT && clearFail == NULL) {
+                            perror("while clearing log files");
+                            clearFail = dev->device;
+                        }
+                        free(file);
+                    }
                 }
             } else if (android_logger_clear(dev->logger)) {
                 clearFail = clearFail ?: dev->device;
@@ -1280,11 +1822,36 @@ int main(int argc, char **argv)
     //LOG_EVENT_STRING(0, "whassup, doc?");
 
     dev = NULL;
-    log_device_t unexpected("unexpected", false);
 
-    while (!g_maxCount || (g_printCount < g_maxCount)) {
+    // Read, format and write on threads of their own, so that a slow
+    // write or a rotation does not hold up reading.
+    pthread_t formatThread, writeThread;
+    FormatterArgs formatterArgs = { devices, printDividers };
+    if (pipelineKBytes) {
+        size_t blocks = pipelineKBytes * 1024 / PipeQueue::blockSize;
+        if (blocks < 2) {
+            blocks = 2;
+        }
+        g_readQueue = new PipeQueue(blocks);
+        g_outputQueue = new PipeQueue(blocks);
+
+        struct sigaction wake;
+        memset(&wake, 0, sizeof(wake));
+        wake.sa_handler = wakeReader;
+        sigemptyset(&wake.sa_mask);
+        sigaction(SIGURG, &wake, NULL);
+        g_readThread = pthread_self();
+
+        if (pthread_create(&writeThread, NULL, writeLogs, NULL)
+                || pthread_create(&formatThread, NULL, formatLogs,
+                                  &formatterArgs)) {
+            logcat_panic(false, "failed to start the pipeline\n");
+        }
+    }
+
+    while (g_readQueue ? !g_pipelineDone
+                       : (!g_maxCount || (g_printCount < g_maxCount))) {
         struct log_msg log_msg;
-        log_device_t* d;
         int ret = android_logger_list_read(logger_list, &log_msg);
 
         if (ret == 0) {
@@ -1296,6 +1863,14 @@ int main(int argc, char **argv)
                 break;
             }
 
+            // woken by the formatter, or some other signal
+            if (ret == -EINTR) {
+                if (g_readQueue && g_pipelineDone) {
+                    break;
+                }
+                continue;
+            }
+
             if (ret == -EIO) {
                 logcat_panic(false, "read: unexpected EOF!\n");
             }
@@ -1305,27 +1880,22 @@ int main(int argc, char **argv)
             logcat_panic(false, "logcat read failure");
         }
 
-        for (d = devices; d; d = d->next) {
-            if (android_name_to_log_id(d->device) == log_msg.id()) {
-                break;
-            }
-        }
-        if (!d) {
-            g_devCount = 2; // set to Multiple
-            d = &unexpected;
-            d->binary = log_msg.id() == LOG_ID_EVENTS;
+        if (g_readQueue) {
+            g_readQueue->write(&log_msg, pipeEntryLength(&log_msg));
+            continue;
         }
+        outputEntry(devices, dev, printDividers, &log_msg);
+    }
 
-        if (dev != d) {
-            dev = d;
-            maybePrintStart(dev, printDividers);
-        }
-        if (g_printBinary) {
-            printBinary(&log_msg);
-        } else {
-            processBuffer(dev, &log_msg);
-        }
+    if (g_readQueue) {
+        g_readQueue->close();
+        pthread_join(formatThread, NULL);
+        pthread_join(writeThread, NULL);
+    }
+    if (g_capture) {
+        g_captureWriter.close(g_outFD);
     }
+    waitForCompression();
 
     android_logger_list_free(logger_list);
 
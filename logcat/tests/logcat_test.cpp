@@ -665,6 +665,107 @@ TEST(logcat, logrotate_suffix) {
     EXPECT_FALSE(system(command));
 }
 
+TEST(logcat, logrotate_pipeline_gzip) {
+    static const char tmp_out_dir_form[] = "/data/local/tmp/logcat.logrotate.XXXXXX";
+    char tmp_out_dir[sizeof(tmp_out_dir_form)];
+    ASSERT_TRUE(NULL != mkdtemp(strcpy(tmp_out_dir, tmp_out_dir_form)));
+
+    static const char logcat_cmd[] = "logcat -b all -d -f %s/log.txt -n 10 -r 1"
+                                     " --pipeline --gzip";
+    static const char clear_cmd[] = "logcat -c -f %s/log.txt -n 10";
+    char command[sizeof(tmp_out_dir) + sizeof(logcat_cmd)];
+    snprintf(command, sizeof(command), logcat_cmd, tmp_out_dir);
+
+    int ret;
+    EXPECT_FALSE((ret = system(command)));
+    if (!ret) {
+        snprintf(command, sizeof(command), "ls %s 2>/dev/null", tmp_out_dir);
+
+        FILE *fp;
+        EXPECT_TRUE(NULL != (fp = popen(command, "r")));
+        char buffer[BIG_BUFFER];
+        int log_file_count = 0;
+        int compressed_count = 0;
+
+        while (fgets(buffer, sizeof(buffer), fp)) {
+            // Rotated files are all compressed by the time logcat exits
+            int suffix_value;
+            char c;
+            if (2 == sscanf(buffer, "log.txt.%d.g%c", &suffix_value, &c)) {
+                EXPECT_LE(suffix_value, 10);
+                EXPECT_GT(suffix_value, 0);
+                ++compressed_count;
+            } else if (strcmp(buffer, "log.txt\n")) {
+                fprintf(stderr, "ERROR: Unexpected file: %s", buffer);
+                ADD_FAILURE();
+            }
+            ++log_file_count;
+        }
+        pclose(fp);
+        EXPECT_LE(2, log_file_count);
+        EXPECT_EQ(log_file_count - 1, compressed_count);
+
+        // and cleared along with the rest
+        snprintf(command, sizeof(command), clear_cmd, tmp_out_dir);
+        EXPECT_FALSE(system(command));
+        snprintf(command, sizeof(command), "ls %s 2>/dev/null", tmp_out_dir);
+        EXPECT_TRUE(NULL != (fp = popen(command, "r")));
+        EXPECT_TRUE(NULL == fgets(buffer, sizeof(buffer), fp));
+        pclose(fp);
+    }
+    snprintf(command, sizeof(command), "rm -rf %s", tmp_out_dir);
+    EXPECT_FALSE(system(command));
+}
+
+static int count_lines(const char *command, const char *prefix) {
+    FILE *fp = popen(command, "r");
+    if (!fp) {
+        return -1;
+    }
+    char buffer[BIG_BUFFER];
+    int count = 0;
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        if (!strncmp(buffer, prefix, strlen(prefix))) {
+            ++count;
+        }
+    }
+    pclose(fp);
+    return count;
+}
+
+TEST(logcat, capture_replay) {
+    static const char tmp_out_dir_form[] = "/data/local/tmp/logcat.capture.XXXXXX";
+    char tmp_out_dir[sizeof(tmp_out_dir_form)];
+    ASSERT_TRUE(NULL != mkdtemp(strcpy(tmp_out_dir, tmp_out_dir_form)));
+
+    static const char capture_cmd[] = "logcat -b main -b system -d -f %s/capture"
+                                      " --capture";
+    static const char replay_cmd[] = "logcat -b main -b system -v threadtime"
+                                     " --replay=%s/capture%s";
+    char command[sizeof(tmp_out_dir) + sizeof(replay_cmd) + 32];
+
+    // A marker so that there is something to find
+    LOG_FAILURE_RETRY(__android_log_print(ANDROID_LOG_INFO, "logcat.capture",
+                                          "pid=%d", getpid()));
+    snprintf(command, sizeof(command), capture_cmd, tmp_out_dir);
+    EXPECT_FALSE(system(command));
+
+    snprintf(command, sizeof(command), replay_cmd, tmp_out_dir, "");
+    int count = count_lines(command, "");
+    EXPECT_LT(2, count);
+
+    snprintf(command, sizeof(command), replay_cmd, tmp_out_dir,
+             " logcat.capture:I '*:S'");
+    EXPECT_LE(1, count_lines(command, ""));
+
+    // The tail is found by the index, dividers aside
+    snprintf(command, sizeof(command), replay_cmd, tmp_out_dir, " -t 10");
+    EXPECT_EQ(10, count_lines(command, "") - count_lines(command, "---------"));
+
+    snprintf(command, sizeof(command), "rm -rf %s", tmp_out_dir);
+    EXPECT_FALSE(system(command));
+}
+
 TEST(logcat, logrotate_continue) {
     static const char tmp_out_dir_form[] = "/data/local/tmp/logcat.logrotate.XXXXXX";
     char tmp_out_dir[sizeof(tmp_out_dir_form)];
@@ -9,12 +9,19 @@ LOCAL_INIT_RC := logd.rc
 LOCAL_SRC_FILES := \
     main.cpp \
     LogCommand.cpp \
+    LogCompact.cpp \
     CommandListener.cpp \
     LogListener.cpp \
+    LogRates.cpp \
+    LogRateLimit.cpp \
     LogReader.cpp \
+    LogShm.cpp \
     FlushCommand.cpp \
     LogBuffer.cpp \
+    LogBufferCold.cpp \
     LogBufferElement.cpp \
+    LogBufferRing.cpp \
+    LogFilter.cpp \
     LogTimes.cpp \
     LogStatistics.cpp \
     LogWhiteBlackList.cpp \
@@ -28,7 +35,8 @@ LOCAL_SHARED_LIBRARIES := \
     liblog \
     libcutils \
     libbase \
-    libpackagelistparser
+    libpackagelistparser \
+    libz
 
 # This is what we want to do:
 #  event_logtags = $(shell \
@@ -37,7 +37,7 @@
 #include "LogUtils.h"
 
 CommandListener::CommandListener(LogBuffer *buf, LogReader * /*reader*/,
-                                 LogListener * /*swl*/) :
+                                 LogListener * /*swl*/, LogShm *shm) :
         FrameworkListener(getLogSocket()) {
     // registerCmd(new ShutdownCmd(buf, writer, swl));
     registerCmd(new ClearCmd(buf));
@@ -45,9 +45,15 @@ CommandListener::CommandListener(LogBuffer *buf, LogReader * /*reader*/,
     registerCmd(new SetBufSizeCmd(buf));
     registerCmd(new GetBufSizeUsedCmd(buf));
     registerCmd(new GetStatisticsCmd(buf));
+    registerCmd(new GetRatesCmd(buf));
     registerCmd(new SetPruneListCmd(buf));
     registerCmd(new GetPruneListCmd(buf));
+    registerCmd(new SetRateLimitCmd(buf));
+    registerCmd(new GetRateLimitCmd(buf));
     registerCmd(new ReinitCmd());
+    if (shm) {
+        registerCmd(new ShmCmd(shm));
+    }
 }
 
 CommandListener::ShutdownCmd::ShutdownCmd(LogReader *reader,
@@ -238,6 +244,37 @@ int CommandListener::GetStatisticsCmd::runCommand(SocketClient *cli,
     return 0;
 }
 
+CommandListener::GetRatesCmd::GetRatesCmd(LogBuffer *buf) :
+        LogCommand("getRates"),
+        mBuf(*buf) {
+}
+
+int CommandListener::GetRatesCmd::runCommand(SocketClient *cli,
+                                             int argc, char **argv) {
+    setname();
+    uid_t uid = cli->getUid();
+    if (clientHasLogCredentials(cli)) {
+        uid = AID_ROOT;
+    }
+
+    pid_t pid = 0;
+    for (int i = 1; i < argc; ++i) {
+        static const char _pid[] = "pid=";
+        if (strncmp(argv[i], _pid, sizeof(_pid) - 1)) {
+            cli->sendMsg("Argument Error");
+            return 0;
+        }
+        pid = atol(argv[i] + sizeof(_pid) - 1);
+        if (pid == 0) {
+            cli->sendMsg("PID Error");
+            return 0;
+        }
+    }
+
+    cli->sendMsg(package_string(mBuf.formatRates(uid, pid)).c_str());
+    return 0;
+}
+
 CommandListener::GetPruneListCmd::GetPruneListCmd(LogBuffer *buf) :
         LogCommand("getPruneList"),
         mBuf(*buf) {
@@ -283,6 +320,97 @@ int CommandListener::SetPruneListCmd::runCommand(SocketClient *cli,
     return 0;
 }
 
+CommandListener::GetRateLimitCmd::GetRateLimitCmd(LogBuffer *buf) :
+        LogCommand("getRateLimit"),
+        mBuf(*buf) {
+}
+
+int CommandListener::GetRateLimitCmd::runCommand(SocketClient *cli,
+                                         int /*argc*/, char ** /*argv*/) {
+    setname();
+    cli->sendMsg(package_string(mBuf.formatRateLimit()).c_str());
+    return 0;
+}
+
+CommandListener::SetRateLimitCmd::SetRateLimitCmd(LogBuffer *buf) :
+        LogCommand("setRateLimit"),
+        mBuf(*buf) {
+}
+
+int CommandListener::SetRateLimitCmd::runCommand(SocketClient *cli,
+                                         int argc, char **argv) {
+    setname();
+    if (!clientHasLogCredentials(cli)) {
+        cli->sendMsg("Permission Denied");
+        return 0;
+    }
+
+    std::string str;
+    for (int i = 1; i < argc; ++i) {
+        if (str.length()) {
+            str += " ";
+        }
+        str += argv[i];
+    }
+
+    int ret = mBuf.initRateLimit(str.c_str());
+
+    if (ret) {
+        cli->sendMsg("Invalid");
+        return 0;
+    }
+
+    cli->sendMsg("success");
+
+    return 0;
+}
+
+CommandListener::ShmCmd::ShmCmd(LogShm *shm) :
+        LogCommand("shm"),
+        mShm(*shm) {
+}
+
+int CommandListener::ShmCmd::runCommand(SocketClient *cli,
+                                         int /*argc*/, char ** /*argv*/) {
+    setname();
+
+    int fds[2];
+    ssize_t size = mShm.create(cli, fds);
+    if (size < 0) {
+        cli->sendMsg((size == -ENOSPC) || (size == -EBUSY) ? "busy"
+                   : (size == -EPERM) ? "Permission Denied"
+                   : "Unsupported");
+        return 0;
+    }
+
+    // The reply is the ring size, the ring and the eventfd ride along
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%zd", size);
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = strlen(buf) + 1;
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // Should the client have gone, its duplicate socket tells the ring
+    TEMP_FAILURE_RETRY(sendmsg(cli->getSocket(), &msg, MSG_NOSIGNAL));
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
+
 CommandListener::ReinitCmd::ReinitCmd() : LogCommand("reinit") {
 }
 
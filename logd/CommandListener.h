@@ -22,6 +22,7 @@
 #include "LogBuffer.h"
 #include "LogReader.h"
 #include "LogListener.h"
+#include "LogShm.h"
 
 // See main.cpp for implementation
 void reinit_signal_handler(int /*signal*/);
@@ -29,7 +30,8 @@ void reinit_signal_handler(int /*signal*/);
 class CommandListener : public FrameworkListener {
 
 public:
-    CommandListener(LogBuffer *buf, LogReader *reader, LogListener *swl);
+    CommandListener(LogBuffer *buf, LogReader *reader, LogListener *swl,
+                    LogShm *shm);
     virtual ~CommandListener() {}
 
 private:
@@ -59,8 +61,20 @@ private:
     LogBufferCmd(SetBufSize)
     LogBufferCmd(GetBufSizeUsed)
     LogBufferCmd(GetStatistics)
+    LogBufferCmd(GetRates)
     LogBufferCmd(GetPruneList)
     LogBufferCmd(SetPruneList)
+    LogBufferCmd(GetRateLimit)
+    LogBufferCmd(SetRateLimit)
+
+    class ShmCmd : public LogCommand {
+        LogShm &mShm;
+
+    public:
+        ShmCmd(LogShm *shm);
+        virtual ~ShmCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
 
     class ReinitCmd : public LogCommand {
     public:
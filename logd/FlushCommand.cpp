@@ -32,14 +32,18 @@ FlushCommand::FlushCommand(LogReader &reader,
                            unsigned int logMask,
                            pid_t pid,
                            uint64_t start,
-                           uint64_t timeout) :
+                           uint64_t timeout,
+                           const std::shared_ptr<const LogFilter> &filter,
+                           bool compact) :
         mReader(reader),
         mNonBlock(nonBlock),
         mTail(tail),
         mLogMask(logMask),
         mPid(pid),
         mStart(start),
-        mTimeout((start > 1) ? timeout : 0) {
+        mTimeout((start > 1) ? timeout : 0),
+        mFilter(filter),
+        mCompact(compact) {
 }
 
 // runSocketCommand is called once for every open client on the
@@ -82,7 +86,7 @@ void FlushCommand::runSocketCommand(SocketClient *client) {
             return;
         }
         entry = new LogTimeEntry(mReader, client, mNonBlock, mTail, mLogMask,
-                                 mPid, mStart, mTimeout);
+                                 mPid, mStart, mTimeout, mFilter, mCompact);
         times.push_front(entry);
     }
 
@@ -16,6 +16,8 @@
 #ifndef _FLUSH_COMMAND_H
 #define _FLUSH_COMMAND_H
 
+#include <memory>
+
 #include <log/log_read.h>
 #include <sysutils/SocketClientCommand.h>
 
@@ -33,6 +35,8 @@ class FlushCommand : public SocketClientCommand {
     pid_t mPid;
     uint64_t mStart;
     uint64_t mTimeout;
+    std::shared_ptr<const LogFilter> mFilter;
+    bool mCompact;
 
 public:
     FlushCommand(LogReader &mReader,
@@ -41,7 +45,10 @@ public:
                  unsigned int logMask = -1,
                  pid_t pid = 0,
                  uint64_t start = 1,
-                 uint64_t timeout = 0);
+                 uint64_t timeout = 0,
+                 const std::shared_ptr<const LogFilter> &filter =
+                     std::shared_ptr<const LogFilter>(),
+                 bool compact = false);
     virtual void runSocketCommand(SocketClient *client);
 
     static bool hasReadLogs(SocketClient *client);
@@ -15,25 +15,37 @@
  */
 
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/user.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <memory>
 #include <unordered_map>
 
+#include <linux/sockios.h>
+
+#include <android-base/stringprintf.h>
 #include <cutils/properties.h>
 #include <log/logger.h>
+#include <private/android_logger.h>
 
 #include "LogBuffer.h"
+#include "LogBufferCold.h"
 #include "LogKlog.h"
 #include "LogReader.h"
 
 // Default
 #define LOG_BUFFER_SIZE (256 * 1024) // Tuned with ro.logd.size per-platform
 #define log_buffer_size(id) mMaxSize[id]
+
+// Where persistent rings are kept, survives logd but not a reboot
+static const char mmap_dir[] = "/dev/logd";
 #define LOG_BUFFER_MIN_SIZE (64 * 1024UL)
 #define LOG_BUFFER_MAX_SIZE (256 * 1024 * 1024UL)
 
@@ -96,6 +108,11 @@ static unsigned long property_get_size(const char *key) {
 void LogBuffer::init() {
     static const char global_tuneable[] = "persist.logd.size"; // Settings App
     static const char global_default[] = "ro.logd.size";       // BoardConfig.mk
+    // Compressed history, disabled unless one of these is set
+    static const char cold_tuneable[] = "persist.logd.size.cold";
+    static const char cold_default[] = "ro.logd.size.cold";
+    // Persistent ring, ro. and persist. variants, for selected log ids
+    static const char mmap_tuneable[] = "logd.mmap";
 
     unsigned long default_size = property_get_size(global_tuneable);
     if (!default_size) {
@@ -109,9 +126,6 @@ void LogBuffer::init() {
     }
 
     log_id_for_each(i) {
-        mLastSet[i] = false;
-        mLast[i] = mLogElements.begin();
-
         char key[PROP_NAME_MAX];
 
         snprintf(key, sizeof(key), "%s.%s",
@@ -135,6 +149,35 @@ void LogBuffer::init() {
         if (setSize(i, property_size)) {
             setSize(i, LOG_BUFFER_MIN_SIZE);
         }
+
+        snprintf(key, sizeof(key), "%s.%s",
+                 cold_tuneable, android_log_id_to_name(i));
+        unsigned long cold_size = property_get_size(key);
+
+        if (!cold_size) {
+            snprintf(key, sizeof(key), "%s.%s",
+                     cold_default, android_log_id_to_name(i));
+            cold_size = property_get_size(key);
+        }
+
+        if (!cold_size) {
+            cold_size = property_get_size(cold_tuneable);
+        }
+
+        if (!cold_size) {
+            cold_size = property_get_size(cold_default);
+        }
+
+        pthread_mutex_lock(&mLogElementsLock);
+        mCold[i].setSize(cold_size);
+        pthread_mutex_unlock(&mLogElementsLock);
+
+        snprintf(key, sizeof(key), "%s.%s",
+                 mmap_tuneable, android_log_id_to_name(i));
+        if (property_get_bool(key, BOOL_DEFAULT_FALSE
+                                 | BOOL_DEFAULT_FLAG_PERSIST)) {
+            adopt(i);
+        }
     }
     bool lastMonotonic = monotonic;
     monotonic = android_log_clockid() == CLOCK_MONOTONIC;
@@ -155,19 +198,21 @@ void LogBuffer::init() {
         // be corrected. 1/30 corner case YMMV.
         //
         pthread_mutex_lock(&mLogElementsLock);
-        LogBufferElementCollection::iterator it = mLogElements.begin();
-        while((it != mLogElements.end())) {
-            LogBufferElement *e = *it;
-            if (monotonic) {
-                if (!android::isMonotonic(e->mRealTime)) {
-                    LogKlog::convertRealToMonotonic(e->mRealTime);
-                }
-            } else {
-                if (android::isMonotonic(e->mRealTime)) {
-                    LogKlog::convertMonotonicToReal(e->mRealTime);
+        log_id_for_each(i) {
+            LogBufferRing::iterator it = mLogElements[i].begin();
+            while((it != mLogElements[i].end())) {
+                LogBufferElement *e = *it;
+                if (monotonic) {
+                    if (!android::isMonotonic(e->mRealTime)) {
+                        LogKlog::convertRealToMonotonic(e->mRealTime);
+                    }
+                } else {
+                    if (android::isMonotonic(e->mRealTime)) {
+                        LogKlog::convertMonotonicToReal(e->mRealTime);
+                    }
                 }
+                ++it;
             }
-            ++it;
         }
         pthread_mutex_unlock(&mLogElementsLock);
     }
@@ -191,7 +236,38 @@ void LogBuffer::init() {
     LogTimeEntry::unlock();
 }
 
+// Back the ring with a file mapping that outlives us, taking in whatever a
+// previous logd left behind. Only possible before anything is logged.
+void LogBuffer::adopt(log_id_t id) {
+    char path[sizeof(mmap_dir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", mmap_dir, android_log_id_to_name(id));
+
+    pthread_mutex_lock(&mLogElementsLock);
+    LogBufferRing &ring = mLogElements[id];
+    if (ring.isMapped() || !ring.empty()) {
+        pthread_mutex_unlock(&mLogElementsLock);
+        return;
+    }
+    // Headers are stored too, leave room for those of small entries. On
+    // failure we carry on with the heap.
+    ssize_t ret = ring.map(id, path, log_buffer_size(id) * 2);
+    if (ret > 0) {
+        for (LogBufferRing::iterator it = ring.begin(); it != ring.end(); ++it) {
+            LogBufferElement *element = *it;
+            unsigned short dropped = element->getDropped();
+            element->setDropped(0);
+            stats.add(element);
+            if (dropped) {
+                stats.drop(element);
+                element->setDropped(dropped);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mLogElementsLock);
+}
+
 LogBuffer::LogBuffer(LastLogTimes *times):
+        mColdSealed(false),
         monotonic(android_log_clockid() == CLOCK_MONOTONIC),
         mTimes(*times) {
     pthread_mutex_init(&mLogElementsLock, NULL);
@@ -199,6 +275,46 @@ LogBuffer::LogBuffer(LastLogTimes *times):
     init();
 }
 
+// Check outside of mLogElementsLock whether the entry is to be stored.
+bool LogBuffer::isLoggable(log_id_t log_id, const char *msg,
+                           unsigned short len) {
+    if (log_id == LOG_ID_SECURITY) {
+        return true;
+    }
+    int prio = ANDROID_LOG_INFO;
+    const char *tag = NULL;
+    if (log_id == LOG_ID_EVENTS) {
+        uint32_t tagId = 0;
+        if (len >= sizeof(uint32_t)) {
+            tagId = le32toh(reinterpret_cast<const android_event_header_t *>(msg)->tag);
+        }
+        tag = android::tagToName(tagId);
+    } else {
+        prio = *msg;
+        tag = msg + 1;
+    }
+    return __android_log_is_loggable(prio, tag, ANDROID_LOG_VERBOSE);
+}
+
+// Place the entry in the buffer, caller is responsible for any pruning.
+//
+// mLogElementsLock must be held when this function is called.
+LogBufferElement *LogBuffer::log_Locked(log_id_t log_id, log_time realtime,
+                                        uid_t uid, pid_t pid, pid_t tid,
+                                        const char *msg, unsigned short len) {
+    stats.addRate(log_id, uid, pid, msg, len);
+
+    // Elements are stored in arrival (sequence) order, the order in which
+    // readers resume, so a late timestamp can never hide an entry from them.
+    LogBufferElement *elem = mLogElements[log_id].emplace(log_id, realtime,
+                                                          uid, pid, tid,
+                                                          msg, len);
+    if (elem) {
+        stats.add(elem);
+    }
+    return elem;
+}
+
 int LogBuffer::log(log_id_t log_id, log_time realtime,
                    uid_t uid, pid_t pid, pid_t tid,
                    const char *msg, unsigned short len) {
@@ -206,82 +322,140 @@ int LogBuffer::log(log_id_t log_id, log_time realtime,
         return -EINVAL;
     }
 
-    LogBufferElement *elem = new LogBufferElement(log_id, realtime,
-                                                  uid, pid, tid, msg, len);
-    if (log_id != LOG_ID_SECURITY) {
-        int prio = ANDROID_LOG_INFO;
-        const char *tag = NULL;
-        if (log_id == LOG_ID_EVENTS) {
-            tag = android::tagToName(elem->getTag());
-        } else {
-            prio = *msg;
-            tag = msg + 1;
-        }
-        if (!__android_log_is_loggable(prio, tag, ANDROID_LOG_VERBOSE)) {
-            // Log traffic received to total
-            pthread_mutex_lock(&mLogElementsLock);
-            stats.add(elem);
-            stats.subtract(elem);
-            pthread_mutex_unlock(&mLogElementsLock);
-            delete elem;
-            return -EACCES;
-        }
+    if (!isLoggable(log_id, msg, len)) {
+        // Log traffic received to total
+        pthread_mutex_lock(&mLogElementsLock);
+        stats.addTotal(log_id, len);
+        stats.addRate(log_id, uid, pid, msg, len);
+        pthread_mutex_unlock(&mLogElementsLock);
+        return -EACCES;
     }
 
     pthread_mutex_lock(&mLogElementsLock);
+    if (!mRateLimit.allow(log_id, realtime, uid, pid, tid, msg, len)) {
+        // Counted, and reported later by a summary
+        stats.addTotal(log_id, len);
+        stats.addRate(log_id, uid, pid, msg, len);
+        placeSummaries_Locked();
+        pthread_mutex_unlock(&mLogElementsLock);
+        return -EBUSY;
+    }
+    LogBufferElement *elem = log_Locked(log_id, realtime, uid, pid, tid,
+                                        msg, len);
+    if (elem) {
+        maybePrune(log_id);
+    }
+    placeSummaries_Locked();
+    bool sealed = mColdSealed;
+    mColdSealed = false;
+    pthread_mutex_unlock(&mLogElementsLock);
 
-    // Insert elements in time sorted order if possible
-    //  NB: if end is region locked, place element at end of list
-    LogBufferElementCollection::iterator it = mLogElements.end();
-    LogBufferElementCollection::iterator last = it;
-    while (last != mLogElements.begin()) {
-        --it;
-        if ((*it)->getRealTime() <= realtime) {
-            break;
-        }
-        last = it;
+    if (sealed) {
+        compressCold();
     }
 
-    if (last == mLogElements.end()) {
-        mLogElements.push_back(elem);
-    } else {
-        uint64_t end = 1;
-        bool end_set = false;
-        bool end_always = false;
-
-        LogTimeEntry::lock();
-
-        LastLogTimes::iterator times = mTimes.begin();
-        while(times != mTimes.end()) {
-            LogTimeEntry *entry = (*times);
-            if (entry->owned_Locked()) {
-                if (!entry->mNonBlock) {
-                    end_always = true;
-                    break;
-                }
-                if (!end_set || (end <= entry->mEnd)) {
-                    end = entry->mEnd;
-                    end_set = true;
-                }
-            }
-            times++;
-        }
+    return elem ? len : -ENOMEM;
+}
 
-        if (end_always
-                || (end_set && (end >= (*last)->getSequence()))) {
-            mLogElements.push_back(elem);
-        } else {
-            mLogElements.insert(last,elem);
+// Place a batch of entries with a single acquisition of mLogElementsLock,
+// returns the number of entries accepted. Each entry's accepted member is
+// set accordingly.
+size_t LogBuffer::log(LogBufferIngest *entries, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        LogBufferIngest &e = entries[i];
+        e.accepted = (e.log_id < LOG_ID_MAX) && (e.log_id >= 0)
+                  && isLoggable(e.log_id, e.msg, e.len);
+    }
+
+    size_t accepted = 0;
+    bool placed[LOG_ID_MAX] = { false };
+
+    pthread_mutex_lock(&mLogElementsLock);
+    for (size_t i = 0; i < count; ++i) {
+        LogBufferIngest &e = entries[i];
+        if ((e.log_id >= LOG_ID_MAX) || (e.log_id < 0)) {
+            continue;
+        }
+        if (!e.accepted) {
+            // Log traffic received to total
+            stats.addTotal(e.log_id, e.len);
+            stats.addRate(e.log_id, e.uid, e.pid, e.msg, e.len);
+            continue;
+        }
+        if (!mRateLimit.allow(e.log_id, e.realtime, e.uid, e.pid, e.tid,
+                              e.msg, e.len)) {
+            e.accepted = false;
+            stats.addTotal(e.log_id, e.len);
+            stats.addRate(e.log_id, e.uid, e.pid, e.msg, e.len);
+            continue;
+        }
+        if (!log_Locked(e.log_id, e.realtime, e.uid, e.pid, e.tid,
+                        e.msg, e.len)) {
+            e.accepted = false;
+            continue;
+        }
+        placed[e.log_id] = true;
+        ++accepted;
+    }
+    log_id_for_each(i) {
+        if (placed[i]) {
+            maybePrune(i);
         }
+    }
+    placeSummaries_Locked();
+    bool sealed = mColdSealed;
+    mColdSealed = false;
+    pthread_mutex_unlock(&mLogElementsLock);
 
-        LogTimeEntry::unlock();
+    if (sealed) {
+        compressCold();
     }
 
-    stats.add(elem);
-    maybePrune(log_id);
-    pthread_mutex_unlock(&mLogElementsLock);
+    return accepted;
+}
 
-    return len;
+// Place a summary for each rate limit that has dropped entries in the last
+// second, pruning for them as need be.
+//
+// mLogElementsLock must be held when this function is called.
+void LogBuffer::placeSummaries_Locked() {
+    std::vector<LogRateLimit::Summary> summaries;
+    mRateLimit.summaries(summaries);
+
+    static const char tag[] = "chatty";
+    for (size_t i = 0; i < summaries.size(); ++i) {
+        const LogRateLimit::Summary &s = summaries[i];
+        const char *name = stats.uidToName(s.uid);
+        std::string text = android::base::StringPrintf(
+            "uid=%u%s%s%s%s rate limited %zu line%s %zu bytes",
+            s.uid, name ? "(" : "", name ? name : "", name ? ")" : "",
+            s.tag.empty() ? "" : (" tag=" + s.tag).c_str(),
+            s.lines, (s.lines > 1) ? "s" : "", s.bytes);
+        free(const_cast<char *>(name));
+
+        std::string msg;
+        if (s.id == LOG_ID_EVENTS) {
+            android_log_event_string_t event;
+            event.header.tag = htole32(LOGD_LOG_TAG);
+            event.type = EVENT_TYPE_STRING;
+            event.length = htole32(text.length());
+            msg.assign(reinterpret_cast<const char *>(&event), sizeof(event));
+            msg += text;
+        } else {
+            msg = static_cast<char>(ANDROID_LOG_INFO);
+            msg.append(tag, sizeof(tag));
+            msg += text;
+            msg += '\0';
+        }
+        if (msg.length() > LOGGER_ENTRY_MAX_PAYLOAD) {
+            msg.resize(LOGGER_ENTRY_MAX_PAYLOAD);
+        }
+
+        if (log_Locked(s.id, s.realtime, s.uid, s.pid, s.tid,
+                       msg.data(), msg.length())) {
+            maybePrune(s.id);
+        }
+    }
 }
 
 // Prune at most 10% of the log entries or maxPrune, whichever is less.
@@ -306,12 +480,56 @@ void LogBuffer::maybePrune(log_id_t id) {
         }
         prune(id, pruneRows);
     }
+
+    // Entries pruned for the worst uid, or made chatty, leave their space
+    // behind in the ring until the oldest entries ahead of them go too. Hold
+    // the memory actually allocated to twice what the entries in budget
+    // would need, by aging out from the oldest end when it grows past that.
+    size_t allocated = mLogElements[id].allocated();
+    size_t elements = stats.realElements(id);
+    size_t budget = maxSize + elements * sizeof(LogBufferElement);
+    if (elements && (allocated > (2 * budget))) {
+        size_t sizeOver = allocated - ((2 * budget * 9) / 10);
+        unsigned long pruneRows = elements * sizeOver / allocated;
+        if (pruneRows < minPrune) {
+            pruneRows = minPrune;
+        }
+        if (pruneRows > maxPrune) {
+            pruneRows = maxPrune;
+        }
+        prune(id, pruneRows, AID_ROOT, true);
+    }
 }
 
-LogBufferElementCollection::iterator LogBuffer::erase(
-        LogBufferElementCollection::iterator it, bool coalesce) {
+// Deflate the cold segments sealed by prune. The writer thread pays for
+// this, at the fastest level, with mLogElementsLock dropped so that other
+// writers and readers proceed.
+void LogBuffer::compressCold() {
+    log_id_for_each(i) {
+        for (;;) {
+            pthread_mutex_lock(&mLogElementsLock);
+            LogBufferCold::SegmentPtr segment = mCold[i].sealed();
+            pthread_mutex_unlock(&mLogElementsLock);
+            if (!segment) {
+                break;
+            }
+
+            LogBufferCold::SegmentPtr compressed = LogBufferCold::deflate(segment);
+            if (!compressed) {
+                continue;
+            }
+
+            pthread_mutex_lock(&mLogElementsLock);
+            mCold[i].replace(segment, compressed);
+            pthread_mutex_unlock(&mLogElementsLock);
+        }
+    }
+}
+
+LogBufferRing::iterator LogBuffer::erase(log_id_t id,
+                                         LogBufferRing::iterator it,
+                                         bool coalesce) {
     LogBufferElement *element = *it;
-    log_id_t id = element->getLogId();
 
     // Remove iterator references in the various lists that will become stale
     // after the element is erased from the main logging list.
@@ -335,31 +553,14 @@ LogBufferElementCollection::iterator LogBuffer::erase(
         }
     }
 
-    bool setLast[LOG_ID_MAX];
-    bool doSetLast = false;
-    log_id_for_each(i) {
-        doSetLast |= setLast[i] = mLastSet[i] && (it == mLast[i]);
-    }
-    it = mLogElements.erase(it);
-    if (doSetLast) {
-        log_id_for_each(i) {
-            if (setLast[i]) {
-                if (it == mLogElements.end()) { // unlikely
-                    mLastSet[i] = false;
-                } else {
-                    mLast[i] = it;
-                }
-            }
-        }
-    }
+    // Account before the element storage can be reclaimed
     if (coalesce) {
         stats.erase(element);
     } else {
         stats.subtract(element);
     }
-    delete element;
 
-    return it;
+    return mLogElements[id].erase(it);
 }
 
 // Define a temporary mechanism to report the last LogBufferElement pointer
@@ -487,7 +688,8 @@ public:
 //
 // mLogElementsLock must be held when this function is called.
 //
-bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
+bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid,
+                      bool oldestFirst) {
     LogTimeEntry *oldest = NULL;
     bool busy = false;
     bool clearAll = pruneRows == ULONG_MAX;
@@ -508,24 +710,27 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
         times++;
     }
 
-    LogBufferElementCollection::iterator it;
+    LogBufferRing &ring = mLogElements[id];
+    LogBufferRing::iterator it;
+
+    // A compressed segment can not give up just one uid's entries, so only
+    // a clear by root takes the cold history with it; a clear by any other
+    // uid leaves the cold history, everyone's, as it is.
+    if (clearAll && (caller_uid == AID_ROOT)) {
+        mCold[id].clear();
+    }
 
     if (caller_uid != AID_ROOT) {
         // Only here if clearAll condition (pruneRows == ULONG_MAX)
-        it = mLastSet[id] ? mLast[id] : mLogElements.begin();
-        while (it != mLogElements.end()) {
+        it = ring.begin();
+        while (it != ring.end()) {
             LogBufferElement *element = *it;
 
-            if ((element->getLogId() != id) || (element->getUid() != caller_uid)) {
+            if (element->getUid() != caller_uid) {
                 ++it;
                 continue;
             }
 
-            if (!mLastSet[id] || ((*mLast[id])->getLogId() != id)) {
-                mLast[id] = it;
-                mLastSet[id] = true;
-            }
-
             if (oldest && (oldest->mStart <= element->getSequence())) {
                 busy = true;
                 if (oldest->mTimeout.tv_sec || oldest->mTimeout.tv_nsec) {
@@ -536,7 +741,7 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
                 break;
             }
 
-            it = erase(it);
+            it = erase(id, it);
             pruneRows--;
         }
         LogTimeEntry::unlock();
@@ -545,7 +750,7 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
 
     // prune by worst offenders; by blacklist, UID, and by PID of system UID
     bool hasBlacklist = (id != LOG_ID_SECURITY) && mPrune.naughty();
-    while (!clearAll && (pruneRows > 0)) {
+    while (!clearAll && !oldestFirst && (pruneRows > 0)) {
         // recalculate the worst offender on every batched pass
         uid_t worst = (uid_t) -1;
         size_t worst_sizes = 0;
@@ -594,7 +799,7 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
 
         bool kick = false;
         bool leading = true;
-        it = mLastSet[id] ? mLast[id] : mLogElements.begin();
+        it = ring.begin();
         // Perform at least one mandatory garbage collection cycle in following
         // - clear leading chatty tags
         // - coalesce chatty tags
@@ -604,7 +809,7 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
             {   // begin scope for uid worst found iterator
                 LogBufferIteratorMap::iterator found = mLastWorstUid[id].find(worst);
                 if ((found != mLastWorstUid[id].end())
-                        && (found->second != mLogElements.end())) {
+                        && (found->second != ring.end())) {
                     leading = false;
                     it = found->second;
                 }
@@ -614,7 +819,7 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
                 LogBufferPidIteratorMap::iterator found
                     = mLastWorstPidOfSystem[id].find(worstPid);
                 if ((found != mLastWorstPidOfSystem[id].end())
-                        && (found->second != mLogElements.end())) {
+                        && (found->second != ring.end())) {
                     leading = false;
                     it = found->second;
                 }
@@ -623,11 +828,9 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
         static const timespec too_old = {
             EXPIRE_HOUR_THRESHOLD * 60 * 60, 0
         };
-        LogBufferElementCollection::iterator lastt;
-        lastt = mLogElements.end();
-        --lastt;
+        LogBufferElement *lastt = ring.back();
         LogBufferElementLast last;
-        while (it != mLogElements.end()) {
+        while (it != ring.end()) {
             LogBufferElement *element = *it;
 
             if (oldest && (oldest->mStart <= element->getSequence())) {
@@ -638,33 +841,22 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
                 break;
             }
 
-            if (element->getLogId() != id) {
-                ++it;
-                continue;
-            }
-            // below this point element->getLogId() == id
-
-            if (leading && (!mLastSet[id] || ((*mLast[id])->getLogId() != id))) {
-                mLast[id] = it;
-                mLastSet[id] = true;
-            }
-
             unsigned short dropped = element->getDropped();
 
             // remove any leading drops
             if (leading && dropped) {
-                it = erase(it);
+                it = erase(id, it);
                 continue;
             }
 
             if (dropped && last.coalesce(element, dropped)) {
-                it = erase(it, true);
+                it = erase(id, it, true);
                 continue;
             }
 
             if (hasBlacklist && mPrune.naughty(element)) {
                 last.clear(element);
-                it = erase(it);
+                it = erase(id, it);
                 if (dropped) {
                     continue;
                 }
@@ -684,8 +876,8 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
                 continue;
             }
 
-            if ((element->getRealTime() < ((*lastt)->getRealTime() - too_old))
-                    || (element->getRealTime() > (*lastt)->getRealTime())) {
+            if ((element->getRealTime() < (lastt->getRealTime() - too_old))
+                    || (element->getRealTime() > lastt->getRealTime())) {
                 break;
             }
 
@@ -729,12 +921,12 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
 
             // do not create any leading drops
             if (leading) {
-                it = erase(it);
+                it = erase(id, it);
             } else {
                 stats.drop(element);
                 element->setDropped(1);
                 if (last.coalesce(element, 1)) {
-                    it = erase(it, true);
+                    it = erase(id, it, true);
                 } else {
                     last.add(element);
                     if (worstPid && (!gc
@@ -764,21 +956,12 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
     }
 
     bool whitelist = false;
-    bool hasWhitelist = (id != LOG_ID_SECURITY) && mPrune.nice() && !clearAll;
-    it = mLastSet[id] ? mLast[id] : mLogElements.begin();
-    while((pruneRows > 0) && (it != mLogElements.end())) {
+    bool hasWhitelist = (id != LOG_ID_SECURITY) && mPrune.nice() && !clearAll
+                        && !oldestFirst;
+    it = ring.begin();
+    while((pruneRows > 0) && (it != ring.end())) {
         LogBufferElement *element = *it;
 
-        if (element->getLogId() != id) {
-            it++;
-            continue;
-        }
-
-        if (!mLastSet[id] || ((*mLast[id])->getLogId() != id)) {
-            mLast[id] = it;
-            mLastSet[id] = true;
-        }
-
         if (oldest && (oldest->mStart <= element->getSequence())) {
             busy = true;
             if (whitelist) {
@@ -799,30 +982,24 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
         if (hasWhitelist && !element->getDropped() && mPrune.nice(element)) {
             // WhiteListed
             whitelist = true;
-            it++;
+            ++it;
             continue;
         }
 
-        it = erase(it);
+        // age out into the compressed history, if enabled
+        if (!clearAll && mCold[id].add(element)) {
+            mColdSealed = true;
+        }
+        it = erase(id, it);
         pruneRows--;
     }
 
     // Do not save the whitelist if we are reader range limited
     if (whitelist && (pruneRows > 0)) {
-        it = mLastSet[id] ? mLast[id] : mLogElements.begin();
-        while((it != mLogElements.end()) && (pruneRows > 0)) {
+        it = ring.begin();
+        while((it != ring.end()) && (pruneRows > 0)) {
             LogBufferElement *element = *it;
 
-            if (element->getLogId() != id) {
-                ++it;
-                continue;
-            }
-
-            if (!mLastSet[id] || ((*mLast[id])->getLogId() != id)) {
-                mLast[id] = it;
-                mLastSet[id] = true;
-            }
-
             if (oldest && (oldest->mStart <= element->getSequence())) {
                 busy = true;
                 if (stats.sizes(id) > (2 * log_buffer_size(id))) {
@@ -836,7 +1013,10 @@ bool LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
                 break;
             }
 
-            it = erase(it);
+            if (mCold[id].add(element)) {
+                mColdSealed = true;
+            }
+            it = erase(id, it);
             pruneRows--;
         }
     }
@@ -916,72 +1096,488 @@ unsigned long LogBuffer::getSize(log_id_t id) {
     return retval;
 }
 
-uint64_t LogBuffer::flushTo(
-        SocketClient *reader, const uint64_t start,
-        bool privileged, bool security,
-        int (*filter)(const LogBufferElement *element, void *arg), void *arg) {
-    LogBufferElementCollection::iterator it;
-    uint64_t max = start;
-    uid_t uid = reader->getUid();
+// Entries gathered for a reader while mLogElementsLock is held, sent with a
+// single sendmmsg once the lock has been dropped. Each entry remains its own
+// packet on the reader socket, so the protocol is unchanged.
+class LogBufferBatch {
+    static constexpr unsigned maxEntries = 64;
+    static constexpr size_t maxBytes = 64 * 1024;
+
+    SocketClient *mReader;
+    std::unique_ptr<char[]> mBuffer;
+    size_t mSize;
+    size_t mUsed;
+    unsigned mCount;
+    uint64_t mSequence;
+    struct iovec mIov[maxEntries];
+    struct mmsghdr mMsgs[maxEntries];
+
+    // What the reader socket can currently accept, up to maxBytes
+    size_t space() const {
+        int fd = mReader->getSocket();
+        int sndbuf = 0;
+        socklen_t optlen = sizeof(sndbuf);
+        int queued = 0;
+
+        if (!getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen)
+                && !ioctl(fd, SIOCOUTQ, &queued)) {
+            if (sndbuf <= queued) {
+                return 0;
+            }
+            if ((size_t)(sndbuf - queued) < maxBytes) {
+                return sndbuf - queued;
+            }
+        }
+        return maxBytes;
+    }
 
-    pthread_mutex_lock(&mLogElementsLock);
+    // Size the batch to what the reader socket can currently accept, a
+    // reader that is falling behind is sent one entry at a time.
+    void resize() {
+        mSize = space();
+        if (mSize < LOGGER_ENTRY_MAX_LEN) {
+            mSize = LOGGER_ENTRY_MAX_LEN;
+        }
+    }
 
-    if (start <= 1) {
-        // client wants to start from the beginning
-        it = mLogElements.begin();
-    } else {
-        // Client wants to start from some specified time. Chances are
-        // we are better off starting from the end of the time sorted list.
-        for (it = mLogElements.end(); it != mLogElements.begin(); /* do nothing */) {
-            --it;
-            LogBufferElement *element = *it;
-            if (element->getSequence() <= start) {
-                it++;
+public:
+    LogBufferBatch(SocketClient *reader):
+            mReader(reader),
+            mSize(0),
+            mUsed(0),
+            mCount(0),
+            mSequence(0) {
+    }
+
+    bool empty() const { return !mCount; }
+    // Sending more would block until the reader catches up
+    bool congested() const { return space() < LOGGER_ENTRY_MAX_LEN; }
+    bool full() const {
+        return (mCount >= maxEntries) || ((mSize - mUsed) < LOGGER_ENTRY_MAX_LEN);
+    }
+
+    // Copy the element into the batch, false if it can not be batched
+    bool add(const LogBufferElement *element, bool privileged,
+             LogCompact *compact) {
+        if (!mBuffer) {
+            mBuffer.reset(new char[maxBytes]);
+        }
+        if (!mCount) {
+            resize();
+        }
+        char *buffer = mBuffer.get() + mUsed;
+        size_t len = element->copyTo(buffer, mSize - mUsed, privileged,
+                                     compact);
+        if (!len) {
+            return false;
+        }
+        mIov[mCount].iov_base = buffer;
+        mIov[mCount].iov_len = len;
+        memset(&mMsgs[mCount], 0, sizeof(mMsgs[mCount]));
+        mMsgs[mCount].msg_hdr.msg_iov = &mIov[mCount];
+        mMsgs[mCount].msg_hdr.msg_iovlen = 1;
+        mUsed += len;
+        ++mCount;
+        mSequence = element->getSequence();
+        return true;
+    }
+
+    // Returns the sequence of the last entry sent, or FLUSH_ERROR. Given a
+    // backlog nothing blocks, what the socket will not take is added to it.
+    uint64_t flush(std::vector<std::string> *backlog) {
+        int rc = 0;
+        if (!backlog) {
+            rc = mReader->sendDatamv(mMsgs, mCount);
+        } else if (backlog->empty()) {
+            // entries already in the backlog go first
+            rc = mReader->sendDatamv(mMsgs, mCount, MSG_DONTWAIT);
+        }
+        if (rc >= 0) {
+            for (unsigned i = rc; i < mCount; ++i) {
+                backlog->push_back(std::string(
+                    static_cast<const char *>(mIov[i].iov_base),
+                    mIov[i].iov_len));
+            }
+        }
+        mUsed = 0;
+        mCount = 0;
+        return (rc < 0) ? LogBufferElement::FLUSH_ERROR : mSequence;
+    }
+
+    // Send what the socket will take from the front of the backlog,
+    // false on error
+    static bool drain(SocketClient *reader,
+                      std::vector<std::string> &backlog) {
+        while (!backlog.empty()) {
+            struct iovec iov[maxEntries];
+            struct mmsghdr msgs[maxEntries];
+            unsigned count = 0;
+            while ((count < maxEntries) && (count < backlog.size())) {
+                iov[count].iov_base = &backlog[count][0];
+                iov[count].iov_len = backlog[count].length();
+                memset(&msgs[count], 0, sizeof(msgs[count]));
+                msgs[count].msg_hdr.msg_iov = &iov[count];
+                msgs[count].msg_hdr.msg_iovlen = 1;
+                ++count;
+            }
+            int rc = reader->sendDatamv(msgs, count, MSG_DONTWAIT);
+            if (rc < 0) {
+                return false;
+            }
+            backlog.erase(backlog.begin(), backlog.begin() + rc);
+            if ((unsigned)rc < count) {
                 break;
             }
         }
+        return true;
     }
+};
 
-    for (; it != mLogElements.end(); ++it) {
-        LogBufferElement *element = *it;
+// Raw copies of the elements offered to a reader whose filter is too costly
+// to run with mLogElementsLock held, laid out as LogBufferCold records. The
+// filter is applied to them once the lock has been dropped.
+class LogBufferStage {
+    static constexpr size_t maxBytes = 64 * 1024;
+    static constexpr size_t maxRecord = (sizeof(LogBufferElement)
+            + LOGGER_ENTRY_MAX_PAYLOAD + sizeof(uint64_t) - 1)
+                & ~(sizeof(uint64_t) - 1);
+
+    std::unique_ptr<char[]> mBuffer;
+    size_t mUsed;
+    size_t mPos;
+
+    static size_t recordSize(const LogBufferElement *element) {
+        return (sizeof(LogBufferElement) + element->getMsgLen()
+                    + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    }
 
-        if (!privileged && (element->getUid() != uid)) {
-            continue;
+public:
+    LogBufferStage():mUsed(0), mPos(0) { }
+
+    bool empty() const { return mPos >= mUsed; }
+    bool full() const { return (maxBytes - mUsed) < maxRecord; }
+
+    void add(const LogBufferElement *element) {
+        if (!mBuffer) {
+            mBuffer.reset(new char[maxBytes]);
         }
+        memcpy(mBuffer.get() + mUsed, element,
+               sizeof(LogBufferElement) + element->getMsgLen());
+        mUsed += recordSize(element);
+    }
+
+    // Walk the copies in order, then start over once exhausted
+    LogBufferElement *next() {
+        if (empty()) {
+            mUsed = mPos = 0;
+            return NULL;
+        }
+        LogBufferElement *element =
+            reinterpret_cast<LogBufferElement *>(mBuffer.get() + mPos);
+        mPos += recordSize(element);
+        return element;
+    }
+};
 
-        if (!security && (element->getLogId() == LOG_ID_SECURITY)) {
+// Send the batch, then direct if not NULL: a dropped or oversized entry that
+// could not be batched. Returns false once the reader is done, on error or
+// once its socket is full.
+static bool deliver(LogBufferFlush &f, LogBufferBatch &batch,
+                    LogBufferElement *direct, LogBuffer *parent) {
+    if (!batch.empty()) {
+        f.max = batch.flush(f.backlog);
+    }
+    if (direct && (f.max != LogBufferElement::FLUSH_ERROR)) {
+        f.max = direct->flushTo(f.reader, parent, f.privileged, f.compact,
+                                f.backlog);
+    }
+    if (f.max == LogBufferElement::FLUSH_ERROR) {
+        return false;
+    }
+    if (f.backlog && !f.backlog->empty()) {
+        if (!LogBufferBatch::drain(f.reader, *f.backlog)) {
+            f.max = LogBufferElement::FLUSH_ERROR;
+            return false;
+        }
+        if (!f.backlog->empty()) {
+            f.congested = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run the reader's filter over its staged copies, and batch up what passes.
+// Called without mLogElementsLock, returns false once the reader is done.
+static bool flushStage(LogBufferFlush &f, LogBufferStage &stage,
+                       LogBufferBatch &batch, LogBuffer *parent) {
+    bool ret = true;
+    LogBufferElement *element;
+    while ((element = stage.next())) {
+        if (!ret) {
             continue;
         }
+        int match = (*f.filter)(element, f.arg);
+        if (match == false) {
+            continue;
+        }
+        if (match != true) {
+            ret = false;
+            continue;
+        }
+        if (!batch.add(element, f.privileged, f.compact)) {
+            ret = deliver(f, batch, element, parent);
+        } else if (batch.full()) {
+            ret = deliver(f, batch, NULL, parent);
+        }
+    }
+    return ret;
+}
+
+uint64_t LogBuffer::flushTo(
+        SocketClient *reader, const uint64_t start,
+        bool privileged, bool security,
+        int (*filter)(const LogBufferElement *element, void *arg), void *arg,
+        bool defer) {
+    LogBufferFlush flush = {
+        reader, privileged, security, NULL, filter, arg, defer && filter,
+        NULL, start, false
+    };
+    flushTo(&flush, 1, start);
+    return flush.max;
+}
 
-        if (element->getSequence() <= start) {
+// Serve a group of readers at the same start with a single walk of the
+// buffer. Each has its own filter and batch, and drops out of the walk
+// when its filter says stop, it fails, or its socket is congested.
+void LogBuffer::flushTo(LogBufferFlush *readers, size_t count,
+                        const uint64_t start) {
+    LogBufferRing::iterator it[LOG_ID_MAX];
+    LogBufferCold::Reader cold[LOG_ID_MAX];
+
+    // What was left over last time goes before anything newer
+    size_t active = count;
+    for (size_t r = 0; r < count; ++r) {
+        LogBufferFlush &f = readers[r];
+        f.max = start;
+        f.congested = false;
+        if (f.backlog && !f.backlog->empty()) {
+            if (!LogBufferBatch::drain(f.reader, *f.backlog)) {
+                f.max = LogBufferElement::FLUSH_ERROR;
+                --active;
+            } else if (!f.backlog->empty()) {
+                f.congested = true;
+                --active;
+            }
+        }
+    }
+    if (!active) {
+        return;
+    }
+
+    // Readers woken with nothing newer to report need not contend with
+    // the writers. Sequence numbers are only handed out under the lock,
+    // so anything newer than start has at least been started.
+    if ((start > 1) && ((start + 1) >= LogBufferElement::getCurrentSequence())) {
+        return;
+    }
+
+    std::unique_ptr<std::unique_ptr<LogBufferBatch>[]> batch(
+        new std::unique_ptr<LogBufferBatch>[count]);
+    std::unique_ptr<bool[]> done(new bool[count]);
+    std::unique_ptr<bool[]> direct(new bool[count]);
+    std::unique_ptr<std::unique_ptr<LogBufferStage>[]> stage(
+        new std::unique_ptr<LogBufferStage>[count]);
+    for (size_t r = 0; r < count; ++r) {
+        batch[r].reset(new LogBufferBatch(readers[r].reader));
+        done[r] = readers[r].congested
+               || (readers[r].max == LogBufferElement::FLUSH_ERROR);
+        if (readers[r].defer && readers[r].filter) {
+            stage[r].reset(new LogBufferStage());
+        }
+    }
+
+    pthread_mutex_lock(&mLogElementsLock);
+
+    log_id_for_each(i) {
+        // client wants to start from the beginning, or from some sequence
+        it[i] = (start <= 1) ? mLogElements[i].begin()
+                             : mLogElements[i].seek(start + 1);
+        mCold[i].snapshot(start, cold[i]);
+    }
+
+    while (active) {
+        // cold segments are expanded without holding up the writers
+        bool expand = false;
+        log_id_for_each(i) {
+            expand = expand || cold[i].needExpand();
+        }
+        if (expand) {
+            pthread_mutex_unlock(&mLogElementsLock);
+            log_id_for_each(i) {
+                if (cold[i].needExpand()) {
+                    cold[i].expand();
+                }
+            }
+            pthread_mutex_lock(&mLogElementsLock);
+        }
+
+        // merge the log ids, and their cold history, back into sequence order
+        LogBufferElement *element = NULL;
+        log_id_t id = LOG_ID_MAX;
+        bool fromCold = false;
+        log_id_for_each(i) {
+            LogBufferElement *e = cold[i].current();
+            bool c = e != NULL;
+            if ((it[i] != mLogElements[i].end())
+                    && (!e || ((*it[i])->getSequence() < e->getSequence()))) {
+                e = *it[i];
+                c = false;
+            }
+            if (e && (!element || (e->getSequence() < element->getSequence()))) {
+                element = e;
+                id = i;
+                fromCold = c;
+            }
+        }
+        if (!element) {
+            break;
+        }
+
+        uint64_t sequence = element->getSequence();
+        // element remains valid in the reader's copy until the next expand
+        if (fromCold) {
+            cold[id].next();
+        } else {
+            ++it[id];
+        }
+
+        if (sequence <= start) {
             continue;
         }
 
-        // NB: calling out to another object with mLogElementsLock held (safe)
-        if (filter) {
-            int ret = (*filter)(element, arg);
-            if (ret == false) {
+        bool spill = false;
+        for (size_t r = 0; r < count; ++r) {
+            LogBufferFlush &f = readers[r];
+            direct[r] = false;
+            if (done[r]) {
                 continue;
             }
-            if (ret != true) {
-                break;
+
+            if (!f.privileged && (element->getUid() != f.reader->getUid())) {
+                continue;
+            }
+
+            if (!f.security && (element->getLogId() == LOG_ID_SECURITY)) {
+                continue;
+            }
+
+            // Leave the reader where it is rather than block on it, before
+            // the filter has a chance to account for the element.
+            if (f.backlog && batch[r]->empty() && batch[r]->congested()) {
+                f.congested = true;
+                done[r] = true;
+                --active;
+                continue;
+            }
+
+            // A reader supplied regex could hold up every writer
+            if (stage[r]) {
+                stage[r]->add(element);
+                if (stage[r]->full()) {
+                    spill = true;
+                }
+                continue;
+            }
+
+            // NB: calling out to another object with mLogElementsLock held (safe)
+            if (f.filter) {
+                int ret = (*f.filter)(element, f.arg);
+                if (ret == false) {
+                    continue;
+                }
+                if (ret != true) {
+                    done[r] = true;
+                    --active;
+                    continue;
+                }
+            }
+
+            // Copies are independent of the buffer, keep gathering while we
+            // hold the lock and there is room.
+            if (!batch[r]->add(element, f.privileged, f.compact)) {
+                direct[r] = true;
+                spill = true;
+            } else if (batch[r]->full()) {
+                spill = true;
             }
         }
 
-        pthread_mutex_unlock(&mLogElementsLock);
+        if (!spill) {
+            continue;
+        }
 
-        // range locking in LastLogTimes looks after us
-        max = element->flushTo(reader, this, privileged);
+        pthread_mutex_unlock(&mLogElementsLock);
 
-        if (max == element->FLUSH_ERROR) {
-            return max;
+        for (size_t r = 0; r < count; ++r) {
+            LogBufferFlush &f = readers[r];
+            bool more = true;
+            if (stage[r] && !done[r] && !stage[r]->empty()) {
+                more = flushStage(f, *stage[r], *batch[r], this);
+            }
+            // Dropped or oversized entries are delivered directly, range
+            // locking in LastLogTimes looks after us as it is the last visited.
+            if ((!batch[r]->empty() || direct[r])
+                    && !deliver(f, *batch[r], direct[r] ? element : NULL,
+                                this)) {
+                more = false;
+            }
+            if (!more && !done[r]) {
+                done[r] = true;
+                --active;
+            }
         }
 
         pthread_mutex_lock(&mLogElementsLock);
+
+        // prune() only holds back for the log ids a reader watches, any
+        // other iterator may have been erased and its chunk reclaimed. Seek
+        // them all again, which also picks up log ids that have since grown.
+        log_id_for_each(i) {
+            it[i] = mLogElements[i].seek(sequence + 1);
+        }
+    }
+    pthread_mutex_unlock(&mLogElementsLock);
+
+    for (size_t r = 0; r < count; ++r) {
+        if (stage[r] && !done[r]) {
+            flushStage(readers[r], *stage[r], *batch[r], this);
+        }
+        if (!batch[r]->empty()) {
+            deliver(readers[r], *batch[r], NULL, this);
+        }
     }
+}
+
+int LogBuffer::initRateLimit(const char *cp) {
+    pthread_mutex_lock(&mLogElementsLock);
+    int ret = mRateLimit.init(cp);
     pthread_mutex_unlock(&mLogElementsLock);
+    return ret;
+}
 
-    return max;
+std::string LogBuffer::formatRateLimit() {
+    pthread_mutex_lock(&mLogElementsLock);
+    std::string ret = mRateLimit.format();
+    pthread_mutex_unlock(&mLogElementsLock);
+    return ret;
+}
+
+std::string LogBuffer::formatRates(uid_t uid, pid_t pid) {
+    pthread_mutex_lock(&mLogElementsLock);
+    std::string ret = stats.formatRates(uid, pid);
+    pthread_mutex_unlock(&mLogElementsLock);
+    return ret;
 }
 
 std::string LogBuffer::formatStatistics(uid_t uid, pid_t pid,
@@ -990,6 +1586,22 @@ std::string LogBuffer::formatStatistics(uid_t uid, pid_t pid,
 
     std::string ret = stats.format(uid, pid, logMask);
 
+    // Report on any compressed history, size/raw/num
+    std::string cold;
+    log_id_for_each(id) {
+        if (!(logMask & (1 << id)) || !mCold[id].elements()) {
+            continue;
+        }
+        cold += android::base::StringPrintf("\n%-8s%zu/%zu/%zu",
+                                            android_log_id_to_name(id),
+                                            mCold[id].sizes(),
+                                            mCold[id].rawSizes(),
+                                            mCold[id].elements());
+    }
+    if (!cold.empty()) {
+        ret += "\n\nCompressed history size/raw/num" + cold + "\n";
+    }
+
     pthread_mutex_unlock(&mLogElementsLock);
 
     return ret;
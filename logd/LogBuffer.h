@@ -19,15 +19,19 @@
 
 #include <sys/types.h>
 
-#include <list>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <log/log.h>
 #include <sysutils/SocketClient.h>
 
 #include <private/android_filesystem_config.h>
 
+#include "LogBufferCold.h"
 #include "LogBufferElement.h"
+#include "LogBufferRing.h"
+#include "LogRateLimit.h"
 #include "LogTimes.h"
 #include "LogStatistics.h"
 #include "LogWhiteBlackList.h"
@@ -73,26 +77,52 @@ static bool isMonotonic(const log_time &mono) {
 
 }
 
-typedef std::list<LogBufferElement *> LogBufferElementCollection;
+// An entry as received by a writer, before being placed in a LogBuffer
+struct LogBufferIngest {
+    log_id_t log_id;
+    log_time realtime;
+    uid_t uid;
+    pid_t pid;
+    pid_t tid;
+    const char *msg;
+    unsigned short len;
+    bool accepted; // set by LogBuffer::log()
+};
+
+// A reader to be served by LogBuffer::flushTo
+struct LogBufferFlush {
+    SocketClient *reader;
+    bool privileged;
+    bool security;
+    // Never block on the socket: entries it will not take yet are kept
+    // here, and sent first next time. NULL to block instead.
+    std::vector<std::string> *backlog;
+    int (*filter)(const LogBufferElement *element, void *arg);
+    void *arg;
+    bool defer; // filter is costly, run it on copies without the lock held
+    LogCompact *compact; // encoder for a format=2 reader, or NULL
+    uint64_t max;   // set to the last sequence sent, or FLUSH_ERROR
+    bool congested; // set if stopped on a full socket, see backlog
+};
 
 class LogBuffer {
-    LogBufferElementCollection mLogElements;
+    // each log id is stored separately, all in sequence order
+    LogBufferRing mLogElements[LOG_ID_MAX];
     pthread_mutex_t mLogElementsLock;
+    // optional compressed history of entries expired from mLogElements
+    LogBufferCold mCold[LOG_ID_MAX];
+    bool mColdSealed; // segments are waiting to be deflated
 
     LogStatistics stats;
 
     PruneList mPrune;
-    // watermark for last per log id
-    LogBufferElementCollection::iterator mLast[LOG_ID_MAX];
-    bool mLastSet[LOG_ID_MAX];
+    LogRateLimit mRateLimit;
     // watermark of any worst/chatty uid processing
-    typedef std::unordered_map<uid_t,
-                               LogBufferElementCollection::iterator>
+    typedef std::unordered_map<uid_t, LogBufferRing::iterator>
                 LogBufferIteratorMap;
     LogBufferIteratorMap mLastWorstUid[LOG_ID_MAX];
     // watermark of any worst/chatty pid of system processing
-    typedef std::unordered_map<pid_t,
-                               LogBufferElementCollection::iterator>
+    typedef std::unordered_map<pid_t, LogBufferRing::iterator>
                 LogBufferPidIteratorMap;
     LogBufferPidIteratorMap mLastWorstPidOfSystem[LOG_ID_MAX];
 
@@ -110,10 +140,12 @@ public:
     int log(log_id_t log_id, log_time realtime,
             uid_t uid, pid_t pid, pid_t tid,
             const char *msg, unsigned short len);
+    size_t log(LogBufferIngest *entries, size_t count);
     uint64_t flushTo(SocketClient *writer, const uint64_t start,
                      bool privileged, bool security,
                      int (*filter)(const LogBufferElement *element, void *arg) = NULL,
-                     void *arg = NULL);
+                     void *arg = NULL, bool defer = false);
+    void flushTo(LogBufferFlush *readers, size_t count, const uint64_t start);
 
     bool clear(log_id_t id, uid_t uid = AID_ROOT);
     unsigned long getSize(log_id_t id);
@@ -121,6 +153,8 @@ public:
     unsigned long getSizeUsed(log_id_t id);
     // *strp uses malloc, use free to release.
     std::string formatStatistics(uid_t uid, pid_t pid, unsigned int logMask);
+    // Bytes and lines per second, recent
+    std::string formatRates(uid_t uid, pid_t pid);
 
     void enableStatistics() {
         stats.enableStatistics();
@@ -128,6 +162,8 @@ public:
 
     int initPrune(const char *cp) { return mPrune.init(cp); }
     std::string formatPrune() { return mPrune.format(); }
+    int initRateLimit(const char *cp);
+    std::string formatRateLimit();
 
     // helper must be protected directly or implicitly by lock()/unlock()
     const char *pidToName(pid_t pid) { return stats.pidToName(pid); }
@@ -141,10 +177,20 @@ private:
     static constexpr size_t minPrune = 4;
     static constexpr size_t maxPrune = 256;
 
+    bool isLoggable(log_id_t log_id, const char *msg, unsigned short len);
+    LogBufferElement *log_Locked(log_id_t log_id, log_time realtime,
+                                 uid_t uid, pid_t pid, pid_t tid,
+                                 const char *msg, unsigned short len);
+    void placeSummaries_Locked();
+    void adopt(log_id_t id);
     void maybePrune(log_id_t id);
-    bool prune(log_id_t id, unsigned long pruneRows, uid_t uid = AID_ROOT);
-    LogBufferElementCollection::iterator erase(
-        LogBufferElementCollection::iterator it, bool coalesce = false);
+    void compressCold();
+    // oldestFirst skips the worst offender and whitelist passes, so that
+    // the space held by the ring is given back
+    bool prune(log_id_t id, unsigned long pruneRows, uid_t uid = AID_ROOT,
+               bool oldestFirst = false);
+    LogBufferRing::iterator erase(log_id_t id, LogBufferRing::iterator it,
+                                  bool coalesce = false);
 };
 
 #endif // _LOGD_LOG_BUFFER_H__
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <zlib.h>
+
+#include "LogBufferCold.h"
+
+LogBufferCold::LogBufferCold() :
+        mPendingLen(0),
+        mPendingCount(0),
+        mPendingFirst(0),
+        mPendingLast(0),
+        mMaxSize(0),
+        mSize(0),
+        mRawSize(0),
+        mElements(0) {
+}
+
+void LogBufferCold::setSize(unsigned long size) {
+    mMaxSize = size;
+    if (!mMaxSize) {
+        clear();
+        mPending.reset();
+        return;
+    }
+    trim();
+}
+
+bool LogBufferCold::add(const LogBufferElement *element) {
+    // chatty summaries carry no payload, and would only mislead
+    if (!enabled() || element->getDropped()) {
+        return false;
+    }
+
+    size_t len = recordSize(element);
+    if (!mPending) {
+        mPending.reset(new char[segmentSize + sizeof(LogBufferElement)
+                                + LOGGER_ENTRY_MAX_PAYLOAD]);
+    }
+    char *record = mPending.get() + mPendingLen;
+    size_t used = sizeof(LogBufferElement) + element->getMsgLen();
+    memcpy(record, element, used);
+    memset(record + used, 0, len - used);
+
+    if (!mPendingCount) {
+        mPendingFirst = element->getSequence();
+    }
+    mPendingLast = element->getSequence();
+    ++mPendingCount;
+    mPendingLen += len;
+    mSize += len;
+    mRawSize += len;
+    ++mElements;
+
+    if (mPendingLen < segmentSize) {
+        return false;
+    }
+    seal();
+    trim();
+    return true;
+}
+
+// Copy of the pending block as an uncompressed segment
+LogBufferCold::Segment *LogBufferCold::pending() const {
+    Segment *segment = new Segment;
+    segment->mFirst = mPendingFirst;
+    segment->mLast = mPendingLast;
+    segment->mCount = mPendingCount;
+    segment->mRawLen = mPendingLen;
+    segment->mLen = mPendingLen;
+    segment->mCompressed = false;
+    segment->mData.reset(new char[mPendingLen]);
+    memcpy(segment->mData.get(), mPending.get(), mPendingLen);
+    return segment;
+}
+
+void LogBufferCold::seal() {
+    SegmentPtr segment(pending());
+    mSegments.push_back(segment);
+    mSealed.push_back(segment);
+    mPendingLen = 0;
+    mPendingCount = 0;
+}
+
+// Drop the oldest segments until we fit
+void LogBufferCold::trim() {
+    while ((mSize > mMaxSize) && !mSegments.empty()) {
+        const SegmentPtr &oldest = mSegments.front();
+        mSize -= oldest->mLen;
+        mRawSize -= oldest->mRawLen;
+        mElements -= oldest->mCount;
+        if (!mSealed.empty() && (mSealed.front() == oldest)) {
+            mSealed.pop_front();
+        }
+        mSegments.pop_front();
+    }
+}
+
+void LogBufferCold::clear() {
+    mSegments.clear();
+    mSealed.clear();
+    mPendingLen = 0;
+    mPendingCount = 0;
+    mSize = 0;
+    mRawSize = 0;
+    mElements = 0;
+}
+
+void LogBufferCold::snapshot(uint64_t sequence, Reader &reader) const {
+    for (std::deque<SegmentPtr>::const_iterator it = mSegments.begin();
+            it != mSegments.end(); ++it) {
+        if ((*it)->mLast > sequence) {
+            reader.mSegments.push_back(*it);
+        }
+    }
+
+    // The pending block is still being appended to, readers get a copy
+    if (mPendingCount && (mPendingLast > sequence)) {
+        reader.mSegments.push_back(SegmentPtr(pending()));
+    }
+}
+
+LogBufferCold::SegmentPtr LogBufferCold::sealed() {
+    SegmentPtr segment;
+    if (!mSealed.empty()) {
+        segment = mSealed.front();
+        mSealed.pop_front();
+    }
+    return segment;
+}
+
+LogBufferCold::SegmentPtr LogBufferCold::deflate(const SegmentPtr &from) {
+    uLongf len = compressBound(from->mRawLen);
+    std::unique_ptr<char[]> data(new char[len]);
+    // Fastest level, this runs on the writer thread, if without the lock
+    if ((compress2(reinterpret_cast<Bytef *>(data.get()), &len,
+                   reinterpret_cast<const Bytef *>(from->mData.get()),
+                   from->mRawLen, Z_BEST_SPEED) != Z_OK)
+            || (len >= from->mRawLen)) {
+        return SegmentPtr();
+    }
+
+    Segment *segment = new Segment;
+    segment->mFirst = from->mFirst;
+    segment->mLast = from->mLast;
+    segment->mCount = from->mCount;
+    segment->mRawLen = from->mRawLen;
+    segment->mLen = len;
+    segment->mCompressed = true;
+    segment->mData.reset(new char[len]);
+    memcpy(segment->mData.get(), data.get(), len);
+    return SegmentPtr(segment);
+}
+
+void LogBufferCold::replace(const SegmentPtr &from, const SegmentPtr &to) {
+    for (std::deque<SegmentPtr>::iterator it = mSegments.begin();
+            it != mSegments.end(); ++it) {
+        if (*it == from) {
+            mSize -= from->mLen;
+            mSize += to->mLen;
+            *it = to;
+            return;
+        }
+    }
+}
+
+void LogBufferCold::Reader::expand() {
+    while (mNext < mSegments.size()) {
+        SegmentPtr segment = mSegments[mNext];
+        mSegments[mNext++].reset();
+        mCurrent.reset();
+        mStorage.reset();
+
+        if (!segment->mCompressed) {
+            // Segments are immutable, hold a reference while we walk it
+            mCurrent = segment;
+            mPos = segment->mData.get();
+            mEnd = mPos + segment->mRawLen;
+            return;
+        }
+
+        mStorage.reset(new char[segment->mRawLen]);
+        uLongf len = segment->mRawLen;
+        if ((uncompress(reinterpret_cast<Bytef *>(mStorage.get()), &len,
+                        reinterpret_cast<const Bytef *>(segment->mData.get()),
+                        segment->mLen) != Z_OK)
+                || (len != segment->mRawLen)) {
+            continue;
+        }
+        mPos = mStorage.get();
+        mEnd = mPos + len;
+        return;
+    }
+    mPos = mEnd = NULL;
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_BUFFER_COLD_H__
+#define _LOGD_LOG_BUFFER_COLD_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "LogBufferElement.h"
+
+// Optional compressed history for a single log id.
+//
+// Entries expired from the LogBufferRing by prune are appended, packed in
+// the same header followed by payload layout the ring uses, to a pending
+// block. Once the block is full it is sealed into an immutable segment, and
+// later deflated outside of mLogElementsLock by deflate(). The oldest
+// segments are dropped once the tier exceeds its size.
+//
+// Segments are shared with readers so that they may be expanded without
+// holding the lock. Except where noted, all methods must be called with the
+// owning LogBuffer's mLogElementsLock held.
+class LogBufferCold {
+public:
+    class Segment {
+        friend LogBufferCold;
+
+        uint64_t mFirst;   // sequence of the first element
+        uint64_t mLast;    // sequence of the last element
+        size_t mCount;     // elements held
+        size_t mRawLen;    // length of the packed elements
+        size_t mLen;       // length of mData
+        bool mCompressed;
+        std::unique_ptr<char[]> mData;
+
+    public:
+        uint64_t getFirst() const { return mFirst; }
+        uint64_t getLast() const { return mLast; }
+        size_t getCount() const { return mCount; }
+        size_t getSize() const { return mLen; }
+        bool isCompressed() const { return mCompressed; }
+    };
+    typedef std::shared_ptr<const Segment> SegmentPtr;
+
+    // Walks a snapshot of segments in sequence order, expanding them one at
+    // a time. Expansion does not require mLogElementsLock.
+    class Reader {
+        friend LogBufferCold;
+
+        std::vector<SegmentPtr> mSegments;
+        size_t mNext;
+        SegmentPtr mCurrent;                // uncompressed, walked in place
+        std::unique_ptr<char[]> mStorage;   // or expanded copy
+        char *mPos;
+        char *mEnd;
+
+    public:
+        Reader():mNext(0), mPos(NULL), mEnd(NULL) { }
+
+        // Current element, NULL if the expanded segment is exhausted
+        LogBufferElement *current() const {
+            return (mPos < mEnd) ? reinterpret_cast<LogBufferElement *>(mPos)
+                                 : NULL;
+        }
+        void next() { mPos += recordSize(current()); }
+        bool needExpand() const {
+            return (mPos >= mEnd) && (mNext < mSegments.size());
+        }
+        void expand();
+    };
+
+    LogBufferCold();
+
+    void setSize(unsigned long size);
+    unsigned long getSize() const { return mMaxSize; }
+    bool enabled() const { return mMaxSize != 0; }
+
+    // Copy an expired element into the pending block, returns true if a
+    // segment was sealed and there is something to deflate.
+    bool add(const LogBufferElement *element);
+    void clear();
+
+    // Snapshot every element newer than sequence into reader
+    void snapshot(uint64_t sequence, Reader &reader) const;
+
+    // Next sealed segment to be deflated, each is handed out only once
+    SegmentPtr sealed();
+    // Deflate a sealed segment, does not require mLogElementsLock.
+    // Returns NULL if the result would not be any smaller.
+    static SegmentPtr deflate(const SegmentPtr &segment);
+    // Swap in the deflated segment, unless it has since been trimmed
+    void replace(const SegmentPtr &from, const SegmentPtr &to);
+
+    size_t sizes() const { return mSize; }
+    size_t elements() const { return mElements; }
+    size_t rawSizes() const { return mRawSize; }
+
+private:
+    static constexpr size_t segmentSize = 64 * 1024;
+
+    std::deque<SegmentPtr> mSegments;
+    std::deque<SegmentPtr> mSealed;    // awaiting deflate()
+    std::unique_ptr<char[]> mPending;
+    size_t mPendingLen;
+    size_t mPendingCount;
+    uint64_t mPendingFirst;
+    uint64_t mPendingLast;
+
+    unsigned long mMaxSize;
+    size_t mSize;      // bytes held by segments and pending block
+    size_t mRawSize;   // bytes the held elements would occupy in the ring
+    size_t mElements;
+
+    static size_t recordSize(const LogBufferElement *element) {
+        return (sizeof(LogBufferElement) + element->getMsgLen()
+                    + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    }
+
+    Segment *pending() const;
+    void seal();
+    void trim();
+
+    // Non-copyable, shared segment ownership is handed out by snapshot()
+    LogBufferCold(const LogBufferCold &);
+    LogBufferCold &operator=(const LogBufferCold &);
+};
+
+#endif // _LOGD_LOG_BUFFER_COLD_H__
@@ -28,6 +28,7 @@
 #include "LogBuffer.h"
 #include "LogBufferElement.h"
 #include "LogCommand.h"
+#include "LogCompact.h"
 #include "LogReader.h"
 #include "LogUtils.h"
 
@@ -37,27 +38,24 @@ atomic_int_fast64_t LogBufferElement::sequence(1);
 LogBufferElement::LogBufferElement(log_id_t log_id, log_time realtime,
                                    uid_t uid, pid_t pid, pid_t tid,
                                    const char *msg, unsigned short len) :
-        mLogId(log_id),
+        mSequence(sequence.fetch_add(1, memory_order_relaxed)),
+        mRealTime(realtime),
         mUid(uid),
         mPid(pid),
         mTid(tid),
         mMsgLen(len),
-        mSequence(sequence.fetch_add(1, memory_order_relaxed)),
-        mRealTime(realtime) {
-    mMsg = new char[len];
-    memcpy(mMsg, msg, len);
-}
-
-LogBufferElement::~LogBufferElement() {
-    delete [] mMsg;
+        mDropped(0),
+        mLogId(log_id),
+        mErased(false) {
+    memcpy(getMsg(), msg, len);
 }
 
 uint32_t LogBufferElement::getTag() const {
     if (((mLogId != LOG_ID_EVENTS) && (mLogId != LOG_ID_SECURITY)) ||
-            !mMsg || (mMsgLen < sizeof(uint32_t))) {
+            mDropped || (mMsgLen < sizeof(uint32_t))) {
         return 0;
     }
-    return le32toh(reinterpret_cast<android_event_header_t *>(mMsg)->tag);
+    return le32toh(reinterpret_cast<const android_event_header_t *>(getMsg())->tag);
 }
 
 // caller must own and free character string
@@ -105,7 +103,7 @@ char *android::tidToName(pid_t tid) {
     return retval;
 }
 
-// assumption: mMsg == NULL
+// assumption: mDropped != 0
 size_t LogBufferElement::populateDroppedMessage(char *&buffer,
         LogBuffer *parent) {
     static const char tag[] = "chatty";
@@ -199,10 +197,8 @@ size_t LogBufferElement::populateDroppedMessage(char *&buffer,
     return retval;
 }
 
-uint64_t LogBufferElement::flushTo(SocketClient *reader, LogBuffer *parent,
-                                   bool privileged) {
-    struct logger_entry_v4 entry;
-
+void LogBufferElement::populateEntry(struct logger_entry_v4 &entry,
+                                     bool privileged) const {
     memset(&entry, 0, sizeof(struct logger_entry_v4));
 
     entry.hdr_size = privileged ?
@@ -214,6 +210,47 @@ uint64_t LogBufferElement::flushTo(SocketClient *reader, LogBuffer *parent,
     entry.uid = mUid;
     entry.sec = mRealTime.tv_sec;
     entry.nsec = mRealTime.tv_nsec;
+    entry.len = mMsgLen;
+}
+
+size_t LogBufferElement::copyTo(char *buffer, size_t len,
+                                bool privileged, LogCompact *compact) const {
+    struct logger_entry_v4 entry;
+
+    populateEntry(entry, privileged);
+
+    if (mDropped) {
+        return 0;
+    }
+    if (compact) {
+        char header[LogCompact::maxHeader];
+        size_t skip;
+        size_t hdrLen = compact->encode(entry, getMsg(), header, &skip);
+        size_t retval = hdrLen + entry.len - skip;
+        if (retval > len) {
+            return 0;
+        }
+        memcpy(buffer, header, hdrLen);
+        memcpy(buffer + hdrLen, getMsg() + skip, entry.len - skip);
+        compact->commit();
+        return retval;
+    }
+
+    size_t retval = entry.hdr_size + entry.len;
+    if (retval > len) {
+        return 0;
+    }
+    memcpy(buffer, &entry, entry.hdr_size);
+    memcpy(buffer + entry.hdr_size, getMsg(), entry.len);
+    return retval;
+}
+
+uint64_t LogBufferElement::flushTo(SocketClient *reader, LogBuffer *parent,
+                                   bool privileged, LogCompact *compact,
+                                   std::vector<std::string> *backlog) {
+    struct logger_entry_v4 entry;
+
+    populateEntry(entry, privileged);
 
     struct iovec iovec[2];
     iovec[0].iov_base = &entry;
@@ -221,7 +258,7 @@ uint64_t LogBufferElement::flushTo(SocketClient *reader, LogBuffer *parent,
 
     char *buffer = NULL;
 
-    if (!mMsg) {
+    if (mDropped) {
         entry.len = populateDroppedMessage(buffer, parent);
         if (!entry.len) {
             return mSequence;
@@ -229,11 +266,33 @@ uint64_t LogBufferElement::flushTo(SocketClient *reader, LogBuffer *parent,
         iovec[1].iov_base = buffer;
     } else {
         entry.len = mMsgLen;
-        iovec[1].iov_base = mMsg;
+        iovec[1].iov_base = getMsg();
     }
     iovec[1].iov_len = entry.len;
 
-    uint64_t retval = reader->sendDatav(iovec, 2) ? FLUSH_ERROR : mSequence;
+    char header[LogCompact::maxHeader];
+    if (compact) {
+        size_t skip;
+        iovec[0].iov_base = header;
+        iovec[0].iov_len = compact->encode(entry,
+                                           static_cast<char *>(iovec[1].iov_base),
+                                           header, &skip);
+        iovec[1].iov_base = static_cast<char *>(iovec[1].iov_base) + skip;
+        iovec[1].iov_len -= skip;
+    }
+
+    uint64_t retval = mSequence;
+    if (backlog) {
+        backlog->push_back(std::string(
+            static_cast<const char *>(iovec[0].iov_base), iovec[0].iov_len));
+        backlog->back().append(static_cast<const char *>(iovec[1].iov_base),
+                               iovec[1].iov_len);
+    } else if (reader->sendDatav(iovec, 2)) {
+        retval = FLUSH_ERROR;
+    }
+    if (compact && (retval != FLUSH_ERROR)) {
+        compact->commit();
+    }
 
     if (buffer) {
         free(buffer);
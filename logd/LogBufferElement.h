@@ -21,11 +21,17 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <string>
+#include <vector>
+
 #include <sysutils/SocketClient.h>
 #include <log/log.h>
 #include <log/log_read.h>
+#include <log/logger.h>
 
 class LogBuffer;
+class LogBufferRing;
+class LogCompact;
 
 #define EXPIRE_HOUR_THRESHOLD 24 // Only expire chatty UID logs to preserve
                                  // non-chatty UIDs less than this age in hours
@@ -33,46 +39,52 @@ class LogBuffer;
                                  // chatty for the temporal expire messages
 #define EXPIRE_RATELIMIT 10      // maximum rate in seconds to report expiration
 
+// Elements are placed, header immediately followed by the payload, into the
+// per log id LogBufferRing storage and never individually allocated.
 class LogBufferElement {
 
     friend LogBuffer;
+    friend LogBufferRing;
 
-    const log_id_t mLogId;
+    const uint64_t mSequence;
+    log_time mRealTime;
     const uid_t mUid;
     const pid_t mPid;
     const pid_t mTid;
-    char *mMsg;
-    union {
-        const unsigned short mMsgLen; // mMSg != NULL
-        unsigned short mDropped;      // mMsg == NULL
-    };
-    const uint64_t mSequence;
-    log_time mRealTime;
+    const unsigned short mMsgLen; // payload length stored after the header
+    unsigned short mDropped;      // non-zero if payload has been dropped
+    const uint8_t mLogId;
+    bool mErased;                 // reclaimable by LogBufferRing
     static atomic_int_fast64_t sequence;
 
-    // assumption: mMsg == NULL
-    size_t populateDroppedMessage(char *&buffer,
-                                  LogBuffer *parent);
-
-public:
+    // Only LogBufferRing may place an element, len bytes of storage for
+    // msg must immediately follow.
     LogBufferElement(log_id_t log_id, log_time realtime,
                      uid_t uid, pid_t pid, pid_t tid,
                      const char *msg, unsigned short len);
-    virtual ~LogBufferElement();
 
-    log_id_t getLogId() const { return mLogId; }
+    char *getMsg() { return reinterpret_cast<char *>(this + 1); }
+
+    void populateEntry(struct logger_entry_v4 &entry, bool privileged) const;
+    // assumption: mDropped != 0
+    size_t populateDroppedMessage(char *&buffer,
+                                  LogBuffer *parent);
+
+public:
+    log_id_t getLogId() const { return static_cast<log_id_t>(mLogId); }
     uid_t getUid(void) const { return mUid; }
     pid_t getPid(void) const { return mPid; }
     pid_t getTid(void) const { return mTid; }
-    unsigned short getDropped(void) const { return mMsg ? 0 : mDropped; }
+    unsigned short getDropped(void) const { return mDropped; }
+    // payload remains in the ring until reclaimed, but is no longer reported
     unsigned short setDropped(unsigned short value) {
-        if (mMsg) {
-            delete [] mMsg;
-            mMsg = NULL;
-        }
         return mDropped = value;
     }
-    unsigned short getMsgLen() const { return mMsg ? mMsgLen : 0; }
+    unsigned short getMsgLen() const { return mDropped ? 0 : mMsgLen; }
+    // payload, getMsgLen() bytes of it are valid
+    const char *getMsg() const {
+        return reinterpret_cast<const char *>(this + 1);
+    }
     uint64_t getSequence(void) const { return mSequence; }
     static uint64_t getCurrentSequence(void) { return sequence.load(memory_order_relaxed); }
     log_time getRealTime(void) const { return mRealTime; }
@@ -80,7 +92,15 @@ public:
     uint32_t getTag(void) const;
 
     static const uint64_t FLUSH_ERROR;
-    uint64_t flushTo(SocketClient *writer, LogBuffer *parent, bool privileged);
+    // compact, if not NULL, encodes the header for a format=2 reader.
+    // Given a backlog the entry is appended to it rather than sent.
+    uint64_t flushTo(SocketClient *writer, LogBuffer *parent, bool privileged,
+                     LogCompact *compact = NULL,
+                     std::vector<std::string> *backlog = NULL);
+    // Copy the entry as it would be sent to a reader, returns length used
+    // or 0 if it does not fit. Not for dropped entries.
+    size_t copyTo(char *buffer, size_t len, bool privileged,
+                  LogCompact *compact = NULL) const;
 };
 
 #endif
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "LogBufferRing.h"
+
+LogBufferRing::LogBufferRing() :
+        mSinceCheckpoint(0),
+        mOldest(NULL),
+        mNewest(NULL),
+        mSpare(NULL),
+        mBack(NULL),
+        mAllocated(0),
+        mMap(NULL),
+        mMapLen(0) {
+}
+
+LogBufferRing::~LogBufferRing() {
+    while (mOldest) {
+        Chunk *chunk = mOldest;
+        mOldest = chunk->next;
+        if (!mapped(chunk)) {
+            free(chunk);
+        }
+    }
+    free(mSpare);
+    if (mMap) {
+        munmap(mMap, mMapLen);
+    }
+}
+
+void LogBufferRing::iterator::skipErased() {
+    while (mChunk) {
+        if (mOffset >= mChunk->head) {
+            mChunk = mChunk->next;
+            mOffset = 0;
+            continue;
+        }
+        if (!mChunk->at(mOffset)->mErased) {
+            return;
+        }
+        mOffset += recordSize(mChunk->at(mOffset));
+    }
+    mOffset = 0;
+}
+
+LogBufferRing::Chunk *LogBufferRing::allocate(size_t need) {
+    Chunk *chunk;
+    if (!mFree.empty() && (need <= chunkSize)) {
+        chunk = mFree.back();
+        mFree.pop_back();
+        mAllocated += chunk->size;
+    } else if (mSpare && (need <= mSpare->size)) {
+        chunk = mSpare;
+        mSpare = NULL;
+    } else {
+        size_t size = (need > chunkSize) ? need : chunkSize;
+        chunk = static_cast<Chunk *>(malloc(sizeof(Chunk) + size));
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = size;
+        mAllocated += size;
+    }
+    chunk->next = NULL;
+    chunk->head = 0;
+    chunk->tail = 0;
+    return chunk;
+}
+
+void LogBufferRing::release(Chunk *chunk) {
+    if (mapped(chunk)) {
+        chunk->head = chunk->tail = 0;
+        mAllocated -= chunk->size;
+        mFree.push_back(chunk);
+        return;
+    }
+    if (!mSpare && (chunk->size == chunkSize)) {
+        mSpare = chunk;
+        return;
+    }
+    mAllocated -= chunk->size;
+    free(chunk);
+}
+
+LogBufferElement *LogBufferRing::emplace(log_id_t log_id, log_time realtime,
+                                         uid_t uid, pid_t pid, pid_t tid,
+                                         const char *msg, unsigned short len) {
+    size_t need = (sizeof(LogBufferElement) + len + sizeof(uint64_t) - 1)
+                & ~(sizeof(uint64_t) - 1);
+
+    if (!mNewest || ((mNewest->size - mNewest->head) < need)) {
+        Chunk *chunk = allocate(need);
+        if (!chunk) {
+            return NULL;
+        }
+        if (mNewest) {
+            mNewest->next = chunk;
+        } else {
+            mOldest = chunk;
+        }
+        mNewest = chunk;
+    }
+
+    LogBufferElement *element = new (mNewest->at(mNewest->head))
+        LogBufferElement(log_id, realtime, uid, pid, tid, msg, len);
+    if (!mSinceCheckpoint) {
+        Checkpoint checkpoint = {
+            element->getSequence(), mNewest, mNewest->head
+        };
+        mIndex.push_back(checkpoint);
+    }
+    if (++mSinceCheckpoint >= indexInterval) {
+        mSinceCheckpoint = 0;
+    }
+    // The element must be complete before the head covers it, should it be
+    // adopted from a mapping after a crash.
+    __atomic_store_n(&mNewest->head, mNewest->head + need, __ATOMIC_RELEASE);
+    mBack = element;
+    return element;
+}
+
+// Advance the tail past erased elements, releasing any chunks left behind
+void LogBufferRing::reclaim() {
+    while (mOldest) {
+        if (mOldest->tail < mOldest->head) {
+            LogBufferElement *element = mOldest->at(mOldest->tail);
+            if (!element->mErased) {
+                return;
+            }
+            mOldest->tail += recordSize(element);
+            continue;
+        }
+        if (mOldest == mNewest) {
+            // Empty, rewind and keep the chunk for the next append
+            mOldest->head = mOldest->tail = 0;
+            mBack = NULL;
+            mIndex.clear();
+            mSinceCheckpoint = 0;
+            return;
+        }
+        Chunk *chunk = mOldest;
+        mOldest = chunk->next;
+        while (!mIndex.empty() && (mIndex.front().chunk == chunk)) {
+            mIndex.pop_front();
+        }
+        release(chunk);
+    }
+}
+
+LogBufferRing::iterator LogBufferRing::erase(iterator it) {
+    (*it)->mErased = true;
+    bool oldest = (it.mChunk == mOldest) && (it.mOffset == mOldest->tail);
+    ++it;
+    if (oldest) {
+        reclaim();
+    }
+    return it;
+}
+
+LogBufferRing::iterator LogBufferRing::seek(uint64_t sequence) {
+    if (!mOldest || (sequence > lastSequence())) {
+        return end();
+    }
+
+    // Last checkpoint at or before sequence, elements before it that
+    // have since been erased or reclaimed are skipped by the iterator.
+    std::deque<Checkpoint>::iterator found = std::upper_bound(
+        mIndex.begin(), mIndex.end(), sequence,
+        [](uint64_t sequence, const Checkpoint &checkpoint) {
+            return sequence < checkpoint.sequence;
+        });
+
+    iterator it = begin();
+    if (found != mIndex.begin()) {
+        --found;
+        size_t offset = found->offset;
+        if ((found->chunk == mOldest) && (offset < mOldest->tail)) {
+            offset = mOldest->tail;
+        }
+        it = iterator(found->chunk, offset);
+    }
+
+    while ((it != end()) && ((*it)->getSequence() < sequence)) {
+        ++it;
+    }
+    return it;
+}
+
+// Validate the elements of a chunk left in the mapping, truncating it at the
+// first that is not whole. Returns the number of live elements kept.
+size_t LogBufferRing::adopt(log_id_t id, Chunk *chunk) {
+    size_t head = chunk->head;
+    size_t tail = 0;
+    size_t offset = 0;
+    size_t count = 0;
+    uint64_t last = 0;
+
+    if ((chunk->size != chunkSize) || (head > chunkSize)) {
+        head = 0;
+    }
+    while ((offset + sizeof(LogBufferElement)) <= head) {
+        LogBufferElement *element = chunk->at(offset);
+        if ((element->mLogId != id)
+                || (element->mMsgLen > LOGGER_ENTRY_MAX_PAYLOAD)
+                || (element->mSequence <= last)
+                || ((offset + recordSize(element)) > head)) {
+            break;
+        }
+        last = element->mSequence;
+        if (offset <= chunk->tail) {
+            tail = offset;
+        }
+        offset += recordSize(element);
+        if (!element->mErased) {
+            ++count;
+        }
+    }
+    chunk->size = chunkSize;
+    chunk->head = offset;
+    chunk->tail = (chunk->tail >= offset) ? offset : tail;
+    chunk->next = NULL;
+    return count;
+}
+
+ssize_t LogBufferRing::map(log_id_t id, const char *path, size_t size) {
+    if (mMap || mOldest) {
+        return -EBUSY;
+    }
+
+    size_t chunks = (size + chunkSize - 1) / chunkSize;
+    if (chunks < 2) {
+        chunks = 2;
+    }
+    size_t len = mapOffset + chunks * slotSize;
+
+    int fd = TEMP_FAILURE_RETRY(open(path,
+        O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, S_IRUSR | S_IWUSR));
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (static_cast<size_t>(st.st_size) != len)) {
+        // Resized, start afresh rather than guess at what was kept
+        if (ftruncate(fd, 0) || ftruncate(fd, len)) {
+            int err = errno;
+            close(fd);
+            return -err;
+        }
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -err;
+    }
+    mMap = static_cast<char *>(map);
+    mMapLen = len;
+
+    MapHeader *header = reinterpret_cast<MapHeader *>(mMap);
+    if ((header->magic != mapMagic)
+            || (header->version != mapVersion)
+            || (header->logId != static_cast<uint32_t>(id))
+            || (header->elementSize != sizeof(LogBufferElement))
+            || (header->chunkSize != chunkSize)
+            || (header->chunks != chunks)) {
+        header->magic = 0;
+        for (size_t i = 0; i < chunks; ++i) {
+            slot(i)->head = slot(i)->tail = 0;
+        }
+        header->version = mapVersion;
+        header->logId = id;
+        header->elementSize = sizeof(LogBufferElement);
+        header->chunkSize = chunkSize;
+        header->chunks = chunks;
+        __atomic_store_n(&header->magic, mapMagic, __ATOMIC_RELEASE);
+    }
+
+    // Chunks are not linked in the mapping, their first element orders them
+    std::vector<Chunk *> live;
+    size_t count = 0;
+    for (size_t i = chunks; i > 0; --i) {
+        Chunk *chunk = slot(i - 1);
+        size_t kept = adopt(id, chunk);
+        if (kept) {
+            live.push_back(chunk);
+            count += kept;
+        } else {
+            chunk->head = chunk->tail = 0;
+            mFree.push_back(chunk);
+        }
+    }
+    std::sort(live.begin(), live.end(), [](Chunk *lhs, Chunk *rhs) {
+        return lhs->at(0)->mSequence < rhs->at(0)->mSequence;
+    });
+
+    for (size_t i = 0; i < live.size(); ++i) {
+        Chunk *chunk = live[i];
+        if (mNewest) {
+            mNewest->next = chunk;
+        } else {
+            mOldest = chunk;
+        }
+        mNewest = chunk;
+        mAllocated += chunk->size;
+        for (size_t offset = 0; offset < chunk->head;
+                offset += recordSize(chunk->at(offset))) {
+            if (!mSinceCheckpoint) {
+                Checkpoint checkpoint = {
+                    chunk->at(offset)->mSequence, chunk, offset
+                };
+                mIndex.push_back(checkpoint);
+            }
+            if (++mSinceCheckpoint >= indexInterval) {
+                mSinceCheckpoint = 0;
+            }
+            mBack = chunk->at(offset);
+        }
+    }
+
+    // New elements must follow those adopted
+    uint64_t next = lastSequence() + 1;
+    int_fast64_t current = LogBufferElement::sequence.load(memory_order_relaxed);
+    while ((current < static_cast<int_fast64_t>(next))
+            && !LogBufferElement::sequence.compare_exchange_weak(current, next,
+                    memory_order_relaxed))
+        ;
+
+    reclaim();
+    return count;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_BUFFER_RING_H__
+#define _LOGD_LOG_BUFFER_RING_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <vector>
+
+#include <log/log.h>
+#include <log/log_read.h>
+
+#include "LogBufferElement.h"
+
+// Storage for all the LogBufferElements of a single log id.
+//
+// Elements are packed, header followed immediately by the payload, into a
+// singly linked chain of fixed size chunks. New elements are appended at the
+// head of the newest chunk, so the ring is always in sequence order. Erasing
+// an element only marks it; the space is reclaimed by advancing the tail past
+// erased elements, releasing a chunk back to the allocator (or keeping it as a
+// spare) once the tail has moved beyond its last element.
+//
+// Elements never move once placed, so pointers and iterators remain valid
+// until the element itself is erased. All methods must be called with the
+// owning LogBuffer's mLogElementsLock held.
+//
+// A sparse index, a checkpoint every indexInterval elements, allows readers
+// to seek to a sequence number with a binary search followed by a short walk
+// rather than having to visit every element in the ring.
+//
+// Optionally the chunks are carved out of a shared file mapping, see map(),
+// so that the content survives a restart of logd. An element is complete in
+// the mapping before the chunk head is advanced past it, so a crash at any
+// point leaves only whole elements behind. Should the mapping be exhausted
+// further chunks come from the heap and are not persisted.
+class LogBufferRing {
+    struct Chunk {
+        Chunk *next;
+        size_t size; // capacity of data()
+        size_t head; // offset of next element to append
+        size_t tail; // offset of oldest element not yet reclaimed
+
+        char *data() { return reinterpret_cast<char *>(this + 1); }
+        LogBufferElement *at(size_t offset) {
+            return reinterpret_cast<LogBufferElement *>(data() + offset);
+        }
+    };
+
+    static constexpr size_t chunkSize = 32 * 1024;
+    static constexpr size_t indexInterval = 64;
+
+    struct Checkpoint {
+        uint64_t sequence;
+        Chunk *chunk;
+        size_t offset;
+    };
+    std::deque<Checkpoint> mIndex;
+    size_t mSinceCheckpoint;
+
+    Chunk *mOldest;
+    Chunk *mNewest;
+    Chunk *mSpare;
+    LogBufferElement *mBack;
+    size_t mAllocated;
+
+    // Persistent storage, file header followed by fixed size chunk slots
+    struct MapHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t logId;
+        uint32_t elementSize; // sizeof(LogBufferElement)
+        uint32_t chunkSize;
+        uint32_t chunks;
+    };
+    static constexpr uint32_t mapMagic = 0x676f4c52; // "RLog"
+    static constexpr uint32_t mapVersion = 1;
+    static constexpr size_t slotSize = sizeof(Chunk) + chunkSize;
+    static constexpr size_t mapOffset = 4096; // slots follow the header page
+    char *mMap;
+    size_t mMapLen;
+    std::vector<Chunk *> mFree; // unused slots
+
+    bool mapped(const Chunk *chunk) const {
+        return mMap && (reinterpret_cast<const char *>(chunk) >= mMap)
+                    && (reinterpret_cast<const char *>(chunk) < (mMap + mMapLen));
+    }
+    Chunk *slot(size_t index) const {
+        return reinterpret_cast<Chunk *>(mMap + mapOffset + index * slotSize);
+    }
+    size_t adopt(log_id_t id, Chunk *chunk);
+
+    static size_t recordSize(const LogBufferElement *element) {
+        return (sizeof(LogBufferElement) + element->mMsgLen
+                    + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    }
+
+    Chunk *allocate(size_t need);
+    void release(Chunk *chunk);
+    void reclaim();
+
+    // Non-copyable, elements point back into our chunks
+    LogBufferRing(const LogBufferRing &);
+    LogBufferRing &operator=(const LogBufferRing &);
+
+public:
+    class iterator {
+        friend LogBufferRing;
+
+        Chunk *mChunk; // NULL if end()
+        size_t mOffset;
+
+        iterator(Chunk *chunk, size_t offset):mChunk(chunk), mOffset(offset) {
+            skipErased();
+        }
+        void skipErased();
+
+    public:
+        iterator():mChunk(NULL), mOffset(0) { }
+
+        LogBufferElement *operator*() const { return mChunk->at(mOffset); }
+        iterator &operator++() {
+            mOffset += recordSize(mChunk->at(mOffset));
+            skipErased();
+            return *this;
+        }
+        bool operator==(const iterator &rhs) const {
+            return (mChunk == rhs.mChunk) && (mOffset == rhs.mOffset);
+        }
+        bool operator!=(const iterator &rhs) const { return !(*this == rhs); }
+    };
+
+    LogBufferRing();
+    ~LogBufferRing();
+
+    // Back an empty ring with the file at path, of roughly size bytes,
+    // adopting the elements a previous instance of logd left there. Returns
+    // the number of elements adopted, or negative errno on failure in which
+    // case the ring remains heap backed.
+    ssize_t map(log_id_t id, const char *path, size_t size);
+    bool isMapped() const { return mMap != NULL; }
+
+    // Construct a new element at the head of the ring
+    LogBufferElement *emplace(log_id_t log_id, log_time realtime,
+                              uid_t uid, pid_t pid, pid_t tid,
+                              const char *msg, unsigned short len);
+
+    iterator begin() {
+        return mOldest ? iterator(mOldest, mOldest->tail) : end();
+    }
+    iterator end() { return iterator(); }
+
+    // First element with a sequence number greater or equal to sequence,
+    // O(log n) by way of the checkpoint index.
+    iterator seek(uint64_t sequence);
+
+    // Mark the element erased, returns iterator to the next live element.
+    // The element must no longer be referenced once this returns.
+    iterator erase(iterator it);
+
+    bool empty() { return begin() == end(); }
+    // Newest element placed, may already be erased, NULL if none.
+    LogBufferElement *back() const { return mBack; }
+    uint64_t lastSequence() const {
+        return mBack ? mBack->getSequence() : 0;
+    }
+    // Bytes held in chunks, including reclaimable and spare space
+    size_t allocated() const { return mAllocated; }
+};
+
+#endif // _LOGD_LOG_BUFFER_RING_H__
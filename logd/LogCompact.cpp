@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "LogCompact.h"
+#include "LogUtils.h"
+
+static char *putVarint(char *cp, uint64_t value) {
+    while (value >= 0x80) {
+        *cp++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *cp++ = static_cast<char>(value);
+    return cp;
+}
+
+static char *putZigzag(char *cp, int64_t value) {
+    return putVarint(cp, (static_cast<uint64_t>(value) << 1) ^ (value >> 63));
+}
+
+LogCompact::LogCompact() :
+        mLid(0),
+        mPid(0),
+        mTid(0),
+        mUid(0),
+        mTime(0),
+        mCount(0),
+        mPendingTag(NULL),
+        mPendingTagLen(0),
+        mPendingSlot(0) {
+    memset(mHash, 0, sizeof(mHash));
+    memset(&mPending, 0, sizeof(mPending));
+}
+
+size_t LogCompact::encode(const struct logger_entry_v4 &entry,
+                          const char *msg, char *header, size_t *skip) {
+    char *cp = header + 1;
+    uint8_t flags = 0;
+
+    mPending = entry;
+    mPendingTag = NULL;
+    *skip = 0;
+
+    if (entry.lid != mLid) {
+        flags |= LOGGER_COMPACT_LID;
+        *cp++ = static_cast<char>(entry.lid);
+    }
+    if (entry.pid != mPid) {
+        flags |= LOGGER_COMPACT_PID;
+        cp = putZigzag(cp, static_cast<int64_t>(entry.pid) - mPid);
+    }
+    if (entry.tid != mTid) {
+        flags |= LOGGER_COMPACT_TID;
+        cp = putZigzag(cp, static_cast<int64_t>(entry.tid) - mTid);
+    }
+    if (entry.hdr_size < sizeof(struct logger_entry_v4)) {
+        flags |= LOGGER_COMPACT_NOUID;
+        mPending.uid = mUid;
+    } else if (entry.uid != mUid) {
+        flags |= LOGGER_COMPACT_UID;
+        cp = putVarint(cp, entry.uid);
+    }
+    int64_t time = entry.sec * 1000000000LL + entry.nsec;
+    cp = putZigzag(cp, time - mTime);
+
+    // Text payloads are a priority, a tag, then the message
+    if ((entry.lid != LOG_ID_EVENTS) && (entry.lid != LOG_ID_SECURITY)
+            && (entry.len > 2)) {
+        size_t max = entry.len - 1;
+        if (max > (LOGGER_COMPACT_MAX_TAG_LEN + 1)) {
+            max = LOGGER_COMPACT_MAX_TAG_LEN + 1;
+        }
+        const char *tag = msg + 1;
+        const char *nul = static_cast<const char *>(memchr(tag, '\0', max));
+        size_t len = nul ? (nul - tag) : 0;
+        if (len) {
+            size_t slot = hashTag(tag, len) & (hashSize - 1);
+            while (mHash[slot]) {
+                const char *known = mTags[mHash[slot] - 1];
+                if (!strncmp(known, tag, len) && !known[len]) {
+                    break;
+                }
+                slot = (slot + 1) & (hashSize - 1);
+            }
+            if (mHash[slot]) {
+                flags |= LOGGER_COMPACT_TAG;
+                cp = putVarint(cp, mHash[slot] - 1);
+                *cp++ = msg[0];
+                *skip = 1 + len + 1;
+            } else if (mCount < LOGGER_COMPACT_MAX_TAGS) {
+                flags |= LOGGER_COMPACT_NEWTAG;
+                mPendingTag = tag;
+                mPendingTagLen = len;
+                mPendingSlot = slot;
+            }
+        }
+    }
+
+    header[0] = static_cast<char>(flags);
+    return cp - header;
+}
+
+void LogCompact::commit() {
+    mLid = mPending.lid;
+    mPid = mPending.pid;
+    mTid = mPending.tid;
+    mUid = mPending.uid;
+    mTime = mPending.sec * 1000000000LL + mPending.nsec;
+
+    if (mPendingTag) {
+        memcpy(mTags[mCount], mPendingTag, mPendingTagLen);
+        mTags[mCount][mPendingTagLen] = '\0';
+        mHash[mPendingSlot] = ++mCount;
+        mPendingTag = NULL;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_COMPACT_H__
+#define _LOGD_LOG_COMPACT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <log/logger.h>
+#include <private/android_logger.h>
+
+// Encoder for the compact reader stream, one per reader that asked for it.
+// Each header is encoded against the previous entry sent to that reader,
+// see LOGGER_COMPACT_MAGIC in private/android_logger.h for the format.
+// encode() leaves the state alone, so an entry that does not fit, or fails
+// to send, is simply encoded again; commit() once it is on its way.
+class LogCompact {
+    static const size_t hashSize = LOGGER_COMPACT_MAX_TAGS * 2;
+
+    // Previous entry
+    uint8_t mLid;
+    int32_t mPid;
+    uint32_t mTid;
+    uint32_t mUid;
+    int64_t mTime;
+
+    // Tag dictionary, mHash holds index + 1 of the tag, or 0 if empty
+    char mTags[LOGGER_COMPACT_MAX_TAGS][LOGGER_COMPACT_MAX_TAG_LEN + 1];
+    size_t mCount;
+    uint16_t mHash[hashSize];
+
+    // Entry last encoded, applied by commit()
+    struct logger_entry_v4 mPending;
+    const char *mPendingTag; // to add to the dictionary, or NULL
+    size_t mPendingTagLen;
+    size_t mPendingSlot;
+
+public:
+    static const size_t maxHeader = LOGGER_COMPACT_MAX_HEADER;
+
+    LogCompact();
+
+    // Write the header for entry, maxHeader bytes at most. Returns its
+    // length, and in skip how many bytes off the front of msg are covered
+    // by the header and are not to be sent.
+    size_t encode(const struct logger_entry_v4 &entry, const char *msg,
+                  char *header, size_t *skip);
+    // The entry last encoded has been sent
+    void commit();
+};
+
+#endif // _LOGD_LOG_COMPACT_H__
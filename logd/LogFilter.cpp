@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "LogFilter.h"
+#include "LogUtils.h"
+
+LogFilter::LogFilter() :
+        mHasTags(false),
+        mDefaultPriority(ANDROID_LOG_VERBOSE),
+        mHasRegex(false) {
+}
+
+LogFilter::~LogFilter() {
+    if (mHasRegex) {
+        regfree(&mRegex);
+    }
+}
+
+static int charToPriority(char c) {
+    switch (tolower(c)) {
+    case 'v': return ANDROID_LOG_VERBOSE;
+    case 'd': return ANDROID_LOG_DEBUG;
+    case 'i': return ANDROID_LOG_INFO;
+    case 'w': return ANDROID_LOG_WARN;
+    case 'e': return ANDROID_LOG_ERROR;
+    case 'f': return ANDROID_LOG_FATAL;
+    case 's': return ANDROID_LOG_SILENT;
+    }
+    return ANDROID_LOG_UNKNOWN;
+}
+
+// Parse a comma separated list of numbers into a sorted vector
+template <typename T>
+static int parseList(const char *cp, std::vector<T> &list) {
+    for (;;) {
+        if (!isdigit(*cp)) {
+            return -EINVAL;
+        }
+        char *ep;
+        list.push_back(static_cast<T>(strtoul(cp, &ep, 10)));
+        cp = ep;
+        if (*cp != ',') {
+            break;
+        }
+        ++cp;
+    }
+    if (*cp && !isspace(*cp)) {
+        return -EINVAL;
+    }
+    std::sort(list.begin(), list.end());
+    return 0;
+}
+
+int LogFilter::init(char *request) {
+    // The expression is the remainder of the request, it may hold spaces
+    static const char _regex[] = " regex=";
+    char *cp = strstr(request, _regex);
+    if (cp) {
+        *cp = '\0';
+        if (regcomp(&mRegex, cp + sizeof(_regex) - 1,
+                    REG_EXTENDED | REG_NOSUB)) {
+            return -EINVAL;
+        }
+        mHasRegex = true;
+    }
+
+    static const char _pids[] = " pids=";
+    cp = strstr(request, _pids);
+    if (cp && parseList(cp + sizeof(_pids) - 1, mPids)) {
+        return -EINVAL;
+    }
+
+    static const char _uids[] = " uids=";
+    cp = strstr(request, _uids);
+    if (cp && parseList(cp + sizeof(_uids) - 1, mUids)) {
+        return -EINVAL;
+    }
+
+    static const char _tags[] = " tags=";
+    cp = strstr(request, _tags);
+    if (cp) {
+        cp += sizeof(_tags) - 1;
+        for (;;) {
+            size_t len = strcspn(cp, ":, \t\n");
+            if (!len) {
+                return -EINVAL;
+            }
+            TagRule rule = { std::string(cp, len), ANDROID_LOG_VERBOSE };
+            cp += len;
+            if (*cp == ':') {
+                rule.priority = charToPriority(*++cp);
+                if (rule.priority == ANDROID_LOG_UNKNOWN) {
+                    return -EINVAL;
+                }
+                ++cp;
+            }
+            if (rule.tag == "*") {
+                mDefaultPriority = rule.priority;
+            } else {
+                mTags.push_back(rule);
+            }
+            if (*cp != ',') {
+                break;
+            }
+            ++cp;
+        }
+        mHasTags = true;
+    }
+
+    return 0;
+}
+
+// Minimum priority to report for tag
+int LogFilter::priority(const char *tag, size_t len) const {
+    if (tag) {
+        for (std::vector<TagRule>::const_iterator it = mTags.begin();
+                it != mTags.end(); ++it) {
+            if ((it->tag.length() == len) && !memcmp(it->tag.data(), tag, len)) {
+                return it->priority;
+            }
+        }
+    }
+    return mDefaultPriority;
+}
+
+bool LogFilter::match(const LogBufferElement *element) const {
+    if (!mPids.empty() && !std::binary_search(mPids.begin(), mPids.end(),
+                                              element->getPid())) {
+        return false;
+    }
+    if (!mUids.empty() && !std::binary_search(mUids.begin(), mUids.end(),
+                                              element->getUid())) {
+        return false;
+    }
+    if (!mHasTags && !mHasRegex) {
+        return true;
+    }
+
+    // chatty summaries say nothing about the content that was dropped
+    if (element->getDropped()) {
+        return false;
+    }
+
+    // Binary logs are all reported at info, and have no text for the regex
+    log_id_t id = element->getLogId();
+    if ((id == LOG_ID_EVENTS) || (id == LOG_ID_SECURITY)) {
+        if (!mHasTags) {
+            return true;
+        }
+        const char *tag = android::tagToName(element->getTag());
+        return ANDROID_LOG_INFO >= priority(tag, tag ? strlen(tag) : 0);
+    }
+
+    const char *msg = element->getMsg();
+    size_t len = element->getMsgLen();
+    if (len < 2) {
+        return false;
+    }
+    const char *tag = msg + 1;
+    size_t tagLen = strnlen(tag, len - 1);
+    if (mHasTags && (*msg < priority(tag, tagLen))) {
+        return false;
+    }
+    if (!mHasRegex) {
+        return true;
+    }
+
+    const char *text = tag + tagLen + 1;
+    const char *end = msg + len;
+    if (text > end) {
+        text = end;
+    }
+    while ((end > text) && !end[-1]) {
+        --end;
+    }
+    regmatch_t match;
+    match.rm_so = 0;
+    match.rm_eo = end - text;
+    return !regexec(&mRegex, text, 1, &match, REG_STARTEND);
+}
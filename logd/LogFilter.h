@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_FILTER_H__
+#define _LOGD_LOG_FILTER_H__
+
+#include <regex.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "LogBufferElement.h"
+
+// Reader supplied filters, applied in logd so that entries the reader is
+// not interested in never leave. Parsed from the reader request:
+//
+//   tags=<tag>[:<priority>][,...]  priority one of VDIWEFS, tag * sets
+//                                  the default for tags not listed
+//   pids=<pid>[,...]
+//   uids=<uid>[,...]
+//   regex=<expr>                   POSIX extended, matched against the
+//                                  text of the message, must come last
+//
+// Immutable once parsed, so may be evaluated without any lock held. A regex
+// is costly, readers with one are matched against copies of the entries.
+class LogFilter {
+    struct TagRule {
+        std::string tag;
+        int priority;
+    };
+    bool mHasTags;
+    std::vector<TagRule> mTags;
+    int mDefaultPriority;
+    std::vector<pid_t> mPids; // sorted
+    std::vector<uid_t> mUids; // sorted
+    bool mHasRegex;
+    regex_t mRegex;
+
+    int priority(const char *tag, size_t len) const;
+
+    // Non-copyable, owns the compiled regex
+    LogFilter(const LogFilter &);
+    LogFilter &operator=(const LogFilter &);
+
+public:
+    LogFilter();
+    ~LogFilter();
+
+    // Parse the request, which has any regex= parameter cut from it.
+    // Returns 0, or -EINVAL if a parameter is malformed.
+    int init(char *request);
+
+    bool empty() const {
+        return !mHasTags && mPids.empty() && mUids.empty() && !mHasRegex;
+    }
+    // Too costly to evaluate with mLogElementsLock held
+    bool costly() const { return mHasRegex; }
+    bool match(const LogBufferElement *element) const;
+};
+
+#endif // _LOGD_LOG_FILTER_H__
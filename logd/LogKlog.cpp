@@ -215,14 +215,20 @@ log_time LogKlog::correction =
         ? log_time::EPOCH
         : (log_time(CLOCK_REALTIME) - log_time(CLOCK_MONOTONIC));
 
-LogKlog::LogKlog(LogBuffer *buf, LogReader *reader, int fdWrite, int fdRead, bool auditd) :
+LogKlog::LogKlog(LogBuffer *buf, LogReader *reader, int fdWrite, int fdRead,
+                 bool auditd, bool structured) :
         SocketListener(fdRead, false),
         logbuf(buf),
         reader(reader),
         signature(CLOCK_MONOTONIC),
         initialized(false),
         enableLogging(true),
-        auditd(auditd) {
+        auditd(auditd),
+        structured(structured),
+        sequence(0),
+        batchCount(0),
+        storage(new char[batchStorage]),
+        storageLen(0) {
     static const char klogd_message[] = "%slogd.klogd: %" PRIu64 "\n";
     char buffer[sizeof(priority_message) + sizeof(klogd_message) + 20 - 4];
     snprintf(buffer, sizeof(buffer), klogd_message, priority_message,
@@ -237,6 +243,10 @@ bool LogKlog::onDataAvailable(SocketClient *cli) {
         enableLogging = false;
     }
 
+    if (structured) {
+        return readKmsg(cli->getSocket());
+    }
+
     char buffer[LOGGER_ENTRY_MAX_PAYLOAD];
     size_t len = 0;
 
@@ -269,10 +279,104 @@ bool LogKlog::onDataAvailable(SocketClient *cli) {
             }
         }
     }
+    flush();
 
     return true;
 }
 
+// Drain the /dev/kmsg records available, each read() returns one record:
+//
+// <PRI>,<SEQ>,<USEC>,<FLAGS>[,...];<message>\n[ <KEY>=<VALUE>\n]...
+//
+// The header gives priority and monotonic timestamp directly, so none of
+// the heuristics needed for the /proc/kmsg text stream apply.
+bool LogKlog::readKmsg(int fd) {
+    // The kernel's CONSOLE_EXT_LOG_MAX, no /dev/kmsg record is larger
+    static const size_t PRINTK_MESSAGE_MAX = 8192;
+    char buffer[PRINTK_MESSAGE_MAX + 1];
+
+    for (;;) {
+        ssize_t retval = read(fd, buffer, sizeof(buffer) - 1);
+        if (retval < 0) {
+            // Records lost either way are counted by logKmsg(), from the
+            // gap in sequence numbers to the next record that we read.
+            if (errno == EPIPE) { // overwritten before we got to them
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            // Record does not fit, and the kernel will not move past it,
+            // nor can it be told to skip just the one. Skip to the newest
+            // rather than stall kernel logging.
+            if ((errno == EINVAL) && (lseek(fd, 0, SEEK_END) >= 0)) {
+                continue;
+            }
+            bool drained = errno == EAGAIN;
+            flush();
+            return drained;
+        }
+        if (retval == 0) {
+            break;
+        }
+        buffer[retval] = '\0';
+        logKmsg(buffer, retval);
+    }
+    flush();
+
+    return true;
+}
+
+int LogKlog::logKmsg(const char *buf, size_t len) {
+    char *ep;
+    int pri = strtol(buf, &ep, 10);
+    if ((ep == buf) || (*ep != ',')) {
+        return -EINVAL;
+    }
+    const char *cp = ep + 1;
+    uint64_t seq = strtoull(cp, &ep, 10);
+    if ((ep == cp) || (*ep != ',')) {
+        return -EINVAL;
+    }
+    cp = ep + 1;
+    uint64_t usec = strtoull(cp, &ep, 10);
+    if ((ep == cp) || (*ep != ',')) {
+        return -EINVAL;
+    }
+    const char *msg = static_cast<const char *>(memchr(ep, ';', len - (ep - buf)));
+    if (!msg) {
+        return -EINVAL;
+    }
+    ++msg;
+    // continuation lines carry device properties, not content
+    const char *end = static_cast<const char *>(memchr(msg, '\n', len - (msg - buf)));
+    if (!end) {
+        end = &buf[len];
+    }
+
+    if (seq && (seq <= sequence)) {
+        return 0;
+    }
+    uint64_t lost = (seq && sequence) ? (seq - sequence - 1) : 0;
+    sequence = seq;
+
+    log_time now(usec / 1000000, (usec % 1000000) * 1000);
+    if (!isMonotonic()) {
+        correct(now, msg, end - msg, false);
+        convertMonotonicToReal(now);
+    }
+
+    if (lost) {
+        char lostMessage[64];
+        int lostLen = snprintf(lostMessage, sizeof(lostMessage),
+                               "logd: %" PRIu64 " kernel log records lost",
+                               lost);
+        queue(lostMessage, lostLen, lostMessage, LOG_WARNING, now);
+    }
+
+    return queue(msg, end - msg, msg, pri, now);
+}
+
 
 void LogKlog::calculateCorrection(const log_time &monotonic,
                                   const char *real_string,
@@ -335,9 +439,6 @@ void LogKlog::sniffTime(log_time &now,
         cp = NULL;
     }
     if (cp) {
-        static const char healthd[] = "healthd";
-        static const char battery[] = ": battery ";
-
         len -= cp - *buf;
         if (len && isspace(*cp)) {
             ++cp;
@@ -349,49 +450,7 @@ void LogKlog::sniffTime(log_time &now,
             return;
         }
 
-        const char *b;
-        if (((b = strnstr(cp, len, suspendStr)))
-                && ((size_t)((b += sizeof(suspendStr) - 1) - cp) < len)) {
-            len -= b - cp;
-            calculateCorrection(now, b, len);
-        } else if (((b = strnstr(cp, len, resumeStr)))
-                && ((size_t)((b += sizeof(resumeStr) - 1) - cp) < len)) {
-            len -= b - cp;
-            calculateCorrection(now, b, len);
-        } else if (((b = strnstr(cp, len, healthd)))
-                && ((size_t)((b += sizeof(healthd) - 1) - cp) < len)
-                && ((b = strnstr(b, len -= b - cp, battery)))
-                && ((size_t)((b += sizeof(battery) - 1) - cp) < len)) {
-            // NB: healthd is roughly 150us late, so we use it instead to
-            //     trigger a check for ntp-induced or hardware clock drift.
-            log_time real(CLOCK_REALTIME);
-            log_time mono(CLOCK_MONOTONIC);
-            correction = (real < mono) ? log_time::EPOCH : (real - mono);
-        } else if (((b = strnstr(cp, len, suspendedStr)))
-                && ((size_t)((b += sizeof(suspendStr) - 1) - cp) < len)) {
-            len -= b - cp;
-            log_time real;
-            char *endp;
-            real.tv_sec = strtol(b, &endp, 10);
-            if ((*endp == '.') && ((size_t)(endp - b) < len)) {
-                unsigned long multiplier = NS_PER_SEC;
-                real.tv_nsec = 0;
-                len -= endp - b;
-                while (--len && isdigit(*++endp) && (multiplier /= 10)) {
-                    real.tv_nsec += (*endp - '0') * multiplier;
-                }
-                if (reverse) {
-                    if (real > correction) {
-                        correction = log_time::EPOCH;
-                    } else {
-                        correction -= real;
-                    }
-                } else {
-                    correction += real;
-                }
-            }
-        }
-
+        correct(now, cp, len, reverse);
         convertMonotonicToReal(now);
     } else {
         if (isMonotonic()) {
@@ -402,6 +461,57 @@ void LogKlog::sniffTime(log_time &now,
     }
 }
 
+// Track the monotonic to realtime correction from suspend, resume and
+// healthd reports in the content of a kernel message.
+void LogKlog::correct(const log_time &now, const char *cp, size_t len,
+                      bool reverse) {
+    static const char healthd[] = "healthd";
+    static const char battery[] = ": battery ";
+
+    const char *b;
+    if (((b = strnstr(cp, len, suspendStr)))
+            && ((size_t)((b += sizeof(suspendStr) - 1) - cp) < len)) {
+        len -= b - cp;
+        calculateCorrection(now, b, len);
+    } else if (((b = strnstr(cp, len, resumeStr)))
+            && ((size_t)((b += sizeof(resumeStr) - 1) - cp) < len)) {
+        len -= b - cp;
+        calculateCorrection(now, b, len);
+    } else if (((b = strnstr(cp, len, healthd)))
+            && ((size_t)((b += sizeof(healthd) - 1) - cp) < len)
+            && ((b = strnstr(b, len -= b - cp, battery)))
+            && ((size_t)((b += sizeof(battery) - 1) - cp) < len)) {
+        // NB: healthd is roughly 150us late, so we use it instead to
+        //     trigger a check for ntp-induced or hardware clock drift.
+        log_time real(CLOCK_REALTIME);
+        log_time mono(CLOCK_MONOTONIC);
+        correction = (real < mono) ? log_time::EPOCH : (real - mono);
+    } else if (((b = strnstr(cp, len, suspendedStr)))
+            && ((size_t)((b += sizeof(suspendStr) - 1) - cp) < len)) {
+        len -= b - cp;
+        log_time real;
+        char *endp;
+        real.tv_sec = strtol(b, &endp, 10);
+        if ((*endp == '.') && ((size_t)(endp - b) < len)) {
+            unsigned long multiplier = NS_PER_SEC;
+            real.tv_nsec = 0;
+            len -= endp - b;
+            while (--len && isdigit(*++endp) && (multiplier /= 10)) {
+                real.tv_nsec += (*endp - '0') * multiplier;
+            }
+            if (reverse) {
+                if (real > correction) {
+                    correction = log_time::EPOCH;
+                } else {
+                    correction -= real;
+                }
+            } else {
+                correction += real;
+            }
+        }
+    }
+}
+
 pid_t LogKlog::sniffPid(const char **buf, size_t len) {
     const char *cp = *buf;
     // HTC kernels with modified printk "c0   1648 "
@@ -582,16 +692,23 @@ static const char *strnrchr(const char *s, size_t len, char c) {
 // return -1 if message logd.klogd: <signature>
 //
 int LogKlog::log(const char *buf, size_t len) {
-    if (auditd && strnstr(buf, len, " audit(")) {
-        return 0;
-    }
-
     const char *p = buf;
     int pri = parseKernelPrio(&p, len);
 
     log_time now;
     sniffTime(now, &p, len - (p - buf), false);
 
+    return queue(buf, len, p, pri, now);
+}
+
+// Parse tag and content of a kernel line, p is past any prefix, and queue it
+// for flush(). Returns -1 if it is our start marker, 0 if dropped.
+int LogKlog::queue(const char *buf, size_t len, const char *p,
+                   int pri, log_time now) {
+    if (auditd && strnstr(buf, len, " audit(")) {
+        return 0;
+    }
+
     // sniff for start marker
     const char klogd_message[] = "logd.klogd: ";
     const char *start = strnstr(p, len - (p - buf), klogd_message);
@@ -797,13 +914,12 @@ twoWord:    while (--taglen && !isspace(*++cp) && (*cp != ':'));
         return -EINVAL;
     }
 
-    // Careful.
-    // We are using the stack to house the log buffer for speed reasons.
-    // If we malloc'd this buffer, we could get away without n's USHRT_MAX
-    // test above, but we would then required a max(n, USHRT_MAX) as
-    // truncating length argument to logbuf->log() below. Gain is protection
-    // of stack sanity and speedup, loss is truncated long-line content.
-    char newstr[n];
+    // Lines are accumulated in storage and placed by flush() under a single
+    // acquisition of the LogBuffer lock.
+    if ((batchCount >= batchMax) || ((storageLen + n) > batchStorage)) {
+        flush();
+    }
+    char *newstr = storage.get() + storageLen;
     char *np = newstr;
 
     // Convert priority into single-byte Android logger priority
@@ -845,14 +961,31 @@ twoWord:    while (--taglen && !isspace(*++cp) && (*cp != ':'));
         }
     }
 
-    // Log message
-    int rc = logbuf->log(LOG_ID_KERNEL, now, uid, pid, tid, newstr,
-                         (unsigned short) n);
+    LogBufferIngest &entry = batch[batchCount++];
+    entry.log_id = LOG_ID_KERNEL;
+    entry.realtime = now;
+    entry.uid = uid;
+    entry.pid = pid;
+    entry.tid = tid;
+    entry.msg = newstr;
+    entry.len = n;
+    storageLen += n;
+
+    return n;
+}
+
+// Place the queued lines in the buffer
+void LogKlog::flush() {
+    if (!batchCount) {
+        return;
+    }
+
+    size_t accepted = logbuf->log(batch, batchCount);
+    batchCount = 0;
+    storageLen = 0;
 
     // notify readers
-    if (!rc) {
+    if (accepted) {
         reader->notifyNewLog();
     }
-
-    return rc;
 }
@@ -17,9 +17,13 @@
 #ifndef _LOGD_LOG_KLOG_H__
 #define _LOGD_LOG_KLOG_H__
 
+#include <memory>
+
 #include <sysutils/SocketListener.h>
 #include <log/log_read.h>
 
+#include "LogBuffer.h"
+
 char *log_strntok_r(char *s, size_t *len, char **saveptr, size_t *sublen);
 
 class LogBuffer;
@@ -37,12 +41,29 @@ class LogKlog : public SocketListener {
     // set if we are also running auditd, to filter out audit reports from
     // our copy of the kernel log
     bool auditd;
+    // set if fdRead is /dev/kmsg, rather than /proc/kmsg
+    const bool structured;
+    // of the last /dev/kmsg record
+    uint64_t sequence;
+
+    // Lines parsed but not yet placed in logbuf
+    static const size_t batchMax = 64;
+    static const size_t batchStorage = 64 * 1024;
+    LogBufferIngest batch[batchMax];
+    size_t batchCount;
+    std::unique_ptr<char[]> storage; // content of the batch
+    size_t storageLen;
 
     static log_time correction;
 
 public:
-    LogKlog(LogBuffer *buf, LogReader *reader, int fdWrite, int fdRead, bool auditd);
+    LogKlog(LogBuffer *buf, LogReader *reader, int fdWrite, int fdRead,
+            bool auditd, bool structured);
+    // Queue a line of /proc/kmsg or klogctl() format, followed by flush()
     int log(const char *buf, size_t len);
+    // Queue a /dev/kmsg record, followed by flush()
+    int logKmsg(const char *buf, size_t len);
+    void flush();
     void synchronize(const char *buf, size_t len);
 
     bool isMonotonic() { return logbuf->isMonotonic(); }
@@ -51,7 +72,12 @@ public:
 
 protected:
     void sniffTime(log_time &now, const char **buf, size_t len, bool reverse);
+    void correct(const log_time &now, const char *cp, size_t len,
+                 bool reverse);
     pid_t sniffPid(const char **buf, size_t len);
+    int queue(const char *buf, size_t len, const char *p,
+              int pri, log_time now);
+    bool readKmsg(int fd);
     void calculateCorrection(const log_time &monotonic,
                              const char *real_string, size_t len);
     virtual bool onDataAvailable(SocketClient *cli);
@@ -15,6 +15,7 @@
  */
 
 #include <limits.h>
+#include <string.h>
 #include <sys/cdefs.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
@@ -44,78 +45,126 @@ bool LogListener::onDataAvailable(SocketClient *cli) {
         name_set = true;
     }
 
-    char buffer[sizeof_log_id_t + sizeof(uint16_t) + sizeof(log_time)
-        + LOGGER_ENTRY_MAX_PAYLOAD];
-    struct iovec iov = { buffer, sizeof(buffer) };
-
-    char control[CMSG_SPACE(sizeof(struct ucred))] __aligned(4);
-    struct msghdr hdr = {
-        NULL,
-        0,
-        &iov,
-        1,
-        control,
-        sizeof(control),
-        0,
-    };
+    struct iovec iov[maxBatch];
+    struct mmsghdr msgs[maxBatch];
+    for (unsigned i = 0; i < maxBatch; ++i) {
+        iov[i].iov_base = mDatagram[i].buffer;
+        iov[i].iov_len = sizeof(mDatagram[i].buffer);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = mDatagram[i].control;
+        msgs[i].msg_hdr.msg_controllen = sizeof(mDatagram[i].control);
+    }
 
     int socket = cli->getSocket();
 
     // To clear the entire buffer is secure/safe, but this contributes to 1.68%
     // overhead under logging load. We are safe because we check counts.
     // memset(buffer, 0, sizeof(buffer));
-    ssize_t n = recvmsg(socket, &hdr, 0);
-    if (n <= (ssize_t)(sizeof(android_log_header_t))) {
+    //
+    // Drain whatever has queued up since we were last woken, but do not
+    // wait for more to arrive.
+    int count = recvmmsg(socket, msgs, maxBatch, MSG_DONTWAIT, NULL);
+    if (count <= 0) {
         return false;
     }
 
-    struct ucred *cred = NULL;
+    mEntries.clear();
 
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
-    while (cmsg != NULL) {
-        if (cmsg->cmsg_level == SOL_SOCKET
-                && cmsg->cmsg_type  == SCM_CREDENTIALS) {
-            cred = (struct ucred *)CMSG_DATA(cmsg);
-            break;
+    for (int i = 0; i < count; ++i) {
+        struct msghdr &hdr = msgs[i].msg_hdr;
+        ssize_t n = msgs[i].msg_len;
+        if (n <= (ssize_t)(sizeof(android_log_header_t))) {
+            continue;
         }
-        cmsg = CMSG_NXTHDR(&hdr, cmsg);
-    }
 
-    if (cred == NULL) {
-        return false;
+        struct ucred *cred = NULL;
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        while (cmsg != NULL) {
+            if (cmsg->cmsg_level == SOL_SOCKET
+                    && cmsg->cmsg_type  == SCM_CREDENTIALS) {
+                cred = (struct ucred *)CMSG_DATA(cmsg);
+                break;
+            }
+            cmsg = CMSG_NXTHDR(&hdr, cmsg);
+        }
+
+        if (cred == NULL) {
+            continue;
+        }
+
+        if (cred->uid == AID_LOGD) {
+            // ignore log messages we send to ourself.
+            // Such log messages are often generated by libraries we depend on
+            // which use standard Android logging.
+            continue;
+        }
+
+        char *buffer = mDatagram[i].buffer;
+
+        // NB: hdr.msg_flags & MSG_TRUNC is not tested, silently passing a
+        // truncated message to the logs.
+
+        if (*reinterpret_cast<typeof_log_id_t *>(buffer) != LOGGER_ID_BATCH) {
+            add(reinterpret_cast<android_log_header_t *>(buffer), cred,
+                buffer + sizeof(android_log_header_t),
+                n - sizeof(android_log_header_t));
+            continue;
+        }
+
+        // Entries batched by one thread of the writer, each record is
+        // bounds checked against what was received and the rest of the
+        // datagram dropped at the first that does not fit.
+        android_log_batch_header_t *batch =
+            reinterpret_cast<android_log_batch_header_t *>(buffer);
+        char *end = buffer + n;
+        char *cp = buffer + sizeof(android_log_batch_header_t);
+        for (uint16_t r = 0; r < batch->count; ++r) {
+            if ((size_t)(end - cp) < sizeof(android_log_batch_record_t)) {
+                break;
+            }
+            android_log_batch_record_t *record =
+                reinterpret_cast<android_log_batch_record_t *>(cp);
+            char *msg = cp + sizeof(android_log_batch_record_t);
+            if (!record->len || ((size_t)(end - msg) < record->len)) {
+                break;
+            }
+            add(&record->header, cred, msg, record->len);
+            cp = msg + record->len;
+        }
     }
 
-    if (cred->uid == AID_LOGD) {
-        // ignore log messages we send to ourself.
-        // Such log messages are often generated by libraries we depend on
-        // which use standard Android logging.
-        return false;
+    // One wakeup for the readers per batch
+    if (!mEntries.empty() && logbuf->log(&mEntries[0], mEntries.size())) {
+        reader->notifyNewLog();
     }
 
-    android_log_header_t *header = reinterpret_cast<android_log_header_t *>(buffer);
+    return true;
+}
+
+void LogListener::add(const android_log_header_t *header,
+                      const struct ucred *cred, char *msg, size_t len) {
     if (/* header->id < LOG_ID_MIN || */ header->id >= LOG_ID_MAX || header->id == LOG_ID_KERNEL) {
-        return false;
+        return;
     }
 
     if ((header->id == LOG_ID_SECURITY) &&
             (!__android_log_security() ||
              !clientHasLogCredentials(cred->uid, cred->gid, cred->pid))) {
-        return false;
+        return;
     }
 
-    char *msg = ((char *)buffer) + sizeof(android_log_header_t);
-    n -= sizeof(android_log_header_t);
-
-    // NB: hdr.msg_flags & MSG_TRUNC is not tested, silently passing a
-    // truncated message to the logs.
-
-    if (logbuf->log((log_id_t)header->id, header->realtime,
-            cred->uid, cred->pid, header->tid, msg,
-            ((size_t) n <= USHRT_MAX) ? (unsigned short) n : USHRT_MAX) >= 0) {
-        reader->notifyNewLog();
-    }
-
-    return true;
+    LogBufferIngest entry;
+    entry.log_id = (log_id_t)header->id;
+    entry.realtime = header->realtime;
+    entry.uid = cred->uid;
+    entry.pid = cred->pid;
+    entry.tid = header->tid;
+    entry.msg = msg;
+    entry.len = (len <= USHRT_MAX) ? (unsigned short) len : USHRT_MAX;
+    mEntries.push_back(entry);
 }
 
 int LogListener::getLogSocket() {
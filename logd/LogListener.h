@@ -17,13 +17,34 @@
 #ifndef _LOGD_LOG_LISTENER_H__
 #define _LOGD_LOG_LISTENER_H__
 
+#include <sys/cdefs.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include <log/logger.h>
+#include <private/android_logger.h>
 #include <sysutils/SocketListener.h>
+
+#include "LogBuffer.h"
 #include "LogReader.h"
 
 class LogListener : public SocketListener {
     LogBuffer *logbuf;
     LogReader *reader;
 
+    // Datagrams drained from the socket per wakeup, and placed into the
+    // LogBuffer with a single lock acquisition.
+    static const unsigned maxBatch = 32;
+    struct Datagram {
+        char buffer[sizeof_log_id_t + sizeof(uint16_t) + sizeof(log_time)
+            + LOGGER_ENTRY_MAX_PAYLOAD];
+        char control[CMSG_SPACE(sizeof(struct ucred))] __aligned(4);
+    } mDatagram[maxBatch];
+    // Entries parsed from the datagrams, a batched datagram from liblog
+    // carries many.
+    std::vector<LogBufferIngest> mEntries;
+
 public:
     LogListener(LogBuffer *buf, LogReader *reader);
 
@@ -32,6 +53,8 @@ protected:
 
 private:
     static int getLogSocket();
+    void add(const android_log_header_t *header, const struct ucred *cred,
+             char *msg, size_t len);
 };
 
 #endif
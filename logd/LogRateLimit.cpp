@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+#include <private/android_filesystem_config.h>
+
+#include "LogRateLimit.h"
+#include "LogUtils.h"
+
+LogRateLimit::LogRateLimit() :
+        mTagRules(false),
+        mDropping(0),
+        mDue(0),
+        mSwept(0) {
+    init(NULL);
+}
+
+uint64_t LogRateLimit::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static bool parseNumber(const char *&str, unsigned &value) {
+    if (!isdigit(*str)) {
+        return false;
+    }
+    value = 0;
+    do {
+        value = value * 10 + *str++ - '0';
+    } while (isdigit(*str));
+    return true;
+}
+
+int LogRateLimit::init(const char *str) {
+    static const char _default[] = "default";
+    // default here means take ro.logd.ratelimit, persist.logd.ratelimit
+    // then internal default in that order.
+    if (str && !strcmp(str, _default)) {
+        str = NULL;
+    }
+    static const char _disable[] = "disable";
+    if (str && !strcmp(str, _disable)) {
+        str = "";
+    }
+
+    std::string limits;
+
+    if (str) {
+        limits = str;
+    } else {
+        char property[PROPERTY_VALUE_MAX];
+        property_get("ro.logd.ratelimit", property, _default);
+        limits = property;
+        property_get("persist.logd.ratelimit", property, limits.c_str());
+        // default here means take ro.logd.ratelimit
+        if (strcmp(property, _default)) {
+            limits = property;
+        }
+    }
+
+    // default here means take internal default, which is no limits.
+    if ((limits == _default) || (limits == _disable)) {
+        limits = "";
+    }
+
+    // See README.property for description of the format
+    std::vector<Rule> rules;
+    for (str = limits.c_str(); *str; ++str) {
+        if (isspace(*str)) {
+            continue;
+        }
+
+        Rule rule;
+        unsigned uid;
+        if (*str == '*') {
+            rule.uid = uid_all;
+            ++str;
+        } else if (parseNumber(str, uid)) {
+            rule.uid = uid;
+        } else {
+            return 1;
+        }
+
+        if (*str == ':') {
+            const char *tag = ++str;
+            while (*str && (*str != '=') && !isspace(*str)) {
+                ++str;
+            }
+            if (str == tag) {
+                return 1;
+            }
+            rule.tag.assign(tag, str - tag);
+        }
+
+        if ((*str++ != '=') || !parseNumber(str, rule.rate) || !rule.rate) {
+            return 1;
+        }
+        rule.burst = rule.rate;
+        if ((*str == '/') && (!parseNumber(++str, rule.burst) || !rule.burst)) {
+            return 1;
+        }
+
+        if (*str && !isspace(*str)) {
+            return 1;
+        }
+
+        // a later rule for the same uid and tag replaces the earlier one
+        std::vector<Rule>::iterator it;
+        for (it = rules.begin(); it != rules.end(); ++it) {
+            if ((it->uid == rule.uid) && (it->tag == rule.tag)) {
+                *it = rule;
+                break;
+            }
+        }
+        if (it == rules.end()) {
+            rules.push_back(rule);
+        }
+        if (!*str) {
+            break;
+        }
+    }
+
+    // Buckets point at the rules they were filled by, start them afresh
+    mUidBuckets.clear();
+    mTagBuckets.clear();
+    mDropping = 0;
+    mRules.swap(rules);
+    mTagRules = false;
+    for (size_t i = 0; i < mRules.size(); ++i) {
+        mTagRules |= !mRules[i].tag.empty();
+    }
+    mSwept = now();
+
+    return 0;
+}
+
+std::string LogRateLimit::format() const {
+    std::string string;
+
+    for (size_t i = 0; i < mRules.size(); ++i) {
+        const Rule &rule = mRules[i];
+        if (!string.empty()) {
+            string += " ";
+        }
+        string += (rule.uid == uid_all)
+            ? std::string("*")
+            : android::base::StringPrintf("%u", rule.uid);
+        if (!rule.tag.empty()) {
+            string += ":" + rule.tag;
+        }
+        string += android::base::StringPrintf("=%u", rule.rate);
+        if (rule.burst != rule.rate) {
+            string += android::base::StringPrintf("/%u", rule.burst);
+        }
+    }
+
+    return string;
+}
+
+const LogRateLimit::Rule *LogRateLimit::findUid(uid_t uid) const {
+    const Rule *all = NULL;
+    for (size_t i = 0; i < mRules.size(); ++i) {
+        const Rule &rule = mRules[i];
+        if (!rule.tag.empty()) {
+            continue;
+        }
+        if (rule.uid == uid) {
+            return &rule;
+        }
+        if (rule.uid == uid_all) {
+            all = &rule;
+        }
+    }
+    return all;
+}
+
+const LogRateLimit::Rule *LogRateLimit::findTag(uid_t uid, const char *tag,
+                                                size_t tagLen) const {
+    const Rule *all = NULL;
+    for (size_t i = 0; i < mRules.size(); ++i) {
+        const Rule &rule = mRules[i];
+        if ((rule.tag.length() != tagLen)
+                || ((rule.uid != uid) && (rule.uid != uid_all))
+                || memcmp(rule.tag.data(), tag, tagLen)) {
+            continue;
+        }
+        if (rule.uid == uid) {
+            return &rule;
+        }
+        all = &rule;
+    }
+    return all;
+}
+
+void LogRateLimit::refill(Bucket &b, uint64_t now) {
+    if (now > b.last) {
+        b.tokens += (now - b.last) * b.rule->rate / 1000.0;
+        if (b.tokens > b.rule->burst) {
+            b.tokens = b.rule->burst;
+        }
+        b.last = now;
+    }
+}
+
+void LogRateLimit::drop(Bucket &b, uint64_t now, log_id_t id,
+                        log_time realtime, uid_t uid, pid_t pid, pid_t tid,
+                        unsigned short len) {
+    if (!b.dropped.lines) {
+        if (!mDropping || ((now + summaryMs) < mDue)) {
+            mDue = now + summaryMs;
+        }
+        ++mDropping;
+        b.firstDrop = now;
+        b.dropped.bytes = 0;
+    }
+    ++b.dropped.lines;
+    b.dropped.bytes += len;
+    b.dropped.id = id;
+    b.dropped.realtime = realtime;
+    b.dropped.uid = uid;
+    b.dropped.pid = pid;
+    b.dropped.tid = tid;
+}
+
+bool LogRateLimit::allow(log_id_t id, log_time realtime, uid_t uid,
+                         pid_t pid, pid_t tid, const char *msg,
+                         unsigned short len) {
+    if (mRules.empty() || (id == LOG_ID_SECURITY) || (id == LOG_ID_KERNEL)
+            || (uid == AID_LOGD)) {
+        return true;
+    }
+
+    uint64_t ms = now();
+
+    Bucket *u = NULL;
+    const Rule *rule = findUid(uid);
+    if (rule) {
+        std::unordered_map<uid_t, Bucket>::iterator it = mUidBuckets.find(uid);
+        if (it == mUidBuckets.end()) {
+            Bucket &b = mUidBuckets[uid];
+            b.rule = rule;
+            b.tokens = rule->burst;
+            b.last = ms;
+            b.dropped.lines = 0;
+            u = &b;
+        } else {
+            u = &it->second;
+            refill(*u, ms);
+        }
+    }
+
+    // Tags of the text buffers only, event tags are numbers
+    Bucket *t = NULL;
+    if (mTagRules && (id != LOG_ID_EVENTS) && (len >= 2)) {
+        const char *tag = msg + 1;
+        size_t tagLen = strnlen(tag, len - 1);
+        rule = findTag(uid, tag, tagLen);
+        if (rule) {
+            uint64_t key = (static_cast<uint64_t>(uid) << 32)
+                         | hashTag(tag, tagLen);
+            std::unordered_map<uint64_t, Bucket>::iterator it =
+                mTagBuckets.find(key);
+            if (it == mTagBuckets.end()) {
+                Bucket &b = mTagBuckets[key];
+                b.rule = rule;
+                b.tokens = rule->burst;
+                b.last = ms;
+                b.dropped.lines = 0;
+                b.dropped.tag.assign(tag, tagLen);
+                t = &b;
+            } else {
+                t = &it->second;
+                refill(*t, ms);
+            }
+        }
+    }
+
+    // Both must have a token for the entry, the drop is put down to
+    // the uid if it is over, otherwise to the tag.
+    if (u && (u->tokens < 1)) {
+        drop(*u, ms, id, realtime, uid, pid, tid, len);
+        return false;
+    }
+    if (t && (t->tokens < 1)) {
+        drop(*t, ms, id, realtime, uid, pid, tid, len);
+        return false;
+    }
+    if (u) {
+        u->tokens -= 1;
+    }
+    if (t) {
+        t->tokens -= 1;
+    }
+    return true;
+}
+
+void LogRateLimit::collect(Bucket &b, uint64_t now,
+                           std::vector<Summary> &out) {
+    if (!b.dropped.lines) {
+        return;
+    }
+    if ((now - b.firstDrop) < summaryMs) {
+        if ((b.firstDrop + summaryMs) < mDue) {
+            mDue = b.firstDrop + summaryMs;
+        }
+        return;
+    }
+    out.push_back(b.dropped);
+    b.dropped.lines = 0;
+    --mDropping;
+}
+
+// Buckets that have filled up again are as good as new, let them go
+void LogRateLimit::sweep(uint64_t now) {
+    mSwept = now;
+    for (std::unordered_map<uid_t, Bucket>::iterator it = mUidBuckets.begin();
+            it != mUidBuckets.end();) {
+        refill(it->second, now);
+        bool full = !it->second.dropped.lines
+                 && (it->second.tokens >= it->second.rule->burst);
+        it = full ? mUidBuckets.erase(it) : ++it;
+    }
+    for (std::unordered_map<uint64_t, Bucket>::iterator it = mTagBuckets.begin();
+            it != mTagBuckets.end();) {
+        refill(it->second, now);
+        bool full = !it->second.dropped.lines
+                 && (it->second.tokens >= it->second.rule->burst);
+        it = full ? mTagBuckets.erase(it) : ++it;
+    }
+}
+
+void LogRateLimit::summaries(std::vector<Summary> &out) {
+    if (mUidBuckets.empty() && mTagBuckets.empty()) {
+        return;
+    }
+
+    uint64_t ms = now();
+
+    if (mDropping && (ms >= mDue)) {
+        mDue = UINT64_MAX;
+        for (std::unordered_map<uid_t, Bucket>::iterator it = mUidBuckets.begin();
+                it != mUidBuckets.end(); ++it) {
+            collect(it->second, ms, out);
+        }
+        for (std::unordered_map<uint64_t, Bucket>::iterator it = mTagBuckets.begin();
+                it != mTagBuckets.end(); ++it) {
+            collect(it->second, ms, out);
+        }
+    }
+
+    if ((ms - mSwept) >= (60 * 1000)) {
+        sweep(ms);
+    }
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_RATE_LIMIT_H__
+#define _LOGD_LOG_RATE_LIMIT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <log/log.h>
+#include <log/log_read.h>
+
+// Token buckets per uid, and optionally per uid and tag, checked as entries
+// arrive so that a chatty writer is held to its rate before it can push
+// everyone else out of the buffer. Entries over the rate are counted, not
+// stored, and each bucket that dropped any is reported at most once a
+// second by a single summary. See README.property for the rule format.
+class LogRateLimit {
+public:
+    static const uid_t uid_all = (uid_t) -1;
+    static const unsigned summaryMs = 1000;
+
+    struct Summary {
+        log_id_t id;            // of the last entry dropped
+        log_time realtime;
+        uid_t uid;
+        pid_t pid;
+        pid_t tid;
+        std::string tag;        // empty if the limit is for the uid
+        size_t lines;
+        size_t bytes;
+    };
+
+private:
+    struct Rule {
+        uid_t uid;              // or uid_all
+        std::string tag;        // empty for all
+        unsigned rate;          // lines per second
+        unsigned burst;         // bucket size
+    };
+
+    struct Bucket {
+        const Rule *rule;
+        double tokens;
+        uint64_t last;          // ms, when tokens were topped up
+        Summary dropped;        // lines is 0 if none
+        uint64_t firstDrop;     // ms
+    };
+
+    std::vector<Rule> mRules;
+    bool mTagRules;             // any, or the tag need not be looked at
+    std::unordered_map<uid_t, Bucket> mUidBuckets;
+    std::unordered_map<uint64_t, Bucket> mTagBuckets; // uid << 32 | tag hash
+    size_t mDropping;           // buckets with a summary to come
+    uint64_t mDue;              // ms, of the first of those
+    uint64_t mSwept;
+
+    static uint64_t now();
+    // A uid rule is preferred to *, likewise for the uid:tag rules
+    const Rule *findUid(uid_t uid) const;
+    const Rule *findTag(uid_t uid, const char *tag, size_t tagLen) const;
+    static void refill(Bucket &b, uint64_t now);
+    void drop(Bucket &b, uint64_t now, log_id_t id, log_time realtime,
+              uid_t uid, pid_t pid, pid_t tid, unsigned short len);
+    void collect(Bucket &b, uint64_t now, std::vector<Summary> &out);
+    void sweep(uint64_t now);
+
+public:
+    LogRateLimit();
+
+    // NULL for the properties, returns 0, or 1 if str does not parse
+    int init(const char *str);
+    std::string format() const;
+
+    // Returns false if the entry is over its rate, and is to be dropped
+    bool allow(log_id_t id, log_time realtime, uid_t uid, pid_t pid,
+               pid_t tid, const char *msg, unsigned short len);
+    // Adds the summaries that are due to out
+    void summaries(std::vector<Summary> &out);
+};
+
+#endif // _LOGD_LOG_RATE_LIMIT_H__
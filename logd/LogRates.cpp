@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <private/android_filesystem_config.h>
+#include <private/android_logger.h>
+
+#include "LogRates.h"
+#include "LogStatistics.h"
+#include "LogUtils.h"
+
+const unsigned LogRates::windowSeconds[LogRates::windows] = { 1, 10, 60 };
+
+// Weight left to the rate after a tick, for each window
+static double decay(size_t window, uint64_t ticks) {
+    return exp(-(double)ticks * LogRates::tickMs
+                   / (LogRates::windowSeconds[window] * 1000.0));
+}
+
+LogRates::Counter::Counter() : tick(0), pendingBytes(0), pendingLines(0) {
+    for (size_t w = 0; w < windows; ++w) {
+        bytes[w] = 0;
+        lines[w] = 0;
+    }
+}
+
+void LogRates::Counter::at(uint64_t now, double b[windows],
+                           double l[windows]) const {
+    for (size_t w = 0; w < windows; ++w) {
+        b[w] = bytes[w];
+        l[w] = lines[w];
+        if (now <= tick) {
+            continue;
+        }
+        // Fold in the tick the pending counts are for, then the idle ticks
+        double a = decay(w, 1);
+        b[w] = b[w] * a + (pendingBytes * 1000.0 / tickMs) * (1 - a);
+        l[w] = l[w] * a + (pendingLines * 1000.0 / tickMs) * (1 - a);
+        if ((now - tick) > 1) {
+            a = decay(w, now - tick - 1);
+            b[w] *= a;
+            l[w] *= a;
+        }
+    }
+}
+
+void LogRates::Counter::add(uint64_t now, unsigned short len) {
+    if (now != tick) {
+        double b[windows], l[windows];
+        at(now, b, l);
+        for (size_t w = 0; w < windows; ++w) {
+            bytes[w] = b[w];
+            lines[w] = l[w];
+        }
+        tick = now;
+        pendingBytes = 0;
+        pendingLines = 0;
+    }
+    pendingBytes += len;
+    ++pendingLines;
+}
+
+LogRates::LogRates() : mSwept(now()) {
+}
+
+uint64_t LogRates::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000) / tickMs;
+}
+
+size_t LogRates::TagKeyHash::operator() (const TagKey &key) const {
+    return key.id ? key.id : hashTag(key.name.data(), key.name.length());
+}
+
+void LogRates::add(log_id_t id, uid_t uid, pid_t pid,
+                   const char *msg, unsigned short len) {
+    uint64_t tick = now();
+
+    mUids[uid].add(tick, len);
+
+    PidRate &p = mPids[pid];
+    p.counter.add(tick, len);
+    p.uid = uid;
+
+    // Event tags are numbers, keyed apart from text tags
+    TagKey key;
+    if ((id == LOG_ID_EVENTS) || (id == LOG_ID_SECURITY)) {
+        if (len < sizeof(android_event_header_t)) {
+            return;
+        }
+        key.id = (1ULL << 32) | le32toh(
+            reinterpret_cast<const android_event_header_t *>(msg)->tag);
+    } else {
+        if (len < 2) {
+            return;
+        }
+        key.id = 0;
+        key.name.assign(msg + 1, strnlen(msg + 1, len - 1));
+    }
+
+    TagRates::iterator it = mTags.find(key);
+    if (it == mTags.end()) {
+        if (mTags.size() >= maxTags) {
+            evictTags(tick);
+        }
+        TagRate &t = mTags[key];
+        t.uid = uid;
+        t.pid = pid;
+        t.counter.add(tick, len);
+    } else {
+        TagRate &t = it->second;
+        if (t.uid != uid) {
+            t.uid = -1;
+        }
+        if (t.pid != pid) {
+            t.pid = -1;
+        }
+        t.counter.add(tick, len);
+    }
+
+    if ((tick - mSwept) >= (60 * 1000 / tickMs)) {
+        sweep(tick);
+    }
+}
+
+// Under a line a minute, and nothing pending, is gone quiet
+static bool quiet(const LogRates::Counter &counter, uint64_t now) {
+    double b[LogRates::windows], l[LogRates::windows];
+    counter.at(now, b, l);
+    return (l[LogRates::windows - 1] < (1 / 60.0)) && (now > counter.tick);
+}
+
+void LogRates::sweep(uint64_t now) {
+    mSwept = now;
+    for (std::unordered_map<uid_t, Counter>::iterator it = mUids.begin();
+            it != mUids.end();) {
+        it = quiet(it->second, now) ? mUids.erase(it) : ++it;
+    }
+    for (std::unordered_map<pid_t, PidRate>::iterator it = mPids.begin();
+            it != mPids.end();) {
+        it = quiet(it->second.counter, now) ? mPids.erase(it) : ++it;
+    }
+    for (TagRates::iterator it = mTags.begin(); it != mTags.end();) {
+        it = quiet(it->second.counter, now) ? mTags.erase(it) : ++it;
+    }
+}
+
+// Drops the slowest quarter of the tags over 10 seconds, the order they
+// are reported in. Done a quarter at a time so that a stream of new tags
+// pays for a pass over the table once every few hundred entries.
+void LogRates::evictTags(uint64_t now) {
+    struct Slowest {
+        double rate;
+        TagRates::iterator it;
+
+        bool operator< (const Slowest &T) const {
+            return rate < T.rate;
+        }
+    };
+
+    std::vector<Slowest> tags;
+    tags.reserve(mTags.size());
+    for (TagRates::iterator it = mTags.begin(); it != mTags.end(); ++it) {
+        double b[windows], l[windows];
+        it->second.counter.at(now, b, l);
+        Slowest slowest = { b[1], it };
+        tags.push_back(slowest);
+    }
+    size_t count = tags.size() / 4 + 1;
+    if (count < tags.size()) {
+        std::nth_element(tags.begin(), tags.begin() + count, tags.end());
+    } else {
+        count = tags.size();
+    }
+    for (size_t i = 0; i < count; ++i) {
+        mTags.erase(tags[i].it);
+    }
+}
+
+namespace {
+
+static const size_t maximum_sorted_entries = 16;
+
+struct Row {
+    double bytes[LogRates::windows];
+    double lines[LogRates::windows];
+    std::string name;
+
+    bool operator< (const Row &T) const {
+        return bytes[1] > T.bytes[1]; // fastest over 10 seconds first
+    }
+};
+
+// The fastest rows, and those not yet gone quiet
+void trim(std::vector<Row> &rows) {
+    size_t len = std::min(rows.size(), maximum_sorted_entries);
+    std::partial_sort(rows.begin(), rows.begin() + len, rows.end());
+    rows.resize(len);
+    while (!rows.empty()
+            && (rows.back().lines[LogRates::windows - 1] < (1 / 60.0))) {
+        rows.pop_back();
+    }
+}
+
+// Keep the columns narrow, a rate to three or so significant figures
+std::string formatRate(double rate) {
+    if (rate >= 10000000) {
+        return android::base::StringPrintf("%.0fM", rate / 1000000);
+    }
+    if (rate >= 10000) {
+        return android::base::StringPrintf("%.0fK", rate / 1000);
+    }
+    if (rate >= 100) {
+        return android::base::StringPrintf("%.0f", rate);
+    }
+    return android::base::StringPrintf("%.1f", rate);
+}
+
+std::string formatRows(const std::string &title, const std::string &header,
+                       const std::vector<Row> &rows) {
+    std::string output;
+    if (rows.empty()) {
+        return output;
+    }
+    output = "\n\n" + title + "\n";
+    output += android::base::StringPrintf("%-26s", header.c_str());
+    for (size_t w = 0; w < LogRates::windows; ++w) {
+        output += android::base::StringPrintf(" %15s",
+            android::base::StringPrintf("%us", LogRates::windowSeconds[w]).c_str());
+    }
+    output += "\n";
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const Row &row = rows[i];
+        output += android::base::StringPrintf("%-26s", row.name.c_str());
+        for (size_t w = 0; w < LogRates::windows; ++w) {
+            output += android::base::StringPrintf(" %15s",
+                (formatRate(row.bytes[w]) + "/"
+                    + formatRate(row.lines[w])).c_str());
+        }
+        output += "\n";
+    }
+    return output;
+}
+
+std::string nameColumn(const std::string &number, int width,
+                       const char *name) {
+    std::string output = number;
+    if (name) {
+        output += android::base::StringPrintf(
+            "%*s%s", (int)std::max(width - (int)number.length(), 1),
+            "", name);
+    }
+    return output;
+}
+
+}
+
+std::string LogRates::format(const LogStatistics &stat,
+                             uid_t uid, pid_t pid) const {
+    uint64_t tick = now();
+    std::vector<Row> rows;
+    std::string output;
+
+    if (!pid) {
+        for (std::unordered_map<uid_t, Counter>::const_iterator it = mUids.begin();
+                it != mUids.end(); ++it) {
+            if ((uid != AID_ROOT) && (uid != it->first)) {
+                continue;
+            }
+            Row row;
+            it->second.at(tick, row.bytes, row.lines);
+            const char *name = stat.uidToName(it->first);
+            row.name = nameColumn(android::base::StringPrintf("%u", it->first),
+                                  6, name);
+            free(const_cast<char *>(name));
+            rows.push_back(row);
+        }
+        trim(rows);
+        output += formatRows("Fastest UIDs, bytes/lines per second:",
+                             "UID   PACKAGE", rows);
+        rows.clear();
+    }
+
+    for (std::unordered_map<pid_t, PidRate>::const_iterator it = mPids.begin();
+            it != mPids.end(); ++it) {
+        if (((uid != AID_ROOT) && (uid != it->second.uid))
+                || (pid && (pid != it->first))) {
+            continue;
+        }
+        Row row;
+        it->second.counter.at(tick, row.bytes, row.lines);
+        row.name = android::base::StringPrintf("%5u/%u", it->first,
+                                               it->second.uid);
+        rows.push_back(row);
+    }
+    trim(rows);
+    // Names only for those that made the cut, they come from /proc
+    for (size_t i = 0; i < rows.size(); ++i) {
+        pid_t p = atol(rows[i].name.c_str());
+        char *name = android::pidToName(p);
+        rows[i].name = nameColumn(rows[i].name, 12, name);
+        free(name);
+    }
+    output += formatRows("Fastest PIDs, bytes/lines per second:",
+                         "  PID/UID   COMMAND LINE", rows);
+    rows.clear();
+
+    for (TagRates::const_iterator it = mTags.begin();
+            it != mTags.end(); ++it) {
+        const TagRate &t = it->second;
+        if (((uid != AID_ROOT) && (uid != t.uid))
+                || (pid && (pid != t.pid))) {
+            continue;
+        }
+        Row row;
+        t.counter.at(tick, row.bytes, row.lines);
+        if (it->first.id) {
+            uint32_t tag = it->first.id;
+            std::string number = (t.uid == (uid_t)-1)
+                ? android::base::StringPrintf("%7u", tag)
+                : android::base::StringPrintf("%7u/%u", tag, t.uid);
+            row.name = nameColumn(number, 14, android::tagToName(tag));
+        } else {
+            const std::string &name = it->first.name;
+            row.name = (t.uid == (uid_t)-1)
+                ? name
+                : android::base::StringPrintf("%s/%u", name.c_str(), t.uid);
+        }
+        rows.push_back(row);
+    }
+    trim(rows);
+    output += formatRows("Fastest TAGs, bytes/lines per second:",
+                         "    TAG/UID   TAGNAME", rows);
+
+    return output;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_RATES_H__
+#define _LOGD_LOG_RATES_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <unordered_map>
+
+#include <log/log.h>
+
+class LogStatistics;
+
+// Bytes and lines per second logged by each uid, pid and tag, exponentially
+// decayed over 1, 10 and 60 seconds. Counts gather for a tick and are
+// folded into the rates by the first entry of a later tick, so the cost of
+// an entry is three table lookups and, once a tick, a little arithmetic.
+// Entries that have gone quiet are swept out once a minute.
+class LogRates {
+public:
+    static const size_t windows = 3;
+    static const unsigned windowSeconds[windows];
+    static const unsigned tickMs = 250;
+
+    struct Counter {
+        uint64_t tick;          // that pending counts are for
+        uint32_t pendingBytes;
+        uint32_t pendingLines;
+        float bytes[windows];   // per second
+        float lines[windows];
+
+        Counter();
+        void add(uint64_t now, unsigned short len);
+        // Rates as of the start of tick now
+        void at(uint64_t now, double bytes[windows],
+                double lines[windows]) const;
+    };
+
+private:
+    struct PidRate {
+        Counter counter;
+        uid_t uid;
+    };
+
+    // Tags are told apart by their text, not just its hash, so that two
+    // tags cannot be counted as one.
+    struct TagKey {
+        uint64_t id;            // (1 << 32) | number for events, else 0
+        std::string name;       // of a text tag, events are looked up
+
+        bool operator== (const TagKey &T) const {
+            return (id == T.id) && (name == T.name);
+        }
+    };
+
+    struct TagKeyHash {
+        size_t operator() (const TagKey &key) const;
+    };
+
+    struct TagRate {
+        Counter counter;
+        uid_t uid;              // -1 if more than one
+        pid_t pid;              // -1 if more than one
+    };
+
+    typedef std::unordered_map<TagKey, TagRate, TagKeyHash> TagRates;
+
+    // Past this many tags the slowest are dropped, a stream of new tags
+    // must not grow the table between sweeps.
+    static const size_t maxTags = 1024;
+
+    std::unordered_map<uid_t, Counter> mUids;
+    std::unordered_map<pid_t, PidRate> mPids;
+    TagRates mTags;
+    uint64_t mSwept;
+
+    void sweep(uint64_t now);
+    void evictTags(uint64_t now);
+
+public:
+    LogRates();
+
+    static uint64_t now();
+
+    // An entry as it arrives
+    void add(log_id_t id, uid_t uid, pid_t pid,
+             const char *msg, unsigned short len);
+    // uid and pid select as they do for LogStatistics::format
+    std::string format(const LogStatistics &stat,
+                       uid_t uid, pid_t pid) const;
+};
+
+#endif // _LOGD_LOG_RATES_H__
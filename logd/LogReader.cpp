@@ -20,11 +20,15 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <memory>
+
 #include <cutils/sockets.h>
+#include <private/android_logger.h>
 
 #include "FlushCommand.h"
 #include "LogBuffer.h"
 #include "LogBufferElement.h"
+#include "LogFilter.h"
 #include "LogReader.h"
 #include "LogUtils.h"
 
@@ -47,7 +51,8 @@ bool LogReader::onDataAvailable(SocketClient *cli) {
         name_set = true;
     }
 
-    char buffer[255];
+    // Room for the reader supplied filters
+    char buffer[1024];
 
     int len = read(cli->getSocket(), buffer, sizeof(buffer) - 1);
     if (len <= 0) {
@@ -56,6 +61,16 @@ bool LogReader::onDataAvailable(SocketClient *cli) {
     }
     buffer[len] = '\0';
 
+    // Cuts any regex from the buffer, so must precede the other parameters
+    std::shared_ptr<LogFilter> filter(new LogFilter);
+    if (filter->init(buffer)) {
+        doSocketDelete(cli);
+        return false;
+    }
+    if (filter->empty()) {
+        filter.reset();
+    }
+
     unsigned long tail = 0;
     static const char _tail[] = " tail=";
     char *cp = strstr(buffer, _tail);
@@ -106,6 +121,14 @@ bool LogReader::onDataAvailable(SocketClient *cli) {
         pid = atol(cp + sizeof(_pid) - 1);
     }
 
+    // Compact headers, see LOGGER_COMPACT_MAGIC, for readers that ask
+    bool compact = false;
+    static const char _format[] = " format=";
+    cp = strstr(buffer, _format);
+    if (cp) {
+        compact = atol(cp + sizeof(_format) - 1) == 2;
+    }
+
     bool nonBlock = false;
     if (!fast<strncmp>(buffer, "dumpAndClose", 12)) {
         // Allow writer to get some cycles, and wait for pending notifications
@@ -179,12 +202,22 @@ bool LogReader::onDataAvailable(SocketClient *cli) {
         }
     }
 
-    FlushCommand command(*this, nonBlock, tail, logMask, pid, sequence, timeout);
+    FlushCommand command(*this, nonBlock, tail, logMask, pid, sequence, timeout,
+                         filter, compact);
 
     // Set acceptable upper limit to wait for slow reader processing b/27242723
     struct timeval t = { LOGD_SNDTIMEO, 0 };
     setsockopt(cli->getSocket(), SOL_SOCKET, SO_SNDTIMEO, (const char *)&t, sizeof(t));
 
+    // Ahead of any entry, tells the reader its request was understood
+    if (compact) {
+        android_log_compact_hello_t hello = { LOGGER_COMPACT_MAGIC };
+        if (cli->sendData(&hello, sizeof(hello))) {
+            doSocketDelete(cli);
+            return false;
+        }
+    }
+
     command.runSocketCommand(cli);
     return true;
 }
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#include <cutils/ashmem.h>
+#include <private/android_filesystem_config.h>
+
+#include "LogShm.h"
+
+LogShm::LogShm(LogBuffer *buf, LogReader *reader) :
+        logbuf(buf),
+        reader(reader),
+        mEpollFd(-1) {
+    pthread_mutex_init(&mLock, NULL);
+}
+
+int LogShm::startListener() {
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd < 0) {
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr)) {
+        return -1;
+    }
+    int ret = -1;
+    if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)) {
+        pthread_t thread;
+        if (!pthread_create(&thread, &attr, threadStart, this)) {
+            ret = 0;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+// mLock assumed
+int LogShm::admit(uid_t uid, pid_t pid) {
+    if (mRings.size() >= maxRings) {
+        return -ENOSPC;
+    }
+    size_t count = 0;
+    for (std::list<Ring *>::iterator it = mRings.begin();
+            it != mRings.end(); ++it) {
+        if ((*it)->pid == pid) {
+            return -EBUSY;
+        }
+        if (((*it)->uid == uid) && (++count >= maxRingsPerUid)) {
+            return -ENOSPC;
+        }
+    }
+    return 0;
+}
+
+ssize_t LogShm::create(SocketClient *cli, int fds[2]) {
+    // Entries in the ring are stamped with the peer credentials taken here,
+    // do without a ring if the kernel could not tell us who this is.
+    uid_t uid = cli->getUid();
+    pid_t pid = cli->getPid();
+    if ((uid == AID_LOGD) || (uid == (uid_t)-1) || (pid <= 0)) {
+        return -EPERM;
+    }
+
+    pthread_mutex_lock(&mLock);
+    int ret = admit(uid, pid);
+    pthread_mutex_unlock(&mLock);
+    if (ret) {
+        return ret;
+    }
+
+    size_t len = sizeof(android_log_shm_header_t) + ringSize;
+    int fd = ashmem_create_region("logd-shm", len);
+    if (fd < 0) {
+        return -errno;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    int sock = fcntl(cli->getSocket(), F_DUPFD_CLOEXEC, 0);
+    if (sock < 0) {
+        int err = errno;
+        munmap(map, len);
+        close(fd);
+        return -err;
+    }
+    // Each ring has an eventfd of its own, one client can neither swallow
+    // another's wakeups nor watch when it writes.
+    int event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int eventDup = (event < 0) ? -1 : fcntl(event, F_DUPFD_CLOEXEC, 0);
+    if (eventDup < 0) {
+        int err = errno;
+        if (event >= 0) {
+            close(event);
+        }
+        close(sock);
+        munmap(map, len);
+        close(fd);
+        return -err;
+    }
+
+    Ring *ring = new Ring;
+    ring->header = static_cast<android_log_shm_header_t *>(map);
+    ring->header->magic = LOGGER_SHM_MAGIC;
+    ring->header->size = ringSize;
+    // Asleep until told otherwise, the first entry kicks us
+    ring->header->sleeping = 1;
+    ring->header->head = 0;
+    ring->header->tail = 0;
+    ring->sock = sock;
+    ring->event = event;
+    ring->uid = uid;
+    ring->gid = cli->getGid();
+    ring->pid = pid;
+    ring->hangup = false;
+
+    // The client holds its end of the control socket for as long as it
+    // uses the ring, we only care to hear that it has gone. Both are
+    // registered with the ring, told apart by their events.
+    struct epoll_event hangup;
+    memset(&hangup, 0, sizeof(hangup));
+    hangup.events = EPOLLRDHUP;
+    hangup.data.ptr = ring;
+    struct epoll_event kick;
+    memset(&kick, 0, sizeof(kick));
+    kick.events = EPOLLIN;
+    kick.data.ptr = ring;
+
+    pthread_mutex_lock(&mLock);
+    ret = admit(uid, pid);
+    if (!ret && epoll_ctl(mEpollFd, EPOLL_CTL_ADD, sock, &hangup)) {
+        ret = -errno;
+    }
+    if (!ret && epoll_ctl(mEpollFd, EPOLL_CTL_ADD, event, &kick)) {
+        ret = -errno;
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, sock, NULL);
+    }
+    if (ret) {
+        pthread_mutex_unlock(&mLock);
+        close(eventDup);
+        close(event);
+        close(sock);
+        munmap(map, len);
+        delete ring;
+        close(fd);
+        return ret;
+    }
+    mRings.push_back(ring);
+    pthread_mutex_unlock(&mLock);
+
+    // The ring may be released before the caller has sent these on, so
+    // it gets a duplicate of the eventfd to close along with the ring.
+    fds[0] = fd;
+    fds[1] = eventDup;
+    return ringSize;
+}
+
+void *LogShm::threadStart(void *obj) {
+    prctl(PR_SET_NAME, "logd.shm");
+    static_cast<LogShm *>(obj)->threadLoop();
+    return NULL;
+}
+
+// mLock assumed
+bool LogShm::drain(Ring *ring) {
+    static const size_t align = LOGGER_SHM_ALIGN;
+    android_log_shm_header_t *header = ring->header;
+    char *data = reinterpret_cast<char *>(header + 1);
+
+    // The producer is trusted with its own entries only, anything that
+    // does not add up gets the ring released.
+    uint64_t tail = header->tail;
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+    if ((head - tail) > ringSize) {
+        ring->hangup = true;
+        return false;
+    }
+
+    size_t collected = mEntries.size();
+    while (tail != head) {
+        size_t offset = tail & (ringSize - 1);
+        size_t left = ringSize - offset;
+        if (left > (head - tail)) {
+            left = head - tail;
+        }
+        if (left < sizeof(android_log_batch_record_t)) {
+            tail += left;
+            continue;
+        }
+        android_log_batch_record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+        if (record.header.id == LOGGER_ID_BATCH) {
+            tail += left;
+            continue;
+        }
+        size_t need = (sizeof(record) + record.len + align - 1) & ~(align - 1);
+        if ((need > left) || (record.len > LOGGER_ENTRY_MAX_PAYLOAD)) {
+            ring->hangup = true;
+            break;
+        }
+        // Security entries go through the socket to be checked
+        if ((record.header.id < LOG_ID_MAX)
+                && (record.header.id != LOG_ID_KERNEL)
+                && (record.header.id != LOG_ID_SECURITY)
+                && record.len) {
+            // The producer can still write to the ring, so parse a copy
+            // of our own that cannot change between checks and use.
+            size_t copy = mData.size();
+            mData.resize(copy + record.len);
+            memcpy(&mData[copy], data + offset + sizeof(record), record.len);
+            // isLoggable() takes the tag as a string
+            if ((record.header.id != LOG_ID_EVENTS)
+                    && ((record.len < 2)
+                        || !memchr(&mData[copy + 1], '\0', record.len - 1))) {
+                mData.resize(copy);
+                ring->hangup = true;
+                break;
+            }
+            LogBufferIngest entry;
+            entry.log_id = static_cast<log_id_t>(record.header.id);
+            entry.realtime = record.header.realtime;
+            entry.uid = ring->uid;
+            entry.pid = ring->pid;
+            entry.tid = record.header.tid;
+            entry.msg = NULL; // mData may yet move, see mOffsets
+            entry.len = record.len;
+            mEntries.push_back(entry);
+            mOffsets.push_back(copy);
+        }
+        tail += need;
+    }
+
+    // Copied out, the space can be handed back
+    __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+    return mEntries.size() != collected;
+}
+
+bool LogShm::log() {
+    size_t count = 0;
+    if (!mEntries.empty()) {
+        for (size_t i = 0; i < mEntries.size(); ++i) {
+            mEntries[i].msg = &mData[mOffsets[i]];
+        }
+        count = logbuf->log(&mEntries[0], mEntries.size());
+    }
+    mEntries.clear();
+    mOffsets.clear();
+    mData.clear();
+    return count != 0;
+}
+
+// mLock assumed
+void LogShm::release(Ring *ring) {
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, ring->sock, NULL);
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, ring->event, NULL);
+    close(ring->sock);
+    close(ring->event);
+    munmap(ring->header, sizeof(android_log_shm_header_t) + ringSize);
+    delete ring;
+}
+
+void LogShm::threadLoop() {
+    static const int maxEvents = 16;
+
+    for (;;) {
+        bool drained = false;
+        bool again = false;
+
+        // Only the copying out is done under mLock, LogBuffer can take
+        // its time over the entries without holding up create().
+        pthread_mutex_lock(&mLock);
+        for (std::list<Ring *>::iterator it = mRings.begin();
+                it != mRings.end();) {
+            Ring *ring = *it;
+            drained |= drain(ring);
+            if (ring->hangup) {
+                it = mRings.erase(it);
+                release(ring);
+                continue;
+            }
+            ++it;
+        }
+        if (!drained) {
+            // Tell the producers we are going to sleep, then take a last
+            // look in case they published before they could see it.
+            for (std::list<Ring *>::iterator it = mRings.begin();
+                    it != mRings.end(); ++it) {
+                __atomic_store_n(&(*it)->header->sleeping, 1, __ATOMIC_SEQ_CST);
+            }
+            for (std::list<Ring *>::iterator it = mRings.begin();
+                    it != mRings.end(); ++it) {
+                drained |= drain(*it);
+                again |= (*it)->hangup;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (log()) {
+            reader->notifyNewLog();
+        }
+        if (drained || again) {
+            continue;
+        }
+
+        struct epoll_event events[maxEvents];
+        int count = TEMP_FAILURE_RETRY(epoll_wait(mEpollFd, events, maxEvents,
+                                                  -1));
+        pthread_mutex_lock(&mLock);
+        for (int i = 0; i < count; ++i) {
+            Ring *ring = static_cast<Ring *>(events[i].data.ptr);
+            if (events[i].events & EPOLLIN) {
+                uint64_t value;
+                TEMP_FAILURE_RETRY(read(ring->event, &value, sizeof(value)));
+            }
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // Released on the next pass, after a last drain
+                ring->hangup = true;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+}
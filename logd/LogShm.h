@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_SHM_H__
+#define _LOGD_LOG_SHM_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <list>
+#include <vector>
+
+#include <private/android_logger.h>
+#include <sysutils/SocketClient.h>
+
+#include "LogBuffer.h"
+#include "LogReader.h"
+
+// Shared memory rings handed out to writers that opt in to them, see
+// liblog/logd_shm_writer.c. Each ring has a single producer, the process
+// that asked for it over the control socket, and is drained here by a
+// single thread into the LogBuffer. The thread sleeps on the eventfd each
+// ring comes with, and watches a duplicate of each client's control socket
+// so that a ring is released once its process is gone.
+class LogShm {
+    LogBuffer *logbuf;
+    LogReader *reader;
+
+    static const size_t ringSize = 128 * 1024;
+    static const size_t maxRings = 32;
+    // One ring per process, and a few per uid so that no one uid can
+    // take them all; everyone else carries on through the socket.
+    static const size_t maxRingsPerUid = 4;
+
+    struct Ring {
+        android_log_shm_header_t *header;
+        int sock;       // duplicate of the client's control socket
+        int event;      // eventfd the client kicks us with
+        uid_t uid;
+        gid_t gid;
+        pid_t pid;
+        bool hangup;
+    };
+
+    pthread_mutex_t mLock; // guards mRings
+    std::list<Ring *> mRings;
+    // Drained entries, only ever touched by our thread
+    std::vector<LogBufferIngest> mEntries;
+    std::vector<size_t> mOffsets; // of each entry's payload in mData
+    std::vector<char> mData;
+    int mEpollFd;
+
+public:
+    LogShm(LogBuffer *buf, LogReader *reader);
+
+    int startListener();
+    // Create a ring for cli, return it and its eventfd in fds, the
+    // caller sends them on and closes them. Returns the ring size, or
+    // -errno.
+    ssize_t create(SocketClient *cli, int fds[2]);
+
+private:
+    // Returns 0 if uid/pid may have another ring, or -errno. mLock assumed.
+    int admit(uid_t uid, pid_t pid);
+    static void *threadStart(void *obj);
+    void threadLoop();
+    // Copy the ring's entries into mEntries and hand their space back.
+    // Returns true if any were added. mLock assumed.
+    bool drain(Ring *ring);
+    // Log what drain() collected, returns true if anything was accepted
+    bool log();
+    void release(Ring *ring);
+};
+
+#endif // _LOGD_LOG_SHM_H__
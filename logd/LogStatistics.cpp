@@ -541,6 +541,8 @@ std::string LogStatistics::format(uid_t uid, pid_t pid,
         output += securityTagTable.format(*this, uid, pid, name, LOG_ID_SECURITY);
     }
 
+    output += formatRates(uid, pid);
+
     return output;
 }
 
@@ -24,12 +24,14 @@
 #include <algorithm> // std::max
 #include <string>    // std::string
 #include <unordered_map>
+#include <vector>
 
 #include <android-base/stringprintf.h>
 #include <log/log.h>
 #include <private/android_filesystem_config.h>
 
 #include "LogBufferElement.h"
+#include "LogRates.h"
 #include "LogUtils.h"
 
 #define log_id_for_each(i) \
@@ -42,6 +44,100 @@ class LogHashtable {
 
     std::unordered_map<TKey, TEntry> map;
 
+    // Max-heap of the entries by getSizes(), kept current on every change
+    // so that the worst offenders are known without visiting every entry.
+    // Entries are stable in the map, and record their own heap position.
+    std::vector<TEntry *> heap;
+
+    void heapPlace(size_t index, TEntry *entry) {
+        heap[index] = entry;
+        entry->heapIndex = index;
+    }
+
+    // entry has grown
+    void heapRaise(TEntry &entry) {
+        size_t index = entry.heapIndex;
+        while (index) {
+            size_t parent = (index - 1) / 2;
+            if (heap[parent]->getSizes() >= entry.getSizes()) {
+                break;
+            }
+            heapPlace(index, heap[parent]);
+            index = parent;
+        }
+        heapPlace(index, &entry);
+    }
+
+    // entry has shrunk
+    void heapLower(TEntry &entry) {
+        size_t index = entry.heapIndex;
+        for (;;) {
+            size_t child = 2 * index + 1;
+            if (child >= heap.size()) {
+                break;
+            }
+            if (((child + 1) < heap.size())
+                    && (heap[child + 1]->getSizes() > heap[child]->getSizes())) {
+                ++child;
+            }
+            if (heap[child]->getSizes() <= entry.getSizes()) {
+                break;
+            }
+            heapPlace(index, heap[child]);
+            index = child;
+        }
+        heapPlace(index, &entry);
+    }
+
+    void heapInsert(TEntry &entry) {
+        entry.heapIndex = heap.size();
+        heap.push_back(&entry);
+        heapRaise(entry);
+    }
+
+    void heapRemove(TEntry &entry) {
+        TEntry *last = heap.back();
+        heap.pop_back();
+        if (last != &entry) {
+            heapPlace(entry.heapIndex, last);
+            heapRaise(*last);
+            heapLower(*last);
+        }
+    }
+
+    // The len largest entries, a best first walk of the heap touching at
+    // most 2 * len nodes rather than the whole table.
+    std::unique_ptr<const TEntry *[]> top(size_t len) const {
+        const TEntry **retval = new const TEntry* [len];
+        memset(retval, 0, sizeof(*retval) * len);
+
+        std::vector<size_t> frontier;
+        if (!heap.empty()) {
+            frontier.push_back(0);
+        }
+        for (size_t found = 0; (found < len) && !frontier.empty(); ++found) {
+            size_t best = 0;
+            for (size_t i = 1; i < frontier.size(); ++i) {
+                if (heap[frontier[i]]->getSizes()
+                        > heap[frontier[best]]->getSizes()) {
+                    best = i;
+                }
+            }
+            size_t index = frontier[best];
+            frontier[best] = frontier.back();
+            frontier.pop_back();
+
+            retval[found] = heap[index];
+            for (size_t child = 2 * index + 1;
+                    (child <= (2 * index + 2)) && (child < heap.size());
+                    ++child) {
+                frontier.push_back(child);
+            }
+        }
+        std::unique_ptr<const TEntry *[]> sorted(retval);
+        return sorted;
+    }
+
 public:
 
     typedef typename std::unordered_map<TKey, TEntry>::iterator iterator;
@@ -54,6 +150,11 @@ public:
             return sorted;
         }
 
+        // Unfiltered, as prune asks on every pass, comes from the heap
+        if ((uid == AID_ROOT) && !pid) {
+            return top(len);
+        }
+
         const TEntry **retval = new const TEntry* [len];
         memset(retval, 0, sizeof(*retval) * len);
 
@@ -89,8 +190,10 @@ public:
         iterator it = map.find(key);
         if (it == map.end()) {
             it = map.insert(std::make_pair(key, TEntry(element))).first;
+            heapInsert(it->second);
         } else {
             it->second.add(element);
+            heapRaise(it->second);
         }
         return it;
     }
@@ -99,6 +202,7 @@ public:
         iterator it = map.find(key);
         if (it == map.end()) {
             it = map.insert(std::make_pair(key, TEntry(key))).first;
+            heapInsert(it->second);
         } else {
             it->second.add(key);
         }
@@ -107,8 +211,14 @@ public:
 
     void subtract(TKey key, LogBufferElement *element) {
         iterator it = map.find(key);
-        if ((it != map.end()) && it->second.subtract(element)) {
+        if (it == map.end()) {
+            return;
+        }
+        if (it->second.subtract(element)) {
+            heapRemove(it->second);
             map.erase(it);
+        } else {
+            heapLower(it->second);
         }
     }
 
@@ -116,6 +226,7 @@ public:
         iterator it = map.find(key);
         if (it != map.end()) {
             it->second.drop(element);
+            heapLower(it->second);
         }
     }
 
@@ -164,9 +275,13 @@ namespace EntryBaseConstants {
 
 struct EntryBase {
     size_t size;
+    size_t heapIndex; // position in the LogHashtable heap
 
-    EntryBase():size(0) { }
-    EntryBase(LogBufferElement *element):size(element->getMsgLen()) { }
+    EntryBase():size(0), heapIndex(0) { }
+    EntryBase(LogBufferElement *element):
+            size(element->getMsgLen()),
+            heapIndex(0) {
+    }
 
     size_t getSizes() const { return size; }
 
@@ -435,12 +550,25 @@ class LogStatistics {
     // security tag list
     tagTable_t securityTagTable;
 
+    // recent rates, always on
+    LogRates rates;
+
 public:
     LogStatistics();
 
     void enableStatistics() { enable = true; }
 
     void add(LogBufferElement *entry);
+    // Account for traffic received, but not retained
+    void addTotal(log_id_t log_id, unsigned short size) {
+        mSizesTotal[log_id] += size;
+        ++mElementsTotal[log_id];
+    }
+    // Account for the rate of traffic received, retained or not
+    void addRate(log_id_t log_id, uid_t uid, pid_t pid,
+                 const char *msg, unsigned short len) {
+        rates.add(log_id, uid, pid, msg, len);
+    }
     void subtract(LogBufferElement *entry);
     // entry->setDropped(1) must follow this call
     void drop(LogBufferElement *entry);
@@ -457,6 +585,10 @@ public:
     }
     std::unique_ptr<const PidEntry *[]> sort(uid_t uid, pid_t pid,
                                              size_t len, log_id id, uid_t) {
+        // only AID_SYSTEM entries are held, no need to filter on them
+        if (uid == AID_SYSTEM) {
+            uid = AID_ROOT;
+        }
         return pidSystemTable[id].sort(uid, pid, len);
     }
 
@@ -470,6 +602,9 @@ public:
     size_t elementsTotal(log_id_t id) const { return mElementsTotal[id]; }
 
     std::string format(uid_t uid, pid_t pid, unsigned int logMask) const;
+    std::string formatRates(uid_t uid, pid_t pid) const {
+        return rates.format(*this, uid, pid);
+    }
 
     // helper (must be locked directly or implicitly by mLogElementsLock)
     const char *pidToName(pid_t pid) const;
@@ -15,7 +15,11 @@
  */
 
 #include <errno.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <time.h>
+
+#include <memory>
 
 #include "FlushCommand.h"
 #include "LogBuffer.h"
@@ -23,19 +27,35 @@
 #include "LogReader.h"
 
 pthread_mutex_t LogTimeEntry::timesLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t LogTimeEntry::poolCondition = PTHREAD_COND_INITIALIZER;
+bool LogTimeEntry::poolStarted;
+int LogTimeEntry::parkFd = -1;
+std::list<LogTimeEntry *> LogTimeEntry::runnable;
+std::list<LogTimeEntry *> LogTimeEntry::sleeping;
+std::list<LogTimeEntry *> LogTimeEntry::parked;
 
 LogTimeEntry::LogTimeEntry(LogReader &reader, SocketClient *client,
                            bool nonBlock, unsigned long tail,
                            unsigned int logMask, pid_t pid,
-                           uint64_t start, uint64_t timeout) :
+                           uint64_t start, uint64_t timeout,
+                           const std::shared_ptr<const LogFilter> &filter,
+                           bool compact) :
+        mState(STATE_IDLE),
+        mTriggered(false),
         mRefCount(1),
         mRelease(false),
         mError(false),
         threadRunning(false),
         leadingDropped(false),
+        mCredentials(false),
+        mPrivileged(false),
+        mSecurity(false),
+        mLast(start),
         mReader(reader),
         mLogMask(logMask),
         mPid(pid),
+        mFilter(filter),
+        mCompact(compact ? new LogCompact : NULL),
         mCount(0),
         mTail(tail),
         mIndex(0),
@@ -45,25 +65,63 @@ LogTimeEntry::LogTimeEntry(LogReader &reader, SocketClient *client,
         mEnd(LogBufferElement::getCurrentSequence()) {
     mTimeout.tv_sec = timeout / NS_PER_SEC;
     mTimeout.tv_nsec = timeout % NS_PER_SEC;
-    pthread_cond_init(&threadTriggeredCondition, NULL);
+    mParkedUntil.tv_sec = 0;
+    mParkedUntil.tv_nsec = 0;
     cleanSkip_Locked();
 }
 
-void LogTimeEntry::startReader_Locked(void) {
+static bool expired(const struct timespec &deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec > deadline.tv_sec)
+        || ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec >= deadline.tv_nsec));
+}
+
+bool LogTimeEntry::startPool_Locked(void) {
+    if (poolStarted) {
+        return true;
+    }
+
+    parkFd = epoll_create1(EPOLL_CLOEXEC);
+    if (parkFd < 0) {
+        return false;
+    }
+
     pthread_attr_t attr;
+    if (pthread_attr_init(&attr)) {
+        return false;
+    }
+    size_t threads = 0;
+    if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)) {
+        pthread_t thread;
+        if (!pthread_create(&thread, &attr, parkStart, NULL)) {
+            for (; threads < poolSize; ++threads) {
+                if (pthread_create(&thread, &attr, poolStart, NULL)) {
+                    break;
+                }
+            }
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // The watcher is not stopped, keep it and whatever pool we have
+    poolStarted = threads != 0;
+    return poolStarted;
+}
 
+void LogTimeEntry::startReader_Locked(void) {
     threadRunning = true;
+    leadingDropped = true;
 
-    if (!pthread_attr_init(&attr)) {
-        if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)) {
-            if (!pthread_create(&mThread, &attr,
-                                LogTimeEntry::threadStart, this)) {
-                pthread_attr_destroy(&attr);
-                return;
-            }
+    if (startPool_Locked()) {
+        if (mTimeout.tv_sec || mTimeout.tv_nsec) {
+            sleep_Locked();
+        } else {
+            schedule_Locked();
         }
-        pthread_attr_destroy(&attr);
+        return;
     }
+
     threadRunning = false;
     if (mClient) {
         mClient->decRef();
@@ -71,32 +129,88 @@ void LogTimeEntry::startReader_Locked(void) {
     decRef_Locked();
 }
 
-void LogTimeEntry::threadStop(void *obj) {
-    LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(obj);
+void LogTimeEntry::triggerReader_Locked(void) {
+    if (!threadRunning) {
+        return;
+    }
+    switch (mState) {
+    case STATE_IDLE:
+    case STATE_SLEEPING:
+        schedule_Locked();
+        break;
+    case STATE_BUSY:
+        mTriggered = true;
+        break;
+    case STATE_QUEUED:
+    case STATE_PARKED: // resumes once the socket drains, or it is released
+        break;
+    }
+}
 
-    lock();
+void LogTimeEntry::schedule_Locked(void) {
+    if (mState == STATE_SLEEPING) {
+        sleeping.remove(this);
+    }
+    mState = STATE_QUEUED;
+    runnable.push_back(this);
+    pthread_cond_signal(&poolCondition);
+}
+
+// Wait for a trigger, or the wrap timeout
+void LogTimeEntry::sleep_Locked(void) {
+    mState = STATE_SLEEPING;
+    sleeping.push_back(this);
+    // a pool thread may need to shorten its wait
+    pthread_cond_signal(&poolCondition);
+}
+
+// Wait for the socket to drain, SO_SNDTIMEO applies as if we had blocked.
+// Nothing is sent to the reader that could block a pool thread, what its
+// socket would not take waits in mBacklog.
+void LogTimeEntry::park_Locked(void) {
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.ptr = this;
+    if (epoll_ctl(parkFd, EPOLL_CTL_ADD, mClient->getSocket(), &event)) {
+        schedule_Locked();
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &mParkedUntil);
+    mParkedUntil.tv_sec += LOGD_SNDTIMEO;
+    mState = STATE_PARKED;
+    parked.push_back(this);
+}
+
+// Only the park thread unparks, so entries it is told about remain valid
+void LogTimeEntry::unpark_Locked(void) {
+    epoll_ctl(parkFd, EPOLL_CTL_DEL, mClient->getSocket(), NULL);
+    parked.remove(this);
+    schedule_Locked();
+}
 
-    if (me->mNonBlock) {
-        me->error_Locked();
+// Reader is done, or has failed
+void LogTimeEntry::stop_Locked(void) {
+    if (mNonBlock) {
+        error_Locked();
     }
 
-    SocketClient *client = me->mClient;
+    SocketClient *client = mClient;
 
-    if (me->isError_Locked()) {
-        LogReader &reader = me->mReader;
+    if (isError_Locked()) {
+        LogReader &reader = mReader;
         LastLogTimes &times = reader.logbuf().mTimes;
 
         LastLogTimes::iterator it = times.begin();
         while(it != times.end()) {
-            if (*it == me) {
+            if (*it == this) {
                 times.erase(it);
-                me->release_nodelete_Locked();
+                release_nodelete_Locked();
                 break;
             }
             it++;
         }
 
-        me->mClient = NULL;
+        mClient = NULL;
         reader.release(client);
     }
 
@@ -104,89 +218,217 @@ void LogTimeEntry::threadStop(void *obj) {
         client->decRef();
     }
 
-    me->threadRunning = false;
-    me->decRef_Locked();
-
-    unlock();
+    mState = STATE_IDLE;
+    threadRunning = false;
+    decRef_Locked();
 }
 
-void *LogTimeEntry::threadStart(void *obj) {
-    prctl(PR_SET_NAME, "logd.reader.per");
+void *LogTimeEntry::parkStart(void * /*obj*/) {
+    prctl(PR_SET_NAME, "logd.reader.park");
 
-    LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(obj);
+    static const int maxEvents = 16;
+    struct epoll_event events[maxEvents];
 
-    pthread_cleanup_push(threadStop, obj);
+    for (;;) {
+        // wake at least once a second to check on releases and timeouts
+        int count = epoll_wait(parkFd, events, maxEvents, 1000);
 
-    SocketClient *client = me->mClient;
-    if (!client) {
-        me->error();
-        return NULL;
-    }
+        lock();
 
-    LogBuffer &logbuf = me->mReader.logbuf();
+        for (int i = 0; i < count; ++i) {
+            LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(events[i].data.ptr);
+            if (me->mState == STATE_PARKED) {
+                me->unpark_Locked();
+            }
+        }
 
-    bool privileged = FlushCommand::hasReadLogs(client);
-    bool security = FlushCommand::hasSecurityLogs(client);
+        std::list<LogTimeEntry *>::iterator it = parked.begin();
+        while (it != parked.end()) {
+            LogTimeEntry *me = *it++;
+            if (me->isError_Locked()) {
+                me->unpark_Locked();
+            } else if (expired(me->mParkedUntil)) {
+                me->error_Locked();
+                me->unpark_Locked();
+            }
+        }
 
-    me->leadingDropped = true;
+        unlock();
+    }
 
-    lock();
+    return NULL;
+}
 
-    uint64_t start = me->mStart;
+void *LogTimeEntry::poolStart(void * /*obj*/) {
+    prctl(PR_SET_NAME, "logd.reader.per");
 
-    while (me->threadRunning && !me->isError_Locked()) {
+    lock();
 
-        if (me->mTimeout.tv_sec || me->mTimeout.tv_nsec) {
-            if (pthread_cond_timedwait(&me->threadTriggeredCondition,
-                                       &timesLock,
-                                       &me->mTimeout) == ETIMEDOUT) {
-                me->mTimeout.tv_sec = 0;
-                me->mTimeout.tv_nsec = 0;
+    for (;;) {
+        if (runnable.empty()) {
+            LogTimeEntry *next = NULL;
+            for (std::list<LogTimeEntry *>::iterator it = sleeping.begin();
+                    it != sleeping.end(); ++it) {
+                LogTimeEntry *me = *it;
+                if (!next
+                        || (me->mTimeout.tv_sec < next->mTimeout.tv_sec)
+                        || ((me->mTimeout.tv_sec == next->mTimeout.tv_sec)
+                            && (me->mTimeout.tv_nsec < next->mTimeout.tv_nsec))) {
+                    next = me;
+                }
             }
-            if (!me->threadRunning || me->isError_Locked()) {
-                break;
+            if (!next) {
+                pthread_cond_wait(&poolCondition, &timesLock);
+                continue;
+            }
+            struct timespec deadline = next->mTimeout;
+            if ((pthread_cond_timedwait(&poolCondition, &timesLock,
+                                        &deadline) == ETIMEDOUT)
+                    || expired(deadline)) {
+                std::list<LogTimeEntry *>::iterator it = sleeping.begin();
+                while (it != sleeping.end()) {
+                    LogTimeEntry *me = *it++;
+                    if (expired(me->mTimeout)) {
+                        me->mTimeout.tv_sec = 0;
+                        me->mTimeout.tv_nsec = 0;
+                        me->schedule_Locked();
+                    }
+                }
             }
+            continue;
         }
 
-        unlock();
+        // Gather everyone queued at the same position to share the walk,
+        // a tail= reader has a first pass of its own to make.
+        LogTimeEntry *me = runnable.front();
+        runnable.pop_front();
+        me->mState = STATE_BUSY;
+        std::vector<LogTimeEntry *> group;
+        group.push_back(me);
+        if (!me->mTail) {
+            std::list<LogTimeEntry *>::iterator it = runnable.begin();
+            while ((it != runnable.end()) && (group.size() < maxGroup)) {
+                LogTimeEntry *entry = *it;
+                if ((entry->mLast == me->mLast) && !entry->mTail) {
+                    entry->mState = STATE_BUSY;
+                    group.push_back(entry);
+                    it = runnable.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
 
-        if (me->mTail) {
-            logbuf.flushTo(client, start, privileged, security, FilterFirstPass, me);
-            me->leadingDropped = true;
+        serve_Locked(group);
+    }
+
+    return NULL;
+}
+
+// Serve a group of busy readers, all at the same position. Drops timesLock
+// while walking the buffer.
+void LogTimeEntry::serve_Locked(std::vector<LogTimeEntry *> &group) {
+    std::vector<LogTimeEntry *>::iterator it = group.begin();
+    while (it != group.end()) {
+        LogTimeEntry *me = *it;
+        me->mTriggered = false;
+        if (!me->threadRunning || me->isError_Locked() || !me->mClient) {
+            me->stop_Locked();
+            it = group.erase(it);
+        } else {
+            ++it;
         }
-        start = logbuf.flushTo(client, start, privileged, security, FilterSecondPass, me);
+    }
+    if (group.empty()) {
+        return;
+    }
 
-        lock();
+    size_t count = group.size();
+    uint64_t start = group[0]->mLast;
+    LogBuffer &logbuf = group[0]->mReader.logbuf();
+    std::unique_ptr<LogBufferFlush[]> flush(new LogBufferFlush[count]);
 
-        if (start == LogBufferElement::FLUSH_ERROR) {
-            me->error_Locked();
-            break;
+    unlock();
+
+    for (size_t i = 0; i < count; ++i) {
+        LogTimeEntry *me = group[i];
+        SocketClient *client = me->mClient;
+        if (!me->mCredentials) {
+            me->mPrivileged = FlushCommand::hasReadLogs(client);
+            me->mSecurity = FlushCommand::hasSecurityLogs(client);
+            me->mCredentials = true;
         }
+        LogBufferFlush &f = flush[i];
+        f.reader = client;
+        f.privileged = me->mPrivileged;
+        f.security = me->mSecurity;
+        f.backlog = &me->mBacklog;
+        f.filter = FilterSecondPass;
+        f.arg = me;
+        f.defer = me->mFilter && me->mFilter->costly();
+        f.compact = me->mCompact.get();
+    }
+
+    if (group[0]->mTail) {
+        LogTimeEntry *me = group[0];
+        logbuf.flushTo(me->mClient, start, me->mPrivileged, me->mSecurity,
+                       FilterFirstPass, me,
+                       me->mFilter && me->mFilter->costly());
+        me->leadingDropped = true;
+    }
+    logbuf.flushTo(flush.get(), count, start);
 
-        me->mStart = start + 1;
+    lock();
+
+    for (size_t i = 0; i < count; ++i) {
+        LogTimeEntry *me = group[i];
+        uint64_t max = flush[i].max;
 
-        if (me->mNonBlock || !me->threadRunning || me->isError_Locked()) {
-            break;
+        if (max == LogBufferElement::FLUSH_ERROR) {
+            me->error_Locked();
+            me->stop_Locked();
+            continue;
         }
 
-        me->cleanSkip_Locked();
+        me->mLast = max;
+        me->mStart = max + 1;
 
-        if (!me->mTimeout.tv_sec && !me->mTimeout.tv_nsec) {
-            pthread_cond_wait(&me->threadTriggeredCondition, &timesLock);
+        if (!me->threadRunning || me->isError_Locked()) {
+            me->stop_Locked();
+            continue;
         }
-    }
 
-    unlock();
+        // Not done yet, pick up where we left off once it drains
+        if (flush[i].congested) {
+            me->park_Locked();
+            continue;
+        }
+
+        if (me->mNonBlock) {
+            me->stop_Locked();
+            continue;
+        }
 
-    pthread_cleanup_pop(true);
+        me->cleanSkip_Locked();
 
-    return NULL;
+        if (me->mTimeout.tv_sec || me->mTimeout.tv_nsec) {
+            me->sleep_Locked();
+        } else if (me->mTriggered) {
+            me->schedule_Locked();
+        } else {
+            me->mState = STATE_IDLE;
+        }
+    }
 }
 
 // A first pass to count the number of elements
 int LogTimeEntry::FilterFirstPass(const LogBufferElement *element, void *obj) {
     LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(obj);
 
+    // mFilter is immutable, evaluate it outside of the lock. One that is
+    // costly is handed a copy, without mLogElementsLock held.
+    bool match = !me->mFilter || me->mFilter->match(element);
+
     LogTimeEntry::lock();
 
     if (me->leadingDropped) {
@@ -202,6 +444,7 @@ int LogTimeEntry::FilterFirstPass(const LogBufferElement *element, void *obj) {
     }
 
     if ((!me->mPid || (me->mPid == element->getPid()))
+            && match
             && (me->isWatching(element->getLogId()))) {
         ++me->mCount;
     }
@@ -215,6 +458,10 @@ int LogTimeEntry::FilterFirstPass(const LogBufferElement *element, void *obj) {
 int LogTimeEntry::FilterSecondPass(const LogBufferElement *element, void *obj) {
     LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(obj);
 
+    // mFilter is immutable, evaluate it outside of the lock. One that is
+    // costly is handed a copy, without mLogElementsLock held.
+    bool match = !me->mFilter || me->mFilter->match(element);
+
     LogTimeEntry::lock();
 
     me->mStart = element->getSequence();
@@ -244,6 +491,10 @@ int LogTimeEntry::FilterSecondPass(const LogBufferElement *element, void *obj) {
         goto skip;
     }
 
+    if (!match) {
+        goto skip;
+    }
+
     if (me->isError_Locked()) {
         goto stop;
     }
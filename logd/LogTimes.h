@@ -22,27 +22,73 @@
 #include <sys/types.h>
 
 #include <list>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <sysutils/SocketClient.h>
 #include <log/log.h>
 
+#include "LogCompact.h"
+#include "LogFilter.h"
+
 class LogReader;
 class LogBufferElement;
 
+// Readers are served by a small pool of threads shared by every
+// LogTimeEntry rather than one thread each. A trigger queues the entry, and
+// entries queued at the same position are served by a single walk of the
+// buffer. Readers whose socket is congested are parked, and watched with
+// epoll until they can take more, so they never hold up a pool thread.
 class LogTimeEntry {
     static pthread_mutex_t timesLock;
+
+    // Reader pool, protected by timesLock
+    static constexpr size_t poolSize = 4;
+    static constexpr size_t maxGroup = 16;
+    static pthread_cond_t poolCondition;
+    static bool poolStarted;
+    static int parkFd;
+    static std::list<LogTimeEntry *> runnable; // triggered
+    static std::list<LogTimeEntry *> sleeping; // waiting on trigger or mTimeout
+    static std::list<LogTimeEntry *> parked;   // waiting on their socket
+    static bool startPool_Locked(void);
+    static void *poolStart(void *obj);
+    static void *parkStart(void *obj);
+    static void serve_Locked(std::vector<LogTimeEntry *> &group);
+
+    enum {
+        STATE_IDLE,     // waiting on a trigger
+        STATE_QUEUED,   // on runnable
+        STATE_SLEEPING, // on sleeping
+        STATE_BUSY,     // being served by a pool thread
+        STATE_PARKED,   // on parked
+    } mState;
+    bool mTriggered; // while busy
+    struct timespec mParkedUntil;
+    std::vector<std::string> mBacklog; // entries the socket would not take
+    void schedule_Locked(void);
+    void sleep_Locked(void);
+    void park_Locked(void);
+    void unpark_Locked(void);
+    void stop_Locked(void);
+
     unsigned int mRefCount;
     bool mRelease;
     bool mError;
-    bool threadRunning;
+    bool threadRunning; // served by the pool
     bool leadingDropped;
-    pthread_cond_t threadTriggeredCondition;
-    pthread_t mThread;
+    bool mCredentials;  // mPrivileged and mSecurity are known
+    bool mPrivileged;
+    bool mSecurity;
+    uint64_t mLast;     // last sequence sent
     LogReader &mReader;
-    static void *threadStart(void *me);
-    static void threadStop(void *me);
     const unsigned int mLogMask;
     const pid_t mPid;
+    // reader supplied filters, NULL if none
+    const std::shared_ptr<const LogFilter> mFilter;
+    // header encoder if the reader asked for format=2, NULL if not
+    const std::unique_ptr<LogCompact> mCompact;
     unsigned int skipAhead[LOG_ID_MAX];
     unsigned long mCount;
     unsigned long mTail;
@@ -51,7 +97,9 @@ class LogTimeEntry {
 public:
     LogTimeEntry(LogReader &reader, SocketClient *client, bool nonBlock,
                  unsigned long tail, unsigned int logMask, pid_t pid,
-                 uint64_t start, uint64_t timeout);
+                 uint64_t start, uint64_t timeout,
+                 const std::shared_ptr<const LogFilter> &filter,
+                 bool compact);
 
     SocketClient *mClient;
     uint64_t mStart;
@@ -68,9 +116,7 @@ public:
     bool runningReader_Locked(void) const {
         return threadRunning || mRelease || mError || mNonBlock;
     }
-    void triggerReader_Locked(void) {
-        pthread_cond_signal(&threadTriggeredCondition);
-    }
+    void triggerReader_Locked(void);
 
     void triggerSkip_Locked(log_id_t id, unsigned int skip) { skipAhead[id] = skip; }
     void cleanSkip_Locked(void);
@@ -78,13 +124,13 @@ public:
     // These called after LogTimeEntry removed from list, lock implicitly held
     void release_nodelete_Locked(void) {
         mRelease = true;
-        pthread_cond_signal(&threadTriggeredCondition);
+        triggerReader_Locked();
         // assumes caller code path will call decRef_Locked()
     }
 
     void release_Locked(void) {
         mRelease = true;
-        pthread_cond_signal(&threadTriggeredCondition);
+        triggerReader_Locked();
         if (mRefCount || threadRunning) {
             return;
         }
@@ -17,6 +17,7 @@
 #ifndef _LOGD_LOG_UTILS_H__
 #define _LOGD_LOG_UTILS_H__
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <log/log.h>
@@ -57,6 +58,15 @@ static inline bool worstUidEnabledForLogid(log_id_t id) {
     return (id == LOG_ID_MAIN) || (id == LOG_ID_SYSTEM) || (id == LOG_ID_RADIO);
 }
 
+// FNV-1a of a tag, the hash liblog's tag cache uses too
+static inline uint32_t hashTag(const char *tag, size_t len) {
+    uint32_t hash = 2166136261U;
+    while (len--) {
+        hash = (hash ^ static_cast<uint8_t>(*tag++)) * 16777619U;
+    }
+    return hash;
+}
+
 template <int (*cmp)(const char *l, const char *r, const size_t s)>
 static inline int fast(const char *l, const char *r, const size_t s) {
     return (*l != *r) || cmp(l + 1, r + 1, s - 1);
@@ -47,6 +47,7 @@
 #include "CommandListener.h"
 #include "LogBuffer.h"
 #include "LogListener.h"
+#include "LogShm.h"
 #include "LogAudit.h"
 #include "LogKlog.h"
 #include "LogUtils.h"
@@ -272,6 +273,7 @@ static void *reinit_thread_start(void * /*obj*/) {
         if (logBuf) {
             logBuf->init();
             logBuf->initPrune(NULL);
+            logBuf->initRateLimit(NULL);
         }
     }
 
@@ -361,6 +363,9 @@ static void readDmesg(LogAudit *al, LogKlog *kl) {
             rc = kl->log(tok, sublen);
         }
     }
+    if (kl) {
+        kl->flush();
+    }
 }
 
 // Foreground waits for exit of the main persistent threads
@@ -371,13 +376,19 @@ static void readDmesg(LogAudit *al, LogKlog *kl) {
 // transitory per-client threads are created for each reader.
 int main(int argc, char *argv[]) {
     int fdPmesg = -1;
+    bool kmsg = false;
     bool klogd = property_get_bool("logd.kernel",
                                    BOOL_DEFAULT_TRUE |
                                    BOOL_DEFAULT_FLAG_PERSIST |
                                    BOOL_DEFAULT_FLAG_ENG |
                                    BOOL_DEFAULT_FLAG_SVELTE);
     if (klogd) {
-        fdPmesg = open("/proc/kmsg", O_RDONLY | O_NDELAY);
+        // Structured records if the kernel offers them
+        fdPmesg = open("/dev/kmsg", O_RDONLY | O_NDELAY | O_CLOEXEC);
+        kmsg = fdPmesg >= 0;
+        if (!kmsg) {
+            fdPmesg = open("/proc/kmsg", O_RDONLY | O_NDELAY);
+        }
     }
     fdDmesg = open("/dev/kmsg", O_WRONLY);
 
@@ -484,7 +495,22 @@ int main(int argc, char *argv[]) {
     // Command listener listens on /dev/socket/logd for incoming logd
     // administrative commands.
 
-    CommandListener *cl = new CommandListener(logBuf, reader, swl);
+    // LogShm drains the shared memory rings handed out by the "shm"
+    // command to writers that opt in to them.
+
+    LogShm *shm = NULL;
+    if (property_get_bool("logd.shm",
+                          BOOL_DEFAULT_TRUE |
+                          BOOL_DEFAULT_FLAG_PERSIST |
+                          BOOL_DEFAULT_FLAG_SVELTE)) {
+        shm = new LogShm(logBuf, reader);
+        if (shm->startListener()) {
+            delete shm;
+            shm = NULL;
+        }
+    }
+
+    CommandListener *cl = new CommandListener(logBuf, reader, swl, shm);
     if (cl->startListener()) {
         exit(1);
     }
@@ -508,7 +534,7 @@ int main(int argc, char *argv[]) {
 
     LogKlog *kl = NULL;
     if (klogd) {
-        kl = new LogKlog(logBuf, reader, fdDmesg, fdPmesg, al != NULL);
+        kl = new LogKlog(logBuf, reader, fdDmesg, fdPmesg, al != NULL, kmsg);
     }
 
     readDmesg(al, kl);
@@ -0,0 +1,500 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <log/log.h>
+#include <log/logger.h>
+#include <log/log_read.h>
+
+#include "benchmark.h"
+
+static const char tag[] = "logd_benchmark";
+
+// Fill the main buffer so that readers have something sizable to seek
+// through, returns the timestamp of an entry roughly halfway through.
+static log_time fill(int count) {
+    log_time half(log_time::EPOCH);
+    for (int i = 0; i < count; ++i) {
+        if (i == (count / 2)) {
+            half = log_time(CLOCK_REALTIME);
+        }
+        __android_log_print(ANDROID_LOG_INFO, tag, "fill %d", i);
+    }
+    return half;
+}
+
+// Open a non-blocking reader from start and read the first entry
+static bool reconnect(log_time start) {
+    struct logger_list *logger_list = android_logger_list_alloc_time(
+        ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK, start, 0);
+    if (!logger_list) {
+        return false;
+    }
+    if (!android_logger_open(logger_list, LOG_ID_MAIN)) {
+        android_logger_list_free(logger_list);
+        return false;
+    }
+    log_msg log_msg;
+    int ret = android_logger_list_read(logger_list, &log_msg);
+    android_logger_list_free(logger_list);
+    return ret > 0;
+}
+
+/*
+ *	Measure the time for a reader to reconnect part way into a full buffer
+ * and receive its first entry.
+ */
+static void BM_reader_reconnect(int iters) {
+    log_time start = fill(10000);
+
+    for (int i = 0; i < iters; ++i) {
+        StartBenchmarkTiming();
+        bool ok = reconnect(start);
+        StopBenchmarkTiming();
+        if (!ok) {
+            fprintf(stderr, "Unable to read main log: %s\n", strerror(errno));
+            break;
+        }
+    }
+}
+BENCHMARK(BM_reader_reconnect);
+
+static volatile bool reconnecting;
+
+static void *reconnect_storm(void *obj) {
+    log_time start = *reinterpret_cast<log_time *>(obj);
+    while (reconnecting && reconnect(start))
+        ;
+    return NULL;
+}
+
+/*
+ *	Measure the time for a log entry to make it through logd to a blocking
+ * reader while other readers continually reconnect part way into the buffer,
+ * reflecting how long the writer is stalled behind the reader seeks.
+ */
+static void BM_writer_stall(int iters) {
+    static const int readers = 4;
+
+    log_time start = fill(10000);
+
+    struct logger_list *logger_list = android_logger_list_open(LOG_ID_EVENTS,
+        ANDROID_LOG_RDONLY, 0, getpid());
+    if (!logger_list) {
+        fprintf(stderr, "Unable to open events log: %s\n", strerror(errno));
+        return;
+    }
+
+    reconnecting = true;
+    pthread_t thread[readers];
+    for (int i = 0; i < readers; ++i) {
+        pthread_create(&thread[i], NULL, reconnect_storm, &start);
+    }
+
+    for (int i = 0; i < iters; ++i) {
+        log_time ts(CLOCK_REALTIME);
+
+        StartBenchmarkTiming();
+        android_btWriteLog(0, EVENT_TYPE_LONG, &ts, sizeof(ts));
+
+        for (;;) {
+            log_msg log_msg;
+            if (android_logger_list_read(logger_list, &log_msg) <= 0) {
+                iters = i;
+                break;
+            }
+            if ((log_msg.entry.len == (4 + 1 + 8))
+                    && (log_msg.msg()[4] == EVENT_TYPE_LONG)
+                    && (ts == log_time(log_msg.msg() + 4 + 1))) {
+                break;
+            }
+        }
+        StopBenchmarkTiming();
+    }
+
+    reconnecting = false;
+    for (int i = 0; i < readers; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+
+    android_logger_list_free(logger_list);
+}
+BENCHMARK(BM_writer_stall);
+
+// Pid of logd, 0 if unknown
+static pid_t logd_pid() {
+    DIR *dir = opendir("/proc");
+    if (!dir) {
+        return 0;
+    }
+    pid_t pid = 0;
+    struct dirent *dp;
+    while (!pid && (dp = readdir(dir))) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%s/comm", dp->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        char comm[32];
+        if ((fscanf(fp, "%31s", comm) == 1) && !strcmp(comm, "logd")) {
+            pid = atoi(dp->d_name);
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return pid;
+}
+
+// Ticks of cpu time consumed so far by logd, 0 if unknown
+static unsigned long logd_cpu() {
+    pid_t pid = logd_pid();
+    if (!pid) {
+        return 0;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    unsigned long ticks = 0;
+    unsigned long utime, stime;
+    if (fscanf(fp, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u"
+                   " %*u %*u %lu %lu", &utime, &stime) == 2) {
+        ticks = utime + stime;
+    }
+    fclose(fp);
+    return ticks;
+}
+
+// Voluntary context switches so far across all logd threads, 0 if unknown
+static unsigned long logd_wakeups() {
+    pid_t pid = logd_pid();
+    if (!pid) {
+        return 0;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    unsigned long wakeups = 0;
+    struct dirent *dp;
+    while ((dp = readdir(dir))) {
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/status",
+                 pid, dp->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        char line[128];
+        unsigned long count;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "voluntary_ctxt_switches: %lu", &count) == 1) {
+                wakeups += count;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return wakeups;
+}
+
+static void dump(int iters, const char *filter) {
+    fill(10000);
+
+    uint64_t bytes = 0;
+    unsigned long cpu = logd_cpu();
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iters; ++i) {
+        struct logger_list *logger_list = android_logger_list_open(LOG_ID_MAIN,
+            ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK, 0, 0);
+        if (!logger_list) {
+            fprintf(stderr, "Unable to open main log: %s\n", strerror(errno));
+            break;
+        }
+        if (filter) {
+            android_logger_list_set_filter(logger_list, filter);
+        }
+        log_msg log_msg;
+        int ret;
+        while ((ret = android_logger_list_read(logger_list, &log_msg)) > 0) {
+            bytes += ret;
+        }
+        android_logger_list_free(logger_list);
+    }
+
+    StopBenchmarkTiming();
+    SetBenchmarkBytesProcessed(bytes);
+    if (iters && cpu) {
+        fprintf(stderr, "logd cpu %lu ticks/iteration\n",
+                (logd_cpu() - cpu) / iters);
+    }
+}
+
+/*
+ *	Measure the throughput of a logcat -d style dump of the main buffer.
+ */
+static void BM_log_dump(int iters) {
+    dump(iters, NULL);
+}
+BENCHMARK(BM_log_dump);
+
+/*
+ *	Measure the same dump when the reader only wants one tag, and has logd
+ * do the filtering. Compare the bytes crossing the socket, and logd cpu,
+ * against BM_log_dump.
+ */
+static void BM_log_dump_filtered(int iters) {
+    dump(iters, "tags=logd_benchmark_unused:I,*:S");
+}
+BENCHMARK(BM_log_dump_filtered);
+
+/*
+ *	Measure the rate at which logd ingests a single chatty source that is
+ * well over its share of a full buffer, so that nearly every write has to
+ * prune, and every prune looks for the worst offender.
+ */
+static void BM_log_prune(int iters) {
+    static const size_t payload = 1024;
+
+    struct logger_list *logger_list = android_logger_list_open(LOG_ID_EVENTS,
+        ANDROID_LOG_RDONLY, 0, getpid());
+    if (!logger_list) {
+        fprintf(stderr, "Unable to open events log: %s\n", strerror(errno));
+        return;
+    }
+
+    char buffer[payload];
+    memset(buffer, 'x', sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    fill(10000);
+
+    log_time ts(CLOCK_REALTIME);
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iters; ++i) {
+        __android_log_write(ANDROID_LOG_INFO, tag, buffer);
+    }
+
+    // wait for logd to have caught up with us
+    android_btWriteLog(0, EVENT_TYPE_LONG, &ts, sizeof(ts));
+    for (;;) {
+        log_msg log_msg;
+        if (android_logger_list_read(logger_list, &log_msg) <= 0) {
+            break;
+        }
+        if ((log_msg.entry.len == (4 + 1 + 8))
+                && (log_msg.msg()[4] == EVENT_TYPE_LONG)
+                && (ts == log_time(log_msg.msg() + 4 + 1))) {
+            break;
+        }
+    }
+
+    StopBenchmarkTiming();
+    SetBenchmarkBytesProcessed((uint64_t)iters * payload);
+
+    android_logger_list_free(logger_list);
+}
+BENCHMARK(BM_log_prune);
+
+static volatile bool tailing;
+
+static void *tail(void *obj) {
+    struct logger_list *logger_list = reinterpret_cast<struct logger_list *>(obj);
+    log_msg log_msg;
+    while (tailing && (android_logger_list_read(logger_list, &log_msg) > 0))
+        ;
+    return NULL;
+}
+
+/*
+ *	Measure logd cpu and wakeups per line written while many blocking
+ * readers, logcat style, are following the main buffer.
+ */
+static void BM_reader_fanout(int iters) {
+    static const int readers = 32;
+
+    struct logger_list *logger_list[readers];
+    pthread_t thread[readers];
+    int count = 0;
+
+    tailing = true;
+    for (; count < readers; ++count) {
+        logger_list[count] = android_logger_list_open(LOG_ID_MAIN,
+            ANDROID_LOG_RDONLY, 0, 0);
+        if (!logger_list[count]) {
+            fprintf(stderr, "Unable to open main log: %s\n", strerror(errno));
+            break;
+        }
+        pthread_create(&thread[count], NULL, tail, logger_list[count]);
+    }
+
+    unsigned long cpu = logd_cpu();
+    unsigned long wakeups = logd_wakeups();
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iters; ++i) {
+        __android_log_print(ANDROID_LOG_INFO, tag, "fanout %d", i);
+    }
+
+    StopBenchmarkTiming();
+    // let the readers drain before sampling
+    sleep(1);
+    if (iters && cpu) {
+        fprintf(stderr, "logd cpu %lu ticks, %lu wakeups/1000 lines\n",
+                logd_cpu() - cpu,
+                (logd_wakeups() - wakeups) * 1000 / iters);
+    }
+
+    // readers are unblocked by the next entry to arrive
+    tailing = false;
+    __android_log_print(ANDROID_LOG_INFO, tag, "fanout done");
+    for (int i = 0; i < count; ++i) {
+        pthread_join(thread[i], NULL);
+        android_logger_list_free(logger_list[i]);
+    }
+}
+BENCHMARK(BM_reader_fanout);
+
+// Lines of a captured dmesg, with their timestamps stripped, or a synthetic
+// stand in if none is available.
+static std::vector<std::string> dmesg_lines() {
+    static const char dmesg[] = "/data/local/tmp/dmesg.txt";
+
+    const char *path = getenv("LOGD_BENCHMARK_DMESG");
+    std::vector<std::string> lines;
+    FILE *fp = fopen(path ? path : dmesg, "r");
+    if (fp) {
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            char *cp = line;
+            if (*cp == '<') {
+                cp = strchr(cp, '>');
+                cp = cp ? cp + 1 : line;
+            }
+            if (*cp == '[') {
+                char *ep = strchr(cp, ']');
+                if (ep) {
+                    cp = ep + 1;
+                    while (*cp == ' ') {
+                        ++cp;
+                    }
+                }
+            }
+            size_t len = strlen(cp);
+            while (len && (cp[len - 1] == '\n')) {
+                cp[--len] = '\0';
+            }
+            if (len) {
+                lines.push_back(cp);
+            }
+        }
+        fclose(fp);
+    }
+    if (lines.empty()) {
+        char line[128];
+        for (int i = 0; i < 1000; ++i) {
+            snprintf(line, sizeof(line),
+                     "logd_benchmark%d: driver debug storm line %d", i % 7, i);
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+/*
+ *	Measure the rate at which logd ingests kernel log lines, replaying a
+ * captured dmesg (LOGD_BENCHMARK_DMESG or /data/local/tmp/dmesg.txt) into
+ * /dev/kmsg. Requires root.
+ */
+static void BM_kmsg_replay(int iters) {
+    static const char marker[] = "logd_benchmark: kmsg replay done";
+
+    int fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open /dev/kmsg: %s\n", strerror(errno));
+        return;
+    }
+    struct logger_list *logger_list = android_logger_list_open(LOG_ID_KERNEL,
+        ANDROID_LOG_RDONLY, 0, 0);
+    if (!logger_list) {
+        fprintf(stderr, "Unable to open kernel log: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    std::vector<std::string> lines = dmesg_lines();
+    uint64_t bytes = 0;
+    unsigned long cpu = logd_cpu();
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iters; ++i) {
+        for (size_t j = 0; j < lines.size(); ++j) {
+            if (write(fd, lines[j].c_str(), lines[j].length()) > 0) {
+                bytes += lines[j].length();
+            }
+        }
+    }
+
+    // wait for logd to have caught up with us
+    write(fd, marker, strlen(marker));
+    for (;;) {
+        log_msg log_msg;
+        if (android_logger_list_read(logger_list, &log_msg) <= 0) {
+            break;
+        }
+        const char *msg = log_msg.msg();
+        size_t len = log_msg.entry.len;
+        // <prio> <tag> \0 <message>
+        if (msg && (len > 1)) {
+            const char *content = static_cast<const char *>(memchr(msg + 1, '\0', len - 1));
+            if (content && strstr(content + 1, "kmsg replay done")) {
+                break;
+            }
+        }
+    }
+
+    StopBenchmarkTiming();
+    SetBenchmarkBytesProcessed(bytes);
+    if (iters && cpu) {
+        fprintf(stderr, "logd cpu %lu ticks/%zu lines\n",
+                (logd_cpu() - cpu) / iters, lines.size());
+    }
+
+    android_logger_list_free(logger_list);
+    close(fd);
+}
+BENCHMARK(BM_kmsg_replay);
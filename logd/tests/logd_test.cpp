@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -29,6 +30,7 @@
 #include <cutils/sockets.h>
 #include <log/log.h>
 #include <log/logger.h>
+#include <private/android_logger.h>
 
 #include "../LogReader.h" // pickup LOGD_SNDTIMEO
 
@@ -768,3 +770,368 @@ TEST(logd, SNDTIMEO) {
 
     close(fd);
 }
+
+// A reader that has stopped reading is parked, it must not hold up the
+// pool thread serving the readers that are keeping up.
+TEST(logd, stalled_reader) {
+    std::string tag = android::base::StringPrintf("logd_test_stalled_%d",
+                                                  getpid());
+    std::string ask = android::base::StringPrintf("stream lids=0 pid=%d",
+                                                  getpid());
+
+    int stalled = socket_local_client("logdr",
+                                      ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                      SOCK_SEQPACKET);
+    ASSERT_LT(0, stalled);
+    ASSERT_EQ((ssize_t)ask.length() + 1,
+              write(stalled, ask.c_str(), ask.length() + 1));
+    int fd = socket_local_client("logdr", ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                 SOCK_SEQPACKET);
+    ASSERT_LT(0, fd);
+    ASSERT_EQ((ssize_t)ask.length() + 1,
+              write(fd, ask.c_str(), ask.length() + 1));
+    usleep(100000);
+
+    // several times what the stalled reader's socket can hold
+    static const int count = 500;
+    std::string payload(400, 'x');
+    for (int i = 0; i < count; ++i) {
+        ASSERT_LT(0, __android_log_buf_print(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                             tag.c_str(), "%d %s", i,
+                                             payload.c_str()));
+    }
+
+    // well short of the SO_SNDTIMEO a blocked send would have held us for
+    struct sigaction ignore, old_sigaction;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = caught_signal;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGALRM, &ignore, &old_sigaction);
+    unsigned int old_alarm = alarm(LOGD_SNDTIMEO / 4);
+
+    int last = -1;
+    log_msg msg;
+    while ((last < (count - 1)) && (recv(fd, msg.buf, sizeof(msg), 0) > 0)) {
+        if ((msg.id() == LOG_ID_MAIN) && (tag == (msg.msg() + 1))) {
+            last = atoi(msg.msg() + 1 + tag.length() + 1);
+        }
+    }
+
+    alarm(old_alarm);
+    sigaction(SIGALRM, &old_sigaction, NULL);
+    close(fd);
+    close(stalled);
+
+    EXPECT_EQ(count - 1, last);
+}
+
+TEST(logd, filter) {
+    static const char keep[] = "logd_test_filter_keep";
+    static const char drop[] = "logd_test_filter_drop";
+
+    pid_t pid = getpid();
+    ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                         keep, "keep"));
+    ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                         drop, "drop"));
+    ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_DEBUG,
+                                         keep, "too quiet"));
+    ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_WARN,
+                                         keep, "no match"));
+
+    struct logger_list *logger_list = android_logger_list_open(LOG_ID_MAIN,
+        ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK, 0, 0);
+    ASSERT_TRUE(NULL != logger_list);
+
+    std::string filter = android::base::StringPrintf(
+        "tags=%s:I,*:S pids=%d regex=^(keep|drop)$", keep, pid);
+    EXPECT_EQ(0, android_logger_list_set_filter(logger_list, filter.c_str()));
+
+    int count = 0;
+    int other = 0;
+    log_msg msg;
+    while (android_logger_list_read(logger_list, &msg) > 0) {
+        const char *tag = msg.msg() + 1;
+        if ((msg.entry.pid == pid) && !strcmp(tag, keep)
+                && !strcmp(tag + strlen(tag) + 1, "keep")) {
+            ++count;
+        } else {
+            ++other;
+        }
+    }
+
+    android_logger_list_free(logger_list);
+
+    EXPECT_LE(1, count);
+    EXPECT_EQ(0, other);
+}
+
+TEST(logd, compact) {
+    static const char tag[] = "logd_test_compact";
+    static const char text[] = "compact";
+    static const int count = 4;
+
+    pid_t pid = getpid();
+    for (int i = 0; i < count; ++i) {
+        ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                             tag, text));
+    }
+
+    // logd answers format=2, and sends the tag only the once
+    int fd = socket_local_client("logdr",
+                                 ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                 SOCK_SEQPACKET);
+    ASSERT_LT(0, fd);
+    std::string ask = android::base::StringPrintf(
+        "dumpAndClose lids=0 pid=%d format=2", pid);
+    ASSERT_EQ((ssize_t)ask.length(), write(fd, ask.c_str(), ask.length()));
+
+    char buf[LOGGER_ENTRY_MAX_LEN];
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    ASSERT_EQ((ssize_t)sizeof(android_log_compact_hello_t), len);
+    EXPECT_EQ((uint32_t)LOGGER_COMPACT_MAGIC,
+              ((android_log_compact_hello_t *)buf)->magic);
+
+    int newTag = 0;
+    int oldTag = 0;
+    while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        EXPECT_GT((ssize_t)(sizeof(struct logger_entry_v4) + 1 + sizeof(tag)
+                                + sizeof(text)), len);
+        if (buf[0] & LOGGER_COMPACT_NEWTAG) {
+            ++newTag;
+        } else if (buf[0] & LOGGER_COMPACT_TAG) {
+            ++oldTag;
+        }
+    }
+    close(fd);
+
+    EXPECT_GE(1, newTag);
+    EXPECT_LE(count - 1, oldTag);
+
+    // and liblog puts the entries back together
+    struct logger_list *logger_list = android_logger_list_open(LOG_ID_MAIN,
+        ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK, 0, pid);
+    ASSERT_TRUE(NULL != logger_list);
+
+    int found = 0;
+    log_msg msg;
+    while (android_logger_list_read(logger_list, &msg) > 0) {
+        const char *t = msg.msg() + 1;
+        EXPECT_EQ(pid, msg.entry.pid);
+        if (!strcmp(t, tag) && !strcmp(t + strlen(t) + 1, text)) {
+            EXPECT_EQ(ANDROID_LOG_INFO, msg.msg()[0]);
+            ++found;
+        }
+    }
+
+    android_logger_list_free(logger_list);
+
+    EXPECT_LE(count, found);
+}
+
+TEST(logd, rates) {
+    // only this pid is to have logged with the tag
+    std::string tag = android::base::StringPrintf("logd_test_rates_%d",
+                                                  getpid());
+
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                             tag.c_str(), "rates"));
+    }
+    // let the writes land, and the tick they are counted in pass
+    usleep(500000);
+
+    int sock = socket_local_client("logd",
+                                   ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                   SOCK_STREAM);
+    ASSERT_LT(0, sock);
+    std::string ask = android::base::StringPrintf("getRates pid=%d", getpid());
+    ASSERT_LT(0, write(sock, ask.c_str(), ask.length() + 1));
+
+    std::string rates;
+    char buf[4096];
+    ssize_t ret;
+    while ((ret = read(sock, buf, sizeof(buf))) > 0) {
+        rates.append(buf, ret);
+        if (rates[rates.length() - 1] == '\f') {
+            break;
+        }
+    }
+    close(sock);
+
+    EXPECT_NE(std::string::npos, rates.find("Fastest PIDs"));
+    EXPECT_NE(std::string::npos, rates.find(tag));
+}
+
+static std::string logd_command(const std::string &command) {
+    std::string reply;
+    int sock = socket_local_client("logd",
+                                   ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                   SOCK_STREAM);
+    if (sock < 0) {
+        return reply;
+    }
+    if (write(sock, command.c_str(), command.length() + 1) > 0) {
+        char buf[4096];
+        ssize_t ret;
+        while ((ret = read(sock, buf, sizeof(buf))) > 0) {
+            reply.append(buf, ret);
+            if (!reply[reply.length() - 1]
+                    || (reply[reply.length() - 1] == '\f')) {
+                break;
+            }
+        }
+    }
+    close(sock);
+    return reply.c_str();
+}
+
+TEST(logd, ratelimit) {
+    std::string tag = android::base::StringPrintf("logd_test_ratelimit_%d",
+                                                  getpid());
+    static const unsigned rate = 10;
+
+    std::string saved = logd_command("getRateLimit");
+    size_t end = saved.find('\f');
+    if (end != std::string::npos) {
+        saved.erase(end);
+    }
+    saved.erase(0, saved.find('\n') + 1); // size of the package_string
+    while (!saved.empty() && isspace(saved[saved.length() - 1])) {
+        saved.erase(saved.length() - 1);
+    }
+
+    std::string limit = android::base::StringPrintf(
+        "setRateLimit %s %u:%s=%u", saved.c_str(), getuid(), tag.c_str(),
+        rate);
+    ASSERT_EQ("success", logd_command(limit));
+
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                             tag.c_str(), "ratelimit"));
+    }
+    // the summary follows the next entry a second after the first drop
+    sleep(2);
+    ASSERT_LT(0, __android_log_buf_write(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                         tag.c_str(), "ratelimit"));
+    usleep(100000);
+
+    EXPECT_EQ("success", logd_command("setRateLimit "
+                                      + (saved.empty() ? "disable" : saved)));
+
+    struct logger_list *logger_list = android_logger_list_open(LOG_ID_MAIN,
+        ANDROID_LOG_RDONLY | ANDROID_LOG_NONBLOCK, 0, getpid());
+    ASSERT_TRUE(NULL != logger_list);
+
+    unsigned count = 0;
+    size_t dropped = 0;
+    std::string summary = " tag=" + tag + " rate limited ";
+    log_msg msg;
+    while (android_logger_list_read(logger_list, &msg) > 0) {
+        const char *t = msg.msg() + 1;
+        if (tag == t) {
+            ++count;
+        } else if (!strcmp(t, "chatty")) {
+            const char *cp = strstr(t + strlen(t) + 1, summary.c_str());
+            if (cp) {
+                dropped += strtoul(cp + summary.length(), NULL, 10);
+            }
+        }
+    }
+
+    android_logger_list_free(logger_list);
+
+    // a burst of rate, a few more as the bucket refills, and the last
+    EXPECT_LE(rate + 1, count);
+    EXPECT_GT(rate * 3 + 1, count);
+    EXPECT_EQ(101U, count + dropped);
+}
+
+TEST(logd, shm_one_per_pid) {
+    // The first ring is held for as long as its control socket is open
+    int sock = socket_local_client("logd",
+                                   ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                   SOCK_STREAM);
+    ASSERT_LT(0, sock);
+    static const char cmd[] = "shm";
+    ASSERT_EQ((ssize_t)sizeof(cmd), write(sock, cmd, sizeof(cmd)));
+    char buf[32];
+    ssize_t ret = read(sock, buf, sizeof(buf) - 1);
+    ASSERT_LT(0, ret);
+    buf[ret] = '\0';
+    if (!strcmp(buf, "Unsupported")) {
+        close(sock);
+        GTEST_LOG_(INFO) << "persist.logd.shm is off, skipping\n";
+        return;
+    }
+
+    // a second ring for this pid, whether or not we got the first
+    EXPECT_EQ("busy", logd_command(cmd));
+    close(sock);
+}
+
+static void *flood_radio(void *arg) {
+    volatile bool *stop = static_cast<volatile bool *>(arg);
+    std::string payload(1000, 'r');
+    while (!*stop) {
+        __android_log_buf_write(LOG_ID_RADIO, ANDROID_LOG_INFO,
+                                "logd_test_flood", payload.c_str());
+    }
+    return NULL;
+}
+
+// A reader of main only, slow enough that its batches spill, while radio
+// is pruned underneath it. The walk must not trip over pruned radio entries.
+TEST(logd, prune_unwatched_while_spilling) {
+    std::string tag = android::base::StringPrintf("logd_test_spill_%d",
+                                                  getpid());
+    int fd = socket_local_client("logdr", ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                 SOCK_SEQPACKET);
+    ASSERT_LT(0, fd);
+    std::string ask = android::base::StringPrintf("stream lids=0 pid=%d",
+                                                  getpid());
+    ASSERT_EQ((ssize_t)ask.length() + 1,
+              write(fd, ask.c_str(), ask.length() + 1));
+
+    volatile bool stop = false;
+    pthread_t thread;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, flood_radio,
+                                const_cast<bool *>(&stop)));
+
+    static const int count = 2000;
+    for (int i = 0; i < count; ++i) {
+        ASSERT_LT(0, __android_log_buf_print(LOG_ID_MAIN, ANDROID_LOG_INFO,
+                                             tag.c_str(), "%d", i));
+    }
+
+    struct sigaction ignore, old_sigaction;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = caught_signal;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGALRM, &ignore, &old_sigaction);
+    unsigned int old_alarm = alarm(10);
+
+    int last = -1;
+    bool ordered = true;
+    log_msg msg;
+    while ((last < (count - 1)) && (recv(fd, msg.buf, sizeof(msg), 0) > 0)) {
+        if ((msg.id() == LOG_ID_MAIN) && (tag == (msg.msg() + 1))) {
+            int i = atoi(msg.msg() + 1 + tag.length() + 1);
+            ordered = ordered && (i > last);
+            last = i;
+        }
+        usleep(100);
+    }
+
+    alarm(old_alarm);
+    sigaction(SIGALRM, &old_sigaction, NULL);
+    stop = true;
+    pthread_join(thread, NULL);
+    close(fd);
+
+    EXPECT_TRUE(ordered);
+    EXPECT_EQ(count - 1, last);
+    // and logd is still with us
+    EXPECT_NE(std::string::npos, logd_command("getLogSize 0").find_first_of(
+        "0123456789"));
+}